@@ -55,6 +55,9 @@ type AccountProvider interface {
 	// Groups fetches information about all groups known by the
 	// AccountProvider.
 	Groups() ([]*Group, error)
+	// GIDsForUser fetches the GIDs of all groups known by the
+	// AccountProvider that have the given username as a member.
+	GIDsForUser(username string) ([]uint32, error)
 	// Names fetches the names of all users and groups known by the
 	// AccountProvider.
 	Names() ([]string, error)
@@ -66,6 +69,25 @@ type AccountProvider interface {
 	AuthorizedKeys(username string) ([]string, error)
 }
 
+// A GenerationProvider is an AccountProvider that numbers the versions of its
+// users and groups. The generation increases whenever any of them change, so
+// data fetched after reading an unchanged generation is the same as before.
+type GenerationProvider interface {
+	AccountProvider
+	// Generation returns the current generation.
+	Generation() uint64
+}
+
+// A BatchProvider is an AccountProvider that looks up many users by name at
+// once, so that a refresh started for the names it is missing is shared by
+// all of them.
+type BatchProvider interface {
+	AccountProvider
+	// UsersByName fetches information about users by searching for
+	// usernames. The user of a name that is not found is nil.
+	UsersByName(names []string) ([]*User, error)
+}
+
 // A NotFoundError reports that the user or group that was searched for does
 // not exist.
 type NotFoundError struct {
@@ -15,3 +15,7 @@
 
 # Uninstall the NSS plugin.
 ldconfig
+
+# Remove the files written by the daemon.
+rm -f /var/run/gcua.snapshot /var/run/gcua.snapshot.tmp \
+  /var/run/gcua.generation /var/cache/gcua.cache /var/cache/gcua.cache.tmp
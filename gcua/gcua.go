@@ -22,6 +22,7 @@ import (
 	"syscall"
 	"time"
 
+	"github.com/GoogleCloudPlatform/compute-user-accounts/accounts"
 	"github.com/GoogleCloudPlatform/compute-user-accounts/apiclient"
 	"github.com/GoogleCloudPlatform/compute-user-accounts/logger"
 	"github.com/GoogleCloudPlatform/compute-user-accounts/server"
@@ -29,17 +30,27 @@ import (
 )
 
 var (
-	// version is set at compile time.
+	// version, snapshotPath, generationPath and cachePath are set at compile
+	// time.
 	version                 string
+	snapshotPath            string
+	generationPath          string
+	cachePath               string
 	userAgent               = fmt.Sprintf("gcua/%v", version)
 	apiTimeout              = 20 * time.Second
 	accountRefreshFrequency = time.Minute
 	accountRefreshCooldown  = time.Second
+	accountRefreshWindow    = 20 * time.Millisecond
 	keyRefreshFrequency     = 30 * time.Minute
 	keyRefreshCooldown      = 500 * time.Millisecond
+	keyRefreshConcurrency   = 16
+	keyRefreshRate          = 50.0
+	listenBacklog           = 1024
+	serverWorkers           = 64
 
 	apiBase      = flag.String("clouduseraccounts", "https://www.googleapis.com/clouduseraccounts/vm_beta/", "the URL to the base of the clouduseraccounts API")
 	instanceBase = flag.String("compute", "https://www.googleapis.com/compute/v1/", "the URL to the base of the compute API")
+	logRequests  = flag.Bool("log_requests", false, "whether to log every connection and request to the syslog")
 )
 
 func main() {
@@ -56,12 +67,49 @@ func main() {
 	if err != nil {
 		logger.Fatalf("Init failed: %v.", err)
 	}
-	srv := &server.Server{store.New(api, &store.Config{
+	config := &store.Config{
 		AccountRefreshFrequency: accountRefreshFrequency,
 		AccountRefreshCooldown:  accountRefreshCooldown,
+		AccountRefreshWindow:    accountRefreshWindow,
 		KeyRefreshFrequency:     keyRefreshFrequency,
 		KeyRefreshCooldown:      keyRefreshCooldown,
-	})}
+		KeyRefreshConcurrency:   keyRefreshConcurrency,
+		KeyRefreshRate:          keyRefreshRate,
+		CachePath:               cachePath,
+	}
+	responses := &server.ResponseCache{}
+	var snapshots *server.SnapshotWriter
+	if snapshotPath != "" {
+		snapshots = &server.SnapshotWriter{Path: snapshotPath}
+	}
+	var generations *server.GenerationWriter
+	if generationPath != "" {
+		generations = &server.GenerationWriter{Path: generationPath}
+	}
+	config.UpdateCallback = func(p accounts.AccountProvider) {
+		if err := responses.Update(p); err != nil {
+			logger.Errorf("Failed to cache responses: %v.", err)
+		}
+		if snapshots != nil {
+			if err := snapshots.Write(p); err != nil {
+				logger.Errorf("Failed to write snapshot: %v.", err)
+			}
+		}
+		// The generation is published last, so that the plugin only drops
+		// its cached lookups once the new responses can be looked up.
+		if generations != nil {
+			if err := generations.Write(p); err != nil {
+				logger.Errorf("Failed to write generation: %v.", err)
+			}
+		}
+	}
+	srv := &server.Server{
+		Provider:    store.New(api, config),
+		Responses:   responses,
+		LogRequests: *logRequests,
+		Backlog:     listenBacklog,
+		Workers:     serverWorkers,
+	}
 	go func() {
 		err := srv.Serve()
 		logger.Fatalf("Server failed: %v.", err)
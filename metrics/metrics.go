@@ -0,0 +1,267 @@
+// Copyright 2015 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Package metrics provides counters, gauges and latency histograms that are
+// cheap to update and can be written in the Prometheus text format.
+package metrics
+
+import (
+	"bufio"
+	"fmt"
+	"io"
+	"math"
+	"sort"
+	"strconv"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// latencyBuckets are the upper bounds in seconds of the buckets of latency
+// histograms.
+var latencyBuckets = [...]float64{.0001, .00025, .0005, .001, .0025, .005, .01, .025, .05, .1, .25, .5, 1, 2.5, 5, 10}
+
+// A Counter is a value that only increases.
+type Counter struct {
+	value uint64
+}
+
+// Inc adds one to the counter.
+func (c *Counter) Inc() {
+	atomic.AddUint64(&c.value, 1)
+}
+
+// Value returns the value of the counter.
+func (c *Counter) Value() uint64 {
+	return atomic.LoadUint64(&c.value)
+}
+
+func (c *Counter) write(w *bufio.Writer, name, labels string) {
+	fmt.Fprintf(w, "%v%v %v\n", name, labels, c.Value())
+}
+
+// A Gauge is a value that may increase and decrease.
+type Gauge struct {
+	bits uint64
+}
+
+// Set sets the value of the gauge.
+func (g *Gauge) Set(v float64) {
+	atomic.StoreUint64(&g.bits, math.Float64bits(v))
+}
+
+// Add adds delta to the value of the gauge.
+func (g *Gauge) Add(delta float64) {
+	for {
+		old := atomic.LoadUint64(&g.bits)
+		v := math.Float64bits(math.Float64frombits(old) + delta)
+		if atomic.CompareAndSwapUint64(&g.bits, old, v) {
+			return
+		}
+	}
+}
+
+// Value returns the value of the gauge.
+func (g *Gauge) Value() float64 {
+	return math.Float64frombits(atomic.LoadUint64(&g.bits))
+}
+
+func (g *Gauge) write(w *bufio.Writer, name, labels string) {
+	fmt.Fprintf(w, "%v%v %v\n", name, labels, formatFloat(g.Value()))
+}
+
+// A Histogram counts durations in latency buckets.
+type Histogram struct {
+	// counts holds the number of observations in each bucket, not including
+	// those in lower buckets, and then those above all buckets.
+	counts [len(latencyBuckets) + 1]uint64
+	// sum is the sum of all observations in nanoseconds.
+	sum uint64
+}
+
+// Observe adds a duration to the histogram.
+func (h *Histogram) Observe(d time.Duration) {
+	i := sort.SearchFloat64s(latencyBuckets[:], d.Seconds())
+	atomic.AddUint64(&h.counts[i], 1)
+	if d > 0 {
+		atomic.AddUint64(&h.sum, uint64(d))
+	}
+}
+
+// Since adds the time elapsed since start to the histogram.
+func (h *Histogram) Since(start time.Time) {
+	h.Observe(time.Since(start))
+}
+
+// Count returns the number of observations.
+func (h *Histogram) Count() uint64 {
+	var n uint64
+	for i := range h.counts {
+		n += atomic.LoadUint64(&h.counts[i])
+	}
+	return n
+}
+
+func (h *Histogram) write(w *bufio.Writer, name, labels string) {
+	// Bucket labels are added to any other labels.
+	prefix := "{"
+	if labels != "" {
+		prefix = labels[:len(labels)-1] + ","
+	}
+	var n uint64
+	for i, bound := range latencyBuckets {
+		n += atomic.LoadUint64(&h.counts[i])
+		fmt.Fprintf(w, "%v_bucket%vle=\"%v\"} %v\n", name, prefix, formatFloat(bound), n)
+	}
+	n += atomic.LoadUint64(&h.counts[len(latencyBuckets)])
+	fmt.Fprintf(w, "%v_bucket%vle=\"+Inf\"} %v\n", name, prefix, n)
+	sum := time.Duration(atomic.LoadUint64(&h.sum)).Seconds()
+	fmt.Fprintf(w, "%v_sum%v %v\n", name, labels, formatFloat(sum))
+	fmt.Fprintf(w, "%v_count%v %v\n", name, labels, n)
+}
+
+func formatFloat(v float64) string {
+	return strconv.FormatFloat(v, 'g', -1, 64)
+}
+
+type metric interface {
+	write(w *bufio.Writer, name, labels string)
+}
+
+// A family is the series of a metric, one for each value of its label.
+type family struct {
+	name  string
+	help  string
+	kind  string
+	label string
+	new   func() metric
+	mu    sync.Mutex
+	// series maps label values to metrics. A family without a label has a
+	// single series for the empty value.
+	series map[string]metric
+}
+
+func (f *family) with(value string) metric {
+	f.mu.Lock()
+	defer f.mu.Unlock()
+	m, ok := f.series[value]
+	if !ok {
+		m = f.new()
+		f.series[value] = m
+	}
+	return m
+}
+
+func (f *family) write(w *bufio.Writer) {
+	fmt.Fprintf(w, "# HELP %v %v\n# TYPE %v %v\n", f.name, f.help, f.name, f.kind)
+	f.mu.Lock()
+	values := make([]string, 0, len(f.series))
+	for v := range f.series {
+		values = append(values, v)
+	}
+	sort.Strings(values)
+	series := make([]metric, len(values))
+	for i, v := range values {
+		series[i] = f.series[v]
+	}
+	f.mu.Unlock()
+	for i, m := range series {
+		labels := ""
+		if f.label != "" {
+			labels = fmt.Sprintf("{%v=%q}", f.label, values[i])
+		}
+		m.write(w, f.name, labels)
+	}
+}
+
+var (
+	familiesMu sync.Mutex
+	families   []*family
+)
+
+func register(name, help, kind, label string, new func() metric) *family {
+	f := &family{name: name, help: help, kind: kind, label: label, new: new, series: make(map[string]metric)}
+	familiesMu.Lock()
+	defer familiesMu.Unlock()
+	for _, g := range families {
+		if g.name == name {
+			panic("metrics: " + name + " registered twice")
+		}
+	}
+	families = append(families, f)
+	return f
+}
+
+func newCounter() metric   { return &Counter{} }
+func newGauge() metric     { return &Gauge{} }
+func newHistogram() metric { return &Histogram{} }
+
+// NewCounter registers a counter.
+func NewCounter(name, help string) *Counter {
+	return register(name, help, "counter", "", newCounter).with("").(*Counter)
+}
+
+// NewGauge registers a gauge.
+func NewGauge(name, help string) *Gauge {
+	return register(name, help, "gauge", "", newGauge).with("").(*Gauge)
+}
+
+// NewHistogram registers a histogram.
+func NewHistogram(name, help string) *Histogram {
+	return register(name, help, "histogram", "", newHistogram).with("").(*Histogram)
+}
+
+// A CounterVec is a family of counters distinguished by the value of a label.
+type CounterVec struct {
+	f *family
+}
+
+// NewCounterVec registers a family of counters with a label.
+func NewCounterVec(name, help, label string) *CounterVec {
+	return &CounterVec{register(name, help, "counter", label, newCounter)}
+}
+
+// With returns the counter for a label value.
+func (v *CounterVec) With(value string) *Counter {
+	return v.f.with(value).(*Counter)
+}
+
+// A HistogramVec is a family of histograms distinguished by the value of a
+// label.
+type HistogramVec struct {
+	f *family
+}
+
+// NewHistogramVec registers a family of histograms with a label.
+func NewHistogramVec(name, help, label string) *HistogramVec {
+	return &HistogramVec{register(name, help, "histogram", label, newHistogram)}
+}
+
+// With returns the histogram for a label value.
+func (v *HistogramVec) With(value string) *Histogram {
+	return v.f.with(value).(*Histogram)
+}
+
+// Write writes all registered metrics in the Prometheus text format, in the
+// order they were registered.
+func Write(w io.Writer) error {
+	familiesMu.Lock()
+	fs := append([]*family(nil), families...)
+	familiesMu.Unlock()
+	bw := bufio.NewWriter(w)
+	for _, f := range fs {
+		f.write(bw)
+	}
+	return bw.Flush()
+}
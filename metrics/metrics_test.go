@@ -0,0 +1,124 @@
+// Copyright 2015 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package metrics
+
+import (
+	"bytes"
+	"strings"
+	"sync"
+	"testing"
+	"time"
+)
+
+func written(t *testing.T) string {
+	var buf bytes.Buffer
+	if err := Write(&buf); err != nil {
+		t.Fatalf("Write() = %v; want nil", err)
+	}
+	return buf.String()
+}
+
+// unregister removes the families registered by a test, so that it can run
+// again in the same process.
+func unregister(names ...string) {
+	familiesMu.Lock()
+	defer familiesMu.Unlock()
+	kept := families[:0]
+	for _, f := range families {
+		registered := false
+		for _, name := range names {
+			registered = registered || f.name == name
+		}
+		if !registered {
+			kept = append(kept, f)
+		}
+	}
+	families = kept
+}
+
+func TestCounterAndGauge(t *testing.T) {
+	defer unregister("test_requests_total", "test_in_flight")
+	c := NewCounterVec("test_requests_total", "Requests.", "command")
+	g := NewGauge("test_in_flight", "In flight.")
+	var wg sync.WaitGroup
+	for i := 0; i < 100; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			c.With("users").Inc()
+			g.Add(1)
+		}()
+	}
+	wg.Wait()
+	c.With("groups").Inc()
+	g.Add(-0.5)
+	if v := c.With("users").Value(); v != 100 {
+		t.Errorf("counter = %v; want 100", v)
+	}
+	if v := g.Value(); v != 99.5 {
+		t.Errorf("gauge = %v; want 99.5", v)
+	}
+	want := "# HELP test_requests_total Requests.\n" +
+		"# TYPE test_requests_total counter\n" +
+		"test_requests_total{command=\"groups\"} 1\n" +
+		"test_requests_total{command=\"users\"} 100\n" +
+		"# HELP test_in_flight In flight.\n" +
+		"# TYPE test_in_flight gauge\n" +
+		"test_in_flight 99.5\n"
+	if out := written(t); !strings.Contains(out, want) {
+		t.Errorf("Write() = %q; want it to contain %q", out, want)
+	}
+}
+
+func TestHistogram(t *testing.T) {
+	defer unregister("test_duration_seconds", "test_plain_seconds")
+	h := NewHistogramVec("test_duration_seconds", "Durations.", "kind").With("a")
+	h.Observe(50 * time.Microsecond)
+	h.Observe(3 * time.Millisecond)
+	h.Observe(time.Minute)
+	if n := h.Count(); n != 3 {
+		t.Errorf("Count() = %v; want 3", n)
+	}
+	out := written(t)
+	for _, want := range []string{
+		"# TYPE test_duration_seconds histogram\n",
+		"test_duration_seconds_bucket{kind=\"a\",le=\"0.0001\"} 1\n",
+		"test_duration_seconds_bucket{kind=\"a\",le=\"0.0025\"} 1\n",
+		"test_duration_seconds_bucket{kind=\"a\",le=\"0.005\"} 2\n",
+		"test_duration_seconds_bucket{kind=\"a\",le=\"10\"} 2\n",
+		"test_duration_seconds_bucket{kind=\"a\",le=\"+Inf\"} 3\n",
+		"test_duration_seconds_sum{kind=\"a\"} 60.00305\n",
+		"test_duration_seconds_count{kind=\"a\"} 3\n",
+	} {
+		if !strings.Contains(out, want) {
+			t.Errorf("Write() = %q; want it to contain %q", out, want)
+		}
+	}
+	NewHistogram("test_plain_seconds", "Plain.").Observe(time.Second)
+	if out := written(t); !strings.Contains(out, "test_plain_seconds_bucket{le=\"1\"} 1\n") {
+		t.Errorf("Write() = %q; want unlabeled buckets", out)
+	}
+}
+
+func TestRegisterTwice(t *testing.T) {
+	defer unregister("test_twice")
+	NewCounter("test_twice", "Twice.")
+	defer func() {
+		if recover() == nil {
+			t.Error("second NewCounter() did not panic")
+		}
+	}()
+	NewCounter("test_twice", "Twice.")
+}
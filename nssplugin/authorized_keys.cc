@@ -0,0 +1,79 @@
+/* Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// authorizedkeys is the AuthorizedKeysCommand for sshd. It prints the
+// authorized keys of the user named by its only argument, one per line, and
+// exits with a non-zero code if they cannot be retrieved.
+//
+// Usage: authorizedkeys username
+//
+// It sends the same request as the Go client in authorizedkeys/ through the
+// NSS plugin's client code, so that sshd does not start a Go runtime for every
+// authentication attempt.
+
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "utils.h"  // NOLINT(build/include)
+
+namespace {
+
+// The daemon may fetch the keys from the API before answering, so requests
+// are allowed as long as the Go client allows them.
+const int kKeysTimeoutMs = 5000;
+
+// Reports a failure the way the Go logger does and returns the exit code.
+int Fail(const char* message, const char* username) {
+  syslog(LOG_CRIT | LOG_AUTH, "%s: %s.", message, username);
+  fprintf(stderr, "%s: %s.\n", message, username);
+  return 255;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  openlog("gcua", 0, LOG_AUTH);
+  // Names with whitespace would change the request.
+  if (argc != 2 || argv[1][0] == '\0' || strpbrk(argv[1], " \t\n") != NULL) {
+    return Fail("Invalid username argument to authorized keys command",
+                argc > 1 ? argv[1] : "");
+  }
+  // A single request is cheaper without negotiating a keep-alive connection.
+  utils::SetKeepAliveEnabled(false);
+  utils::SetRequestTimeout(utils::kMultiLine, kKeysTimeoutMs);
+  std::vector<std::string> keys;
+  try {
+    utils::GetDaemonOutput(std::string("keys ") + argv[1], utils::kMultiLine,
+                           &keys);
+  } catch (const std::invalid_argument&) {
+    return Fail("Unknown user for authorized keys command", argv[1]);
+  } catch (const std::exception&) {
+    return Fail("Authorized keys command failed", argv[1]);
+  }
+  std::string output;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    output += keys[i];
+    output += '\n';
+  }
+  if (fwrite(output.data(), 1, output.size(), stdout) != output.size() ||
+      fflush(stdout) != 0) {
+    return Fail("Failed to write authorized keys", argv[1]);
+  }
+  return 0;
+}
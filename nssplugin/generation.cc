@@ -0,0 +1,118 @@
+/* Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "generation.h"  // NOLINT(build/include)
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <cstring>
+
+namespace utils {
+
+// These must match server/generation.go.
+const char kGenerationMagic[] = "GCUAGENR";
+const uint32_t kGenerationVersion = 1;
+const size_t kGenerationPageSize = 24;
+const size_t kGenerationVersionOffset = 8;
+const size_t kGenerationValueOffset = 16;
+// How often to check whether the page was replaced or removed, or whether a
+// missing or invalid page was created.
+const time_t kGenerationCheckInterval = 1;  // 1 second.
+
+// Guards the mapping of the page and g_generation_dev and g_generation_ino.
+pthread_mutex_t g_generation_mutex = PTHREAD_MUTEX_INITIALIZER;
+// The generation in the current page, or NULL. Pages are never unmapped,
+// since the generation is read without locking, so a page that was replaced
+// stays mapped. The daemon only replaces it when the file was removed.
+const volatile uint64_t* volatile g_generation = NULL;
+volatile time_t g_generation_check_time = 0;
+// The file that g_generation was mapped from.
+dev_t g_generation_dev = 0;
+ino_t g_generation_ino = 0;
+
+// Maps the page open at fd, whose status is st. Returns NULL if it is
+// invalid.
+const volatile uint64_t* MapGeneration(int fd, const struct stat& st) {
+  if (st.st_size < static_cast<off_t>(kGenerationPageSize)) {
+    return NULL;
+  }
+  void* data = mmap(NULL, kGenerationPageSize, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+  const unsigned char* page = static_cast<const unsigned char*>(data);
+  uint32_t version = page[kGenerationVersionOffset] |
+      (page[kGenerationVersionOffset + 1] << 8) |
+      (page[kGenerationVersionOffset + 2] << 16) |
+      (static_cast<uint32_t>(page[kGenerationVersionOffset + 3]) << 24);
+  if (memcmp(page, kGenerationMagic, strlen(kGenerationMagic)) != 0 ||
+      version != kGenerationVersion) {
+    munmap(data, kGenerationPageSize);
+    return NULL;
+  }
+  return reinterpret_cast<const volatile uint64_t*>(
+      page + kGenerationValueOffset);
+}
+
+// Maps the page at GENERATION_PATH unless it is the one already mapped.
+// Drops the mapped page if there is no valid one. Must be called with
+// g_generation_mutex locked.
+void CheckGeneration() {
+  struct stat st;
+  if (stat(GENERATION_PATH, &st) == -1) {
+    g_generation = NULL;
+    return;
+  }
+  if (g_generation != NULL && st.st_dev == g_generation_dev &&
+      st.st_ino == g_generation_ino) {
+    return;
+  }
+  const volatile uint64_t* generation = NULL;
+  int fd = open(GENERATION_PATH, O_RDONLY | O_CLOEXEC);
+  if (fd != -1) {
+    if (fstat(fd, &st) == 0) {
+      generation = MapGeneration(fd, st);
+    }
+    close(fd);
+  }
+  g_generation_dev = st.st_dev;
+  g_generation_ino = st.st_ino;
+  g_generation = generation;
+}
+
+uint64_t CurrentGeneration() {
+  time_t now = time(NULL);
+  if (now >= g_generation_check_time) {
+    pthread_mutex_lock(&g_generation_mutex);
+    if (now >= g_generation_check_time) {
+      CheckGeneration();
+      g_generation_check_time = now + kGenerationCheckInterval;
+    }
+    pthread_mutex_unlock(&g_generation_mutex);
+  }
+  const volatile uint64_t* generation = g_generation;
+  if (generation == NULL) {
+    return 0;
+  }
+  // The daemon stores the generation atomically. Where 64-bit loads are not
+  // atomic a torn value only makes a cached lookup miss.
+  return *generation;
+}
+
+}  // namespace utils
@@ -0,0 +1,36 @@
+/* Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GCE_ACCOUNTS_GENERATION_H_  // NOLINT(build/header_guard)
+#define GCE_ACCOUNTS_GENERATION_H_  // NOLINT(build/header_guard)
+
+#include <stdint.h>
+
+namespace utils {
+
+// Returns the generation of users and groups published by the Google Compute
+// User Accounts daemon in the page at GENERATION_PATH, defined in the
+// Makefile, or 0 if there is no valid page. The generation changes whenever
+// users or groups change, so lookups cached at a generation stay current
+// until it changes. The page format is documented in server/generation.go.
+//
+// The page is mapped on first use, so that later calls only read the clock
+// and make a single memory load. Once per second, the path is checked for a
+// page that replaced the mapped one or for a page that was missing.
+uint64_t CurrentGeneration();
+
+}  // namespace utils
+
+#endif  // GCE_ACCOUNTS_GENERATION_H_
@@ -0,0 +1,134 @@
+/* Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cstring>
+#include <string>
+
+#include "generation.h"  // NOLINT(build/include)
+
+using utils::CurrentGeneration;
+
+// The page is mapped once per process, so every test looks at it in a child
+// process.
+class GenerationTest : public ::testing::Test {
+ protected:
+  GenerationTest() {
+    unlink(GENERATION_PATH);
+  }
+
+  ~GenerationTest() {
+    unlink(GENERATION_PATH);
+  }
+
+  // Runs main in a child process and expects it to succeed.
+  static void RunInChild(int (*main)()) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      _exit(main());
+    }
+    int status;
+    EXPECT_EQ(pid, waitpid(pid, &status, 0));
+    EXPECT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(0, WEXITSTATUS(status));
+  }
+};
+
+// Writes a page as written by server/generation.go.
+bool WritePage(const char* magic, uint64_t generation) {
+  unsigned char page[24];
+  memset(page, 0, sizeof(page));
+  memcpy(page, magic, 8);
+  page[8] = 1;
+  memcpy(page + 16, &generation, sizeof(generation));
+  FILE* file = fopen(GENERATION_PATH, "r+b");
+  if (file == NULL) {
+    file = fopen(GENERATION_PATH, "wb");
+  }
+  if (file == NULL) {
+    return false;
+  }
+  bool written = fwrite(page, sizeof(page), 1, file) == 1;
+  return fclose(file) == 0 && written;
+}
+
+int ExpectMissing() {
+  return CurrentGeneration() != 0;
+}
+
+TEST_F(GenerationTest, MissingPage) {
+  RunInChild(ExpectMissing);
+}
+
+int ExpectUpdates() {
+  if (CurrentGeneration() != 1001) {
+    return 1;
+  }
+  // The page is updated in place by the daemon.
+  if (!WritePage("GCUAGENR", 1002)) {
+    return 2;
+  }
+  return CurrentGeneration() != 1002;
+}
+
+TEST_F(GenerationTest, ValidPage) {
+  ASSERT_TRUE(WritePage("GCUAGENR", 1001));
+  RunInChild(ExpectUpdates);
+}
+
+int ExpectCreatedLater() {
+  if (CurrentGeneration() != 0 || !WritePage("GCUAGENR", 1001)) {
+    return 1;
+  }
+  sleep(2);
+  return CurrentGeneration() != 1001;
+}
+
+TEST_F(GenerationTest, PageCreatedLater) {
+  RunInChild(ExpectCreatedLater);
+}
+
+int ExpectReplaced() {
+  if (CurrentGeneration() != 1001) {
+    return 1;
+  }
+  // A restarted daemon creates a new page if the file was removed.
+  if (unlink(GENERATION_PATH) != 0 || !WritePage("GCUAGENR", 5)) {
+    return 2;
+  }
+  sleep(2);
+  if (CurrentGeneration() != 5) {
+    return 3;
+  }
+  unlink(GENERATION_PATH);
+  sleep(2);
+  return CurrentGeneration() != 0;
+}
+
+TEST_F(GenerationTest, ReplacedPage) {
+  ASSERT_TRUE(WritePage("GCUAGENR", 1001));
+  RunInChild(ExpectReplaced);
+}
+
+TEST_F(GenerationTest, InvalidPage) {
+  ASSERT_TRUE(WritePage("GCUASNAP", 1001));
+  RunInChild(ExpectMissing);
+  ASSERT_EQ(0, truncate(GENERATION_PATH, 16));
+  RunInChild(ExpectMissing);
+}
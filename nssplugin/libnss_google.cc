@@ -20,22 +20,52 @@
 #include <stdexcept>
 #include <sstream>
 
+#include "generation.h"  // NOLINT(build/include)
+#include "snapshot.h"  // NOLINT(build/include)
+#include "stats.h"  // NOLINT(build/include)
 #include "utils.h"  // NOLINT(build/include)
 
+// CACHE_SIZE, CACHE_TTL and NEGATIVE_CACHE_TTL are defined in the Makefile.
+utils::LookupCache g_lookup_cache(CACHE_SIZE, CACHE_TTL, NEGATIVE_CACHE_TTL,
+                                  &utils::CurrentGeneration);
+// SNAPSHOT_PATH and SNAPSHOT_MAX_AGE are defined in the Makefile.
+utils::Snapshot g_snapshot(SNAPSHOT_PATH, SNAPSHOT_MAX_AGE);
+
+// Returns the line of an entity that the snapshot looked up with result,
+// asking the daemon if the snapshot was unavailable. Misses are only final for
+// lookups by ID since the daemon refreshes its accounts for missing names.
+static std::string ResolveLine(utils::Snapshot::Result result,
+                               const std::string& snapshot_line, bool by_id,
+                               const std::string& command,
+                               utils::OutputType output_type) {
+  if (result == utils::Snapshot::kFound) {
+    return snapshot_line;
+  } else if (result == utils::Snapshot::kNotFound && by_id) {
+    throw std::invalid_argument(command);
+  }
+  return utils::GetCachedDaemonLine(command, output_type, &g_lookup_cache);
+}
+
 extern "C" {
 
   nss_status _nss_google_getpwnam_r(const char* name, passwd* pwd, char* buf,
                                     size_t buflen, int* errnop) {
+    utils::StatsTimer timer(utils::kGetpwnamCall);
     utils::BufferManager buffer(buf, buflen);
     nss_status status = NSS_STATUS_SUCCESS;
-    std::vector<std::string> output_lines;
     std::stringstream command;
     command << "user_by_name " << name;
+    std::string line;
     try {
-      utils::GetDaemonOutput(command.str(), utils::kSingleLineExtendedTimeout,
-                             &output_lines);
-      utils::UserLineToPasswdStruct(output_lines[0], pwd, &buffer);
+      if (!utils::TakeLineForRetry(command.str(), &line)) {
+        utils::Snapshot::Result result = g_snapshot.UserByName(name, &line);
+        line = ResolveLine(result, line, false, command.str(),
+                           utils::kSingleLineExtendedTimeout);
+      }
+      utils::UserLineToPasswdStruct(line, pwd, &buffer);
     } catch (const std::length_error&) {
+      // glibc retries with a larger buffer.
+      utils::KeepLineForRetry(command.str(), line);
       *errnop = ERANGE;
       status = NSS_STATUS_TRYAGAIN;
     } catch (const std::invalid_argument&) {
@@ -50,15 +80,22 @@ extern "C" {
 
   nss_status _nss_google_getpwuid_r(uid_t uid, passwd* pwd, char* buf,
                                     size_t buflen, int* errnop) {
+    utils::StatsTimer timer(utils::kGetpwuidCall);
     utils::BufferManager buffer(buf, buflen);
     nss_status status = NSS_STATUS_SUCCESS;
-    std::vector<std::string> output_lines;
     std::stringstream command;
     command << "user_by_uid " << uid;
+    std::string line;
     try {
-      utils::GetDaemonOutput(command.str(), utils::kSingleLine, &output_lines);
-      utils::UserLineToPasswdStruct(output_lines[0], pwd, &buffer);
+      if (!utils::TakeLineForRetry(command.str(), &line)) {
+        utils::Snapshot::Result result = g_snapshot.UserByUid(uid, &line);
+        line = ResolveLine(result, line, true, command.str(),
+                           utils::kSingleLine);
+      }
+      utils::UserLineToPasswdStruct(line, pwd, &buffer);
     } catch (const std::length_error&) {
+      // glibc retries with a larger buffer.
+      utils::KeepLineForRetry(command.str(), line);
       *errnop = ERANGE;
       status = NSS_STATUS_TRYAGAIN;
     } catch (const std::invalid_argument&) {
@@ -71,9 +108,10 @@ extern "C" {
     return status;
   }
 
-  utils::EntityList g_pw_entities;
+  utils::EntityList g_pw_entities(CACHE_TTL);
 
   nss_status _nss_google_setpwent() {
+    utils::StatsTimer timer(utils::kSetpwentCall);
     nss_status status = NSS_STATUS_SUCCESS;
     const char* command = "users";
     try {
@@ -92,10 +130,11 @@ extern "C" {
 
   nss_status _nss_google_getpwent_r(passwd* pwd, char* buf, size_t buflen,
                                     int* errnop) {
+    utils::StatsTimer timer(utils::kGetpwentCall);
     utils::BufferManager buffer(buf, buflen);
     nss_status status = NSS_STATUS_SUCCESS;
     try {
-      utils::UserLineToPasswdStruct(g_pw_entities.Pop(), pwd, &buffer);
+      g_pw_entities.Pop(pwd, &buffer);
     } catch (const std::out_of_range&) {
       status = NSS_STATUS_NOTFOUND;
     } catch (const std::length_error&) {
@@ -110,15 +149,22 @@ extern "C" {
 
   nss_status _nss_google_getgrnam_r(const char* name, group* grp, char* buf,
                                     size_t buflen, int* errnop) {
+    utils::StatsTimer timer(utils::kGetgrnamCall);
     utils::BufferManager buffer(buf, buflen);
     nss_status status = NSS_STATUS_SUCCESS;
-    std::vector<std::string> output_lines;
     std::stringstream command;
     command << "group_by_name " << name;
+    std::string line;
     try {
-      utils::GetDaemonOutput(command.str(), utils::kSingleLine, &output_lines);
-      utils::GroupLineToGroupStruct(output_lines[0], grp, &buffer);
+      if (!utils::TakeLineForRetry(command.str(), &line)) {
+        utils::Snapshot::Result result = g_snapshot.GroupByName(name, &line);
+        line = ResolveLine(result, line, false, command.str(),
+                           utils::kSingleLine);
+      }
+      utils::GroupLineToGroupStruct(line, grp, &buffer);
     } catch (const std::length_error&) {
+      // glibc retries with a larger buffer.
+      utils::KeepLineForRetry(command.str(), line);
       *errnop = ERANGE;
       status = NSS_STATUS_TRYAGAIN;
     } catch (const std::invalid_argument&) {
@@ -133,15 +179,22 @@ extern "C" {
 
   nss_status _nss_google_getgrgid_r(uid_t gid, group* grp, char* buf,
                                     size_t buflen, int* errnop) {
+    utils::StatsTimer timer(utils::kGetgrgidCall);
     utils::BufferManager buffer(buf, buflen);
     nss_status status = NSS_STATUS_SUCCESS;
-    std::vector<std::string> output_lines;
     std::stringstream command;
     command << "group_by_gid " << gid;
+    std::string line;
     try {
-      utils::GetDaemonOutput(command.str(), utils::kSingleLine, &output_lines);
-      utils::GroupLineToGroupStruct(output_lines[0], grp, &buffer);
+      if (!utils::TakeLineForRetry(command.str(), &line)) {
+        utils::Snapshot::Result result = g_snapshot.GroupByGid(gid, &line);
+        line = ResolveLine(result, line, true, command.str(),
+                           utils::kSingleLine);
+      }
+      utils::GroupLineToGroupStruct(line, grp, &buffer);
     } catch (const std::length_error&) {
+      // glibc retries with a larger buffer.
+      utils::KeepLineForRetry(command.str(), line);
       *errnop = ERANGE;
       status = NSS_STATUS_TRYAGAIN;
     } catch (const std::invalid_argument&) {
@@ -154,9 +207,10 @@ extern "C" {
     return status;
   }
 
-  utils::EntityList g_gr_entities;
+  utils::EntityList g_gr_entities(CACHE_TTL);
 
   nss_status _nss_google_setgrent() {
+    utils::StatsTimer timer(utils::kSetgrentCall);
     nss_status status = NSS_STATUS_SUCCESS;
     const char* command = "groups";
     try {
@@ -175,10 +229,11 @@ extern "C" {
 
   nss_status _nss_google_getgrent_r(group* grp, char* buf, size_t buflen,
                                     int* errnop) {
+    utils::StatsTimer timer(utils::kGetgrentCall);
     utils::BufferManager buffer(buf, buflen);
     nss_status status = NSS_STATUS_SUCCESS;
     try {
-      utils::GroupLineToGroupStruct(g_gr_entities.Pop(), grp, &buffer);
+      g_gr_entities.Pop(grp, &buffer);
     } catch (const std::out_of_range&) {
       status = NSS_STATUS_NOTFOUND;
     } catch (const std::length_error&) {
@@ -191,8 +246,40 @@ extern "C" {
     return status;
   }
 
+  nss_status _nss_google_initgroups_dyn(
+      const char* user, gid_t skipgroup, long int* start,  // NOLINT
+      long int* size, gid_t** groupsp, long int limit,  // NOLINT
+      int* errnop) {
+    utils::StatsTimer timer(utils::kInitgroupsCall);
+    nss_status status = NSS_STATUS_SUCCESS;
+    std::vector<std::string> output_lines;
+    std::stringstream command;
+    command << "gids_for_user " << user;
+    try {
+      utils::GetDaemonOutput(command.str(), utils::kMultiLine, &output_lines);
+      for (size_t i = 0; i < output_lines.size(); i++) {
+        gid_t gid = utils::ParseId(output_lines[i]);
+        if (gid != skipgroup &&
+            !utils::AppendGroup(gid, start, size, groupsp, limit)) {
+          break;
+        }
+      }
+    } catch (const std::bad_alloc&) {
+      *errnop = ENOMEM;
+      status = NSS_STATUS_TRYAGAIN;
+    } catch (const std::invalid_argument&) {
+      *errnop = ENOENT;
+      status = NSS_STATUS_NOTFOUND;
+    } catch (const std::exception&) {
+      *errnop = ENOENT;
+      status = NSS_STATUS_TRYAGAIN;
+    }
+    return status;
+  }
+
   nss_status _nss_google_getspnam_r(const char* name, spwd* pwd, char* buf,
                                     size_t buflen, int* errnop) {
+    utils::StatsTimer timer(utils::kGetspnamCall);
     utils::BufferManager buffer(buf, buflen);
     nss_status status = NSS_STATUS_SUCCESS;
     std::vector<std::string> output_lines;
@@ -214,9 +301,10 @@ extern "C" {
     return status;
   }
 
-  utils::EntityList g_sp_entities;
+  utils::EntityList g_sp_entities(CACHE_TTL);
 
   nss_status _nss_google_setspent() {
+    utils::StatsTimer timer(utils::kSetspentCall);
     nss_status status = NSS_STATUS_SUCCESS;
     const char* command = "names";
     try {
@@ -235,10 +323,11 @@ extern "C" {
 
   nss_status _nss_google_getspent_r(spwd* pwd, char* buf, size_t buflen,
                                     int* errnop) {
+    utils::StatsTimer timer(utils::kGetspentCall);
     utils::BufferManager buffer(buf, buflen);
     nss_status status = NSS_STATUS_SUCCESS;
     try {
-      utils::AccountNameToShadowStruct(g_sp_entities.Pop(), pwd, &buffer);
+      g_sp_entities.Pop(pwd, &buffer);
     } catch (const std::out_of_range&) {
       status = NSS_STATUS_NOTFOUND;
     } catch (const std::length_error&) {
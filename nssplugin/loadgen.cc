@@ -0,0 +1,220 @@
+/* Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// loadgen sends requests to the daemon from many threads through the same
+// client code as the NSS plugin and reports throughput, latency and failures.
+//
+// Usage: loadgen [-t threads] [-d seconds] [-r min-max] [-T timeout-ms] [-o]
+//                [command...]
+//
+// Each thread repeatedly picks one of the commands at random. A "%d" in a
+// command is replaced with a random ID in the range given by -r. -T sets the
+// time allowed for each request, 1 second by default. -o disables keep-alive
+// so that every request uses a new connection.
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "utils.h"  // NOLINT(build/include)
+
+namespace {
+
+struct Config {
+  std::vector<std::string> commands;
+  unsigned int min_id;
+  unsigned int max_id;
+  double duration;
+  // Failed requests that took at least this long are counted as timeouts,
+  // since the client reports them the same way as other failures.
+  int timeout_ms;
+};
+
+struct Stats {
+  Stats() : not_found(0), timeouts(0), errors(0) {}
+
+  // The latencies of all requests in seconds.
+  std::vector<double> latencies;
+  size_t not_found;
+  size_t timeouts;
+  size_t errors;
+};
+
+struct Worker {
+  const Config* config;
+  unsigned int seed;
+  Stats stats;
+};
+
+double Now() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+std::string MakeCommand(const Config& config, unsigned int* seed) {
+  std::string command = config.commands[rand_r(seed) %
+                                         config.commands.size()];
+  size_t pos = command.find("%d");
+  if (pos != std::string::npos) {
+    std::stringstream id;
+    id << config.min_id + rand_r(seed) % (config.max_id - config.min_id + 1);
+    command.replace(pos, 2, id.str());
+  }
+  return command;
+}
+
+void* WorkerThreadMain(void* data) {
+  Worker* worker = static_cast<Worker*>(data);
+  const Config& config = *worker->config;
+  Stats* stats = &worker->stats;
+  std::vector<std::string> output_lines;
+  double end = Now() + config.duration;
+  double start;
+  while ((start = Now()) < end) {
+    std::string command = MakeCommand(config, &worker->seed);
+    output_lines.clear();
+    try {
+      utils::GetDaemonOutput(command, utils::kMultiLine, &output_lines);
+      stats->latencies.push_back(Now() - start);
+    } catch (const std::invalid_argument&) {
+      stats->latencies.push_back(Now() - start);
+      stats->not_found++;
+    } catch (const std::exception&) {
+      double latency = Now() - start;
+      stats->latencies.push_back(latency);
+      if (latency * 1000 >= config.timeout_ms) {
+        stats->timeouts++;
+      } else {
+        stats->errors++;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Returns the q quantile of sorted latencies in microseconds.
+double Quantile(const std::vector<double>& sorted, double q) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t index = static_cast<size_t>(q * (sorted.size() - 1) + 0.5);
+  return sorted[index] * 1e6;
+}
+
+void Usage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s [-t threads] [-d seconds] [-r min-max] [-T timeout-ms] "
+          "[-o] [command...]\n", name);
+  exit(2);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Config config;
+  config.min_id = 1000;
+  config.max_id = 1999;
+  config.duration = 10;
+  config.timeout_ms = 1000;
+  int threads = 16;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:d:r:T:o")) != -1) {
+    switch (opt) {
+      case 't':
+        threads = atoi(optarg);
+        break;
+      case 'd':
+        config.duration = atof(optarg);
+        break;
+      case 'r':
+        if (sscanf(optarg, "%u-%u", &config.min_id, &config.max_id) != 2) {
+          Usage(argv[0]);
+        }
+        break;
+      case 'T':
+        config.timeout_ms = atoi(optarg);
+        break;
+      case 'o':
+        utils::SetKeepAliveEnabled(false);
+        break;
+      default:
+        Usage(argv[0]);
+    }
+  }
+  for (int i = optind; i < argc; i++) {
+    config.commands.push_back(argv[i]);
+  }
+  if (config.commands.empty()) {
+    config.commands.push_back("user_by_uid %d");
+    config.commands.push_back("group_by_gid %d");
+    config.commands.push_back("is_name user%d");
+  }
+  if (threads <= 0 || config.duration <= 0 || config.timeout_ms <= 0 ||
+      config.max_id < config.min_id) {
+    Usage(argv[0]);
+  }
+  utils::SetRequestTimeout(utils::kMultiLine, config.timeout_ms);
+
+  std::vector<Worker> workers(threads);
+  std::vector<pthread_t> ids(threads);
+  double start = Now();
+  for (int i = 0; i < threads; i++) {
+    workers[i].config = &config;
+    workers[i].seed = i + 1;
+    if (pthread_create(&ids[i], NULL, WorkerThreadMain, &workers[i])) {
+      perror("pthread_create");
+      return 1;
+    }
+  }
+  Stats total;
+  for (int i = 0; i < threads; i++) {
+    pthread_join(ids[i], NULL);
+    const Stats& stats = workers[i].stats;
+    total.latencies.insert(total.latencies.end(), stats.latencies.begin(),
+                           stats.latencies.end());
+    total.not_found += stats.not_found;
+    total.timeouts += stats.timeouts;
+    total.errors += stats.errors;
+  }
+  double elapsed = Now() - start;
+
+  std::sort(total.latencies.begin(), total.latencies.end());
+  size_t requests = total.latencies.size();
+  double percent = requests ? 100.0 / requests : 0;
+  printf("requests:   %lu in %.1fs from %d threads (%.0f/s)\n",
+         static_cast<unsigned long>(requests),  // NOLINT(runtime/int)
+         elapsed, threads, requests / elapsed);
+  printf("not found:  %lu (%.2f%%)\n",
+         static_cast<unsigned long>(total.not_found),  // NOLINT(runtime/int)
+         total.not_found * percent);
+  printf("timeouts:   %lu (%.2f%%)\n",
+         static_cast<unsigned long>(total.timeouts),  // NOLINT(runtime/int)
+         total.timeouts * percent);
+  printf("errors:     %lu (%.2f%%)\n",
+         static_cast<unsigned long>(total.errors),  // NOLINT(runtime/int)
+         total.errors * percent);
+  printf("latency us: p50 %.0f, p99 %.0f, p999 %.0f, max %.0f\n",
+         Quantile(total.latencies, 0.5), Quantile(total.latencies, 0.99),
+         Quantile(total.latencies, 0.999), Quantile(total.latencies, 1));
+  return 0;
+}
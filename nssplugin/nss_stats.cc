@@ -0,0 +1,145 @@
+/* Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// nssstats prints the stats pages written by the NSS plugin, see stats.h.
+// With several pages, the counters of all of them are added up, so that the
+// calls made by the processes of a command can be read together.
+//
+// Usage: nssstats page...
+//
+// For example, to see where the time of "ls -l" goes:
+//
+//   GCUA_NSS_STATS=1 ls -l /home
+//   nssstats /dev/shm/gcua-nss-stats.*
+//
+// Processes that end without running destructors, such as by _exit or a
+// signal, leave their pages behind. After printing, the given pages of such
+// processes that belong to the user running nssstats are added to the page of
+// the user and removed. With stats enabled by STATS_FLAG_PATH, run it
+// regularly for every user whose processes use NSS to bound those pages.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "stats.h"  // NOLINT(build/include)
+
+namespace {
+
+void Add(const utils::StatsCounters& from, utils::StatsCounters* to) {
+  to->count += from.count;
+  to->total_ns += from.total_ns;
+  for (size_t i = 0; i < utils::kStatsBuckets; i++) {
+    to->buckets[i] += from.buckets[i];
+  }
+}
+
+// Returns the upper bound in microseconds of the bucket that holds the
+// fraction q of the events.
+unsigned long Quantile(const utils::StatsCounters& counters,  // NOLINT
+                       double q) {
+  uint64_t seen = 0;
+  for (size_t i = 0; i < utils::kStatsBuckets; i++) {
+    seen += counters.buckets[i];
+    if (seen >= q * counters.count) {
+      return 1UL << i;
+    }
+  }
+  return 1UL << utils::kStatsBuckets;
+}
+
+void Print(const char* name, const utils::StatsCounters& counters) {
+  if (counters.count == 0) {
+    return;
+  }
+  printf("%-12s %10llu %12.3f %10.1f %8lu %8lu\n", name,
+         static_cast<unsigned long long>(counters.count),  // NOLINT
+         counters.total_ns / 1e6, counters.total_ns / 1e3 / counters.count,
+         Quantile(counters, 0.5), Quantile(counters, 0.99));
+}
+
+// Adds a page of an exited process of this user to the user's page and
+// removes it.
+void Collect(const char* path, const utils::StatsPage& page, uid_t owner) {
+  if (page.pid == 0 || owner != geteuid() ||
+      kill(static_cast<pid_t>(page.pid), 0) == 0 || errno != ESRCH) {
+    return;
+  }
+  if (utils::AddToUserStatsPage(page)) {
+    unlink(path);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s page...\n", argv[0]);
+    return 2;
+  }
+  utils::StatsPage total;
+  memset(&total, 0, sizeof(total));
+  int pages = 0;
+  std::vector<utils::StatsPage> read(argc);
+  std::vector<uid_t> owners(argc, static_cast<uid_t>(-1));
+  for (int i = 1; i < argc; i++) {
+    utils::StatsPage& page = read[i];
+    FILE* file = fopen(argv[i], "rb");
+    struct stat st;
+    if (file != NULL && fstat(fileno(file), &st) == 0) {
+      owners[i] = st.st_uid;
+    }
+    bool valid = file != NULL && fread(&page, sizeof(page), 1, file) == 1 &&
+        memcmp(page.magic, utils::kStatsMagic, sizeof(page.magic)) == 0 &&
+        page.version == utils::kStatsVersion;
+    if (file != NULL) {
+      fclose(file);
+    }
+    if (!valid) {
+      fprintf(stderr, "Skipping %s: not a stats page.\n", argv[i]);
+      owners[i] = static_cast<uid_t>(-1);
+      continue;
+    }
+    for (size_t j = 0; j < utils::kNumStatsCalls; j++) {
+      Add(page.calls[j], &total.calls[j]);
+    }
+    for (size_t j = 0; j < utils::kNumStatsPhases; j++) {
+      Add(page.phases[j], &total.phases[j]);
+    }
+    pages++;
+  }
+  printf("%d pages\n", pages);
+  printf("%-12s %10s %12s %10s %8s %8s\n", "", "count", "total ms", "mean us",
+         "p50 us<", "p99 us<");
+  for (size_t i = 0; i < utils::kNumStatsCalls; i++) {
+    Print(utils::StatsCallName(static_cast<utils::StatsCall>(i)),
+          total.calls[i]);
+  }
+  for (size_t i = 0; i < utils::kNumStatsPhases; i++) {
+    Print(utils::StatsPhaseName(static_cast<utils::StatsPhase>(i)),
+          total.phases[i]);
+  }
+  for (int i = 1; i < argc; i++) {
+    if (owners[i] != static_cast<uid_t>(-1)) {
+      Collect(argv[i], read[i], owners[i]);
+    }
+  }
+  return pages > 0 ? 0 : 1;
+}
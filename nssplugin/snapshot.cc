@@ -0,0 +1,229 @@
+/* Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "snapshot.h"  // NOLINT(build/include)
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+
+namespace utils {
+
+// These must match server/snapshot.go.
+const char kSnapshotMagic[] = "GCUASNAP";
+const uint32_t kSnapshotVersion = 1;
+const size_t kHeaderSize = 64;
+const size_t kEntrySize = 12;
+const size_t kVersionOffset = 8;
+const size_t kSupersededOffset = 12;
+const size_t kRefreshTimeOffset = 24;
+const size_t kUserCountOffset = 32;
+const size_t kGroupCountOffset = 36;
+const size_t kUsersByNameOffset = 40;
+const size_t kUsersByUidOffset = 44;
+const size_t kGroupsByNameOffset = 48;
+const size_t kGroupsByGidOffset = 52;
+const size_t kLinesOffset = 56;
+const size_t kLinesSizeOffset = 60;
+// How long to wait before mapping a snapshot again after it was found to be
+// missing, invalid or stale.
+const time_t kRemapInterval = 1;  // 1 second.
+
+uint32_t Load32(const char* data) {
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+uint64_t Load64(const char* data) {
+  return Load32(data) | (static_cast<uint64_t>(Load32(data + 4)) << 32);
+}
+
+uint32_t NameHash(const std::string& value) {
+  // 32-bit FNV-1a.
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < value.size(); i++) {
+    hash ^= static_cast<unsigned char>(value[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+Snapshot::Snapshot(const char* path, time_t max_age)
+    : path_(path),
+      max_age_(max_age),
+      data_(NULL),
+      size_(0),
+      next_remap_time_(0) {
+  pthread_rwlock_init(&lock_, NULL);
+}
+
+Snapshot::~Snapshot() {
+  Unmap();
+  pthread_rwlock_destroy(&lock_);
+}
+
+Snapshot::Result Snapshot::UserByName(const std::string& name,
+                                      std::string* line) {
+  return Find(kUsersByNameOffset, kUserCountOffset, NameHash(name), &name,
+              line);
+}
+
+Snapshot::Result Snapshot::UserByUid(uint32_t uid, std::string* line) {
+  return Find(kUsersByUidOffset, kUserCountOffset, uid, NULL, line);
+}
+
+Snapshot::Result Snapshot::GroupByName(const std::string& name,
+                                       std::string* line) {
+  return Find(kGroupsByNameOffset, kGroupCountOffset, NameHash(name), &name,
+              line);
+}
+
+Snapshot::Result Snapshot::GroupByGid(uint32_t gid, std::string* line) {
+  return Find(kGroupsByGidOffset, kGroupCountOffset, gid, NULL, line);
+}
+
+bool Snapshot::Acquire() {
+  pthread_rwlock_rdlock(&lock_);
+  if (IsCurrent()) {
+    return true;
+  }
+  pthread_rwlock_unlock(&lock_);
+  pthread_rwlock_wrlock(&lock_);
+  if (!IsCurrent()) {
+    Remap();
+  }
+  pthread_rwlock_unlock(&lock_);
+  pthread_rwlock_rdlock(&lock_);
+  if (IsCurrent()) {
+    return true;
+  }
+  pthread_rwlock_unlock(&lock_);
+  return false;
+}
+
+bool Snapshot::IsCurrent() const {
+  if (data_ == NULL) {
+    return false;
+  }
+  // The daemon sets the superseded field of a mapped file, so it must be
+  // reloaded on every check.
+  const volatile uint32_t* superseded =
+      reinterpret_cast<const volatile uint32_t*>(data_ + kSupersededOffset);
+  if (*superseded != 0) {
+    return false;
+  }
+  time_t refresh_time = static_cast<time_t>(Load64(data_ + kRefreshTimeOffset));
+  return time(NULL) - refresh_time <= max_age_;
+}
+
+void Snapshot::Remap() {
+  time_t now = time(NULL);
+  bool superseded = data_ != NULL && Load32(data_ + kSupersededOffset) != 0;
+  if (!superseded && now < next_remap_time_) {
+    return;
+  }
+  next_remap_time_ = now + kRemapInterval;
+  Unmap();
+  int fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return;
+  }
+  struct stat st;
+  void* data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(kHeaderSize)) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED) {
+    return;
+  }
+  data_ = static_cast<const char*>(data);
+  size_ = st.st_size;
+  // Validate the header and index bounds so that lookups only need to check
+  // the lines that they read.
+  bool valid = memcmp(data_, kSnapshotMagic, strlen(kSnapshotMagic)) == 0 &&
+      Load32(data_ + kVersionOffset) == kSnapshotVersion;
+  const size_t indexes[][2] = {
+    { kUsersByNameOffset, kUserCountOffset },
+    { kUsersByUidOffset, kUserCountOffset },
+    { kGroupsByNameOffset, kGroupCountOffset },
+    { kGroupsByGidOffset, kGroupCountOffset },
+  };
+  for (size_t i = 0; valid && i < sizeof(indexes) / sizeof(indexes[0]); i++) {
+    uint64_t offset = Load32(data_ + indexes[i][0]);
+    uint64_t count = Load32(data_ + indexes[i][1]);
+    valid = offset + count * kEntrySize <= size_;
+  }
+  uint64_t lines_end = static_cast<uint64_t>(Load32(data_ + kLinesOffset)) +
+      Load32(data_ + kLinesSizeOffset);
+  if (!valid || lines_end > size_) {
+    Unmap();
+  }
+}
+
+void Snapshot::Unmap() {
+  if (data_ != NULL) {
+    munmap(const_cast<char*>(data_), size_);
+    data_ = NULL;
+    size_ = 0;
+  }
+}
+
+Snapshot::Result Snapshot::Find(size_t index_offset, size_t count_offset,
+                                uint32_t key, const std::string* name,
+                                std::string* line) {
+  if (!Acquire()) {
+    return kUnavailable;
+  }
+  const char* index = data_ + Load32(data_ + index_offset);
+  size_t count = Load32(data_ + count_offset);
+  const char* lines = data_ + Load32(data_ + kLinesOffset);
+  size_t lines_size = Load32(data_ + kLinesSizeOffset);
+  // Find the first entry with the key.
+  size_t low = 0;
+  size_t high = count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (Load32(index + mid * kEntrySize) < key) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  Result result = kNotFound;
+  // Different names can have the same hash.
+  for (size_t i = low; i < count && Load32(index + i * kEntrySize) == key;
+       i++) {
+    const char* entry = index + i * kEntrySize;
+    uint64_t offset = Load32(entry + 4);
+    uint64_t length = Load32(entry + 8);
+    if (offset + length > lines_size) {
+      continue;
+    }
+    const char* start = lines + offset;
+    if (name == NULL || (length > name->size() && start[name->size()] == ':' &&
+                         memcmp(start, name->data(), name->size()) == 0)) {
+      line->assign(start, length);
+      result = kFound;
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&lock_);
+  return result;
+}
+
+}  // namespace utils
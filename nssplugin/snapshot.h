@@ -0,0 +1,84 @@
+/* Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GCE_ACCOUNTS_SNAPSHOT_H_  // NOLINT(build/header_guard)
+#define GCE_ACCOUNTS_SNAPSHOT_H_  // NOLINT(build/header_guard)
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+namespace utils {
+
+// Snapshot answers lookups from the account snapshot file published by the
+// Google Compute User Accounts daemon. The file format is documented in
+// server/snapshot.go.
+//
+// The file is mapped into memory on first use and mapped again after the
+// daemon replaces it, so lookups do not make system calls otherwise.
+class Snapshot {
+ public:
+  enum Result { kUnavailable, kFound, kNotFound };
+
+  // Creates a Snapshot of the file at path. Snapshots that the daemon last
+  // refreshed more than max_age seconds ago are unavailable.
+  Snapshot(const char* path, time_t max_age);
+  // Unmaps the snapshot.
+  ~Snapshot();
+
+  // Looks up an entity by name or ID. The entity's line, in the format
+  // returned by the daemon, is copied to line if it is found.
+  Result UserByName(const std::string& name, std::string* line);
+  Result UserByUid(uint32_t uid, std::string* line);
+  Result GroupByName(const std::string& name, std::string* line);
+  Result GroupByGid(uint32_t gid, std::string* line);
+
+ private:
+  // Returns with the read lock held if a current snapshot is mapped, mapping
+  // the latest one if needed. Otherwise returns false without the lock.
+  bool Acquire();
+  // Returns whether the mapped snapshot is current. Must be called with the
+  // lock held.
+  bool IsCurrent() const;
+  // Maps the latest snapshot, if valid. Must be called with the write lock
+  // held.
+  void Remap();
+  // Unmaps the snapshot. Must be called with the write lock held.
+  void Unmap();
+  // Searches the index at index_offset in the header for key. If name is not
+  // NULL, keys are name hashes and lines must also match name.
+  Result Find(size_t index_offset, size_t count_offset, uint32_t key,
+              const std::string* name, std::string* line);
+
+  const std::string path_;
+  const time_t max_age_;
+  pthread_rwlock_t lock_;
+  const char* data_;
+  size_t size_;
+  // The snapshot is not mapped again before this time unless superseded.
+  time_t next_remap_time_;
+
+  // Not copyable or assignable.
+  Snapshot& operator=(const Snapshot&);
+  Snapshot(const Snapshot&);
+};
+
+// Returns the 32-bit FNV-1a hash of value.
+uint32_t NameHash(const std::string& value);
+
+}  // namespace utils
+
+#endif  // GCE_ACCOUNTS_SNAPSHOT_H_
@@ -0,0 +1,257 @@
+/* Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "snapshot.h"  // NOLINT(build/include)
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+using utils::NameHash;
+using utils::Snapshot;
+
+// An IndexEntry is a key and the index of a line.
+typedef std::pair<uint32_t, size_t> IndexEntry;
+
+struct TestEntity {
+  uint32_t name_key;
+  uint32_t id;
+  std::string line;
+};
+
+void Put32(std::string* data, size_t offset, uint32_t value) {
+  for (size_t i = 0; i < 4; i++) {
+    (*data)[offset + i] = static_cast<char>(value >> (8 * i));
+  }
+}
+
+void Append32(std::string* data, uint32_t value) {
+  data->resize(data->size() + 4);
+  Put32(data, data->size() - 4, value);
+}
+
+TestEntity User(const std::string& name, uint32_t uid) {
+  TestEntity user;
+  user.name_key = NameHash(name);
+  user.id = uid;
+  std::stringstream line;
+  line << name << ":" << uid << ":1000:" << name << ":/home/" << name
+       << ":/bin/bash";
+  user.line = line.str();
+  return user;
+}
+
+TestEntity Group(const std::string& name, uint32_t gid) {
+  TestEntity group;
+  group.name_key = NameHash(name);
+  group.id = gid;
+  std::stringstream line;
+  line << name << ":" << gid << ":user1";
+  group.line = line.str();
+  return group;
+}
+
+// Encodes a snapshot in the format written by server/snapshot.go.
+std::string EncodeSnapshot(const std::vector<TestEntity>& users,
+                           const std::vector<TestEntity>& groups,
+                           time_t refresh_time) {
+  std::string lines;
+  std::vector<uint32_t> offsets;
+  std::vector<TestEntity> entities(users);
+  entities.insert(entities.end(), groups.begin(), groups.end());
+  for (size_t i = 0; i < entities.size(); i++) {
+    offsets.push_back(lines.size());
+    lines += entities[i].line;
+  }
+  std::vector<std::vector<IndexEntry> > indexes(4);
+  for (size_t i = 0; i < entities.size(); i++) {
+    size_t first = i < users.size() ? 0 : 2;
+    indexes[first].push_back(IndexEntry(entities[i].name_key, i));
+    indexes[first + 1].push_back(IndexEntry(entities[i].id, i));
+  }
+  std::string data(64, '\0');
+  data.replace(0, 8, "GCUASNAP");
+  Put32(&data, 8, 1);
+  Put32(&data, 24, refresh_time);
+  Put32(&data, 32, users.size());
+  Put32(&data, 36, groups.size());
+  for (size_t i = 0; i < indexes.size(); i++) {
+    Put32(&data, 40 + 4 * i, data.size());
+    std::sort(indexes[i].begin(), indexes[i].end());
+    for (size_t j = 0; j < indexes[i].size(); j++) {
+      size_t line = indexes[i][j].second;
+      Append32(&data, indexes[i][j].first);
+      Append32(&data, offsets[line]);
+      Append32(&data, entities[line].line.size());
+    }
+  }
+  Put32(&data, 56, data.size());
+  Put32(&data, 60, lines.size());
+  return data + lines;
+}
+
+void WriteSnapshot(const std::string& data) {
+  std::string tmp = std::string(SNAPSHOT_PATH) + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_NE(-1, fd);
+  ASSERT_EQ(static_cast<ssize_t>(data.size()),
+            write(fd, data.data(), data.size()));
+  close(fd);
+  ASSERT_EQ(0, rename(tmp.c_str(), SNAPSHOT_PATH));
+}
+
+void SupersedeSnapshot(const std::string& data) {
+  int fd = open(SNAPSHOT_PATH, O_WRONLY);
+  WriteSnapshot(data);
+  ASSERT_NE(-1, fd);
+  ASSERT_EQ(4, pwrite(fd, "\1\0\0\0", 4, 12));
+  close(fd);
+}
+
+class SnapshotTest : public ::testing::Test {
+ protected:
+  SnapshotTest() {
+    unlink(SNAPSHOT_PATH);
+    users_.push_back(User("user1", 1001));
+    users_.push_back(User("user2", 1002));
+    groups_.push_back(Group("group1", 2001));
+    groups_.push_back(Group("group2", 2002));
+  }
+
+  ~SnapshotTest() {
+    unlink(SNAPSHOT_PATH);
+  }
+
+  std::vector<TestEntity> users_;
+  std::vector<TestEntity> groups_;
+};
+
+TEST_F(SnapshotTest, NormalCase) {
+  WriteSnapshot(EncodeSnapshot(users_, groups_, time(NULL)));
+  Snapshot snapshot(SNAPSHOT_PATH, 300);
+  std::string line;
+  ASSERT_EQ(Snapshot::kFound, snapshot.UserByName("user2", &line));
+  ASSERT_EQ(users_[1].line, line);
+  ASSERT_EQ(Snapshot::kFound, snapshot.UserByUid(1001, &line));
+  ASSERT_EQ(users_[0].line, line);
+  ASSERT_EQ(Snapshot::kFound, snapshot.GroupByName("group1", &line));
+  ASSERT_EQ(groups_[0].line, line);
+  ASSERT_EQ(Snapshot::kFound, snapshot.GroupByGid(2002, &line));
+  ASSERT_EQ(groups_[1].line, line);
+}
+
+TEST_F(SnapshotTest, NotFound) {
+  WriteSnapshot(EncodeSnapshot(users_, groups_, time(NULL)));
+  Snapshot snapshot(SNAPSHOT_PATH, 300);
+  std::string line;
+  ASSERT_EQ(Snapshot::kNotFound, snapshot.UserByName("user", &line));
+  ASSERT_EQ(Snapshot::kNotFound, snapshot.UserByName("group1", &line));
+  ASSERT_EQ(Snapshot::kNotFound, snapshot.UserByUid(2001, &line));
+  ASSERT_EQ(Snapshot::kNotFound, snapshot.GroupByName("user1", &line));
+  ASSERT_EQ(Snapshot::kNotFound, snapshot.GroupByGid(0, &line));
+}
+
+TEST_F(SnapshotTest, Empty) {
+  WriteSnapshot(EncodeSnapshot(std::vector<TestEntity>(),
+                               std::vector<TestEntity>(), time(NULL)));
+  Snapshot snapshot(SNAPSHOT_PATH, 300);
+  std::string line;
+  ASSERT_EQ(Snapshot::kNotFound, snapshot.UserByName("user1", &line));
+  ASSERT_EQ(Snapshot::kNotFound, snapshot.GroupByGid(2001, &line));
+}
+
+TEST_F(SnapshotTest, NameHashCollision) {
+  // user3 and user1 have the same key, so their lines must be compared.
+  users_.push_back(User("user3", 1003));
+  users_[2].name_key = users_[0].name_key;
+  WriteSnapshot(EncodeSnapshot(users_, groups_, time(NULL)));
+  Snapshot snapshot(SNAPSHOT_PATH, 300);
+  std::string line;
+  ASSERT_EQ(Snapshot::kFound, snapshot.UserByName("user1", &line));
+  ASSERT_EQ(users_[0].line, line);
+  ASSERT_EQ(Snapshot::kNotFound, snapshot.UserByName("user3", &line));
+  // A name that is a prefix of the line's name does not match.
+  users_[1].name_key = NameHash("user");
+  WriteSnapshot(EncodeSnapshot(users_, groups_, time(NULL)));
+  Snapshot prefix_snapshot(SNAPSHOT_PATH, 300);
+  ASSERT_EQ(Snapshot::kNotFound, prefix_snapshot.UserByName("user", &line));
+}
+
+TEST_F(SnapshotTest, Missing) {
+  Snapshot snapshot(SNAPSHOT_PATH, 300);
+  std::string line;
+  ASSERT_EQ(Snapshot::kUnavailable, snapshot.UserByName("user1", &line));
+  ASSERT_EQ(Snapshot::kUnavailable, snapshot.GroupByGid(2001, &line));
+}
+
+TEST_F(SnapshotTest, Stale) {
+  WriteSnapshot(EncodeSnapshot(users_, groups_, time(NULL) - 301));
+  Snapshot snapshot(SNAPSHOT_PATH, 300);
+  std::string line;
+  ASSERT_EQ(Snapshot::kUnavailable, snapshot.UserByUid(1001, &line));
+}
+
+TEST_F(SnapshotTest, Invalid) {
+  std::string data = EncodeSnapshot(users_, groups_, time(NULL));
+  std::string invalid[] = {
+    "",
+    data.substr(0, 63),
+    data.substr(0, data.size() - 1),
+    "XCUASNAP" + data.substr(8),
+    data.substr(0, 8) + "\2" + data.substr(9),
+  };
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+    WriteSnapshot(invalid[i]);
+    Snapshot snapshot(SNAPSHOT_PATH, 300);
+    std::string line;
+    ASSERT_EQ(Snapshot::kUnavailable, snapshot.UserByUid(1001, &line)) << i;
+  }
+}
+
+TEST_F(SnapshotTest, InvalidLine) {
+  std::string data = EncodeSnapshot(users_, groups_, time(NULL));
+  // Point the first entry of the users by UID index past the lines.
+  size_t entry = data[44] & 0xff;
+  Put32(&data, entry + 4, 1 << 20);
+  WriteSnapshot(data);
+  Snapshot snapshot(SNAPSHOT_PATH, 300);
+  std::string line;
+  ASSERT_EQ(Snapshot::kNotFound, snapshot.UserByUid(1001, &line));
+  ASSERT_EQ(Snapshot::kFound, snapshot.UserByUid(1002, &line));
+}
+
+TEST_F(SnapshotTest, Superseded) {
+  WriteSnapshot(EncodeSnapshot(users_, groups_, time(NULL)));
+  Snapshot snapshot(SNAPSHOT_PATH, 300);
+  std::string line;
+  ASSERT_EQ(Snapshot::kNotFound, snapshot.UserByName("user3", &line));
+  users_.push_back(User("user3", 1003));
+  SupersedeSnapshot(EncodeSnapshot(users_, groups_, time(NULL)));
+  ASSERT_EQ(Snapshot::kFound, snapshot.UserByName("user3", &line));
+  ASSERT_EQ(users_[2].line, line);
+}
+
+TEST(NameHashTest, NormalCase) {
+  // Hashes computed by hash/fnv in server/snapshot_test.go.
+  ASSERT_EQ(0xa07d2cf9, NameHash("user1"));
+  ASSERT_EQ(0x6d6b6387, NameHash("group1"));
+  ASSERT_EQ(2166136261u, NameHash(""));
+}
@@ -0,0 +1,280 @@
+/* Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "stats.h"  // NOLINT(build/include)
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+
+#ifdef GCUA_USDT
+#include <sys/sdt.h>
+#endif
+
+namespace utils {
+
+enum StatsState { kStatsUnknown, kStatsDisabled, kStatsEnabled };
+
+const char* const kStatsCallNames[] = {
+  "getpwnam",
+  "getpwuid",
+  "setpwent",
+  "getpwent",
+  "getgrnam",
+  "getgrgid",
+  "setgrent",
+  "getgrent",
+  "initgroups",
+  "getspnam",
+  "setspent",
+  "getspent",
+};
+
+const char* const kStatsPhaseNames[] = {
+  "connect",
+  "write",
+  "wait",
+  "read",
+  "parse",
+};
+
+// Guards the creation of the stats page.
+pthread_mutex_t g_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+volatile int g_stats_state = kStatsUnknown;
+StatsPage* volatile g_stats_page = NULL;
+bool g_stats_fork_handler = false;
+
+// Forked children count their calls in a new page.
+void StatsForkChildHandler() {
+  pthread_mutex_init(&g_stats_mutex, NULL);
+  if (g_stats_state == kStatsEnabled) {
+    g_stats_page = NULL;
+    g_stats_state = kStatsUnknown;
+  }
+}
+
+bool StatsRequested() {
+  const char* env = getenv("GCUA_NSS_STATS");
+  if (env != NULL && *env != '\0' && getuid() == geteuid() &&
+      getgid() == getegid()) {
+    return true;
+  }
+  // STATS_FLAG_PATH is defined in the Makefile.
+  return access(STATS_FLAG_PATH, F_OK) == 0;
+}
+
+// Writes the path of the page of process pid to path, or that of user uid if
+// pid is 0.
+bool StatsPagePath(pid_t pid, uid_t uid, char* path, size_t size) {
+  // STATS_DIR is defined in the Makefile.
+  int length = (pid != 0) ?
+      snprintf(path, size, "%s/gcua-nss-stats.%d", STATS_DIR,
+               static_cast<int>(pid)) :
+      snprintf(path, size, "%s/gcua-nss-stats.user.%u", STATS_DIR,
+               static_cast<unsigned>(uid));
+  return length >= 0 && static_cast<size_t>(length) < size;
+}
+
+// Maps a page created or opened as fd. Returns NULL on failure.
+StatsPage* MapStatsPage(int fd) {
+  void* data = mmap(NULL, sizeof(StatsPage), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  return (data != MAP_FAILED) ? static_cast<StatsPage*>(data) : NULL;
+}
+
+void AddStatsCounters(const StatsCounters& from, StatsCounters* to) {
+  __sync_fetch_and_add(&to->count, from.count);
+  __sync_fetch_and_add(&to->total_ns, from.total_ns);
+  for (size_t i = 0; i < kStatsBuckets; i++) {
+    __sync_fetch_and_add(&to->buckets[i], from.buckets[i]);
+  }
+}
+
+StatsPage* CreateStatsPage() {
+  char path[256];
+  if (!StatsPagePath(getpid(), 0, path, sizeof(path))) {
+    return NULL;
+  }
+  // A page left by an earlier process with the same pid is replaced, but
+  // files of other users are never written to.
+  unlink(path);
+  int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                0600);
+  if (fd == -1) {
+    return NULL;
+  }
+  StatsPage* page = NULL;
+  if (ftruncate(fd, sizeof(StatsPage)) == 0) {
+    page = MapStatsPage(fd);
+  }
+  close(fd);
+  if (page == NULL) {
+    unlink(path);
+    return NULL;
+  }
+  memcpy(page->magic, kStatsMagic, sizeof(page->magic));
+  page->version = kStatsVersion;
+  page->pid = getpid();
+  return page;
+}
+
+// Adds the counts of this process to the page of its user and removes its
+// own page when it exits. Threads may still be timing calls, so the page
+// stays mapped. Pages of processes that end without running destructors,
+// such as by _exit or a signal, are left behind; nssstats collects them.
+__attribute__((destructor)) void RemoveStatsPage() {
+  if (g_stats_state != kStatsEnabled || g_stats_page == NULL ||
+      g_stats_page->pid != static_cast<uint32_t>(getpid())) {
+    return;
+  }
+  char path[256];
+  if (StatsPagePath(getpid(), 0, path, sizeof(path))) {
+    AddToUserStatsPage(*g_stats_page);
+    unlink(path);
+  }
+}
+
+bool AddToUserStatsPage(const StatsPage& page) {
+  char path[256];
+  if (!StatsPagePath(0, geteuid(), path, sizeof(path))) {
+    return false;
+  }
+  int fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    return false;
+  }
+  // Processes of the same user may create the page concurrently. Each of them
+  // sizes it and writes the same header until one is there.
+  struct stat st;
+  StatsPage* user_page = NULL;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == geteuid() &&
+      (st.st_size == sizeof(StatsPage) ||
+       (st.st_size == 0 && ftruncate(fd, sizeof(StatsPage)) == 0))) {
+    user_page = MapStatsPage(fd);
+  }
+  close(fd);
+  if (user_page == NULL) {
+    return false;
+  }
+  if (user_page->magic[0] == '\0') {
+    memcpy(user_page->magic, kStatsMagic, sizeof(user_page->magic));
+    user_page->version = kStatsVersion;
+    user_page->pid = 0;
+  }
+  bool valid = memcmp(user_page->magic, kStatsMagic,
+                      sizeof(user_page->magic)) == 0 &&
+      user_page->version == kStatsVersion;
+  if (valid) {
+    for (size_t i = 0; i < kNumStatsCalls; i++) {
+      AddStatsCounters(page.calls[i], &user_page->calls[i]);
+    }
+    for (size_t i = 0; i < kNumStatsPhases; i++) {
+      AddStatsCounters(page.phases[i], &user_page->phases[i]);
+    }
+  }
+  munmap(user_page, sizeof(StatsPage));
+  return valid;
+}
+
+StatsPage* GetStatsPage() {
+  if (g_stats_state != kStatsUnknown) {
+    return g_stats_page;
+  }
+  pthread_mutex_lock(&g_stats_mutex);
+  if (g_stats_state == kStatsUnknown) {
+    StatsPage* page = StatsRequested() ? CreateStatsPage() : NULL;
+    if (page != NULL && !g_stats_fork_handler) {
+      g_stats_fork_handler =
+          pthread_atfork(NULL, NULL, StatsForkChildHandler) == 0;
+    }
+    g_stats_page = page;
+    g_stats_state = (page != NULL) ? kStatsEnabled : kStatsDisabled;
+  }
+  pthread_mutex_unlock(&g_stats_mutex);
+  return g_stats_page;
+}
+
+const char* StatsCallName(StatsCall call) {
+  return kStatsCallNames[call];
+}
+
+const char* StatsPhaseName(StatsPhase phase) {
+  return kStatsPhaseNames[phase];
+}
+
+void RecordStatsEvent(StatsCounters* counters, uint64_t ns) {
+  size_t bucket = 0;
+  for (uint64_t us = ns / 1000; us != 0 && bucket < kStatsBuckets - 1;
+       us >>= 1) {
+    bucket++;
+  }
+  __sync_fetch_and_add(&counters->count, 1);
+  __sync_fetch_and_add(&counters->total_ns, ns);
+  __sync_fetch_and_add(&counters->buckets[bucket], 1);
+}
+
+StatsTimer::StatsTimer(StatsCall call)
+    : counters_(NULL),
+      name_(kStatsCallNames[call]),
+      is_call_(true) {
+  StatsPage* page = GetStatsPage();
+  if (page != NULL) {
+    counters_ = &page->calls[call];
+    Start();
+  }
+}
+
+StatsTimer::StatsTimer(StatsPhase phase)
+    : counters_(NULL),
+      name_(kStatsPhaseNames[phase]),
+      is_call_(false) {
+  StatsPage* page = GetStatsPage();
+  if (page != NULL) {
+    counters_ = &page->phases[phase];
+    Start();
+  }
+}
+
+void StatsTimer::Start() {
+  clock_gettime(CLOCK_MONOTONIC, &start_);
+}
+
+StatsTimer::~StatsTimer() {
+  if (counters_ == NULL) {
+    return;
+  }
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t ns = (now.tv_sec - start_.tv_sec) * 1000000000LL +
+      (now.tv_nsec - start_.tv_nsec);
+  if (ns < 0) {
+    ns = 0;
+  }
+  RecordStatsEvent(counters_, ns);
+#ifdef GCUA_USDT
+  if (is_call_) {
+    DTRACE_PROBE2(gcua_nss, call, name_, ns);
+  } else {
+    DTRACE_PROBE2(gcua_nss, phase, name_, ns);
+  }
+#endif
+}
+
+}  // namespace utils
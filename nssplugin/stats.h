@@ -0,0 +1,131 @@
+/* Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef GCE_ACCOUNTS_STATS_H_  // NOLINT(build/header_guard)
+#define GCE_ACCOUNTS_STATS_H_  // NOLINT(build/header_guard)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+namespace utils {
+
+// The NSS entry points whose calls are timed.
+enum StatsCall {
+  kGetpwnamCall,
+  kGetpwuidCall,
+  kSetpwentCall,
+  kGetpwentCall,
+  kGetgrnamCall,
+  kGetgrgidCall,
+  kSetgrentCall,
+  kGetgrentCall,
+  kInitgroupsCall,
+  kGetspnamCall,
+  kSetspentCall,
+  kGetspentCall,
+  kNumStatsCalls
+};
+
+// The phases of requests to the daemon that are timed: connecting, including
+// retries of a full backlog; sending requests; waiting for responses to be
+// readable; reading them; and parsing lines into entries.
+enum StatsPhase {
+  kConnectPhase,
+  kWritePhase,
+  kWaitPhase,
+  kReadPhase,
+  kParsePhase,
+  kNumStatsPhases
+};
+
+// The number of latency buckets of StatsCounters.
+const size_t kStatsBuckets = 24;
+
+// StatsCounters counts timed events. buckets[0] counts those that took less
+// than a microsecond, buckets[i] those that took at least 2^(i-1) and less
+// than 2^i microseconds, and the last bucket all longer ones.
+struct StatsCounters {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t buckets[kStatsBuckets];
+};
+
+// StatsPage is the layout of the stats file of a process, in native byte
+// order. Counters are updated atomically in place while the process runs.
+// When it exits, they are added to the page of its effective user and its own
+// file is removed. The page of a user has a pid of 0.
+struct StatsPage {
+  char magic[8];  // "GCUASTAT"
+  uint32_t version;
+  uint32_t pid;
+  StatsCounters calls[kNumStatsCalls];
+  StatsCounters phases[kNumStatsPhases];
+};
+
+const char kStatsMagic[] = "GCUASTAT";
+const uint32_t kStatsVersion = 1;
+
+// Returns the stats page of this process, creating it on first use, or NULL
+// if stats are disabled.
+//
+// Stats are disabled by default. They are enabled when the GCUA_NSS_STATS
+// environment variable is set to a non-empty value, except in setuid and
+// setgid processes, or when the file at STATS_FLAG_PATH exists. The page of a
+// process is the file gcua-nss-stats.<pid> in STATS_DIR, both defined in the
+// Makefile. Forked children create pages of their own. Pages can only be read
+// by their owner.
+StatsPage* GetStatsPage();
+
+// Adds the counters of page to the page of the effective user, the file
+// gcua-nss-stats.user.<uid> in STATS_DIR, creating it if needed. Returns
+// false if that file cannot be created or belongs to another user.
+bool AddToUserStatsPage(const StatsPage& page);
+
+// Returns the name of an entry point or phase, as used in stats output.
+const char* StatsCallName(StatsCall call);
+const char* StatsPhaseName(StatsPhase phase);
+
+// Adds an event that took ns nanoseconds to counters.
+void RecordStatsEvent(StatsCounters* counters, uint64_t ns);
+
+// StatsTimer times its own lifetime as a call of an entry point or a phase
+// of a request, if stats are enabled. Otherwise it costs a single check.
+//
+// When built with GCUA_USDT, timed calls and phases also fire the USDT probes
+// gcua_nss:call and gcua_nss:phase with their name and duration in
+// nanoseconds.
+class StatsTimer {
+ public:
+  explicit StatsTimer(StatsCall call);
+  explicit StatsTimer(StatsPhase phase);
+  ~StatsTimer();
+
+ private:
+  void Start();
+
+  StatsCounters* counters_;
+  const char* name_;
+  bool is_call_;
+  timespec start_;
+
+  // Not copyable or assignable.
+  StatsTimer& operator=(const StatsTimer&);
+  StatsTimer(const StatsTimer&);
+};
+
+}  // namespace utils
+
+#endif  // GCE_ACCOUNTS_STATS_H_
@@ -0,0 +1,212 @@
+/* Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "stats.h"  // NOLINT(build/include)
+
+using utils::GetStatsPage;
+using utils::RecordStatsEvent;
+using utils::StatsCounters;
+using utils::StatsPage;
+using utils::StatsTimer;
+
+// Whether stats are enabled is decided once per process, so every test that
+// needs the stats page runs in a child process. This process never creates
+// one.
+class StatsTest : public ::testing::Test {
+ protected:
+  StatsTest() {
+    unsetenv("GCUA_NSS_STATS");
+    unlink(STATS_FLAG_PATH);
+    unlink(UserPagePath().c_str());
+  }
+
+  ~StatsTest() {
+    unlink(STATS_FLAG_PATH);
+    unlink(UserPagePath().c_str());
+    for (size_t i = 0; i < pids_.size(); i++) {
+      unlink(PagePath(pids_[i]).c_str());
+    }
+  }
+
+  // Runs main in a child process and returns its pid once it succeeded.
+  pid_t RunInChild(int (*main)()) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      _exit(main());
+    }
+    pids_.push_back(pid);
+    int status;
+    EXPECT_EQ(pid, waitpid(pid, &status, 0));
+    EXPECT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(0, WEXITSTATUS(status));
+    return pid;
+  }
+
+  static std::string PagePath(pid_t pid) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/gcua-nss-stats.%d", STATS_DIR,
+             static_cast<int>(pid));
+    return path;
+  }
+
+  static std::string UserPagePath() {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/gcua-nss-stats.user.%u", STATS_DIR,
+             static_cast<unsigned>(geteuid()));
+    return path;
+  }
+
+  // Reads the stats page of pid. Returns false if there is none.
+  static bool ReadPage(pid_t pid, StatsPage* page) {
+    return ReadPageFile(PagePath(pid), page);
+  }
+
+  static bool ReadPageFile(const std::string& path, StatsPage* page) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == NULL) {
+      return false;
+    }
+    bool read = fread(page, sizeof(*page), 1, file) == 1;
+    fclose(file);
+    return read;
+  }
+
+  std::vector<pid_t> pids_;
+};
+
+// Times two getpwnam calls, each with a read. Returns whether stats are
+// disabled.
+int TimeCalls() {
+  for (int i = 0; i < 2; i++) {
+    StatsTimer timer(utils::kGetpwnamCall);
+    StatsTimer phase(utils::kReadPhase);
+  }
+  return GetStatsPage() == NULL;
+}
+
+int ExpectDisabled() {
+  return !TimeCalls();
+}
+
+TEST_F(StatsTest, DisabledByDefault) {
+  pid_t pid = RunInChild(ExpectDisabled);
+  StatsPage page;
+  EXPECT_FALSE(ReadPage(pid, &page));
+}
+
+int TimeCallsWithEnvironment() {
+  setenv("GCUA_NSS_STATS", "1", 1);
+  return TimeCalls();
+}
+
+TEST_F(StatsTest, EnabledByEnvironment) {
+  pid_t pid = RunInChild(TimeCallsWithEnvironment);
+  StatsPage page;
+  ASSERT_TRUE(ReadPage(pid, &page));
+  EXPECT_EQ(0, memcmp(utils::kStatsMagic, page.magic, sizeof(page.magic)));
+  EXPECT_EQ(utils::kStatsVersion, page.version);
+  EXPECT_EQ(static_cast<uint32_t>(pid), page.pid);
+  EXPECT_EQ(2, page.calls[utils::kGetpwnamCall].count);
+  EXPECT_EQ(0, page.calls[utils::kGetgrgidCall].count);
+  EXPECT_EQ(2, page.phases[utils::kReadPhase].count);
+  EXPECT_LE(page.phases[utils::kReadPhase].total_ns,
+            page.calls[utils::kGetpwnamCall].total_ns);
+  struct stat st;
+  ASSERT_EQ(0, stat(PagePath(pid).c_str(), &st));
+  EXPECT_EQ(0600, st.st_mode & 0777);
+}
+
+TEST_F(StatsTest, EnabledByFlagFile) {
+  close(open(STATS_FLAG_PATH, O_CREAT | O_WRONLY, 0644));
+  pid_t pid = RunInChild(TimeCalls);
+  StatsPage page;
+  ASSERT_TRUE(ReadPage(pid, &page));
+  EXPECT_EQ(2, page.calls[utils::kGetpwnamCall].count);
+}
+
+// Times a call, then has a forked child time another one.
+int TimeCallsInForkedChild() {
+  setenv("GCUA_NSS_STATS", "1", 1);
+  { StatsTimer timer(utils::kGetgrgidCall); }
+  pid_t pid = fork();
+  if (pid == 0) {
+    { StatsTimer timer(utils::kGetgrgidCall); }
+    _exit(GetStatsPage() == NULL);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  // The test reads the grandchild's pid from the page of this process.
+  GetStatsPage()->calls[utils::kGetspentCall].count = pid;
+  return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+TEST_F(StatsTest, ForkedChildrenHaveTheirOwnPage) {
+  pid_t pid = RunInChild(TimeCallsInForkedChild);
+  StatsPage page;
+  ASSERT_TRUE(ReadPage(pid, &page));
+  EXPECT_EQ(1, page.calls[utils::kGetgrgidCall].count);
+  pid_t grandchild = page.calls[utils::kGetspentCall].count;
+  pids_.push_back(grandchild);
+  ASSERT_TRUE(ReadPage(grandchild, &page));
+  EXPECT_EQ(static_cast<uint32_t>(grandchild), page.pid);
+  EXPECT_EQ(1, page.calls[utils::kGetgrgidCall].count);
+}
+
+// Times calls and exits normally, running destructors.
+int TimeCallsAndExit() {
+  setenv("GCUA_NSS_STATS", "1", 1);
+  TimeCalls();
+  exit(0);
+}
+
+TEST_F(StatsTest, ExitAddsPageToUserPage) {
+  RunInChild(TimeCallsAndExit);
+  pid_t pid = RunInChild(TimeCallsAndExit);
+  StatsPage page;
+  EXPECT_FALSE(ReadPage(pid, &page));
+  ASSERT_TRUE(ReadPageFile(UserPagePath(), &page));
+  EXPECT_EQ(0, memcmp(utils::kStatsMagic, page.magic, sizeof(page.magic)));
+  EXPECT_EQ(0, page.pid);
+  EXPECT_EQ(4, page.calls[utils::kGetpwnamCall].count);
+  EXPECT_EQ(4, page.phases[utils::kReadPhase].count);
+}
+
+TEST_F(StatsTest, RecordStatsEventBuckets) {
+  StatsCounters counters;
+  memset(&counters, 0, sizeof(counters));
+  RecordStatsEvent(&counters, 500);
+  RecordStatsEvent(&counters, 1000);
+  RecordStatsEvent(&counters, 3999);
+  RecordStatsEvent(&counters, 4000);
+  RecordStatsEvent(&counters, 1000000000000ULL);
+  EXPECT_EQ(5, counters.count);
+  EXPECT_EQ(1000000009499ULL, counters.total_ns);
+  EXPECT_EQ(1, counters.buckets[0]);
+  EXPECT_EQ(1, counters.buckets[1]);
+  EXPECT_EQ(1, counters.buckets[2]);
+  EXPECT_EQ(1, counters.buckets[3]);
+  EXPECT_EQ(1, counters.buckets[utils::kStatsBuckets - 1]);
+}
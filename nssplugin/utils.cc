@@ -18,17 +18,21 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
-#include <cassert>
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
-#include <sstream>
+#include <ctime>
+#include <new>
 #include <stdexcept>
 
+#include "stats.h"  // NOLINT(build/include)
+
 #define CONC(A, B) CONC_(A, B)
 #define CONC_(A, B) A ":"#B
 #define LOCATION CONC(__FILE__, __LINE__)
@@ -36,8 +40,63 @@
 
 namespace utils {
 
-const timeval kNormalTimeout = { 1, 0 };  // 1 second.
-const timeval kExtendedTimeout = { 5, 0 };  // 5 seconds.
+// How long to wait before negotiating keep-alive again after the daemon
+// refused it.
+const time_t kKeepAliveRetryInterval = 60;  // 60 seconds.
+// Upper bound on the size of a keep-alive response frame.
+const size_t kMaxFrameSize = 1 << 30;  // 1 GiB.
+// How long a line kept by KeepLineForRetry may answer a retry.
+const time_t kRetryLineTtl = 5;  // 5 seconds.
+// Larger lines are not cached by LookupCache.
+const size_t kMaxCachedLineSize = 64 * 1024;  // 64 KiB.
+// How long to wait before streaming enumerations again after the daemon
+// refused it.
+const time_t kStreamingRetryInterval = 60;  // 60 seconds.
+// How many elements of a paged enumeration are requested at a time, unless
+// set by SetPageSize.
+const size_t kDefaultPageSize = 512;
+// How long to wait before paging enumerations again after the daemon failed
+// to return the first page.
+const time_t kPagingRetryInterval = 60;  // 60 seconds.
+// How long to wait before pipelining lookups again after the daemon refused
+// it.
+const time_t kPipeliningRetryInterval = 60;  // 60 seconds.
+// Upper bound on the size of the header of a pipelined response frame, an ID
+// and a length of up to 20 digits each.
+const size_t kMaxPipelinedHeaderSize = 41;
+// How much of a streamed enumeration is read at a time.
+const size_t kStreamChunkSize = 16 * 1024;  // 16 KiB.
+// Responses of unknown size are read in chunks that start at kMinReadSize and
+// grow with the response up to kMaxReadSize.
+const size_t kMinReadSize = 4 * 1024;  // 4 KiB.
+const size_t kMaxReadSize = 1024 * 1024;  // 1 MiB.
+// Upper bound on the size of a batch request, including its trailing newline,
+// accepted by the daemon.
+const size_t kMaxBatchRequestSize = 16 * 1024;  // 16 KiB.
+// Upper bound on the delay between connects to a daemon whose accept backlog
+// is full.
+const int kMaxConnectBackoffMs = 16;
+// Larger IDs are parsed as kMaxId.
+const uint64_t kMaxId = 0xffffffff;
+// The first byte of a binary user or group record, which text lines never
+// start with.
+const char kBinaryRecordMarker = '\0';
+
+enum WaitType { kRead, kWrite };
+
+// Deadline is a point in time on the monotonic clock by which an operation
+// must complete.
+class Deadline {
+ public:
+  // Creates a Deadline timeout_ms milliseconds from now.
+  explicit Deadline(int timeout_ms);
+
+  // Returns the milliseconds left, rounded up, or 0 if the deadline passed.
+  int RemainingMs() const;
+
+ private:
+  timespec end_;
+};
 
 // AutoFd encapsulates a file descriptor.
 class AutoFd {
@@ -49,9 +108,11 @@ class AutoFd {
 
   // Gets the underlying file descriptor.
   int get() const;
+  // Releases ownership of the underlying file descriptor and returns it.
+  int release();
 
  private:
-  const int fd_;
+  int fd_;
 
   // Not copyable or assignable.
   AutoFd& operator=(const AutoFd&);
@@ -75,6 +136,91 @@ class AutoLock {
   AutoLock(const AutoLock&);
 };
 
+// KeepAliveConnection is a connection to the daemon that is reused across
+// the requests made by a single thread.
+class KeepAliveConnection {
+ public:
+  KeepAliveConnection();
+  // Closes the underlying connection.
+  ~KeepAliveConnection();
+
+  // Returns whether the connection is open and still refers to the socket
+  // that was opened by this process. Stale connections are closed.
+  bool IsReusable();
+  // Opens a new connection and switches it to keep-alive mode. Returns false
+  // if the daemon does not support keep-alive.
+  //
+  // Throws std::runtime_error exception if the daemon cannot be reached.
+  bool Open(const Deadline& deadline);
+  // Closes the connection.
+  void Close();
+  // Sends a request line and reads the response frame into response, where
+  // its body starts at *offset. Returns false if the daemon closed the
+  // connection before responding.
+  //
+  // Throws std::runtime_error exception if the request fails otherwise.
+  bool Request(const std::string& line, const Deadline& deadline,
+               std::string* response, size_t* offset);
+
+ private:
+  int fd_;
+  dev_t dev_;
+  ino_t ino_;
+  unsigned fork_generation_;
+
+  // Not copyable or assignable.
+  KeepAliveConnection& operator=(const KeepAliveConnection&);
+  KeepAliveConnection(const KeepAliveConnection&);
+};
+
+// Keep-alive connections are owned by thread-specific data so that they are
+// closed when their thread exits.
+pthread_once_t g_keep_alive_once = PTHREAD_ONCE_INIT;
+pthread_key_t g_keep_alive_key;
+// The line kept for a retry by each thread is owned by thread-specific data.
+pthread_once_t g_retry_line_once = PTHREAD_ONCE_INIT;
+pthread_key_t g_retry_line_key;
+// Bumped in forked children so that connections shared with the parent are
+// never used by the child.
+volatile unsigned g_fork_generation = 0;
+volatile bool g_keep_alive_enabled = true;
+// Keep-alive is not negotiated before this time.
+volatile time_t g_keep_alive_retry_time = 0;
+volatile bool g_binary_enabled = true;
+volatile bool g_streaming_enabled = true;
+// Enumerations are not streamed before this time.
+volatile time_t g_streaming_retry_time = 0;
+volatile size_t g_page_size = kDefaultPageSize;
+// Enumerations are not paged before this time.
+volatile time_t g_paging_retry_time = 0;
+volatile bool g_pipelining_enabled = true;
+// Lookups are not pipelined before this time.
+volatile time_t g_pipelining_retry_time = 0;
+// The time allowed for a request, in milliseconds, indexed by OutputType.
+volatile int g_request_timeouts_ms[] = {
+  1000,  // kSingleLine
+  10000,  // kMultiLine
+  5000,  // kSingleLineExtendedTimeout
+};
+
+Deadline::Deadline(int timeout_ms) {
+  clock_gettime(CLOCK_MONOTONIC, &end_);
+  end_.tv_sec += timeout_ms / 1000;
+  end_.tv_nsec += (timeout_ms % 1000) * 1000000L;
+  if (end_.tv_nsec >= 1000000000L) {
+    end_.tv_sec++;
+    end_.tv_nsec -= 1000000000L;
+  }
+}
+
+int Deadline::RemainingMs() const {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t remaining_ns = (end_.tv_sec - now.tv_sec) * 1000000000LL +
+      (end_.tv_nsec - now.tv_nsec);
+  return remaining_ns > 0 ? (remaining_ns + 999999) / 1000000 : 0;
+}
+
 AutoFd::AutoFd(int fd)
     : fd_(fd) {}
 
@@ -88,6 +234,12 @@ int AutoFd::get() const {
   return fd_;
 }
 
+int AutoFd::release() {
+  int fd = fd_;
+  fd_ = -1;
+  return fd;
+}
+
 AutoLock::AutoLock(pthread_mutex_t* mutex)
     : mutex_(mutex) {
   pthread_mutex_lock(mutex_);
@@ -102,10 +254,13 @@ BufferManager::BufferManager(char* buf, size_t buflen)
       buflen_(buflen) {}
 
 char* BufferManager::AppendString(const std::string& value) {
-  size_t bytes_to_write = value.length() + 1;
+  return AppendString(value.data(), value.length());
+}
 
-  char* result = static_cast<char*>(Reserve(bytes_to_write));
-  strncpy(result, value.c_str(), bytes_to_write);
+char* BufferManager::AppendString(const char* value, size_t length) {
+  char* result = static_cast<char*>(Reserve(length + 1));
+  memcpy(result, value, length);
+  result[length] = '\0';
 
   return result;
 }
@@ -127,6 +282,34 @@ char** BufferManager::AppendVector(const std::vector<std::string>& value) {
   return result;
 }
 
+char** BufferManager::ReserveVector(size_t count) {
+  if (count >= buflen_ / sizeof(char*)) {
+    throw std::length_error(LOCATION);
+  }
+  char** result = static_cast<char**>(Reserve((count + 1) * sizeof(char*)));
+  result[count] = NULL;
+  return result;
+}
+
+char** BufferManager::AppendTokens(const char* value, size_t length,
+                                   char delim) {
+  size_t count = 0;
+  if (length) {
+    count = std::count(value, value + length, delim) + 1;
+  }
+  size_t bytes_to_write = (count + 1) * sizeof(char*);
+
+  char** result = static_cast<char**>(Reserve(bytes_to_write));
+  const char* end = value + length;
+  for (size_t i = 0; i < count; i++) {
+    const char* token_end = std::find(value, end, delim);
+    result[i] = AppendString(value, token_end - value);
+    value = token_end + 1;
+  }
+  result[count] = NULL;
+
+  return result;
+}
 
 void BufferManager::CheckSpaceAvailable(size_t bytes_to_write) const {
   if (bytes_to_write > buflen_) {
@@ -142,34 +325,565 @@ void* BufferManager::Reserve(size_t bytes) {
   return result;
 }
 
-EntityList::EntityList()
-    : index_(0) {
+void WaitUntilFdReady(int fd, WaitType wait_type, const Deadline& deadline);
+int ConnectToDaemon(const Deadline& deadline);
+bool SendAll(int fd, const std::string& data, const Deadline& deadline);
+ssize_t ReadInto(int fd, size_t length, std::string* buffer);
+bool GetDaemonResponse(const std::string& command,
+                       OutputType output_type,
+                       std::string* response,
+                       size_t* offset,
+                       bool* refused = NULL);
+
+time_t MonotonicTime();
+
+// A Response holds the elements of an enumeration. A paged or streamed response
+// is completed by requesting the next page or reading more of the stream as
+// cursors reach the end of what has been read, with the mutex locked. A
+// complete response is never modified, so cursors that have seen it complete
+// read it without locking.
+class EntityList::Response {
+ public:
+  // Requests the response to command from the daemon. Throws the same
+  // exceptions as GetDaemonOutput.
+  explicit Response(const std::string& command);
+  ~Response();
+
+  void Ref();
+  // Deletes the response when the last reference is released.
+  void Unref();
+  // Returns whether reading the stream failed, so that the response must not
+  // be reused.
+  bool Failed();
+  // The offset of the first element, or std::string::npos if there is none.
+  size_t begin() const { return begin_; }
+
+  // Parses the element at cursor with parse and advances cursor past it.
+  // Throws std::out_of_range exception at the end of the response, moving
+  // cursor there, or the exceptions of parse, leaving cursor unchanged.
+  template <typename Entity>
+  void Pop(Cursor* cursor, Entity* entity, BufferManager* buf,
+           void (*parse)(const char*, size_t, Entity*, BufferManager*));
+
+ private:
+  // Gets the element at offset, reading more of the stream if needed. Must be
+  // called with the mutex locked unless complete_ is set.
+  void Peek(size_t offset, const char** line, size_t* length);
+  // Requests the first page of the response to command_. Returns false if
+  // the daemon does not support paging.
+  bool OpenPages();
+  // Appends the next page of the response to output_, each line followed by
+  // a newline character. Sets complete_ if it is the last page. If refused is
+  // not NULL, it is set instead of throwing if the daemon refuses the
+  // request.
+  void FetchPage(bool* refused = NULL);
+  // Requests a streamed response to command. Returns false if the daemon does
+  // not support streaming.
+  bool OpenStream(const std::string& command);
+  // Appends the next chunk of the stream to output_, waiting for it until
+  // deadline. Returns false at the end of the stream.
+  bool ReadStream(const Deadline& deadline);
+  void CloseStream();
+
+  pthread_mutex_t mutex_;
+  int refs_;
+  std::string output_;
+  size_t begin_;
+  // The connection the response is streamed from, or -1 if it has been read
+  // completely or reading it failed.
+  int stream_fd_;
+  bool streamed_;
+  bool paged_;
+  bool complete_;
+  bool failed_;
+  // The command without a trailing newline, and the name of the last entity
+  // of the last page, for paged responses.
+  std::string command_;
+  std::string last_name_;
+
+  // Not copyable or assignable.
+  Response& operator=(const Response&);
+  Response(const Response&);
+};
+
+// A Cursor is the position of a thread in its entity list.
+struct EntityList::Cursor {
+  Cursor() : response(NULL), offset(std::string::npos), complete(false) {}
+
+  void Reset() {
+    if (response != NULL) {
+      response->Unref();
+    }
+    response = NULL;
+    offset = std::string::npos;
+    complete = false;
+  }
+
+  Response* response;
+  // The offset of the next element, or std::string::npos at the end.
+  size_t offset;
+  // Whether the response was seen complete, so it can be read without
+  // locking.
+  bool complete;
+};
+
+EntityList::Response::Response(const std::string& command)
+    : refs_(1),
+      begin_(std::string::npos),
+      stream_fd_(-1),
+      streamed_(false),
+      paged_(false),
+      complete_(false),
+      failed_(false),
+      command_(command, 0, command.find('\n')) {
+  pthread_mutex_init(&mutex_, NULL);
+  try {
+    paged_ = OpenPages();
+    streamed_ = !paged_ && OpenStream(command);
+    size_t offset;
+    if (!paged_ && !streamed_) {
+      complete_ = true;
+      if (GetDaemonResponse(command, kMultiLine, &output_, &offset)) {
+        begin_ = offset;
+      }
+    }
+  } catch (...) {
+    CloseStream();
+    pthread_mutex_destroy(&mutex_);
+    throw;
+  }
+}
+
+EntityList::Response::~Response() {
+  CloseStream();
+  pthread_mutex_destroy(&mutex_);
+}
+
+void EntityList::Response::Ref() {
+  AutoLock lock(&mutex_);
+  refs_++;
+}
+
+void EntityList::Response::Unref() {
+  bool last;
+  {
+    AutoLock lock(&mutex_);
+    last = --refs_ == 0;
+  }
+  if (last) {
+    delete this;
+  }
+}
+
+bool EntityList::Response::Failed() {
+  AutoLock lock(&mutex_);
+  return failed_;
+}
+
+template <typename Entity>
+void EntityList::Response::Pop(
+    Cursor* cursor, Entity* entity, BufferManager* buf,
+    void (*parse)(const char*, size_t, Entity*, BufferManager*)) {
+  bool locked = !cursor->complete;
+  if (locked) {
+    pthread_mutex_lock(&mutex_);
+  }
+  try {
+    const char* line;
+    size_t length;
+    try {
+      Peek(cursor->offset, &line, &length);
+    } catch (const std::exception&) {
+      // The end of the response and stream errors both end the iteration.
+      cursor->offset = std::string::npos;
+      throw;
+    }
+    cursor->complete = complete_;
+    parse(line, length, entity, buf);
+    size_t next = cursor->offset + length;
+    // Lines are split like TokenizeString, so a trailing newline is followed
+    // by an empty element.
+    cursor->offset = (next < output_.size()) ? next + 1 : std::string::npos;
+  } catch (...) {
+    if (locked) {
+      pthread_mutex_unlock(&mutex_);
+    }
+    throw;
+  }
+  if (locked) {
+    pthread_mutex_unlock(&mutex_);
+  }
+}
+
+void EntityList::Response::Peek(size_t offset, const char** line,
+                                size_t* length) {
+  if (offset == std::string::npos) {
+    throw std::out_of_range(LOCATION);
+  }
+  size_t end = output_.find('\n', offset);
+  if (streamed_) {
+    while (end == std::string::npos) {
+      if (stream_fd_ == -1) {
+        // Reading the stream failed.
+        throw std::runtime_error(LOCATION);
+      }
+      size_t searched = output_.size();
+      try {
+        // The caller sets the pace of a stream, so each read gets the time
+        // allowed for a whole enumeration.
+        if (!ReadStream(Deadline(g_request_timeouts_ms[kMultiLine]))) {
+          // The stream ended without an empty line, so it was truncated.
+          throw std::runtime_error(LOCATION);
+        }
+      } catch (const std::exception&) {
+        CloseStream();
+        failed_ = true;
+        throw;
+      }
+      end = output_.find('\n', searched);
+    }
+    if (end == offset) {
+      // An empty line ends the stream.
+      CloseStream();
+      complete_ = true;
+      throw std::out_of_range(LOCATION);
+    }
+  } else if (paged_) {
+    while (end == std::string::npos) {
+      if (complete_) {
+        throw std::out_of_range(LOCATION);
+      } else if (failed_) {
+        throw std::runtime_error(LOCATION);
+      }
+      size_t searched = output_.size();
+      try {
+        FetchPage();
+      } catch (const std::exception&) {
+        failed_ = true;
+        throw;
+      }
+      end = output_.find('\n', searched);
+    }
+  } else if (end == std::string::npos) {
+    end = output_.size();
+  }
+  *line = output_.data() + offset;
+  *length = end - offset;
+}
+
+bool EntityList::Response::OpenPages() {
+  if (g_page_size == 0 || time(NULL) < g_paging_retry_time) {
+    return false;
+  }
+  // Other errors fail this response only, rather than turning paging off.
+  bool refused = false;
+  FetchPage(&refused);
+  if (refused) {
+    // The daemon does not support paging.
+    g_paging_retry_time = time(NULL) + kPagingRetryInterval;
+    return false;
+  }
+  begin_ = 0;
+  return true;
+}
+
+void EntityList::Response::FetchPage(bool* refused) {
+  size_t page_size = g_page_size;
+  char size[24];
+  snprintf(size, sizeof(size), "%lu", static_cast<unsigned long>(page_size));
+  std::string request = "page " + command_ + " " + size;
+  if (!last_name_.empty()) {
+    request += " " + last_name_;
+  }
+  request.push_back('\n');
+  std::string page;
+  size_t offset;
+  size_t lines = 0;
+  if (GetDaemonResponse(request, kMultiLine, &page, &offset, refused)) {
+    size_t last = offset;
+    for (size_t i = offset; i < page.size(); i++) {
+      if (page[i] == '\n') {
+        last = i + 1;
+        lines++;
+      }
+    }
+    lines++;
+    // Users and groups are named by their first field.
+    size_t name_end = std::min(page.find(':', last), page.size());
+    last_name_.assign(page, last, name_end - last);
+    output_.append(page, offset, std::string::npos);
+    output_.push_back('\n');
+  }
+  if (refused != NULL && *refused) {
+    return;
+  }
+  complete_ = lines < page_size;
+}
+
+bool EntityList::Response::OpenStream(const std::string& command) {
+  if (!g_streaming_enabled || time(NULL) < g_streaming_retry_time) {
+    return false;
+  }
+  Deadline deadline(g_request_timeouts_ms[kMultiLine]);
+  AutoFd fd(ConnectToDaemon(deadline));
+  if (!SendAll(fd.get(), "stream " + command, deadline)) {
+    throw std::runtime_error(LOCATION);
+  }
+  stream_fd_ = fd.release();
+  size_t end;
+  while ((end = output_.find('\n')) == std::string::npos &&
+         ReadStream(deadline)) {}
+  if (end == std::string::npos) {
+    // The daemon responded with an error and closed the connection.
+    std::string result_code;
+    result_code.swap(output_);
+    CloseStream();
+    if (result_code == "400") {
+      // The daemon does not support streaming.
+      g_streaming_retry_time = time(NULL) + kStreamingRetryInterval;
+      return false;
+    } else if (result_code == "404") {
+      throw std::invalid_argument(command);
+    }
+    throw std::runtime_error(LOCATION);
+  } else if (output_.compare(0, end, "200") != 0) {
+    throw std::runtime_error(LOCATION);
+  }
+  begin_ = end + 1;
+  return true;
+}
+
+bool EntityList::Response::ReadStream(const Deadline& deadline) {
+  WaitUntilFdReady(stream_fd_, kRead, deadline);
+  ssize_t bytes_read = ReadInto(stream_fd_, kStreamChunkSize, &output_);
+  if (bytes_read == -1) {
+    throw std::runtime_error(LOCATION);
+  }
+  return bytes_read > 0;
+}
+
+void EntityList::Response::CloseStream() {
+  if (stream_fd_ != -1) {
+    close(stream_fd_);
+    stream_fd_ = -1;
+  }
+}
+
+EntityList::EntityList(time_t ttl)
+    : ttl_(ttl),
+      has_cursor_key_(false),
+      shared_(NULL),
+      loaded_time_(0) {
+  has_cursor_key_ = pthread_key_create(&cursor_key_, DeleteCursor) == 0;
   pthread_mutex_init(&mutex_, NULL);
 }
 
 EntityList::~EntityList() {
+  // The cursors of other threads that are still running are leaked along
+  // with their responses, since the key no longer calls DeleteCursor.
+  if (has_cursor_key_) {
+    DeleteCursor(pthread_getspecific(cursor_key_));
+    pthread_key_delete(cursor_key_);
+  }
+  ReleaseShared();
   pthread_mutex_destroy(&mutex_);
 }
 
+EntityList::Cursor* EntityList::GetCursor() {
+  if (!has_cursor_key_) {
+    throw std::runtime_error(LOCATION);
+  }
+  Cursor* cursor = static_cast<Cursor*>(pthread_getspecific(cursor_key_));
+  if (cursor == NULL) {
+    cursor = new Cursor();
+    if (pthread_setspecific(cursor_key_, cursor)) {
+      delete cursor;
+      throw std::runtime_error(LOCATION);
+    }
+  }
+  return cursor;
+}
+
+void EntityList::DeleteCursor(void* cursor) {
+  if (cursor != NULL) {
+    static_cast<Cursor*>(cursor)->Reset();
+    delete static_cast<Cursor*>(cursor);
+  }
+}
+
+void EntityList::ReleaseShared() {
+  if (shared_ != NULL) {
+    shared_->Unref();
+    shared_ = NULL;
+  }
+}
+
 void EntityList::Load(const std::string& command) {
-  AutoLock lock(&mutex_);
-  index_ = 0;
-  output_.clear();
-  GetDaemonOutput(command, kMultiLine, &output_);
+  Cursor* cursor = GetCursor();
+  cursor->Reset();
+  Response* response;
+  {
+    // Loads wait for each other, so that threads that start iterating at the
+    // same time share one response.
+    AutoLock lock(&mutex_);
+    time_t now = MonotonicTime();
+    if (shared_ == NULL || command_ != command ||
+        now - loaded_time_ >= ttl_ || shared_->Failed()) {
+      ReleaseShared();
+      shared_ = new Response(command);
+      command_ = command;
+      loaded_time_ = now;
+    }
+    response = shared_;
+    response->Ref();
+  }
+  cursor->response = response;
+  cursor->offset = response->begin();
 }
 
 void EntityList::Clear() {
+  GetCursor()->Reset();
   AutoLock lock(&mutex_);
-  index_ = 0;
-  output_.clear();
+  if (MonotonicTime() - loaded_time_ >= ttl_) {
+    ReleaseShared();
+  }
+}
+
+// Copies a line into a string, for Pop.
+void CopyLine(const char* line, size_t length, std::string* result,
+              BufferManager*) {
+  result->assign(line, length);
+}
+
+template <typename Entity>
+void EntityList::PopInto(
+    Entity* entity, BufferManager* buf,
+    void (*parse)(const char*, size_t, Entity*, BufferManager*)) {
+  Cursor* cursor = GetCursor();
+  if (cursor->response == NULL) {
+    throw std::out_of_range(LOCATION);
+  }
+  cursor->response->Pop(cursor, entity, buf, parse);
 }
 
 std::string EntityList::Pop() {
+  std::string line;
+  PopInto(&line, NULL, CopyLine);
+  return line;
+}
+
+void EntityList::Pop(passwd* pwd, BufferManager* buf) {
+  PopInto(pwd, buf, UserLineToPasswdStruct);
+}
+
+void EntityList::Pop(group* grp, BufferManager* buf) {
+  PopInto(grp, buf, GroupLineToGroupStruct);
+}
+
+void EntityList::Pop(spwd* pwd, BufferManager* buf) {
+  PopInto(pwd, buf, AccountNameToShadowStruct);
+}
+
+// Returns the seconds elapsed on a clock that is not affected by changes to
+// the system time.
+time_t MonotonicTime() {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+LookupCache::LookupCache(size_t size, time_t ttl, time_t negative_ttl,
+                         uint64_t (*generation)())
+    : ttl_(ttl),
+      negative_ttl_(negative_ttl),
+      generation_(generation),
+      entries_(size) {
+  pthread_mutex_init(&mutex_, NULL);
+}
+
+LookupCache::~LookupCache() {
+  pthread_mutex_destroy(&mutex_);
+}
+
+uint64_t LookupCache::Generation() const {
+  return generation_ != NULL ? generation_() : 0;
+}
+
+LookupCache::Result LookupCache::Get(const std::string& command,
+                                     std::string* line) {
+  time_t now = MonotonicTime();
+  uint64_t generation = Generation();
   AutoLock lock(&mutex_);
-  if (index_ >= output_.size()) {
-    throw std::out_of_range(LOCATION);
+  Entry* entry = Slot(command);
+  // Found entries of the current generation never expire.
+  bool expired = entry != NULL &&
+      (entry->generation != generation ||
+       ((generation == 0 || !entry->found) && now >= entry->expiry));
+  if (entry == NULL || entry->command != command || expired) {
+    return kMiss;
+  } else if (!entry->found) {
+    return kNotFound;
+  }
+  *line = entry->line;
+  return kFound;
+}
+
+void LookupCache::Put(const std::string& command, const std::string& line) {
+  Put(command, line, Generation());
+}
+
+void LookupCache::Put(const std::string& command, const std::string& line,
+                      uint64_t generation) {
+  if (line.size() <= kMaxCachedLineSize) {
+    Store(command, line, true, ttl_, generation);
   }
-  return output_[index_++];
+}
+
+void LookupCache::PutNotFound(const std::string& command) {
+  PutNotFound(command, Generation());
+}
+
+void LookupCache::PutNotFound(const std::string& command,
+                              uint64_t generation) {
+  Store(command, "", false, negative_ttl_, generation);
+}
+
+void LookupCache::Clear() {
+  AutoLock lock(&mutex_);
+  for (size_t i = 0; i < entries_.size(); i++) {
+    entries_[i] = Entry();
+  }
+}
+
+void LookupCache::Store(const std::string& command, const std::string& line,
+                        bool found, time_t ttl, uint64_t generation) {
+  if (ttl <= 0) {
+    return;
+  }
+  time_t now = MonotonicTime();
+  AutoLock lock(&mutex_);
+  Entry* entry = Slot(command);
+  if (entry == NULL) {
+    return;
+  }
+  entry->command = command;
+  entry->line = line;
+  entry->expiry = now + ttl;
+  entry->generation = generation;
+  entry->found = found;
+}
+
+LookupCache::Entry* LookupCache::Slot(const std::string& command) {
+  if (entries_.empty()) {
+    return NULL;
+  }
+  // 32-bit FNV-1a.
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < command.size(); i++) {
+    hash ^= static_cast<unsigned char>(command[i]);
+    hash *= 16777619u;
+  }
+  return &entries_[hash % entries_.size()];
 }
 
 void TokenizeString(const std::string& value,
@@ -191,52 +905,110 @@ void TokenizeString(const std::string& value,
 }
 
 uint32_t ParseId(const std::string& value) {
-  if (value.empty()) {
+  return ParseId(value.data(), value.length());
+}
+
+uint32_t ParseId(const char* value, size_t length) {
+  if (!length) {
     throw std::runtime_error(LOCATION);
   }
-  char* end = NULL;
-  // NOLINTNEXTLINE(runtime/deprecated_fn)
-  int64_t id = std::strtol(value.c_str(), &end, 10);
-  if (end != &(*value.end()) || id < 0) {
-    throw std::runtime_error(LOCATION);
+  uint64_t id = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (value[i] < '0' || value[i] > '9') {
+      throw std::runtime_error(LOCATION);
+    }
+    if (id <= kMaxId) {
+      id = id * 10 + (value[i] - '0');
+    }
   }
 
-  return static_cast<uint32_t>(id);
+  return static_cast<uint32_t>(std::min(id, kMaxId));
+}
+
+// Token is a field of a line from the daemon.
+struct Token {
+  const char* data;
+  size_t length;
+};
+
+// Splits value like TokenizeString, without copying. Returns false unless
+// value has exactly count tokens.
+bool SplitTokens(const char* value, size_t length, char delim, Token* tokens,
+                 size_t count) {
+  if (!length) {
+    return count == 0;
+  }
+  const char* end = value + length;
+  for (size_t i = 0; i < count; i++) {
+    const char* token_end = std::find(value, end, delim);
+    tokens[i].data = value;
+    tokens[i].length = token_end - value;
+    if (token_end == end) {
+      return i == count - 1;
+    }
+    value = token_end + 1;
+  }
+  return false;
 }
 
-enum WaitType { kConnection, kRead, kExtendedRead };
+// Reads a 32-bit little-endian integer of a binary record at *data and advances
+// past it. Throws std::runtime_error exception if it does not end before end.
+uint32_t ReadUint32(const char** data, const char* end) {
+  if (end - *data < 4) {
+    throw std::runtime_error(LOCATION);
+  }
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(*data);
+  *data += 4;
+  return bytes[0] | bytes[1] << 8 | bytes[2] << 16 |
+      static_cast<uint32_t>(bytes[3]) << 24;
+}
 
-void WaitUntilFdReady(int fd, WaitType wait_type) {
-  fd_set fds;
-  FD_ZERO(&fds);
-  FD_SET(fd, &fds);
-  fd_set* read_fds = NULL;
-  fd_set* write_fds = NULL;
-  timeval timeout;
-  switch (wait_type) {
-    case kConnection:
-      write_fds = &fds;
-      timeout = kNormalTimeout;
-      break;
-    case kRead:
-      read_fds = &fds;
-      timeout = kNormalTimeout;
-      break;
-    case kExtendedRead:
-      read_fds = &fds;
-      timeout = kExtendedTimeout;
-      break;
-    default:
-      assert(false);
+// Reads a length-prefixed string of a binary record at *data like ReadUint32.
+Token ReadToken(const char** data, const char* end) {
+  Token token;
+  token.length = ReadUint32(data, end);
+  if (static_cast<size_t>(end - *data) < token.length) {
+    throw std::runtime_error(LOCATION);
   }
-  if (select(fd+1, read_fds, write_fds, NULL, &timeout) != 1) {
+  token.data = *data;
+  *data += token.length;
+  return token;
+}
+
+// Returns whether the line at offset in response is a binary record.
+bool IsBinaryRecord(const std::string& response, size_t offset) {
+  return offset < response.size() && response[offset] == kBinaryRecordMarker;
+}
+
+// Waits until fd can be read or written without blocking. Throws
+// std::runtime_error exception if deadline passes first.
+void PollFd(int fd, short events, const Deadline& deadline) {  // NOLINT
+  pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = events;
+  int ret;
+  do {
+    pfd.revents = 0;
+    ret = poll(&pfd, 1, deadline.RemainingMs());
+  } while (ret == -1 && errno == EINTR);
+  // Errors and hang ups are reported by the following read or write.
+  if (ret != 1) {
     throw std::runtime_error(LOCATION);
   }
 }
 
-void GetDaemonOutput(const std::string& command,
-                     OutputType output_type,
-                     std::vector<std::string>* output_lines) {
+void WaitUntilFdReady(int fd, WaitType wait_type, const Deadline& deadline) {
+  if (wait_type == kRead) {
+    StatsTimer timer(kWaitPhase);
+    PollFd(fd, POLLIN, deadline);
+  } else {
+    // Waits to write are timed as part of connecting and writing.
+    PollFd(fd, POLLOUT, deadline);
+  }
+}
+
+int ConnectToDaemon(const Deadline& deadline) {
+  StatsTimer timer(kConnectPhase);
   sockaddr_un address;
   address.sun_family = AF_UNIX;
   // SOCKET_PATH is defined in the Makefile.
@@ -248,99 +1020,857 @@ void GetDaemonOutput(const std::string& command,
   if (fd.get() == -1) {
     throw std::runtime_error(LOCATION);
   }
-  // Set the socket to be non-blocking.
-  if (fcntl(fd.get(), F_SETFL, O_NONBLOCK)) {
+  // Set the socket to be non-blocking and not inherited by exec'd programs.
+  if (fcntl(fd.get(), F_SETFL, O_NONBLOCK) ||
+      fcntl(fd.get(), F_SETFD, FD_CLOEXEC)) {
     throw std::runtime_error(LOCATION);
   }
-  errno = 0;
-  int ret = connect(fd.get(), reinterpret_cast<sockaddr*>(&address),
-                    sizeof(address));
+  // A full accept backlog fails non-blocking connects with EAGAIN, so they
+  // are retried with a growing delay until the deadline.
+  int ret;
+  int backoff_ms = 1;
+  while (true) {
+    errno = 0;
+    ret = connect(fd.get(), reinterpret_cast<sockaddr*>(&address),
+                  sizeof(address));
+    if (ret == 0 || errno != EAGAIN) {
+      break;
+    }
+    int remaining_ms = deadline.RemainingMs();
+    if (remaining_ms == 0) {
+      throw std::runtime_error(LOCATION);
+    }
+    int delay_ms = std::min(backoff_ms, remaining_ms);
+    timespec delay = {delay_ms / 1000, (delay_ms % 1000) * 1000000L};
+    nanosleep(&delay, NULL);
+    backoff_ms = std::min(backoff_ms * 2, kMaxConnectBackoffMs);
+  }
   if (errno == EINPROGRESS) {
-    WaitUntilFdReady(fd.get(), kConnection);
+    WaitUntilFdReady(fd.get(), kWrite, deadline);
   } else if (ret) {
     throw std::runtime_error(LOCATION);
   }
+  return fd.release();
+}
 
-  size_t bytes_written = write(fd.get(), command.c_str(), command.size());
-  if (bytes_written != command.size()) {
-    throw std::runtime_error(LOCATION);
+// Writes all of data to fd. Returns false if the peer closed the connection.
+bool SendAll(int fd, const std::string& data, const Deadline& deadline) {
+  StatsTimer timer(kWritePhase);
+  size_t offset = 0;
+  while (offset < data.size()) {
+    ssize_t bytes_written = send(fd, data.data() + offset,
+                                 data.size() - offset, MSG_NOSIGNAL);
+    if (bytes_written == -1 && (errno == EPIPE || errno == ECONNRESET)) {
+      return false;
+    } else if (bytes_written == -1 && errno == EAGAIN) {
+      WaitUntilFdReady(fd, kWrite, deadline);
+    } else if (bytes_written == -1 && errno != EINTR) {
+      throw std::runtime_error(LOCATION);
+    } else if (bytes_written > 0) {
+      offset += bytes_written;
+    }
   }
+  return true;
+}
 
-  WaitType type = (output_type != kSingleLineExtendedTimeout) ?
-      kRead : kExtendedRead;
-  WaitUntilFdReady(fd.get(), type);
-  std::ostringstream output;
-  char buff[1024];
+// Reads up to length bytes from fd directly into the end of buffer. Returns
+// the result of read().
+ssize_t ReadInto(int fd, size_t length, std::string* buffer) {
+  StatsTimer timer(kReadPhase);
+  size_t size = buffer->size();
+  buffer->resize(size + length);
   ssize_t bytes_read;
-  while ((bytes_read = read(fd.get(), buff, sizeof(buff)))) {
+  do {
+    bytes_read = read(fd, &(*buffer)[size], length);
+  } while (bytes_read == -1 && errno == EINTR);
+  buffer->resize(size + std::max<ssize_t>(bytes_read, 0));
+  return bytes_read;
+}
+
+void ForkChildHandler() {
+  g_fork_generation++;
+}
+
+void DeleteKeepAliveConnection(void* connection) {
+  delete static_cast<KeepAliveConnection*>(connection);
+}
+
+void InitKeepAlive() {
+  pthread_key_create(&g_keep_alive_key, DeleteKeepAliveConnection);
+  pthread_atfork(NULL, NULL, ForkChildHandler);
+}
+
+KeepAliveConnection::KeepAliveConnection()
+    : fd_(-1),
+      dev_(0),
+      ino_(0),
+      fork_generation_(0) {}
+
+KeepAliveConnection::~KeepAliveConnection() {
+  Close();
+}
+
+bool KeepAliveConnection::IsReusable() {
+  if (fd_ == -1) {
+    return false;
+  }
+  if (fork_generation_ != g_fork_generation) {
+    // The connection is shared with the parent process.
+    Close();
+    return false;
+  }
+  // The application may have closed the descriptor and reused its number.
+  struct stat info;
+  if (fstat(fd_, &info) || !S_ISSOCK(info.st_mode) || info.st_dev != dev_ ||
+      info.st_ino != ino_) {
+    // Do not close a descriptor that is no longer owned by this connection.
+    fd_ = -1;
+    return false;
+  }
+  return true;
+}
+
+bool KeepAliveConnection::Open(const Deadline& deadline) {
+  Close();
+  AutoFd fd(ConnectToDaemon(deadline));
+  if (!SendAll(fd.get(), "keepalive\n", deadline)) {
+    throw std::runtime_error(LOCATION);
+  }
+  // A daemon that supports keep-alive acknowledges with "200\n" and leaves
+  // the connection open. Other daemons respond with an error and close it.
+  std::string ack;
+  char buff[16];
+  while (ack.find('\n') == std::string::npos) {
+    WaitUntilFdReady(fd.get(), kRead, deadline);
+    ssize_t bytes_read = read(fd.get(), buff, sizeof(buff));
     if (bytes_read == -1) {
       throw std::runtime_error(LOCATION);
+    } else if (bytes_read == 0) {
+      break;
     }
-    output.write(buff, bytes_read);
-    WaitUntilFdReady(fd.get(), kRead);
+    ack.append(buff, bytes_read);
   }
+  if (ack != "200\n") {
+    g_keep_alive_retry_time = time(NULL) + kKeepAliveRetryInterval;
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd.get(), &info)) {
+    throw std::runtime_error(LOCATION);
+  }
+  dev_ = info.st_dev;
+  ino_ = info.st_ino;
+  fork_generation_ = g_fork_generation;
+  fd_ = fd.release();
+  if (g_binary_enabled) {
+    // A daemon that does not support binary records refuses them and keeps
+    // responding with text lines, so the response is not needed.
+    std::string response;
+    size_t offset;
+    try {
+      if (!Request("binary\n", deadline, &response, &offset)) {
+        throw std::runtime_error(LOCATION);
+      }
+    } catch (const std::exception&) {
+      Close();
+      throw;
+    }
+  }
+  return true;
+}
+
+void KeepAliveConnection::Close() {
+  if (fd_ != -1) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
 
-  TokenizeString(output.str(), '\n', output_lines);
-  if (!output_lines->size()) {
+bool KeepAliveConnection::Request(const std::string& line,
+                                  const Deadline& deadline,
+                                  std::string* response,
+                                  size_t* offset) {
+  if (!SendAll(fd_, line, deadline)) {
+    return false;
+  }
+  response->clear();
+  // The size of the frame, including its header once that has been read.
+  size_t frame_size = 0;
+  bool first_read = true;
+  while (frame_size == 0 || response->size() < frame_size) {
+    WaitUntilFdReady(fd_, kRead, deadline);
+    // Once the header gives the size of the frame, its body is read straight
+    // into place.
+    size_t length = frame_size ? frame_size - response->size() : kMinReadSize;
+    ssize_t bytes_read = ReadInto(fd_, length, response);
+    if (first_read && (bytes_read == 0 ||
+                       (bytes_read == -1 && errno == ECONNRESET))) {
+      return false;
+    } else if (bytes_read <= 0) {
+      throw std::runtime_error(LOCATION);
+    }
+    first_read = false;
+    if (frame_size == 0) {
+      size_t end = response->find('\n');
+      if (end == std::string::npos) {
+        if (response->size() > 20) {
+          throw std::runtime_error(LOCATION);
+        }
+        continue;
+      }
+      size_t body_size = ParseId(response->data(), end);
+      if (body_size > kMaxFrameSize) {
+        throw std::runtime_error(LOCATION);
+      }
+      *offset = end + 1;
+      frame_size = *offset + body_size;
+      if (response->size() > frame_size) {
+        // Responses are only sent for requests.
+        throw std::runtime_error(LOCATION);
+      }
+      response->reserve(frame_size);
+    }
+  }
+  return true;
+}
+
+// Sends command over this thread's keep-alive connection, opening one if
+// needed. Returns false if the command cannot be sent in keep-alive mode.
+bool GetKeepAliveResponse(const std::string& command,
+                          const Deadline& deadline,
+                          std::string* response,
+                          size_t* offset) {
+  if (!g_keep_alive_enabled || time(NULL) < g_keep_alive_retry_time) {
+    return false;
+  }
+  std::string line = command;
+  if (line.empty() || line[line.size() - 1] != '\n') {
+    line.push_back('\n');
+  }
+  if (line.find('\n') != line.size() - 1) {
+    // An embedded newline would be read as a separate request.
+    return false;
+  }
+  pthread_once(&g_keep_alive_once, InitKeepAlive);
+  KeepAliveConnection* connection = static_cast<KeepAliveConnection*>(
+      pthread_getspecific(g_keep_alive_key));
+  if (connection == NULL) {
+    connection = new KeepAliveConnection();
+    if (pthread_setspecific(g_keep_alive_key, connection)) {
+      delete connection;
+      return false;
+    }
+  }
+  // A reused connection may have been closed by the daemon while idle, in
+  // which case the request is retried once on a new connection.
+  bool reused = connection->IsReusable();
+  for (;;) {
+    if (!reused && !connection->Open(deadline)) {
+      return false;
+    }
+    try {
+      if (connection->Request(line, deadline, response, offset)) {
+        return true;
+      }
+    } catch (const std::exception&) {
+      connection->Close();
+      throw;
+    }
+    connection->Close();
+    if (!reused) {
+      throw std::runtime_error(LOCATION);
+    }
+    reused = false;
+  }
+}
+
+// Sends command over a new connection and reads the response until the
+// daemon closes the connection.
+void GetOneShotResponse(const std::string& command,
+                        const Deadline& deadline,
+                        std::string* response) {
+  AutoFd fd(ConnectToDaemon(deadline));
+  if (!SendAll(fd.get(), command, deadline)) {
     throw std::runtime_error(LOCATION);
   }
-  std::string result_code = *output_lines->begin();
-  output_lines->erase(output_lines->begin());
-  if (result_code == "404") {
+
+  // The size of the response is unknown, so reads grow with it to keep their
+  // number logarithmic in its size.
+  response->clear();
+  ssize_t bytes_read;
+  do {
+    WaitUntilFdReady(fd.get(), kRead, deadline);
+    size_t length = std::min(std::max(response->size(), kMinReadSize),
+                             kMaxReadSize);
+    bytes_read = ReadInto(fd.get(), length, response);
+    if (bytes_read == -1) {
+      throw std::runtime_error(LOCATION);
+    }
+  } while (bytes_read);
+}
+
+// Gets the response to a command and checks its result code. The output lines
+// are left in place in response, starting at *offset. Returns false if there
+// are no output lines. Throws the same exceptions as GetDaemonOutput, except
+// that if refused is not NULL, result code 400 sets it and returns false.
+bool GetDaemonResponse(const std::string& command,
+                       OutputType output_type,
+                       std::string* response,
+                       size_t* offset,
+                       bool* refused) {
+  // The whole request, including connecting and any retry, must complete
+  // within the time allowed for its output type.
+  Deadline deadline(g_request_timeouts_ms[output_type]);
+  size_t begin = 0;
+  if (!GetKeepAliveResponse(command, deadline, response, &begin)) {
+    GetOneShotResponse(command, deadline, response);
+    begin = 0;
+  }
+
+  size_t end = response->find('\n', begin);
+  size_t length = (end == std::string::npos) ? end : end - begin;
+  if (response->compare(begin, length, "404") == 0) {
     // User or group argument was not found.
     throw std::invalid_argument(command);
-  } else if (result_code != "200") {
+  } else if (refused != NULL && response->compare(begin, length, "400") == 0) {
+    // The daemon does not support the command.
+    *refused = true;
+    return false;
+  } else if (response->compare(begin, length, "200") != 0) {
     // Operation did not succeed.
     throw std::runtime_error(LOCATION);
-  } else if (output_type != kMultiLine && output_lines->size() != 1) {
+  } else if (end == std::string::npos) {
+    return false;
+  }
+  *offset = end + 1;
+  return true;
+}
+
+// Returns the only output line of a command in line, without splitting the
+// response into lines. Throws the same exceptions as GetDaemonOutput.
+void GetDaemonLine(const std::string& command,
+                   OutputType output_type,
+                   std::string* line) {
+  size_t offset;
+  if (!GetDaemonResponse(command, output_type, line, &offset) ||
+      (!IsBinaryRecord(*line, offset) &&
+       line->find('\n', offset) != std::string::npos)) {
+    throw std::runtime_error(LOCATION);
+  }
+  line->erase(0, offset);
+}
+
+void SetKeepAliveEnabled(bool enabled) {
+  g_keep_alive_enabled = enabled;
+  g_keep_alive_retry_time = 0;
+}
+
+void SetBinaryProtocolEnabled(bool enabled) {
+  g_binary_enabled = enabled;
+}
+
+void SetStreamingEnabled(bool enabled) {
+  g_streaming_enabled = enabled;
+  g_streaming_retry_time = 0;
+}
+
+void SetPageSize(size_t page_size) {
+  g_page_size = page_size;
+  g_paging_retry_time = 0;
+}
+
+void SetPipeliningEnabled(bool enabled) {
+  g_pipelining_enabled = enabled;
+  g_pipelining_retry_time = 0;
+}
+
+void SetRequestTimeout(OutputType output_type, int timeout_ms) {
+  g_request_timeouts_ms[output_type] = timeout_ms;
+}
+
+void GetDaemonOutput(const std::string& command,
+                     OutputType output_type,
+                     std::vector<std::string>* output_lines) {
+  std::string response;
+  size_t initial_size = output_lines->size();
+  size_t offset;
+  if (GetDaemonResponse(command, output_type, &response, &offset)) {
+    if (IsBinaryRecord(response, offset)) {
+      // Binary records are only sent alone and may contain newlines.
+      output_lines->push_back(response.substr(offset));
+    } else {
+      // Lines are split like TokenizeString, except that an empty response
+      // has a single empty line.
+      size_t end;
+      while ((end = response.find('\n', offset)) != std::string::npos) {
+        output_lines->push_back(response.substr(offset, end - offset));
+        offset = end + 1;
+      }
+      output_lines->push_back(response.substr(offset));
+    }
+  }
+  if (output_type != kMultiLine && output_lines->size() - initial_size != 1) {
     throw std::runtime_error(LOCATION);
   }
 }
 
+std::string GetCachedDaemonLine(const std::string& command,
+                                OutputType output_type,
+                                LookupCache* cache) {
+  std::string line;
+  switch (cache->Get(command, &line)) {
+    case LookupCache::kFound:
+      return line;
+    case LookupCache::kNotFound:
+      throw std::invalid_argument(command);
+    default:
+      break;
+  }
+  uint64_t generation = cache->Generation();
+  try {
+    GetDaemonLine(command, output_type, &line);
+  } catch (const std::invalid_argument&) {
+    cache->PutNotFound(command, generation);
+    throw;
+  }
+  cache->Put(command, line, generation);
+  return line;
+}
+
+struct RetryLine {
+  std::string command;
+  std::string line;
+  time_t time;
+};
+
+void DeleteRetryLine(void* retry) {
+  delete static_cast<RetryLine*>(retry);
+}
+
+void InitRetryLine() {
+  pthread_key_create(&g_retry_line_key, DeleteRetryLine);
+}
+
+void KeepLineForRetry(const std::string& command, const std::string& line) {
+  pthread_once(&g_retry_line_once, InitRetryLine);
+  RetryLine* retry =
+      static_cast<RetryLine*>(pthread_getspecific(g_retry_line_key));
+  try {
+    if (retry == NULL) {
+      retry = new RetryLine();
+      if (pthread_setspecific(g_retry_line_key, retry) != 0) {
+        delete retry;
+        return;
+      }
+    }
+    retry->command = command;
+    retry->line = line;
+    retry->time = MonotonicTime();
+  } catch (const std::bad_alloc&) {
+    // The retry goes to the daemon.
+    if (retry != NULL) {
+      retry->command.clear();
+    }
+  }
+}
+
+bool TakeLineForRetry(const std::string& command, std::string* line) {
+  pthread_once(&g_retry_line_once, InitRetryLine);
+  RetryLine* retry =
+      static_cast<RetryLine*>(pthread_getspecific(g_retry_line_key));
+  if (retry == NULL || retry->command.empty()) {
+    return false;
+  }
+  bool found = retry->command == command &&
+      MonotonicTime() < retry->time + kRetryLineTtl;
+  if (found) {
+    line->swap(retry->line);
+  }
+  // A kept line answers a single retry.
+  retry->command.clear();
+  retry->line.clear();
+  return found;
+}
+
+void GetBatchDaemonOutput(const std::string& command,
+                          const std::vector<std::string>& keys,
+                          std::vector<std::string>* output_lines,
+                          LookupCache* cache) {
+  const std::string prefix = "batch " + command;
+  size_t begin = 0;
+  while (begin < keys.size()) {
+    // Add keys to the request while it fits in a batch.
+    std::string request = prefix;
+    size_t end = begin;
+    do {
+      if (keys[end].empty() ||
+          keys[end].find_first_of(" \n") != std::string::npos) {
+        throw std::runtime_error(LOCATION);
+      }
+      request.append(" ").append(keys[end]);
+      end++;
+    } while (end < keys.size() &&
+             request.size() + keys[end].size() + 2 <= kMaxBatchRequestSize);
+    request.push_back('\n');
+
+    size_t initial_size = output_lines->size();
+    uint64_t generation = cache != NULL ? cache->Generation() : 0;
+    GetDaemonOutput(request, kMultiLine, output_lines);
+    if (output_lines->size() - initial_size != end - begin) {
+      output_lines->resize(initial_size);
+      throw std::runtime_error(LOCATION);
+    }
+    if (cache != NULL) {
+      for (size_t i = begin; i < end; i++) {
+        const std::string& line = (*output_lines)[initial_size + i - begin];
+        std::string lookup = command + " " + keys[i];
+        if (line.empty()) {
+          cache->PutNotFound(lookup, generation);
+        } else {
+          cache->Put(lookup, line, generation);
+        }
+      }
+    }
+    begin = end;
+  }
+}
+
+LookupPipeline::LookupPipeline() {}
+
+size_t LookupPipeline::Submit(const std::string& command) {
+  size_t length = command.size();
+  if (length > 0 && command[length - 1] == '\n') {
+    length--;
+  }
+  if (length == 0 || command.find('\n') < length) {
+    throw std::runtime_error(LOCATION);
+  }
+  commands_.push_back(command.substr(0, length));
+  states_.push_back(kPending);
+  lines_.push_back(std::string());
+  return commands_.size() - 1;
+}
+
+void LookupPipeline::Collect() {
+  if (std::find(states_.begin(), states_.end(), kPending) == states_.end()) {
+    return;
+  }
+  if (g_pipelining_enabled && time(NULL) >= g_pipelining_retry_time) {
+    Deadline deadline(g_request_timeouts_ms[kMultiLine]);
+    if (CollectPipelined(deadline)) {
+      return;
+    }
+  }
+  CollectEach();
+}
+
+std::string LookupPipeline::Get(size_t index) const {
+  if (index >= states_.size()) {
+    throw std::runtime_error(LOCATION);
+  }
+  switch (states_[index]) {
+    case kFound:
+      return lines_[index];
+    case kNotFound:
+      throw std::invalid_argument(commands_[index]);
+    default:
+      throw std::runtime_error(LOCATION);
+  }
+}
+
+void LookupPipeline::Clear() {
+  commands_.clear();
+  states_.clear();
+  lines_.clear();
+}
+
+bool LookupPipeline::CollectPipelined(const Deadline& deadline) {
+  AutoFd fd(ConnectToDaemon(deadline));
+  if (!SendAll(fd.get(), "keepalive\npipeline\n", deadline)) {
+    throw std::runtime_error(LOCATION);
+  }
+  // A daemon that supports pipelining acknowledges keep-alive and then
+  // pipelining with a "200" frame. Other daemons refuse one or the other.
+  // Only the acknowledgement is read, so that no response frame is consumed.
+  const std::string ack = "200\n3\n200";
+  std::string buffer;
+  while (buffer.size() < ack.size() &&
+         ack.compare(0, buffer.size(), buffer) == 0) {
+    WaitUntilFdReady(fd.get(), kRead, deadline);
+    ssize_t bytes_read = ReadInto(fd.get(), ack.size() - buffer.size(),
+                                  &buffer);
+    if (bytes_read == -1) {
+      throw std::runtime_error(LOCATION);
+    } else if (bytes_read == 0) {
+      break;
+    }
+  }
+  if (buffer != ack) {
+    g_pipelining_retry_time = time(NULL) + kPipeliningRetryInterval;
+    return false;
+  }
+
+  std::string requests;
+  size_t pending = 0;
+  for (size_t i = 0; i < commands_.size(); i++) {
+    if (states_[i] == kPending) {
+      char id[24];
+      snprintf(id, sizeof(id), "%lu ", static_cast<unsigned long>(i));  // NOLINT
+      requests.append(id).append(commands_[i]).push_back('\n');
+      pending++;
+    }
+  }
+  // Requests are written while responses are read, so that neither side
+  // blocks on a full socket buffer while the other waits for it.
+  buffer.clear();
+  size_t written = 0;
+  while (pending > 0) {
+    pollfd pfd;
+    pfd.fd = fd.get();
+    pfd.events = POLLIN;
+    if (written < requests.size()) {
+      pfd.events |= POLLOUT;
+    }
+    int ret;
+    {
+      StatsTimer timer(kWaitPhase);
+      do {
+        pfd.revents = 0;
+        ret = poll(&pfd, 1, deadline.RemainingMs());
+      } while (ret == -1 && errno == EINTR);
+    }
+    if (ret != 1) {
+      throw std::runtime_error(LOCATION);
+    }
+    if (pfd.revents & POLLOUT) {
+      StatsTimer timer(kWritePhase);
+      ssize_t bytes_written = send(fd.get(), requests.data() + written,
+                                   requests.size() - written, MSG_NOSIGNAL);
+      if (bytes_written > 0) {
+        written += bytes_written;
+      } else if (bytes_written == -1 && errno != EAGAIN && errno != EINTR) {
+        throw std::runtime_error(LOCATION);
+      }
+    }
+    if (pfd.revents & ~POLLOUT) {
+      size_t length = std::min(std::max(buffer.size(), kMinReadSize),
+                               kMaxReadSize);
+      ssize_t bytes_read = ReadInto(fd.get(), length, &buffer);
+      if (bytes_read == 0 || (bytes_read == -1 && errno != EAGAIN)) {
+        // The daemon closed the connection before answering every command.
+        throw std::runtime_error(LOCATION);
+      } else if (bytes_read > 0) {
+        pending -= TakeFrames(&buffer);
+      }
+    }
+  }
+  return true;
+}
+
+void LookupPipeline::CollectEach() {
+  for (size_t i = 0; i < commands_.size(); i++) {
+    if (states_[i] != kPending) {
+      continue;
+    }
+    try {
+      GetDaemonLine(commands_[i], kSingleLine, &lines_[i]);
+      states_[i] = kFound;
+    } catch (const std::invalid_argument&) {
+      states_[i] = kNotFound;
+    } catch (const std::runtime_error&) {
+      states_[i] = kFailed;
+    }
+  }
+}
+
+size_t LookupPipeline::TakeFrames(std::string* buffer) {
+  size_t taken = 0;
+  size_t begin = 0;
+  while (true) {
+    size_t end = buffer->find('\n', begin);
+    if (end == std::string::npos) {
+      if (buffer->size() - begin > kMaxPipelinedHeaderSize) {
+        throw std::runtime_error(LOCATION);
+      }
+      break;
+    }
+    size_t space = buffer->find(' ', begin);
+    if (space >= end) {
+      throw std::runtime_error(LOCATION);
+    }
+    size_t index = ParseId(buffer->data() + begin, space - begin);
+    size_t length = ParseId(buffer->data() + space + 1, end - space - 1);
+    // Each command is answered once.
+    if (index >= commands_.size() || states_[index] != kPending ||
+        length > kMaxFrameSize) {
+      throw std::runtime_error(LOCATION);
+    }
+    if (buffer->size() - (end + 1) < length) {
+      break;
+    }
+    SetResult(index, buffer->data() + end + 1, length);
+    taken++;
+    begin = end + 1 + length;
+  }
+  buffer->erase(0, begin);
+  return taken;
+}
+
+void LookupPipeline::SetResult(size_t index, const char* response,
+                               size_t length) {
+  StatsTimer timer(kParsePhase);
+  const char* end = static_cast<const char*>(memchr(response, '\n', length));
+  size_t code_length = (end == NULL) ? length : end - response;
+  if (code_length == 3 && memcmp(response, "404", 3) == 0) {
+    states_[index] = kNotFound;
+  } else if (end != NULL && code_length == 3 &&
+             memcmp(response, "200", 3) == 0 &&
+             memchr(end + 1, '\n', response + length - end - 1) == NULL) {
+    lines_[index].assign(end + 1, response + length);
+    states_[index] = kFound;
+  } else {
+    states_[index] = kFailed;
+  }
+}
+
+// Decodes the fields of a binary user record, after its marker, as a passwd
+// entry: the UID and GID, then the name, gecos, home directory and shell.
+void BinaryRecordToPasswdStruct(const char* data, const char* end,
+                                passwd* pwd, BufferManager* buf) {
+  pwd->pw_uid = ReadUint32(&data, end);
+  pwd->pw_gid = ReadUint32(&data, end);
+  Token fields[4];
+  for (size_t i = 0; i < 4; i++) {
+    fields[i] = ReadToken(&data, end);
+  }
+  if (data != end) {
+    throw std::runtime_error(LOCATION);
+  }
+  buf->CheckSpaceAvailable(fields[0].length + fields[1].length +
+                           fields[2].length + fields[3].length + 6);
+  pwd->pw_name = buf->AppendString(fields[0].data, fields[0].length);
+  pwd->pw_passwd = buf->AppendString("x", 1);
+  pwd->pw_gecos = buf->AppendString(fields[1].data, fields[1].length);
+  pwd->pw_dir = buf->AppendString(fields[2].data, fields[2].length);
+  pwd->pw_shell = buf->AppendString(fields[3].data, fields[3].length);
+}
+
+// Decodes the fields of a binary group record, after its marker, as a group
+// entry: the GID, then the name, the number of members and each member.
+void BinaryRecordToGroupStruct(const char* data, const char* end,
+                               group* grp, BufferManager* buf) {
+  grp->gr_gid = ReadUint32(&data, end);
+  Token name = ReadToken(&data, end);
+  size_t count = ReadUint32(&data, end);
+  // Each member takes at least its length.
+  if (count > static_cast<size_t>(end - data) / 4) {
+    throw std::runtime_error(LOCATION);
+  }
+  // The members are decoded twice, first to size the entry.
+  const char* members = data;
+  size_t size = name.length + 3 + (count + 1) * sizeof(char*);
+  for (size_t i = 0; i < count; i++) {
+    size += ReadToken(&data, end).length + 1;
+  }
+  if (data != end) {
+    throw std::runtime_error(LOCATION);
+  }
+  buf->CheckSpaceAvailable(size);
+  data = members;
+  grp->gr_name = buf->AppendString(name.data, name.length);
+  grp->gr_passwd = buf->AppendString("x", 1);
+  grp->gr_mem = buf->ReserveVector(count);
+  for (size_t i = 0; i < count; i++) {
+    Token member = ReadToken(&data, end);
+    grp->gr_mem[i] = buf->AppendString(member.data, member.length);
+  }
+}
+
 void UserLineToPasswdStruct(const std::string& line,
                             passwd* pwd,
                             BufferManager* buf) {
-  std::vector<std::string> line_fields;
-  TokenizeString(line, ':', &line_fields);
-  if (line_fields.size() != 6) {
+  UserLineToPasswdStruct(line.data(), line.length(), pwd, buf);
+}
+
+void UserLineToPasswdStruct(const char* line,
+                            size_t length,
+                            passwd* pwd,
+                            BufferManager* buf) {
+  StatsTimer timer(kParsePhase);
+  if (length && line[0] == kBinaryRecordMarker) {
+    BinaryRecordToPasswdStruct(line + 1, line + length, pwd, buf);
+    return;
+  }
+  Token fields[6];
+  if (!SplitTokens(line, length, ':', fields, 6)) {
     throw std::runtime_error(LOCATION);
   }
+  // Four fields and the password "x" are copied as null-terminated strings.
+  buf->CheckSpaceAvailable(fields[0].length + fields[3].length +
+                           fields[4].length + fields[5].length + 6);
 
-  pwd->pw_name = buf->AppendString(line_fields[0]);
-  pwd->pw_passwd = buf->AppendString("x");
-  pwd->pw_uid = ParseId(line_fields[1]);
-  pwd->pw_gid = ParseId(line_fields[2]);
-  pwd->pw_gecos = buf->AppendString(line_fields[3]);
-  pwd->pw_dir = buf->AppendString(line_fields[4]);
-  pwd->pw_shell = buf->AppendString(line_fields[5]);
+  pwd->pw_name = buf->AppendString(fields[0].data, fields[0].length);
+  pwd->pw_passwd = buf->AppendString("x", 1);
+  pwd->pw_uid = ParseId(fields[1].data, fields[1].length);
+  pwd->pw_gid = ParseId(fields[2].data, fields[2].length);
+  pwd->pw_gecos = buf->AppendString(fields[3].data, fields[3].length);
+  pwd->pw_dir = buf->AppendString(fields[4].data, fields[4].length);
+  pwd->pw_shell = buf->AppendString(fields[5].data, fields[5].length);
 }
 
 void GroupLineToGroupStruct(const std::string& line,
                             group* grp,
                             BufferManager* buf) {
-  std::vector<std::string> line_fields;
-  TokenizeString(line, ':', &line_fields);
-  if (line_fields.size() != 3) {
+  GroupLineToGroupStruct(line.data(), line.length(), grp, buf);
+}
+
+void GroupLineToGroupStruct(const char* line,
+                            size_t length,
+                            group* grp,
+                            BufferManager* buf) {
+  StatsTimer timer(kParsePhase);
+  if (length && line[0] == kBinaryRecordMarker) {
+    BinaryRecordToGroupStruct(line + 1, line + length, grp, buf);
+    return;
+  }
+  Token fields[3];
+  if (!SplitTokens(line, length, ':', fields, 3)) {
     throw std::runtime_error(LOCATION);
   }
-  std::vector<std::string> members;
-  TokenizeString(line_fields[2], ',', &members);
+  // Members are copied with their commas replaced by the null terminators of
+  // all but the last one.
+  size_t count = 0;
+  if (fields[2].length) {
+    count = std::count(fields[2].data, fields[2].data + fields[2].length,
+                       ',') + 1;
+  }
+  buf->CheckSpaceAvailable(fields[0].length + 3 +
+                           (count + 1) * sizeof(char*) +
+                           (count ? fields[2].length + 1 : 0));
 
-  grp->gr_name = buf->AppendString(line_fields[0]);
-  grp->gr_passwd = buf->AppendString("x");
-  grp->gr_gid = ParseId(line_fields[1]);
-  grp->gr_mem = buf->AppendVector(members);
+  grp->gr_name = buf->AppendString(fields[0].data, fields[0].length);
+  grp->gr_passwd = buf->AppendString("x", 1);
+  grp->gr_gid = ParseId(fields[1].data, fields[1].length);
+  grp->gr_mem = buf->AppendTokens(fields[2].data, fields[2].length, ',');
 }
 
 void AccountNameToShadowStruct(const std::string& name,
                                spwd* pwd,
                                BufferManager* buf) {
-  if (name.find(':') != std::string::npos) {
+  AccountNameToShadowStruct(name.data(), name.length(), pwd, buf);
+}
+
+void AccountNameToShadowStruct(const char* name,
+                               size_t length,
+                               spwd* pwd,
+                               BufferManager* buf) {
+  StatsTimer timer(kParsePhase);
+  if (std::find(name, name + length, ':') != name + length) {
     throw std::runtime_error(LOCATION);
   }
 
-  pwd->sp_namp = buf->AppendString(name);
-  pwd->sp_pwdp = buf->AppendString("*");
+  pwd->sp_namp = buf->AppendString(name, length);
+  pwd->sp_pwdp = buf->AppendString("*", 1);
   pwd->sp_lstchg = -1;
   pwd->sp_min = -1;
   pwd->sp_max = -1;
@@ -350,4 +1880,29 @@ void AccountNameToShadowStruct(const std::string& name,
   pwd->sp_flag = -1;
 }
 
+bool AppendGroup(gid_t gid, long int* start, long int* size,  // NOLINT
+                 gid_t** groups, long int limit) {  // NOLINT
+  if (std::find(*groups, *groups + *start, gid) != *groups + *start) {
+    return true;
+  }
+  if (*start == *size) {
+    if (limit > 0 && *size >= limit) {
+      return false;
+    }
+    long int new_size = (*size > 0) ? 2 * *size : 8;  // NOLINT
+    if (limit > 0 && new_size > limit) {
+      new_size = limit;
+    }
+    gid_t* new_groups = static_cast<gid_t*>(
+        realloc(*groups, new_size * sizeof(gid_t)));
+    if (new_groups == NULL) {
+      throw std::bad_alloc();
+    }
+    *groups = new_groups;
+    *size = new_size;
+  }
+  (*groups)[(*start)++] = gid;
+  return true;
+}
+
 }  // namespace utils
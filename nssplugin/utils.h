@@ -17,14 +17,18 @@
 #define GCE_ACCOUNTS_UTILS_H_  // NOLINT(build/header_guard)
 
 #include <grp.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <shadow.h>
 #include <stdint.h>
+#include <time.h>
 #include <string>
 #include <vector>
 
 namespace utils {
 
+class Deadline;
+
 enum OutputType { kSingleLine, kMultiLine, kSingleLineExtendedTimeout };
 
 // BufferManager encapsulates and manages a buffer and length.
@@ -40,6 +44,7 @@ class BufferManager {
   // Throws std::length_error exception if the buffer is not large enough to
   // hold the null-terminated string.
   char* AppendString(const std::string& value);
+  char* AppendString(const char* value, size_t length);
 
   // Copies a vector of strings to the buffer.
   //
@@ -49,6 +54,29 @@ class BufferManager {
   // hold the null-terminated vector.
   char** AppendVector(const std::vector<std::string>& value);
 
+  // Copies the tokens of value, as split by TokenizeString, to the buffer as a
+  // vector of strings without allocating memory.
+  //
+  // Copied vector and all strings are guaranteed to be null-terminated.
+  //
+  // Throws std::length_error exception if the buffer is not large enough to
+  // hold the null-terminated vector.
+  char** AppendTokens(const char* value, size_t length, char delim);
+
+  // Reserves a vector of count strings in the buffer, to be filled in with
+  // strings copied by AppendString.
+  //
+  // Reserved vector is guaranteed to be null-terminated.
+  //
+  // Throws std::length_error exception if the buffer is not large enough to
+  // hold the null-terminated vector.
+  char** ReserveVector(size_t count);
+
+  // Throws an std::length_error exception if the buffer cannot hold
+  // bytes_to_write. Entries are checked as a whole before they are copied, so
+  // that a buffer that is too small is rejected without writing to it.
+  void CheckSpaceAvailable(size_t bytes_to_write) const;
+
   // Used in tests to verify correct internal structure after use.
   char* buffer() const { return buf_; }
   size_t size() const { return buflen_; }
@@ -57,10 +85,6 @@ class BufferManager {
   // Return a pointer to a buffer of size bytes.
   void* Reserve(size_t bytes);
 
-  // Throws an std::length_error exception if the buffer cannot hold
-  // bytes_to_write.
-  void CheckSpaceAvailable(size_t bytes_to_write) const;
-
   char* buf_;
   size_t buflen_;
 
@@ -70,24 +94,134 @@ class BufferManager {
 };
 
 // EntityList is a thread-safe list of accounts entities.
+//
+// Each thread iterates over the list with its own cursor, so a thread that
+// loads or clears the list does not disturb the iteration of another. The
+// daemon's response is kept in a single reference counted buffer that is
+// shared by the cursors of all threads, and elements are parsed from it in
+// place. If the daemon supports it, the response is streamed into the buffer
+// as the first cursor reaches the end of what has been read.
 class EntityList {
  public:
-  EntityList();
+  // Creates an EntityList whose response is reused by loads of the same
+  // command for ttl seconds. A ttl of 0 loads the response every time.
+  explicit EntityList(time_t ttl = 0);
   ~EntityList();
 
-  // Loads the entity list using information resulting from the execution of a
-  // command.
+  // Loads the entity list of the calling thread using information resulting
+  // from the execution of a command. When streaming, elements are read from
+  // the daemon as they are popped and reading errors are thrown by Pop.
   void Load(const std::string& command);
-  // Empties the entity list.
+  // Empties the entity list of the calling thread. The response is released
+  // once no other thread iterates over it and it may not be reused.
   void Clear();
-  // Returns the next element of the entity list. Throws std::out_of_range
-  // exception if the list is empty.
+  // Returns the next element of the calling thread's entity list. Throws
+  // std::out_of_range exception if the list is empty.
   std::string Pop();
+  // Parses the next element of the calling thread's entity list into an
+  // entity without allocating memory. The list only advances if parsing
+  // succeeds, so an element that does not fit in buf can be retried with a
+  // larger one.
+  //
+  // Throws std::out_of_range exception if the list is empty, or the
+  // exceptions of the parsing function.
+  void Pop(passwd* pwd, BufferManager* buf);
+  void Pop(group* grp, BufferManager* buf);
+  void Pop(spwd* pwd, BufferManager* buf);
 
  private:
+  class Response;
+  struct Cursor;
+
+  // Returns the cursor of the calling thread, creating it if needed.
+  Cursor* GetCursor();
+  // Releases a cursor when its thread exits.
+  static void DeleteCursor(void* cursor);
+  // Parses the next element of the calling thread's list with parse.
+  template <typename Entity>
+  void PopInto(Entity* entity, BufferManager* buf,
+               void (*parse)(const char*, size_t, Entity*, BufferManager*));
+  // Releases shared_. Must be called with the mutex locked.
+  void ReleaseShared();
+
+  const time_t ttl_;
+  pthread_key_t cursor_key_;
+  bool has_cursor_key_;
   pthread_mutex_t mutex_;
-  size_t index_;
-  std::vector<std::string> output_;
+  // The response that loads of command_ reuse until ttl_ seconds after
+  // loaded_time_, or NULL. Guarded by mutex_.
+  Response* shared_;
+  std::string command_;
+  time_t loaded_time_;
+
+  // Not copyable or assignable.
+  EntityList& operator=(const EntityList&);
+  EntityList(const EntityList&);
+};
+
+// LookupCache is a bounded, thread-safe cache of single line daemon responses
+// keyed by command. Commands that were not found are cached as negative
+// entries.
+//
+// A LookupCache may be versioned by the generation of the daemon's accounts,
+// such as CurrentGeneration in generation.h. Entries are then dropped as soon
+// as the generation changes, and found entries are kept until it does.
+class LookupCache {
+ public:
+  enum Result { kMiss, kFound, kNotFound };
+
+  // Creates a LookupCache holding at most size entries. Found entries expire
+  // after ttl seconds and not found entries after negative_ttl seconds. If
+  // generation is not NULL and returns a generation other than 0, entries
+  // also expire when it changes, but found entries do not expire otherwise.
+  // Not found entries still expire, since looking up a missing name makes the
+  // daemon refresh its accounts. A ttl of 0 disables caching either way.
+  LookupCache(size_t size, time_t ttl, time_t negative_ttl,
+              uint64_t (*generation)() = NULL);
+  ~LookupCache();
+
+  // Returns the current generation, or 0 if the cache is not versioned.
+  uint64_t Generation() const;
+  // Looks up the response to a command. The cached line is copied to line if
+  // the command was found.
+  Result Get(const std::string& command, std::string* line);
+  // Caches the line returned for a command. A generation read by Generation
+  // before the command was sent ensures that the line is not cached as
+  // current if the accounts changed while it was being fetched. Otherwise the
+  // current generation is used.
+  void Put(const std::string& command, const std::string& line);
+  void Put(const std::string& command, const std::string& line,
+           uint64_t generation);
+  // Caches that a command returned result code 404, as for Put.
+  void PutNotFound(const std::string& command);
+  void PutNotFound(const std::string& command, uint64_t generation);
+  // Empties the cache.
+  void Clear();
+
+ private:
+  struct Entry {
+    std::string command;
+    std::string line;
+    time_t expiry;
+    uint64_t generation;
+    bool found;
+  };
+
+  // Stores an entry in the slot for its command, evicting the previous one.
+  void Store(const std::string& command, const std::string& line, bool found,
+             time_t ttl, uint64_t generation);
+  // Returns the entry a command is stored in.
+  Entry* Slot(const std::string& command);
+
+  pthread_mutex_t mutex_;
+  const time_t ttl_;
+  const time_t negative_ttl_;
+  uint64_t (* const generation_)();
+  std::vector<Entry> entries_;
+
+  // Not copyable or assignable.
+  LookupCache& operator=(const LookupCache&);
+  LookupCache(const LookupCache&);
 };
 
 // Tokenizes a string according to a delimiter and appends the tokens to the
@@ -109,13 +243,49 @@ void TokenizeString(const std::string& value,
 //
 // Returns UINT32_MAX in case of overflow.
 uint32_t ParseId(const std::string& value);
+uint32_t ParseId(const char* value, size_t length);
 
 
+// Sets whether GetDaemonOutput reuses a per-thread keep-alive connection to
+// the daemon. Keep-alive is enabled by default. When it is enabled and the
+// daemon does not support it, requests fall back to one connection each.
+void SetKeepAliveEnabled(bool enabled);
+
+// Sets whether keep-alive connections ask the daemon for user and group
+// lookups as binary records, which UserLineToPasswdStruct and
+// GroupLineToGroupStruct decode without parsing text. Binary records are
+// enabled by default. When they are enabled and the daemon does not support
+// them, lookups are answered with text lines.
+void SetBinaryProtocolEnabled(bool enabled);
+
+// Sets whether EntityList streams enumerations from the daemon. Streaming is
+// enabled by default. When it is enabled and the daemon does not support it,
+// enumerations are read completely when they are loaded.
+void SetStreamingEnabled(bool enabled);
+
+// Sets how many elements EntityList requests from the daemon at a time. Pages
+// of 512 elements are requested by default, and 0 disables paging. Paged
+// enumerations are preferred to streamed ones, and when the daemon does not
+// support them, enumerations are streamed or read completely.
+//
+// Current daemons always page, so streams are kept for two cases: a running
+// daemon older than the plugin, as during a package upgrade until the daemon
+// restarts, and paging turned off here, for which a stream still avoids
+// buffering the whole enumeration in one read.
+void SetPageSize(size_t page_size);
+
+// Sets how long a request with output_type may take in total, from connecting
+// to the daemon to reading the last byte of the response. Defaults to 1 second
+// for kSingleLine, 5 seconds for kSingleLineExtendedTimeout and 10 seconds for
+// kMultiLine. Reads from a streamed EntityList are each allowed the kMultiLine
+// timeout.
+void SetRequestTimeout(OutputType output_type, int timeout_ms);
+
 // Returns the stdout resulting from the execution of a command. Each line of
 // stdout is appended to the output_lines vector with trailing newline
 // characters removed.
 //
-// Command must end with a trailing newline character.
+// Command may end with a trailing newline character.
 //
 // Throws std::invalid_argument exception if execution succeeds, but returns
 // result code 404. Throws std::runtime_error exception if execution fails,
@@ -125,8 +295,106 @@ void GetDaemonOutput(const std::string& command,
                      OutputType output_type,
                      std::vector<std::string>* output_lines);
 
+// Returns the only line of stdout resulting from the execution of a command,
+// using cache to skip the daemon for recently executed commands.
+//
+// Command execution must be kSingleLine or kSingleLineExtendedTimeout and
+// throws the same exceptions as GetDaemonOutput, including for cached results.
+std::string GetCachedDaemonLine(const std::string& command,
+                                OutputType output_type,
+                                LookupCache* cache);
+
+// Keeps the line returned for a lookup command on this thread after it did not
+// fit in the caller's buffer, so that the retry that glibc makes with a larger
+// buffer is answered without the daemon. Only the last line is kept. Never
+// throws.
+void KeepLineForRetry(const std::string& command, const std::string& line);
+
+// Copies the line kept for command on this thread to line and forgets it.
+// Returns false if no line was kept for command within the last few seconds.
+bool TakeLineForRetry(const std::string& command, std::string* line);
+
+// Executes a lookup command, one of "user_by_name", "user_by_uid",
+// "group_by_name" or "group_by_gid", for each of keys using as few daemon
+// requests as possible. The output line for each key is appended to the
+// output_lines vector in order, or an empty line if it was not found.
+//
+// If cache is not NULL, the results are also stored in it, so that
+// GetCachedDaemonLine can answer the corresponding lookups without the daemon.
+//
+// Throws std::runtime_error exception if a key is empty or contains a space or
+// newline character, or if execution fails or returns an abnormal result code.
+void GetBatchDaemonOutput(const std::string& command,
+                          const std::vector<std::string>& keys,
+                          std::vector<std::string>* output_lines,
+                          LookupCache* cache);
+
+// Sets whether LookupPipeline pipelines its lookups over a single connection
+// to the daemon. Pipelining is enabled by default. When it is enabled and the
+// daemon does not support it, lookups are executed one at a time.
+void SetPipeliningEnabled(bool enabled);
+
+// LookupPipeline executes many single line commands, such as lookups, at
+// once. Commands are submitted first and then collected together: all their
+// requests are sent over one connection to the daemon, tagged with their
+// index, before their responses are read in whatever order the daemon answers
+// them. The daemon executes them concurrently, so that their latencies overlap
+// instead of adding up.
+//
+// A LookupPipeline is not thread-safe.
+class LookupPipeline {
+ public:
+  LookupPipeline();
+
+  // Submits a command and returns the index of its result. Command may end
+  // with a trailing newline character.
+  //
+  // Throws std::runtime_error exception if command is empty or contains an
+  // embedded newline character.
+  size_t Submit(const std::string& command);
+  // Executes the submitted commands that were not collected yet, within the
+  // kMultiLine timeout.
+  //
+  // Throws std::runtime_error exception if the daemon cannot be reached or
+  // the connection to it fails. Commands that were not answered can then be
+  // collected again.
+  void Collect();
+  // Returns the only output line of the command at index once it has been
+  // collected.
+  //
+  // Throws the same exceptions as GetDaemonOutput does for the command, or
+  // std::runtime_error exception if it was not collected.
+  std::string Get(size_t index) const;
+  // Returns the number of submitted commands.
+  size_t size() const { return commands_.size(); }
+  // Forgets all submitted commands.
+  void Clear();
+
+ private:
+  enum State { kPending, kFound, kNotFound, kFailed };
+
+  // Executes the pending commands over a pipelined connection. Returns false
+  // if the daemon does not support pipelining.
+  bool CollectPipelined(const Deadline& deadline);
+  // Executes the pending commands one at a time.
+  void CollectEach();
+  // Takes the complete response frames at the start of buffer. Returns how
+  // many commands they answered.
+  size_t TakeFrames(std::string* buffer);
+  // Sets the result of the command at index from its response.
+  void SetResult(size_t index, const char* response, size_t length);
+
+  std::vector<std::string> commands_;
+  std::vector<State> states_;
+  std::vector<std::string> lines_;
+
+  // Not copyable or assignable.
+  LookupPipeline& operator=(const LookupPipeline&);
+  LookupPipeline(const LookupPipeline&);
+};
+
 // Parses a user information line from the Google Compute User Accounts daemon
-// as a passwd entry.
+// as a passwd entry. The line may also be a binary record.
 //
 // The line should not have a trailing newline character.
 //
@@ -134,9 +402,15 @@ void GetDaemonOutput(const std::string& command,
 void UserLineToPasswdStruct(const std::string& line,
                             passwd* pwd,
                             BufferManager* buf);
+// Parses the line of the given length at line in place. Fields are copied
+// directly to buf and no memory is allocated.
+void UserLineToPasswdStruct(const char* line,
+                            size_t length,
+                            passwd* pwd,
+                            BufferManager* buf);
 
 // Parses a group information line from the Google Compute User Accounts daemon
-// as a group entry.
+// as a group entry. The line may also be a binary record.
 //
 // The line should not have a trailing newline character.
 //
@@ -144,6 +418,12 @@ void UserLineToPasswdStruct(const std::string& line,
 void GroupLineToGroupStruct(const std::string& line,
                             group* grp,
                             BufferManager* buf);
+// Parses the line of the given length at line in place. Fields are copied
+// directly to buf and no memory is allocated.
+void GroupLineToGroupStruct(const char* line,
+                            size_t length,
+                            group* grp,
+                            BufferManager* buf);
 
 // Converts and account name from the Google Compute User Accounts daemon to a
 // shadow entry.
@@ -154,6 +434,21 @@ void GroupLineToGroupStruct(const std::string& line,
 void AccountNameToShadowStruct(const std::string& name,
                                spwd* pwd,
                                BufferManager* buf);
+// Converts the name of the given length at name in place.
+void AccountNameToShadowStruct(const char* name,
+                               size_t length,
+                               spwd* pwd,
+                               BufferManager* buf);
+
+// Appends a GID to the array of *size GIDs at *groups, of which *start are in
+// use, the way initgroups_dyn does. GIDs already in the array are skipped. The
+// array is grown with realloc, but never beyond limit GIDs if limit is
+// positive.
+//
+// Returns false if the array is full. Throws std::bad_alloc exception if it
+// cannot be grown.
+bool AppendGroup(gid_t gid, long int* start, long int* size,  // NOLINT
+                 gid_t** groups, long int limit);  // NOLINT
 
 }  // namespace utils
 
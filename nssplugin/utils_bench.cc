@@ -0,0 +1,233 @@
+/* Copyright 2015 Google Inc. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "utils.h"  // NOLINT(build/include)
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+
+using utils::BufferManager;
+using utils::GetDaemonOutput;
+using utils::GroupLineToGroupStruct;
+using utils::ParseId;
+using utils::SetKeepAliveEnabled;
+using utils::TokenizeString;
+using utils::UserLineToPasswdStruct;
+
+namespace {
+
+// The response the mock daemon sends to every request. It is only changed
+// while no request is in flight.
+std::string g_response;
+
+std::string UserLine(int i) {
+  std::stringstream line;
+  line << "user" << i << ":" << 1000 + i << ":1000:User " << i
+       << ":/home/user" << i << ":/bin/bash";
+  return line.str();
+}
+
+std::string GroupLine(int members) {
+  std::stringstream line;
+  line << "group:1000:";
+  for (int i = 0; i < members; i++) {
+    line << (i ? "," : "") << "user" << i;
+  }
+  return line.str();
+}
+
+bool WriteAll(int fd, const std::string& data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t n = write(fd, data.data() + written, data.size() - written);
+    if (n <= 0) {
+      return false;
+    }
+    written += n;
+  }
+  return true;
+}
+
+// Serves one connection like the daemon: either a single request, or
+// newline terminated requests with framed responses after "keepalive\n".
+void* ConnectionThreadMain(void* data) {
+  int fd = static_cast<int>(reinterpret_cast<intptr_t>(data));
+  std::string request;
+  char buff[4096];
+  ssize_t bytes_read = read(fd, buff, sizeof(buff));
+  if (bytes_read > 0) {
+    request.assign(buff, bytes_read);
+  }
+  if (request.compare(0, 10, "keepalive\n") != 0) {
+    WriteAll(fd, g_response);
+    close(fd);
+    return NULL;
+  }
+  request.erase(0, 10);
+  bool ok = WriteAll(fd, "200\n");
+  while (ok) {
+    size_t end;
+    while (ok && (end = request.find('\n')) != std::string::npos) {
+      request.erase(0, end + 1);
+      std::stringstream frame;
+      frame << g_response.size() << "\n" << g_response;
+      ok = WriteAll(fd, frame.str());
+    }
+    bytes_read = read(fd, buff, sizeof(buff));
+    ok = ok && bytes_read > 0;
+    if (ok) {
+      request.append(buff, bytes_read);
+    }
+  }
+  close(fd);
+  return NULL;
+}
+
+void* ServerThreadMain(void* data) {
+  int socket_fd = static_cast<int>(reinterpret_cast<intptr_t>(data));
+  for (;;) {
+    int fd = accept(socket_fd, NULL, NULL);
+    if (fd == -1) {
+      continue;
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, ConnectionThreadMain,
+                   reinterpret_cast<void*>(static_cast<intptr_t>(fd)));
+    pthread_detach(thread);
+  }
+  return NULL;
+}
+
+// Starts the mock daemon the first time it is called. It serves until the
+// process exits.
+void StartServer() {
+  static bool started = false;
+  if (started) {
+    return;
+  }
+  started = true;
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, SOCKET_PATH, sizeof(address.sun_path) - 1);
+  int socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(SOCKET_PATH);
+  if (socket_fd == -1 ||
+      bind(socket_fd, reinterpret_cast<sockaddr*>(&address),
+           sizeof(address)) ||
+      listen(socket_fd, 128)) {
+    perror("mock daemon");
+    abort();
+  }
+  pthread_t thread;
+  pthread_create(&thread, NULL, ServerThreadMain,
+                 reinterpret_cast<void*>(static_cast<intptr_t>(socket_fd)));
+  pthread_detach(thread);
+}
+
+void BM_TokenizeString(benchmark::State& state) {
+  std::string value = GroupLine(state.range(0));
+  std::vector<std::string> result;
+  for (auto _ : state) {
+    result.clear();
+    TokenizeString(value, ',', &result);
+    benchmark::DoNotOptimize(result.data());
+  }
+  state.SetBytesProcessed(state.iterations() * value.size());
+}
+BENCHMARK(BM_TokenizeString)->Arg(6)->Arg(1000);
+
+void BM_ParseId(benchmark::State& state) {
+  std::string value = "4294967295";
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ParseId(value));
+  }
+}
+BENCHMARK(BM_ParseId);
+
+void BM_UserLineToPasswdStruct(benchmark::State& state) {
+  std::string line = UserLine(1);
+  std::vector<char> buffer(1024);
+  passwd result;
+  for (auto _ : state) {
+    BufferManager buf(&buffer[0], buffer.size());
+    UserLineToPasswdStruct(line, &result, &buf);
+    benchmark::DoNotOptimize(result.pw_uid);
+  }
+}
+BENCHMARK(BM_UserLineToPasswdStruct);
+
+void BM_GroupLineToGroupStruct(benchmark::State& state) {
+  std::string line = GroupLine(state.range(0));
+  std::vector<char> buffer(line.size() * 2 +
+                           sizeof(char*) * (state.range(0) + 2) + 64);
+  group result;
+  for (auto _ : state) {
+    BufferManager buf(&buffer[0], buffer.size());
+    GroupLineToGroupStruct(line, &result, &buf);
+    benchmark::DoNotOptimize(result.gr_mem);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_GroupLineToGroupStruct)->Arg(0)->Arg(10)->Arg(1000)->Arg(5000);
+
+void BM_AppendVector(benchmark::State& state) {
+  std::vector<std::string> value;
+  TokenizeString(GroupLine(state.range(0)).substr(11), ',', &value);
+  std::vector<char> buffer(value.size() * (sizeof(char*) + 16) + 64);
+  for (auto _ : state) {
+    BufferManager buf(&buffer[0], buffer.size());
+    benchmark::DoNotOptimize(buf.AppendVector(value));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_AppendVector)->Arg(10)->Arg(1000);
+
+// Measures a round trip to the mock daemon for a response of range(0) users,
+// over a new connection or a keep-alive connection if range(1) is set.
+void BM_GetDaemonOutput(benchmark::State& state) {
+  StartServer();
+  SetKeepAliveEnabled(state.range(1));
+  g_response = "200";
+  for (int i = 0; i < state.range(0); i++) {
+    g_response += "\n" + UserLine(i);
+  }
+  utils::OutputType type =
+      state.range(0) == 1 ? utils::kSingleLine : utils::kMultiLine;
+  std::vector<std::string> output_lines;
+  for (auto _ : state) {
+    output_lines.clear();
+    GetDaemonOutput("users", type, &output_lines);
+  }
+  state.SetBytesProcessed(state.iterations() * g_response.size());
+}
+BENCHMARK(BM_GetDaemonOutput)
+    ->ArgNames({"users", "keepalive"})
+    ->Args({1, 0})->Args({1, 1})->Args({1000, 0})->Args({1000, 1});
+
+}  // namespace
+
+BENCHMARK_MAIN();
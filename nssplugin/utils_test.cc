@@ -17,22 +17,63 @@
 
 #include <errno.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/un.h>
+#include <cstdlib>
+#include <sstream>
 #include <stdexcept>
 
 #include "gtest/gtest.h"
 
 using utils::AccountNameToShadowStruct;
+using utils::AppendGroup;
 using utils::BufferManager;
 using utils::EntityList;
+using utils::GetBatchDaemonOutput;
+using utils::GetCachedDaemonLine;
 using utils::GetDaemonOutput;
 using utils::GroupLineToGroupStruct;
+using utils::KeepLineForRetry;
+using utils::LookupCache;
+using utils::LookupPipeline;
 using utils::ParseId;
+using utils::SetBinaryProtocolEnabled;
+using utils::SetKeepAliveEnabled;
+using utils::SetPageSize;
+using utils::SetPipeliningEnabled;
+using utils::SetRequestTimeout;
+using utils::SetStreamingEnabled;
+using utils::TakeLineForRetry;
 using utils::TokenizeString;
 using utils::UserLineToPasswdStruct;
 
 typedef std::pair<const std::string&, const std::string&> RequestResponse;
+typedef std::vector<std::pair<std::string, std::string> > Exchanges;
+
+// Encodes an integer of a binary record.
+std::string BinaryUint32(uint32_t value) {
+  std::string result;
+  for (int i = 0; i < 4; i++) {
+    result.push_back(static_cast<char>(value >> (8 * i)));
+  }
+  return result;
+}
+
+// Encodes a length-prefixed string of a binary record.
+std::string BinaryString(const std::string& value) {
+  return BinaryUint32(value.size()) + value;
+}
+
+std::string BinaryUserRecord(uint32_t uid, uint32_t gid,
+                             const std::string& name) {
+  return std::string(1, '\0') + BinaryUint32(uid) + BinaryUint32(gid) +
+      BinaryString(name) + BinaryString("a:b,c") +
+      BinaryString("/home/" + name) + BinaryString("/bin/sh");
+}
 
 class LibnssGoogleTest : public ::testing::Test {
  protected:
@@ -42,14 +83,28 @@ class LibnssGoogleTest : public ::testing::Test {
     pthread_mutex_init(&mutex_, NULL);
     pthread_cond_init(&listening_cond_, NULL);
     pthread_cond_init(&stop_cond_, NULL);
+    SetKeepAliveEnabled(false);
+    SetStreamingEnabled(false);
+    SetPageSize(0);
+    SetBinaryProtocolEnabled(false);
+    SetPipeliningEnabled(false);
+    // Keep the tests of unresponsive daemons short.
+    SetRequestTimeout(utils::kMultiLine, 1000);
   }
 
   ~LibnssGoogleTest() {
+    ShutdownServer();
     pthread_mutex_destroy(&mutex_);
     pthread_cond_destroy(&listening_cond_);
     pthread_cond_destroy(&stop_cond_);
   }
 
+  void StartServer(void* (*thread_main)(void*), void* data) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, thread_main, data);
+    threads_.push_back(thread);
+  }
+
   static void* ServerThreadMain(void* data) {
     const RequestResponse& rr = *static_cast<RequestResponse*>(data);
     int socket_fd;
@@ -69,6 +124,38 @@ class LibnssGoogleTest : public ::testing::Test {
     return NULL;
   }
 
+  // Fills the accept backlog with a connection of its own before listening is
+  // signaled, and only starts accepting after a delay.
+  static void* FullBacklogServerThreadMain(void* data) {
+    const RequestResponse& rr = *static_cast<RequestResponse*>(data);
+    int socket_fd;
+    OpenServerSocket(&socket_fd);
+    listen(socket_fd, 0);
+    sockaddr_un address;
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, SOCKET_PATH, sizeof(address.sun_path));
+    std::vector<int> fillers;
+    while (true) {
+      int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      fillers.push_back(fd);
+      if (connect(fd, reinterpret_cast<sockaddr*>(&address),
+                  sizeof(address))) {
+        break;
+      }
+    }
+    SignalListening();
+    usleep(100000);
+    for (size_t i = 0; i < fillers.size(); i++) {
+      if (i + 1 < fillers.size()) {
+        close(accept(socket_fd, NULL, NULL));
+      }
+      close(fillers[i]);
+    }
+    VerifyRequestAndSendResponse(socket_fd, rr);
+    CloseServerSocket(socket_fd);
+    return NULL;
+  }
+
   static void* NoResponseServerThreadMain(void*) {
     int socket_fd;
     OpenServerSocket(&socket_fd);
@@ -95,6 +182,165 @@ class LibnssGoogleTest : public ::testing::Test {
     return NULL;
   }
 
+  static void* SlowResponseServerThreadMain(void*) {
+    int socket_fd;
+    OpenServerSocket(&socket_fd);
+    listen(socket_fd, 5);
+    SignalListening();
+    int fd = accept(socket_fd, NULL, NULL);
+    char request_buffer[1024] = {};
+    read(fd, request_buffer, sizeof(request_buffer));
+    // Send a byte at a time, each well within the old per-read timeout.
+    write(fd, "200\n", 4);
+    while (!IsShuttingDown()) {
+      write(fd, "x", 1);
+      usleep(100000);
+    }
+    close(fd);
+    CloseServerSocket(socket_fd);
+    return NULL;
+  }
+
+  static void* KeepAliveServerThreadMain(void* data) {
+    const Exchanges& exchanges = *static_cast<Exchanges*>(data);
+    int socket_fd;
+    OpenServerSocket(&socket_fd);
+    listen(socket_fd, 5);
+    SignalListening();
+    // Only one connection is accepted, so every request must reuse it.
+    int fd = accept(socket_fd, NULL, NULL);
+    EXPECT_EQ("keepalive\n", ReadLine(fd));
+    write(fd, "200\n", 4);
+    for (size_t i = 0; i < exchanges.size(); i++) {
+      EXPECT_EQ(exchanges[i].first, ReadLine(fd));
+      std::stringstream frame;
+      frame << exchanges[i].second.size() << "\n" << exchanges[i].second;
+      write(fd, frame.str().c_str(), frame.str().size());
+    }
+    WaitForShutdown();
+    close(fd);
+    CloseServerSocket(socket_fd);
+    return NULL;
+  }
+
+  static void* NoKeepAliveServerThreadMain(void* data) {
+    const RequestResponse& rr = *static_cast<RequestResponse*>(data);
+    int socket_fd;
+    OpenServerSocket(&socket_fd);
+    listen(socket_fd, 5);
+    SignalListening();
+    // Refuse keep-alive the way a daemon that does not support it does.
+    int fd = accept(socket_fd, NULL, NULL);
+    EXPECT_EQ("keepalive\n", ReadLine(fd));
+    write(fd, "400", 3);
+    close(fd);
+    fd = accept(socket_fd, NULL, NULL);
+    char request_buffer[1024] = {};
+    read(fd, request_buffer, sizeof(request_buffer));
+    EXPECT_EQ(rr.first, request_buffer);
+    write(fd, rr.second.c_str(), rr.second.size());
+    close(fd);
+    WaitForShutdown();
+    CloseServerSocket(socket_fd);
+    return NULL;
+  }
+
+  static void* NoStreamServerThreadMain(void* data) {
+    const RequestResponse& rr = *static_cast<RequestResponse*>(data);
+    int socket_fd;
+    OpenServerSocket(&socket_fd);
+    listen(socket_fd, 5);
+    SignalListening();
+    // Refuse streaming the way a daemon that does not support it does.
+    int fd = accept(socket_fd, NULL, NULL);
+    EXPECT_EQ("stream " + rr.first, ReadLine(fd));
+    write(fd, "400", 3);
+    close(fd);
+    fd = accept(socket_fd, NULL, NULL);
+    char request_buffer[1024] = {};
+    read(fd, request_buffer, sizeof(request_buffer));
+    EXPECT_EQ(rr.first, request_buffer);
+    write(fd, rr.second.c_str(), rr.second.size());
+    close(fd);
+    WaitForShutdown();
+    CloseServerSocket(socket_fd);
+    return NULL;
+  }
+
+  static void* NoPageServerThreadMain(void* data) {
+    const RequestResponse& rr = *static_cast<RequestResponse*>(data);
+    int socket_fd;
+    OpenServerSocket(&socket_fd);
+    listen(socket_fd, 5);
+    SignalListening();
+    // Refuse paging the way a daemon that does not support it does.
+    int fd = accept(socket_fd, NULL, NULL);
+    EXPECT_EQ(0, ReadLine(fd).find("page "));
+    write(fd, "400", 3);
+    close(fd);
+    fd = accept(socket_fd, NULL, NULL);
+    char request_buffer[1024] = {};
+    read(fd, request_buffer, sizeof(request_buffer));
+    EXPECT_EQ(rr.first, request_buffer);
+    write(fd, rr.second.c_str(), rr.second.size());
+    close(fd);
+    WaitForShutdown();
+    CloseServerSocket(socket_fd);
+    return NULL;
+  }
+
+  static void* PipelineServerThreadMain(void* data) {
+    const Exchanges& exchanges = *static_cast<Exchanges*>(data);
+    int socket_fd;
+    OpenServerSocket(&socket_fd);
+    listen(socket_fd, 5);
+    SignalListening();
+    int fd = accept(socket_fd, NULL, NULL);
+    EXPECT_EQ("keepalive\n", ReadLine(fd));
+    EXPECT_EQ("pipeline\n", ReadLine(fd));
+    write(fd, "200\n3\n200", 9);
+    // Every request is read before the first response is written, and the
+    // responses are written in reverse order.
+    for (size_t i = 0; i < exchanges.size(); i++) {
+      std::stringstream request;
+      request << i << " " << exchanges[i].first;
+      EXPECT_EQ(request.str(), ReadLine(fd));
+    }
+    for (size_t i = exchanges.size(); i-- > 0;) {
+      std::stringstream frame;
+      frame << i << " " << exchanges[i].second.size() << "\n"
+            << exchanges[i].second;
+      write(fd, frame.str().c_str(), frame.str().size());
+    }
+    WaitForShutdown();
+    close(fd);
+    CloseServerSocket(socket_fd);
+    return NULL;
+  }
+
+  static void* NoPipelineServerThreadMain(void* data) {
+    const RequestResponse& rr = *static_cast<RequestResponse*>(data);
+    int socket_fd;
+    OpenServerSocket(&socket_fd);
+    listen(socket_fd, 5);
+    SignalListening();
+    // Refuse pipelining the way a daemon that only supports keep-alive does.
+    int fd = accept(socket_fd, NULL, NULL);
+    EXPECT_EQ("keepalive\n", ReadLine(fd));
+    EXPECT_EQ("pipeline\n", ReadLine(fd));
+    write(fd, "200\n3\n400", 9);
+    close(fd);
+    fd = accept(socket_fd, NULL, NULL);
+    char request_buffer[1024] = {};
+    read(fd, request_buffer, sizeof(request_buffer));
+    EXPECT_EQ(rr.first, request_buffer);
+    write(fd, rr.second.c_str(), rr.second.size());
+    close(fd);
+    WaitForShutdown();
+    CloseServerSocket(socket_fd);
+    return NULL;
+  }
+
   static void WaitForServerToListen() {
     pthread_mutex_lock(&mutex_);
     while (!is_listening_) {
@@ -103,11 +349,17 @@ class LibnssGoogleTest : public ::testing::Test {
     pthread_mutex_unlock(&mutex_);
   }
 
-  static void ShutdownServer() {
+  // Stops the server threads and waits for them, so that they cannot access
+  // data of the test or interfere with later tests.
+  void ShutdownServer() {
     pthread_mutex_lock(&mutex_);
     stop_listening_ = true;
     pthread_cond_broadcast(&stop_cond_);
     pthread_mutex_unlock(&mutex_);
+    for (size_t i = 0; i < threads_.size(); i++) {
+      pthread_join(threads_[i], NULL);
+    }
+    threads_.clear();
   }
 
  private:
@@ -122,11 +374,22 @@ class LibnssGoogleTest : public ::testing::Test {
     int ret = setsockopt(*socket_fd, SOL_SOCKET, SO_REUSEADDR, &yes,
                          sizeof(yes));
     ASSERT_EQ(0, ret) << strerror(errno);
+    // Remove any socket left behind by an interrupted run.
+    unlink(SOCKET_PATH);
     ret = bind(*socket_fd, reinterpret_cast<sockaddr*>(&address),
                    sizeof(address));
     ASSERT_EQ(0, ret) << strerror(errno);
   }
 
+  static std::string ReadLine(int fd) {
+    std::string line;
+    char c = 0;
+    while (c != '\n' && read(fd, &c, 1) == 1) {
+      line.push_back(c);
+    }
+    return line;
+  }
+
   static void SignalListening() {
     pthread_mutex_lock(&mutex_);
     is_listening_ = true;
@@ -140,7 +403,7 @@ class LibnssGoogleTest : public ::testing::Test {
     SignalListening();
     int fd = accept(socket_fd, NULL, NULL);
     ASSERT_GE(fd, 0) << strerror(errno);
-    char request_buffer[1024];
+    char request_buffer[1024] = {};
     read(fd, request_buffer, sizeof(request_buffer));
     EXPECT_EQ(rr.first, request_buffer);
     // Send 16 bytes at a time to simulate packets.
@@ -152,6 +415,13 @@ class LibnssGoogleTest : public ::testing::Test {
     WaitForShutdown();
   }
 
+  static bool IsShuttingDown() {
+    pthread_mutex_lock(&mutex_);
+    bool stop = stop_listening_;
+    pthread_mutex_unlock(&mutex_);
+    return stop;
+  }
+
   static void WaitForShutdown() {
     pthread_mutex_lock(&mutex_);
     while (!stop_listening_) {
@@ -165,6 +435,8 @@ class LibnssGoogleTest : public ::testing::Test {
     unlink(SOCKET_PATH);
   }
 
+  std::vector<pthread_t> threads_;
+
   static bool is_listening_;
   static bool stop_listening_;
   static pthread_mutex_t mutex_;
@@ -244,6 +516,37 @@ TEST_F(LibnssGoogleTest, CopyVectorBufferTooSmallForNullTerm) {
   ASSERT_THROW(buf.AppendVector(value), std::length_error);
 }
 
+TEST_F(LibnssGoogleTest, CopyTokensNormalCase) {
+  char buffer[64];
+  BufferManager buf(buffer, sizeof(buffer));
+  const char* value = "test,,test2,ignored";
+
+  char** result = buf.AppendTokens(value, 11, ',');
+  EXPECT_STREQ("test", result[0]);
+  EXPECT_STREQ("", result[1]);
+  EXPECT_STREQ("test2", result[2]);
+  EXPECT_EQ(NULL, result[3]);
+  size_t data_size = sizeof(char*) * 4 + 12;
+  EXPECT_EQ(64 - data_size, buf.size());
+  EXPECT_EQ(buffer + data_size, buf.buffer());
+}
+
+TEST_F(LibnssGoogleTest, CopyEmptyTokens) {
+  char buffer[64];
+  BufferManager buf(buffer, sizeof(buffer));
+
+  char** result = buf.AppendTokens("", 0, ',');
+  EXPECT_EQ(NULL, result[0]);
+  EXPECT_EQ(64 - sizeof(char*), buf.size());
+}
+
+TEST_F(LibnssGoogleTest, CopyTokensBufferTooSmall) {
+  char buffer[sizeof(char*) * 3 + 3];
+  BufferManager buf(buffer, sizeof(buffer));
+
+  ASSERT_THROW(buf.AppendTokens("a,b", 3, ','), std::length_error);
+}
+
 TEST_F(LibnssGoogleTest, TokenizeStringNormalCase) {
   std::string value = "user:1:2: :dir::";
   std::vector<std::string> result;
@@ -301,14 +604,20 @@ TEST_F(LibnssGoogleTest, StringToIdNegative) {
   ASSERT_THROW(ParseId(value), std::runtime_error);
 }
 
+TEST_F(LibnssGoogleTest, StringToIdOnlyParsesLength) {
+  EXPECT_EQ(12, ParseId("123", 2));
+  ASSERT_THROW(ParseId("123", 0), std::runtime_error);
+  ASSERT_THROW(ParseId(" 12", 3), std::runtime_error);
+  EXPECT_EQ(UINT32_MAX, ParseId("4294967296", 10));
+}
+
 TEST_F(LibnssGoogleTest, GetDaemonOutputNormalCase) {
   std::string command = "get_users\n";
   std::string response = "200\n"
       "user2:x:1002:1001::/home/user2:/bin/bash\n"
       "user1:x:1001:1001::/home/user1:/bin/bash";
   RequestResponse rr(command, response);
-  pthread_t thread;
-  pthread_create(&thread, NULL, ServerThreadMain, &rr);
+  StartServer(ServerThreadMain, &rr);
   WaitForServerToListen();
   std::vector<std::string> output_lines;
   GetDaemonOutput(command, utils::kMultiLine, &output_lines);
@@ -324,8 +633,7 @@ TEST_F(LibnssGoogleTest, GetDaemonOutputNonexistantUser) {
   std::string command = "get_user user\n";
   std::string response = "404";
   RequestResponse rr(command, response);
-  pthread_t thread;
-  pthread_create(&thread, NULL, ServerThreadMain, &rr);
+  StartServer(ServerThreadMain, &rr);
   WaitForServerToListen();
   std::vector<std::string> output_lines;
   ASSERT_THROW(GetDaemonOutput(command, utils::kSingleLine, &output_lines),
@@ -337,8 +645,7 @@ TEST_F(LibnssGoogleTest, GetDaemonOutputServerError) {
   std::string command = "get_user user\n";
   std::string response = "500";
   RequestResponse rr(command, response);
-  pthread_t thread;
-  pthread_create(&thread, NULL, ServerThreadMain, &rr);
+  StartServer(ServerThreadMain, &rr);
   WaitForServerToListen();
   std::vector<std::string> output_lines;
   ASSERT_THROW(GetDaemonOutput(command, utils::kSingleLine, &output_lines),
@@ -350,8 +657,7 @@ TEST_F(LibnssGoogleTest, GetDaemonOutputNoOutput) {
   std::string command = "get_user user\n";
   std::string response = "";
   RequestResponse rr(command, response);
-  pthread_t thread;
-  pthread_create(&thread, NULL, ServerThreadMain, &rr);
+  StartServer(ServerThreadMain, &rr);
   WaitForServerToListen();
   std::vector<std::string> output_lines;
   ASSERT_THROW(GetDaemonOutput(command, utils::kSingleLine, &output_lines),
@@ -363,8 +669,7 @@ TEST_F(LibnssGoogleTest, GetDaemonOutputNoGroups) {
   std::string command = "get_groups\n";
   std::string response = "200";
   RequestResponse rr(command, response);
-  pthread_t thread;
-  pthread_create(&thread, NULL, ServerThreadMain, &rr);
+  StartServer(ServerThreadMain, &rr);
   WaitForServerToListen();
   std::vector<std::string> output_lines;
   GetDaemonOutput(command, utils::kMultiLine, &output_lines);
@@ -376,8 +681,7 @@ TEST_F(LibnssGoogleTest, GetDaemonOutputNoUser) {
   std::string command = "get_user user\n";
   std::string response = "200";
   RequestResponse rr(command, response);
-  pthread_t thread;
-  pthread_create(&thread, NULL, ServerThreadMain, &rr);
+  StartServer(ServerThreadMain, &rr);
   WaitForServerToListen();
   std::vector<std::string> output_lines;
   ASSERT_THROW(GetDaemonOutput(command, utils::kSingleLine, &output_lines),
@@ -386,8 +690,7 @@ TEST_F(LibnssGoogleTest, GetDaemonOutputNoUser) {
 }
 
 TEST_F(LibnssGoogleTest, GetDaemonOutputConnectDoesNotHangOnConnect) {
-  pthread_t thread;
-  pthread_create(&thread, NULL, NoAcceptServerThreadMain, NULL);
+  StartServer(NoAcceptServerThreadMain, NULL);
   WaitForServerToListen();
   std::vector<std::string> output_lines;
   ASSERT_THROW(GetDaemonOutput("", utils::kMultiLine, &output_lines),
@@ -395,9 +698,21 @@ TEST_F(LibnssGoogleTest, GetDaemonOutputConnectDoesNotHangOnConnect) {
   ShutdownServer();
 }
 
+TEST_F(LibnssGoogleTest, GetDaemonOutputRetriesFullBacklog) {
+  std::string command = "users";
+  std::string response = "200\nuser1:1001:1000::/home/user1:/bin/sh";
+  RequestResponse rr(command, response);
+  StartServer(FullBacklogServerThreadMain, &rr);
+  WaitForServerToListen();
+  std::vector<std::string> output_lines;
+  GetDaemonOutput(command, utils::kMultiLine, &output_lines);
+  ASSERT_EQ(1, output_lines.size());
+  EXPECT_EQ("user1:1001:1000::/home/user1:/bin/sh", output_lines[0]);
+  ShutdownServer();
+}
+
 TEST_F(LibnssGoogleTest, GetDaemonOutputReadDoesNotHang) {
-  pthread_t thread;
-  pthread_create(&thread, NULL, NoResponseServerThreadMain, NULL);
+  StartServer(NoResponseServerThreadMain, NULL);
   WaitForServerToListen();
   std::vector<std::string> output_lines;
   ASSERT_THROW(GetDaemonOutput("", utils::kMultiLine, &output_lines),
@@ -406,8 +721,7 @@ TEST_F(LibnssGoogleTest, GetDaemonOutputReadDoesNotHang) {
 }
 
 TEST_F(LibnssGoogleTest, GetDaemonOutputPartialReadDoesNotHang) {
-  pthread_t thread;
-  pthread_create(&thread, NULL, PartialResponseServerThreadMain, NULL);
+  StartServer(PartialResponseServerThreadMain, NULL);
   WaitForServerToListen();
   std::vector<std::string> output_lines;
   ASSERT_THROW(GetDaemonOutput("", utils::kMultiLine, &output_lines),
@@ -415,20 +729,210 @@ TEST_F(LibnssGoogleTest, GetDaemonOutputPartialReadDoesNotHang) {
   ShutdownServer();
 }
 
+TEST_F(LibnssGoogleTest, GetDaemonOutputSlowResponseHonorsDeadline) {
+  StartServer(SlowResponseServerThreadMain, NULL);
+  WaitForServerToListen();
+  SetRequestTimeout(utils::kMultiLine, 500);
+  timeval start, end;
+  gettimeofday(&start, NULL);
+  std::vector<std::string> output_lines;
+  ASSERT_THROW(GetDaemonOutput("users", utils::kMultiLine, &output_lines),
+               std::runtime_error);
+  gettimeofday(&end, NULL);
+  EXPECT_LT(end.tv_sec - start.tv_sec, 2);
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, GetDaemonOutputHighFd) {
+  rlimit old_limit;
+  getrlimit(RLIMIT_NOFILE, &old_limit);
+  rlimit limit = old_limit;
+  limit.rlim_cur = FD_SETSIZE + 64;
+  if (limit.rlim_max < limit.rlim_cur || setrlimit(RLIMIT_NOFILE, &limit)) {
+    // Descriptors beyond FD_SETSIZE cannot be opened.
+    return;
+  }
+  std::string command = "user_by_uid 1001";
+  std::string response = "200\nuser1:1001:1001::/home/user1:/bin/bash";
+  RequestResponse rr(command, response);
+  StartServer(ServerThreadMain, &rr);
+  WaitForServerToListen();
+  std::vector<int> fds;
+  while (fds.empty() || fds.back() < FD_SETSIZE) {
+    int fd = open("/dev/null", O_RDONLY);
+    ASSERT_NE(-1, fd);
+    fds.push_back(fd);
+  }
+  std::vector<std::string> output_lines;
+  GetDaemonOutput(command, utils::kSingleLine, &output_lines);
+  for (size_t i = 0; i < fds.size(); i++) {
+    close(fds[i]);
+  }
+  setrlimit(RLIMIT_NOFILE, &old_limit);
+  ASSERT_EQ(1, output_lines.size());
+  EXPECT_STREQ("user1:1001:1001::/home/user1:/bin/bash",
+               output_lines[0].c_str());
+  ShutdownServer();
+}
+
 TEST_F(LibnssGoogleTest, GetDaemonOutputHandlesNoSocketGracefully) {
   std::vector<std::string> output_lines;
   ASSERT_THROW(GetDaemonOutput("", utils::kMultiLine, &output_lines),
                std::runtime_error);
 }
 
+TEST_F(LibnssGoogleTest, GetDaemonOutputKeepAliveReusesConnection) {
+  Exchanges exchanges;
+  exchanges.push_back(std::make_pair(
+      "user_by_uid 1001\n", "200\nuser1:1001:1001::/home/user1:/bin/bash"));
+  exchanges.push_back(std::make_pair("user_by_uid 1003\n", "404"));
+  exchanges.push_back(std::make_pair(
+      "groups\n", "200\ngroup1:1001:\ngroup2:1002:user1"));
+  StartServer(KeepAliveServerThreadMain, &exchanges);
+  WaitForServerToListen();
+  SetKeepAliveEnabled(true);
+  std::vector<std::string> output_lines;
+  GetDaemonOutput("user_by_uid 1001", utils::kSingleLine, &output_lines);
+  ASSERT_EQ(1, output_lines.size());
+  EXPECT_STREQ("user1:1001:1001::/home/user1:/bin/bash",
+               output_lines[0].c_str());
+  output_lines.clear();
+  ASSERT_THROW(GetDaemonOutput("user_by_uid 1003", utils::kSingleLine,
+                               &output_lines),
+               std::invalid_argument);
+  output_lines.clear();
+  GetDaemonOutput("groups\n", utils::kMultiLine, &output_lines);
+  ASSERT_EQ(2, output_lines.size());
+  EXPECT_STREQ("group1:1001:", output_lines[0].c_str());
+  EXPECT_STREQ("group2:1002:user1", output_lines[1].c_str());
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, GetDaemonOutputKeepAliveBinaryRecords) {
+  // The UID and GID contain newline bytes.
+  std::string record = BinaryUserRecord(10, 0x0a0a, "user1");
+  Exchanges exchanges;
+  exchanges.push_back(std::make_pair("binary\n", "200"));
+  exchanges.push_back(std::make_pair("user_by_uid 10\n", "200\n" + record));
+  exchanges.push_back(std::make_pair("user_by_name user1\n",
+                                     "200\n" + record));
+  exchanges.push_back(std::make_pair(
+      "groups\n", "200\ngroup1:1001:\ngroup2:1002:user1"));
+  StartServer(KeepAliveServerThreadMain, &exchanges);
+  WaitForServerToListen();
+  SetKeepAliveEnabled(true);
+  SetBinaryProtocolEnabled(true);
+  std::vector<std::string> output_lines;
+  GetDaemonOutput("user_by_uid 10", utils::kSingleLine, &output_lines);
+  ASSERT_EQ(1, output_lines.size());
+  EXPECT_EQ(record, output_lines[0]);
+  LookupCache cache(16, 60, 60);
+  std::string line = GetCachedDaemonLine("user_by_name user1",
+                                         utils::kSingleLine, &cache);
+  EXPECT_EQ(record, line);
+  passwd result;
+  char buffer[128];
+  BufferManager buf(buffer, sizeof(buffer));
+  UserLineToPasswdStruct(line, &result, &buf);
+  EXPECT_STREQ("user1", result.pw_name);
+  EXPECT_EQ(10, result.pw_uid);
+  EXPECT_EQ(0x0a0a, result.pw_gid);
+  // Other responses are still text.
+  output_lines.clear();
+  GetDaemonOutput("groups", utils::kMultiLine, &output_lines);
+  ASSERT_EQ(2, output_lines.size());
+  EXPECT_STREQ("group1:1001:", output_lines[0].c_str());
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, GetDaemonOutputKeepAliveBinaryRefused) {
+  Exchanges exchanges;
+  exchanges.push_back(std::make_pair("binary\n", "400"));
+  exchanges.push_back(std::make_pair(
+      "user_by_uid 1001\n", "200\nuser1:1001:1001::/home/user1:/bin/bash"));
+  StartServer(KeepAliveServerThreadMain, &exchanges);
+  WaitForServerToListen();
+  SetKeepAliveEnabled(true);
+  SetBinaryProtocolEnabled(true);
+  std::vector<std::string> output_lines;
+  GetDaemonOutput("user_by_uid 1001", utils::kSingleLine, &output_lines);
+  ASSERT_EQ(1, output_lines.size());
+  EXPECT_STREQ("user1:1001:1001::/home/user1:/bin/bash",
+               output_lines[0].c_str());
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, GetDaemonOutputKeepAliveFallsBackToOneShot) {
+  std::string command = "user_by_uid 1001";
+  std::string response = "200\nuser1:1001:1001::/home/user1:/bin/bash";
+  RequestResponse rr(command, response);
+  StartServer(NoKeepAliveServerThreadMain, &rr);
+  WaitForServerToListen();
+  SetKeepAliveEnabled(true);
+  std::vector<std::string> output_lines;
+  GetDaemonOutput(command, utils::kSingleLine, &output_lines);
+  ASSERT_EQ(1, output_lines.size());
+  EXPECT_STREQ("user1:1001:1001::/home/user1:/bin/bash",
+               output_lines[0].c_str());
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, GetDaemonOutputLargeResponse) {
+  std::string command = "users\n";
+  std::string response = "200";
+  for (int i = 0; i < 50000; i++) {
+    std::stringstream line;
+    line << "\nuser" << i << ":" << 1000 + i << ":1000::/home/user" << i
+         << ":/bin/bash";
+    response += line.str();
+  }
+  RequestResponse rr(command, response);
+  StartServer(ServerThreadMain, &rr);
+  WaitForServerToListen();
+  std::vector<std::string> output_lines;
+  GetDaemonOutput(command, utils::kMultiLine, &output_lines);
+  ASSERT_EQ(50000, output_lines.size());
+  EXPECT_STREQ("user0:1000:1000::/home/user0:/bin/bash",
+               output_lines[0].c_str());
+  EXPECT_STREQ("user49999:50999:1000::/home/user49999:/bin/bash",
+               output_lines[49999].c_str());
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, GetDaemonOutputKeepAliveLargeResponse) {
+  std::string response = "200";
+  for (int i = 0; i < 50000; i++) {
+    std::stringstream line;
+    line << "\ngroup" << i << ":" << 1000 + i << ":";
+    response += line.str();
+  }
+  Exchanges exchanges;
+  exchanges.push_back(std::make_pair("groups\n", response));
+  exchanges.push_back(std::make_pair("group_by_gid 1000\n",
+                                     "200\ngroup0:1000:"));
+  StartServer(KeepAliveServerThreadMain, &exchanges);
+  WaitForServerToListen();
+  SetKeepAliveEnabled(true);
+  std::vector<std::string> output_lines;
+  GetDaemonOutput("groups", utils::kMultiLine, &output_lines);
+  ASSERT_EQ(50000, output_lines.size());
+  EXPECT_STREQ("group0:1000:", output_lines[0].c_str());
+  EXPECT_STREQ("group49999:50999:", output_lines[49999].c_str());
+  // The frame was read exactly, so the next response is intact.
+  output_lines.clear();
+  GetDaemonOutput("group_by_gid 1000", utils::kSingleLine, &output_lines);
+  ASSERT_EQ(1, output_lines.size());
+  EXPECT_STREQ("group0:1000:", output_lines[0].c_str());
+  ShutdownServer();
+}
+
 TEST_F(LibnssGoogleTest, EntityListNormalCase) {
   std::string command = "get_users\n";
   std::string response = "200\n"
       "user2:x:1002:1001::/home/user2:/bin/bash\n"
       "user1:x:1001:1001::/home/user1:/bin/bash";
   RequestResponse rr(command, response);
-  pthread_t thread;
-  pthread_create(&thread, NULL, ServerThreadMain, &rr);
+  StartServer(ServerThreadMain, &rr);
   WaitForServerToListen();
   EntityList list;
   list.Load(command);
@@ -446,8 +950,7 @@ TEST_F(LibnssGoogleTest, EntityListClear) {
       "user2:x:1002:1001::/home/user2:/bin/bash\n"
       "user1:x:1001:1001::/home/user1:/bin/bash";
   RequestResponse rr(command, response);
-  pthread_t thread;
-  pthread_create(&thread, NULL, ServerThreadMain, &rr);
+  StartServer(ServerThreadMain, &rr);
   WaitForServerToListen();
   EntityList list;
   list.Load(command);
@@ -458,28 +961,687 @@ TEST_F(LibnssGoogleTest, EntityListClear) {
   ShutdownServer();
 }
 
-TEST_F(LibnssGoogleTest, UserLineToPasswdStructNormalCase) {
-  std::string value = "jsmith:1001:1000:Joe Smith,Room 1007,(234)555-8910,"
-      "(234)555-0044,email:/home/jsmith:/bin/sh";
-  passwd result;
-  char buffer[128];
-  BufferManager buf(buffer, sizeof(buffer));
-  UserLineToPasswdStruct(value, &result, &buf);
-  EXPECT_STREQ("jsmith", result.pw_name);
-  EXPECT_STREQ("x", result.pw_passwd);
-  EXPECT_EQ(1001, result.pw_uid);
-  EXPECT_EQ(1000, result.pw_gid);
-  EXPECT_STREQ("Joe Smith,Room 1007,(234)555-8910,(234)555-0044,email",
-               result.pw_gecos);
-  EXPECT_STREQ("/home/jsmith", result.pw_dir);
-  EXPECT_STREQ("/bin/sh", result.pw_shell);
-}
-
-TEST_F(LibnssGoogleTest, UserLineToPasswdStructInvalid) {
-  std::string value = "jsmith:1001:1000";
-  passwd result;
-  char buffer[128];
-  BufferManager buf(buffer, sizeof(buffer));
+TEST_F(LibnssGoogleTest, EntityListEmpty) {
+  std::string command = "get_users\n";
+  std::string response = "200";
+  RequestResponse rr(command, response);
+  StartServer(ServerThreadMain, &rr);
+  WaitForServerToListen();
+  EntityList list;
+  list.Load(command);
+  ASSERT_THROW(list.Pop(), std::out_of_range);
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, EntityListTrailingNewline) {
+  std::string command = "get_names\n";
+  std::string response = "200\nuser1\n";
+  RequestResponse rr(command, response);
+  StartServer(ServerThreadMain, &rr);
+  WaitForServerToListen();
+  EntityList list;
+  list.Load(command);
+  EXPECT_STREQ("user1", list.Pop().c_str());
+  EXPECT_STREQ("", list.Pop().c_str());
+  ASSERT_THROW(list.Pop(), std::out_of_range);
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, EntityListParsesInPlace) {
+  std::string command = "get_groups\n";
+  std::string response = "200\n"
+      "sudoers:1002:user1,user2\n"
+      "admins:1003:";
+  RequestResponse rr(command, response);
+  StartServer(ServerThreadMain, &rr);
+  WaitForServerToListen();
+  EntityList list;
+  list.Load(command);
+  group result;
+  char small_buffer[8];
+  BufferManager small_buf(small_buffer, sizeof(small_buffer));
+  ASSERT_THROW(list.Pop(&result, &small_buf), std::length_error);
+  // The element that did not fit is returned again.
+  char buffer[128];
+  BufferManager buf(buffer, sizeof(buffer));
+  list.Pop(&result, &buf);
+  EXPECT_STREQ("sudoers", result.gr_name);
+  EXPECT_STREQ("user2", result.gr_mem[1]);
+  list.Pop(&result, &buf);
+  EXPECT_STREQ("admins", result.gr_name);
+  ASSERT_THROW(list.Pop(&result, &buf), std::out_of_range);
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, EntityListStreamNormalCase) {
+  std::string command = "stream groups\n";
+  std::string response = "200\n"
+      "sudoers:1002:user1,user2\n"
+      "admins:1003:\n"
+      "\n";
+  RequestResponse rr(command, response);
+  StartServer(ServerThreadMain, &rr);
+  WaitForServerToListen();
+  SetStreamingEnabled(true);
+  EntityList list;
+  list.Load("groups\n");
+  group result;
+  char small_buffer[8];
+  BufferManager small_buf(small_buffer, sizeof(small_buffer));
+  ASSERT_THROW(list.Pop(&result, &small_buf), std::length_error);
+  char buffer[128];
+  BufferManager buf(buffer, sizeof(buffer));
+  list.Pop(&result, &buf);
+  EXPECT_STREQ("sudoers", result.gr_name);
+  EXPECT_STREQ("user2", result.gr_mem[1]);
+  EXPECT_STREQ("admins:1003:", list.Pop().c_str());
+  ASSERT_THROW(list.Pop(), std::out_of_range);
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, EntityListStreamTruncated) {
+  std::string command = "stream users\n";
+  std::string response = "200\n"
+      "user1:x:1001:1001::/home/user1:/bin/bash\n"
+      "user2:x:1002:1001::/home/";
+  RequestResponse rr(command, response);
+  StartServer(ServerThreadMain, &rr);
+  WaitForServerToListen();
+  SetStreamingEnabled(true);
+  EntityList list;
+  list.Load("users\n");
+  EXPECT_STREQ("user1:x:1001:1001::/home/user1:/bin/bash",
+               list.Pop().c_str());
+  ASSERT_THROW(list.Pop(), std::runtime_error);
+  ASSERT_THROW(list.Pop(), std::out_of_range);
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, EntityListStreamError) {
+  std::string command = "stream users\n";
+  std::string response = "500";
+  RequestResponse rr(command, response);
+  StartServer(ServerThreadMain, &rr);
+  WaitForServerToListen();
+  SetStreamingEnabled(true);
+  EntityList list;
+  ASSERT_THROW(list.Load("users\n"), std::runtime_error);
+  ASSERT_THROW(list.Pop(), std::out_of_range);
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, EntityListStreamFallsBackToOneShot) {
+  std::string command = "users\n";
+  std::string response = "200\nuser1:x:1001:1001::/home/user1:/bin/bash";
+  RequestResponse rr(command, response);
+  StartServer(NoStreamServerThreadMain, &rr);
+  WaitForServerToListen();
+  SetStreamingEnabled(true);
+  EntityList list;
+  list.Load(command);
+  EXPECT_STREQ("user1:x:1001:1001::/home/user1:/bin/bash",
+               list.Pop().c_str());
+  ASSERT_THROW(list.Pop(), std::out_of_range);
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, EntityListPagesNormalCase) {
+  Exchanges exchanges;
+  exchanges.push_back(std::make_pair("page users 2\n", "200\n"
+      "user1:x:1001:1001::/home/user1:/bin/bash\n"
+      "user2:x:1002:1001::/home/user2:/bin/bash"));
+  exchanges.push_back(std::make_pair("page users 2 user2\n", "200\n"
+      "user3:1003:1001::/home/user3:/bin/bash"));
+  StartServer(KeepAliveServerThreadMain, &exchanges);
+  WaitForServerToListen();
+  SetKeepAliveEnabled(true);
+  SetPageSize(2);
+  EntityList list;
+  list.Load("users\n");
+  EXPECT_STREQ("user1:x:1001:1001::/home/user1:/bin/bash",
+               list.Pop().c_str());
+  EXPECT_STREQ("user2:x:1002:1001::/home/user2:/bin/bash",
+               list.Pop().c_str());
+  passwd result;
+  char buffer[128];
+  BufferManager buf(buffer, sizeof(buffer));
+  list.Pop(&result, &buf);
+  EXPECT_STREQ("user3", result.pw_name);
+  ASSERT_THROW(list.Pop(), std::out_of_range);
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, EntityListPagesEndWithEmptyPage) {
+  Exchanges exchanges;
+  exchanges.push_back(std::make_pair("page groups 2\n", "200\n"
+      "admins:1003:\n"
+      "sudoers:1002:user1,user2"));
+  exchanges.push_back(std::make_pair("page groups 2 sudoers\n", "200"));
+  StartServer(KeepAliveServerThreadMain, &exchanges);
+  WaitForServerToListen();
+  SetKeepAliveEnabled(true);
+  SetPageSize(2);
+  EntityList list;
+  list.Load("groups\n");
+  EXPECT_STREQ("admins:1003:", list.Pop().c_str());
+  EXPECT_STREQ("sudoers:1002:user1,user2", list.Pop().c_str());
+  ASSERT_THROW(list.Pop(), std::out_of_range);
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, EntityListPageError) {
+  Exchanges exchanges;
+  exchanges.push_back(std::make_pair("page users 1\n", "200\n"
+      "user1:x:1001:1001::/home/user1:/bin/bash"));
+  exchanges.push_back(std::make_pair("page users 1 user1\n", "500"));
+  StartServer(KeepAliveServerThreadMain, &exchanges);
+  WaitForServerToListen();
+  SetKeepAliveEnabled(true);
+  SetPageSize(1);
+  EntityList list;
+  list.Load("users\n");
+  EXPECT_STREQ("user1:x:1001:1001::/home/user1:/bin/bash",
+               list.Pop().c_str());
+  ASSERT_THROW(list.Pop(), std::runtime_error);
+  ASSERT_THROW(list.Pop(), std::out_of_range);
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, EntityListFirstPageError) {
+  Exchanges exchanges;
+  exchanges.push_back(std::make_pair("page users 2\n", "500"));
+  exchanges.push_back(std::make_pair("page users 2\n", "200\n"
+      "user1:x:1001:1001::/home/user1:/bin/bash"));
+  StartServer(KeepAliveServerThreadMain, &exchanges);
+  WaitForServerToListen();
+  SetKeepAliveEnabled(true);
+  SetPageSize(2);
+  // A failed page fails the load without turning paging off.
+  EntityList list;
+  ASSERT_THROW(list.Load("users\n"), std::runtime_error);
+  list.Load("users\n");
+  EXPECT_STREQ("user1:x:1001:1001::/home/user1:/bin/bash",
+               list.Pop().c_str());
+  ASSERT_THROW(list.Pop(), std::out_of_range);
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, EntityListPagesFallBackToOneShot) {
+  std::string command = "users\n";
+  std::string response = "200\nuser1:x:1001:1001::/home/user1:/bin/bash";
+  RequestResponse rr(command, response);
+  StartServer(NoPageServerThreadMain, &rr);
+  WaitForServerToListen();
+  SetPageSize(2);
+  EntityList list;
+  list.Load(command);
+  EXPECT_STREQ("user1:x:1001:1001::/home/user1:/bin/bash",
+               list.Pop().c_str());
+  ASSERT_THROW(list.Pop(), std::out_of_range);
+  ShutdownServer();
+}
+
+// Loads an EntityList in a new thread and pops all of its elements.
+struct ThreadIteration {
+  explicit ThreadIteration(EntityList* list) : list(list), failed(false) {}
+
+  static void* Main(void* data) {
+    ThreadIteration* iteration = static_cast<ThreadIteration*>(data);
+    try {
+      iteration->list->Load("users\n");
+      while (true) {
+        iteration->lines.push_back(iteration->list->Pop());
+      }
+    } catch (const std::out_of_range&) {
+    } catch (const std::exception&) {
+      iteration->failed = true;
+    }
+    return NULL;
+  }
+
+  void Run() {
+    pthread_t thread;
+    pthread_create(&thread, NULL, Main, this);
+    pthread_join(thread, NULL);
+  }
+
+  EntityList* list;
+  std::vector<std::string> lines;
+  bool failed;
+};
+
+TEST_F(LibnssGoogleTest, EntityListThreadsShareResponse) {
+  std::string command = "users\n";
+  std::string response = "200\nuser1\nuser2";
+  RequestResponse rr(command, response);
+  StartServer(ServerThreadMain, &rr);
+  WaitForServerToListen();
+  EntityList list(60);
+  list.Load(command);
+  EXPECT_EQ("user1", list.Pop());
+  // Another thread iterates over the response without loading it again or
+  // moving this thread's position.
+  ThreadIteration other(&list);
+  other.Run();
+  EXPECT_FALSE(other.failed);
+  ASSERT_EQ(2, other.lines.size());
+  EXPECT_EQ("user1", other.lines[0]);
+  EXPECT_EQ("user2", other.lines[1]);
+  EXPECT_EQ("user2", list.Pop());
+  ASSERT_THROW(list.Pop(), std::out_of_range);
+  // Clearing the list of this thread keeps the response for reuse.
+  list.Clear();
+  list.Load(command);
+  EXPECT_EQ("user1", list.Pop());
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, EntityListThreadsShareStream) {
+  std::string command = "stream users\n";
+  std::string response = "200\nuser1\nuser2\n\n";
+  RequestResponse rr(command, response);
+  StartServer(ServerThreadMain, &rr);
+  WaitForServerToListen();
+  SetStreamingEnabled(true);
+  EntityList list(60);
+  list.Load("users\n");
+  EXPECT_EQ("user1", list.Pop());
+  ThreadIteration other(&list);
+  other.Run();
+  EXPECT_FALSE(other.failed);
+  ASSERT_EQ(2, other.lines.size());
+  EXPECT_EQ("user2", other.lines[1]);
+  EXPECT_EQ("user2", list.Pop());
+  ASSERT_THROW(list.Pop(), std::out_of_range);
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, EntityListThreadsLoadIndependently) {
+  std::string command = "users\n";
+  std::string response = "200\nuser1\nuser2";
+  RequestResponse rr(command, response);
+  StartServer(ServerThreadMain, &rr);
+  WaitForServerToListen();
+  EntityList list;
+  list.Load(command);
+  // Without reuse, another thread loads its own response, and failing to do
+  // so leaves this thread's iteration intact.
+  ThreadIteration other(&list);
+  other.Run();
+  EXPECT_TRUE(other.failed);
+  EXPECT_EQ("user1", list.Pop());
+  EXPECT_EQ("user2", list.Pop());
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, GetBatchDaemonOutputNormalCase) {
+  std::string command = "batch user_by_uid 1001 1003 1002\n";
+  std::string response = "200\n"
+      "user1:1001:1001::/home/user1:/bin/bash\n"
+      "\n"
+      "user2:1002:1001::/home/user2:/bin/bash";
+  RequestResponse rr(command, response);
+  StartServer(ServerThreadMain, &rr);
+  WaitForServerToListen();
+  std::vector<std::string> keys;
+  keys.push_back("1001");
+  keys.push_back("1003");
+  keys.push_back("1002");
+  LookupCache cache(16, 60, 60);
+  std::vector<std::string> output_lines;
+  GetBatchDaemonOutput("user_by_uid", keys, &output_lines, &cache);
+  ASSERT_EQ(3, output_lines.size());
+  EXPECT_STREQ("user1:1001:1001::/home/user1:/bin/bash",
+               output_lines[0].c_str());
+  EXPECT_STREQ("", output_lines[1].c_str());
+  EXPECT_STREQ("user2:1002:1001::/home/user2:/bin/bash",
+               output_lines[2].c_str());
+  ShutdownServer();
+  // The lookups are answered by the cache without the daemon.
+  EXPECT_STREQ("user2:1002:1001::/home/user2:/bin/bash",
+               GetCachedDaemonLine("user_by_uid 1002", utils::kSingleLine,
+                                   &cache).c_str());
+  ASSERT_THROW(GetCachedDaemonLine("user_by_uid 1003", utils::kSingleLine,
+                                   &cache),
+               std::invalid_argument);
+}
+
+TEST_F(LibnssGoogleTest, GetBatchDaemonOutputSplitsRequests) {
+  std::vector<std::string> keys(4000, "1003");
+  // The largest request under 16 KiB holds 3273 keys.
+  std::string first = "batch user_by_uid";
+  for (size_t i = 0; i < 3273; i++) {
+    first.append(" 1003");
+  }
+  std::string second = "batch user_by_uid";
+  for (size_t i = 3273; i < keys.size(); i++) {
+    second.append(" 1003");
+  }
+  Exchanges exchanges;
+  exchanges.push_back(std::make_pair(first + "\n",
+                                     "200" + std::string(3273, '\n')));
+  exchanges.push_back(std::make_pair(second + "\n",
+                                     "200" + std::string(727, '\n')));
+  StartServer(KeepAliveServerThreadMain, &exchanges);
+  WaitForServerToListen();
+  SetKeepAliveEnabled(true);
+  std::vector<std::string> output_lines;
+  GetBatchDaemonOutput("user_by_uid", keys, &output_lines, NULL);
+  ASSERT_EQ(keys.size(), output_lines.size());
+  EXPECT_STREQ("", output_lines.back().c_str());
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, GetBatchDaemonOutputWrongLineCount) {
+  std::string command = "batch group_by_gid 1001 1002\n";
+  std::string response = "200\ngroup1:1001:";
+  RequestResponse rr(command, response);
+  StartServer(ServerThreadMain, &rr);
+  WaitForServerToListen();
+  std::vector<std::string> keys;
+  keys.push_back("1001");
+  keys.push_back("1002");
+  std::vector<std::string> output_lines;
+  ASSERT_THROW(GetBatchDaemonOutput("group_by_gid", keys, &output_lines, NULL),
+               std::runtime_error);
+  EXPECT_EQ(0, output_lines.size());
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, GetBatchDaemonOutputInvalidKey) {
+  std::vector<std::string> keys;
+  keys.push_back("user1 user2");
+  std::vector<std::string> output_lines;
+  ASSERT_THROW(GetBatchDaemonOutput("user_by_name", keys, &output_lines, NULL),
+               std::runtime_error);
+  keys[0] = "";
+  ASSERT_THROW(GetBatchDaemonOutput("user_by_name", keys, &output_lines, NULL),
+               std::runtime_error);
+}
+
+TEST_F(LibnssGoogleTest, LookupPipelineNormalCase) {
+  Exchanges exchanges;
+  exchanges.push_back(std::make_pair(
+      "user_by_name user1\n", "200\nuser1:1001:1001::/home/user1:/bin/bash"));
+  exchanges.push_back(std::make_pair("user_by_name user2\n", "404"));
+  exchanges.push_back(std::make_pair("group_by_gid 1001\n", "500"));
+  exchanges.push_back(std::make_pair("group_by_gid 1002\n",
+                                     "200\ngroup2:1002:user1"));
+  StartServer(PipelineServerThreadMain, &exchanges);
+  WaitForServerToListen();
+  SetPipeliningEnabled(true);
+  LookupPipeline pipeline;
+  EXPECT_EQ(0, pipeline.Submit("user_by_name user1"));
+  EXPECT_EQ(1, pipeline.Submit("user_by_name user2\n"));
+  EXPECT_EQ(2, pipeline.Submit("group_by_gid 1001"));
+  EXPECT_EQ(3, pipeline.Submit("group_by_gid 1002"));
+  ASSERT_THROW(pipeline.Get(0), std::runtime_error);
+  pipeline.Collect();
+  EXPECT_STREQ("user1:1001:1001::/home/user1:/bin/bash",
+               pipeline.Get(0).c_str());
+  ASSERT_THROW(pipeline.Get(1), std::invalid_argument);
+  ASSERT_THROW(pipeline.Get(2), std::runtime_error);
+  EXPECT_STREQ("group2:1002:user1", pipeline.Get(3).c_str());
+  ASSERT_THROW(pipeline.Get(4), std::runtime_error);
+  // Collected commands are not sent again.
+  pipeline.Collect();
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, LookupPipelineFallsBackToOneShot) {
+  std::string command = "user_by_uid 1001";
+  std::string response = "200\nuser1:1001:1001::/home/user1:/bin/bash";
+  RequestResponse rr(command, response);
+  StartServer(NoPipelineServerThreadMain, &rr);
+  WaitForServerToListen();
+  SetPipeliningEnabled(true);
+  LookupPipeline pipeline;
+  pipeline.Submit(command);
+  pipeline.Collect();
+  EXPECT_STREQ("user1:1001:1001::/home/user1:/bin/bash",
+               pipeline.Get(0).c_str());
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, LookupPipelineInvalidCommand) {
+  LookupPipeline pipeline;
+  ASSERT_THROW(pipeline.Submit(""), std::runtime_error);
+  ASSERT_THROW(pipeline.Submit("\n"), std::runtime_error);
+  ASSERT_THROW(pipeline.Submit("users\ngroups"), std::runtime_error);
+  EXPECT_EQ(0, pipeline.size());
+}
+
+TEST_F(LibnssGoogleTest, LookupCacheNormalCase) {
+  LookupCache cache(16, 60, 60);
+  std::string line;
+  EXPECT_EQ(LookupCache::kMiss, cache.Get("user_by_uid 1001", &line));
+  cache.Put("user_by_uid 1001", "user1:1001:1001::/home/user1:/bin/bash");
+  cache.PutNotFound("user_by_uid 1003");
+  ASSERT_EQ(LookupCache::kFound, cache.Get("user_by_uid 1001", &line));
+  EXPECT_STREQ("user1:1001:1001::/home/user1:/bin/bash", line.c_str());
+  EXPECT_EQ(LookupCache::kNotFound, cache.Get("user_by_uid 1003", &line));
+  EXPECT_EQ(LookupCache::kMiss, cache.Get("user_by_uid 1002", &line));
+  cache.Clear();
+  EXPECT_EQ(LookupCache::kMiss, cache.Get("user_by_uid 1001", &line));
+  EXPECT_EQ(LookupCache::kMiss, cache.Get("user_by_uid 1003", &line));
+}
+
+TEST_F(LibnssGoogleTest, LookupCacheEvictsCollidingEntries) {
+  LookupCache cache(1, 60, 60);
+  std::string line;
+  cache.Put("user_by_uid 1001", "user1:1001:1001::/home/user1:/bin/bash");
+  cache.Put("user_by_uid 1002", "user2:1002:1001::/home/user2:/bin/bash");
+  EXPECT_EQ(LookupCache::kMiss, cache.Get("user_by_uid 1001", &line));
+  ASSERT_EQ(LookupCache::kFound, cache.Get("user_by_uid 1002", &line));
+  EXPECT_STREQ("user2:1002:1001::/home/user2:/bin/bash", line.c_str());
+}
+
+TEST_F(LibnssGoogleTest, LookupCacheDisabled) {
+  LookupCache cache(16, 0, 0);
+  std::string line;
+  cache.Put("user_by_uid 1001", "user1:1001:1001::/home/user1:/bin/bash");
+  cache.PutNotFound("user_by_uid 1003");
+  EXPECT_EQ(LookupCache::kMiss, cache.Get("user_by_uid 1001", &line));
+  EXPECT_EQ(LookupCache::kMiss, cache.Get("user_by_uid 1003", &line));
+  LookupCache empty(0, 60, 60);
+  empty.Put("user_by_uid 1001", "user1:1001:1001::/home/user1:/bin/bash");
+  EXPECT_EQ(LookupCache::kMiss, empty.Get("user_by_uid 1001", &line));
+}
+
+uint64_t g_test_generation = 0;
+
+uint64_t TestGeneration() {
+  return g_test_generation;
+}
+
+TEST_F(LibnssGoogleTest, LookupCacheVersioned) {
+  g_test_generation = 7;
+  LookupCache cache(16, 60, 60, TestGeneration);
+  EXPECT_EQ(7, cache.Generation());
+  std::string line;
+  cache.Put("user_by_uid 1001", "user1:1001:1001::/home/user1:/bin/bash");
+  cache.PutNotFound("user_by_uid 1003");
+  // Lookups fetched before the generation changed are not current.
+  cache.Put("user_by_uid 1002", "user2:1002:1001::/home/user2:/bin/bash", 6);
+  ASSERT_EQ(LookupCache::kFound, cache.Get("user_by_uid 1001", &line));
+  EXPECT_EQ(LookupCache::kNotFound, cache.Get("user_by_uid 1003", &line));
+  EXPECT_EQ(LookupCache::kMiss, cache.Get("user_by_uid 1002", &line));
+  g_test_generation = 8;
+  EXPECT_EQ(LookupCache::kMiss, cache.Get("user_by_uid 1001", &line));
+  EXPECT_EQ(LookupCache::kMiss, cache.Get("user_by_uid 1003", &line));
+  EXPECT_EQ(0, LookupCache(16, 60, 60).Generation());
+}
+
+TEST_F(LibnssGoogleTest, LookupCacheVersionedOutlivesTtl) {
+  g_test_generation = 7;
+  LookupCache cache(16, 1, 1, TestGeneration);
+  std::string line;
+  cache.Put("user_by_uid 1001", "user1:1001:1001::/home/user1:/bin/bash");
+  cache.PutNotFound("user_by_uid 1003");
+  sleep(2);
+  // Only names that were not found expire.
+  ASSERT_EQ(LookupCache::kFound, cache.Get("user_by_uid 1001", &line));
+  EXPECT_STREQ("user1:1001:1001::/home/user1:/bin/bash", line.c_str());
+  EXPECT_EQ(LookupCache::kMiss, cache.Get("user_by_uid 1003", &line));
+  // Without a generation, entries expire after the ttl again.
+  g_test_generation = 0;
+  cache.Put("user_by_uid 1001", "user1:1001:1001::/home/user1:/bin/bash");
+  sleep(2);
+  EXPECT_EQ(LookupCache::kMiss, cache.Get("user_by_uid 1001", &line));
+}
+
+TEST_F(LibnssGoogleTest, GetCachedDaemonLineCachesResponse) {
+  std::string command = "user_by_uid 1001";
+  std::string response = "200\nuser1:1001:1001::/home/user1:/bin/bash";
+  RequestResponse rr(command, response);
+  StartServer(ServerThreadMain, &rr);
+  WaitForServerToListen();
+  LookupCache cache(16, 60, 60);
+  EXPECT_STREQ("user1:1001:1001::/home/user1:/bin/bash",
+               GetCachedDaemonLine(command, utils::kSingleLine,
+                                   &cache).c_str());
+  ShutdownServer();
+  // The server accepts only one connection, so the response must come from
+  // the cache.
+  EXPECT_STREQ("user1:1001:1001::/home/user1:/bin/bash",
+               GetCachedDaemonLine(command, utils::kSingleLine,
+                                   &cache).c_str());
+}
+
+TEST_F(LibnssGoogleTest, GetCachedDaemonLineCachesNotFound) {
+  std::string command = "user_by_uid 1003";
+  std::string response = "404";
+  RequestResponse rr(command, response);
+  StartServer(ServerThreadMain, &rr);
+  WaitForServerToListen();
+  LookupCache cache(16, 60, 60);
+  ASSERT_THROW(GetCachedDaemonLine(command, utils::kSingleLine, &cache),
+               std::invalid_argument);
+  ShutdownServer();
+  ASSERT_THROW(GetCachedDaemonLine(command, utils::kSingleLine, &cache),
+               std::invalid_argument);
+}
+
+TEST_F(LibnssGoogleTest, GetCachedDaemonLineRejectsMultipleLines) {
+  std::string command = "user_by_uid 1001";
+  std::string response = "200\nuser1:1001:1001::/home/user1:/bin/bash\n";
+  RequestResponse rr(command, response);
+  StartServer(ServerThreadMain, &rr);
+  WaitForServerToListen();
+  LookupCache cache(16, 60, 60);
+  ASSERT_THROW(GetCachedDaemonLine(command, utils::kSingleLine, &cache),
+               std::runtime_error);
+  ShutdownServer();
+}
+
+TEST_F(LibnssGoogleTest, UserLineToPasswdStructNormalCase) {
+  std::string value = "jsmith:1001:1000:Joe Smith,Room 1007,(234)555-8910,"
+      "(234)555-0044,email:/home/jsmith:/bin/sh";
+  passwd result;
+  char buffer[128];
+  BufferManager buf(buffer, sizeof(buffer));
+  UserLineToPasswdStruct(value, &result, &buf);
+  EXPECT_STREQ("jsmith", result.pw_name);
+  EXPECT_STREQ("x", result.pw_passwd);
+  EXPECT_EQ(1001, result.pw_uid);
+  EXPECT_EQ(1000, result.pw_gid);
+  EXPECT_STREQ("Joe Smith,Room 1007,(234)555-8910,(234)555-0044,email",
+               result.pw_gecos);
+  EXPECT_STREQ("/home/jsmith", result.pw_dir);
+  EXPECT_STREQ("/bin/sh", result.pw_shell);
+}
+
+TEST_F(LibnssGoogleTest, UserLineToPasswdStructInPlace) {
+  // Only the first line is parsed.
+  std::string value = "jsmith:1001:1000::/home/jsmith:/bin/sh\nuser2:1002";
+  passwd result;
+  char buffer[128];
+  BufferManager buf(buffer, sizeof(buffer));
+  UserLineToPasswdStruct(value.data(), value.find('\n'), &result, &buf);
+  EXPECT_STREQ("jsmith", result.pw_name);
+  EXPECT_STREQ("x", result.pw_passwd);
+  EXPECT_EQ(1001, result.pw_uid);
+  EXPECT_EQ(1000, result.pw_gid);
+  EXPECT_STREQ("", result.pw_gecos);
+  EXPECT_STREQ("/home/jsmith", result.pw_dir);
+  EXPECT_STREQ("/bin/sh", result.pw_shell);
+}
+
+TEST_F(LibnssGoogleTest, UserLineToPasswdStructBufferTooSmall) {
+  std::string value = "jsmith:1001:1000::/home/jsmith:/bin/sh";
+  passwd result;
+  char buffer[16];
+  BufferManager buf(buffer, sizeof(buffer));
+  ASSERT_THROW(UserLineToPasswdStruct(value, &result, &buf),
+               std::length_error);
+}
+
+TEST_F(LibnssGoogleTest, UserLineToPasswdStructExactSize) {
+  std::string value = "jsmith:1001:1000::/home/jsmith:/bin/sh";
+  std::string binary = std::string(1, '\0') + BinaryUint32(1001) +
+      BinaryUint32(1000) + BinaryString("jsmith") + BinaryString("") +
+      BinaryString("/home/jsmith") + BinaryString("/bin/sh");
+  const size_t size = 31;
+  passwd result;
+  char buffer[size];
+  BufferManager small_buf(buffer, size - 1);
+  // Nothing is written to a buffer that is too small.
+  ASSERT_THROW(UserLineToPasswdStruct(value, &result, &small_buf),
+               std::length_error);
+  ASSERT_THROW(UserLineToPasswdStruct(binary, &result, &small_buf),
+               std::length_error);
+  EXPECT_EQ(buffer, small_buf.buffer());
+  BufferManager buf(buffer, size);
+  UserLineToPasswdStruct(value, &result, &buf);
+  EXPECT_EQ(0, buf.size());
+  BufferManager binary_buf(buffer, size);
+  UserLineToPasswdStruct(binary, &result, &binary_buf);
+  EXPECT_EQ(0, binary_buf.size());
+  EXPECT_STREQ("/bin/sh", result.pw_shell);
+}
+
+TEST_F(LibnssGoogleTest, UserLineToPasswdStructInvalid) {
+  std::string value = "jsmith:1001:1000";
+  passwd result;
+  char buffer[128];
+  BufferManager buf(buffer, sizeof(buffer));
+  ASSERT_THROW(UserLineToPasswdStruct(value, &result, &buf),
+               std::runtime_error);
+  value = "jsmith:1001:1000::/home/jsmith:/bin/sh:";
+  ASSERT_THROW(UserLineToPasswdStruct(value, &result, &buf),
+               std::runtime_error);
+  value = "jsmith:1001:x::/home/jsmith:/bin/sh";
+  ASSERT_THROW(UserLineToPasswdStruct(value, &result, &buf),
+               std::runtime_error);
+}
+
+TEST_F(LibnssGoogleTest, UserLineToPasswdStructBinaryRecord) {
+  std::string value = BinaryUserRecord(1001, 1000, "jsmith");
+  passwd result;
+  char buffer[128];
+  BufferManager buf(buffer, sizeof(buffer));
+  UserLineToPasswdStruct(value, &result, &buf);
+  EXPECT_STREQ("jsmith", result.pw_name);
+  EXPECT_STREQ("x", result.pw_passwd);
+  EXPECT_EQ(1001, result.pw_uid);
+  EXPECT_EQ(1000, result.pw_gid);
+  EXPECT_STREQ("a:b,c", result.pw_gecos);
+  EXPECT_STREQ("/home/jsmith", result.pw_dir);
+  EXPECT_STREQ("/bin/sh", result.pw_shell);
+}
+
+TEST_F(LibnssGoogleTest, UserLineToPasswdStructBinaryRecordInvalid) {
+  std::string value = BinaryUserRecord(1001, 1000, "jsmith");
+  passwd result;
+  char buffer[128];
+  BufferManager buf(buffer, sizeof(buffer));
+  ASSERT_THROW(UserLineToPasswdStruct(value.substr(0, value.size() - 1),
+                                      &result, &buf),
+               std::runtime_error);
+  ASSERT_THROW(UserLineToPasswdStruct(value + "x", &result, &buf),
+               std::runtime_error);
+  value = std::string(1, '\0') + BinaryUint32(1001) + BinaryUint32(1000) +
+      BinaryUint32(0xffffffff);
   ASSERT_THROW(UserLineToPasswdStruct(value, &result, &buf),
                std::runtime_error);
 }
@@ -511,6 +1673,20 @@ TEST_F(LibnssGoogleTest, GroupLineToGroupStructEmptyGroup) {
   EXPECT_EQ(NULL, result.gr_mem[0]);
 }
 
+TEST_F(LibnssGoogleTest, GroupLineToGroupStructInPlace) {
+  // Only the first line is parsed.
+  std::string value = "sudoers:1002:user1,user2\nadmins:1003:";
+  group result;
+  char buffer[128];
+  BufferManager buf(buffer, sizeof(buffer));
+  GroupLineToGroupStruct(value.data(), value.find('\n'), &result, &buf);
+  EXPECT_STREQ("sudoers", result.gr_name);
+  EXPECT_EQ(1002, result.gr_gid);
+  EXPECT_STREQ("user1", result.gr_mem[0]);
+  EXPECT_STREQ("user2", result.gr_mem[1]);
+  EXPECT_EQ(NULL, result.gr_mem[2]);
+}
+
 TEST_F(LibnssGoogleTest, GroupLineToGroupStructInvalid) {
   std::string value = "group:";
   group result;
@@ -520,6 +1696,97 @@ TEST_F(LibnssGoogleTest, GroupLineToGroupStructInvalid) {
                std::runtime_error);
 }
 
+TEST_F(LibnssGoogleTest, GroupLineToGroupStructBinaryRecord) {
+  std::string value = std::string(1, '\0') + BinaryUint32(1002) +
+      BinaryString("sudoers") + BinaryUint32(2) + BinaryString("user1") +
+      BinaryString("user,2");
+  group result;
+  char buffer[128];
+  BufferManager buf(buffer, sizeof(buffer));
+  GroupLineToGroupStruct(value, &result, &buf);
+  EXPECT_STREQ("sudoers", result.gr_name);
+  EXPECT_STREQ("x", result.gr_passwd);
+  EXPECT_EQ(1002, result.gr_gid);
+  EXPECT_STREQ("user1", result.gr_mem[0]);
+  EXPECT_STREQ("user,2", result.gr_mem[1]);
+  EXPECT_EQ(NULL, result.gr_mem[2]);
+}
+
+TEST_F(LibnssGoogleTest, GroupLineToGroupStructBinaryRecordInvalid) {
+  std::string value = std::string(1, '\0') + BinaryUint32(1002) +
+      BinaryString("sudoers") + BinaryUint32(0x20000000);
+  group result;
+  char buffer[128];
+  BufferManager buf(buffer, sizeof(buffer));
+  ASSERT_THROW(GroupLineToGroupStruct(value, &result, &buf),
+               std::runtime_error);
+  value = std::string(1, '\0') + BinaryUint32(1002) +
+      BinaryString("sudoers") + BinaryUint32(1) + BinaryString("user1") +
+      BinaryString("user2");
+  ASSERT_THROW(GroupLineToGroupStruct(value, &result, &buf),
+               std::runtime_error);
+}
+
+TEST_F(LibnssGoogleTest, GroupLineToGroupStructExactSize) {
+  std::string value = "sudoers:1002:user1,user2";
+  std::string binary = std::string(1, '\0') + BinaryUint32(1002) +
+      BinaryString("sudoers") + BinaryUint32(2) + BinaryString("user1") +
+      BinaryString("user2");
+  const size_t size = 22 + 3 * sizeof(char*);
+  group result;
+  char buffer[size];
+  BufferManager small_buf(buffer, size - 1);
+  // Nothing is written to a buffer that is too small.
+  ASSERT_THROW(GroupLineToGroupStruct(value, &result, &small_buf),
+               std::length_error);
+  ASSERT_THROW(GroupLineToGroupStruct(binary, &result, &small_buf),
+               std::length_error);
+  EXPECT_EQ(buffer, small_buf.buffer());
+  BufferManager buf(buffer, size);
+  GroupLineToGroupStruct(value, &result, &buf);
+  EXPECT_EQ(0, buf.size());
+  BufferManager binary_buf(buffer, size);
+  GroupLineToGroupStruct(binary, &result, &binary_buf);
+  EXPECT_EQ(0, binary_buf.size());
+  EXPECT_STREQ("user2", result.gr_mem[1]);
+}
+
+// Takes the line kept for command in a new thread.
+void* TakeLineForRetryThreadMain(void* data) {
+  std::string line;
+  *static_cast<bool*>(data) = TakeLineForRetry("group_by_gid 1002", &line);
+  return NULL;
+}
+
+TEST_F(LibnssGoogleTest, LineForRetry) {
+  std::string line;
+  EXPECT_FALSE(TakeLineForRetry("group_by_gid 1002", &line));
+  KeepLineForRetry("group_by_gid 1002", "sudoers:1002:user1,user2");
+  // Lines are kept for their thread only.
+  pthread_t thread;
+  bool taken = true;
+  pthread_create(&thread, NULL, TakeLineForRetryThreadMain, &taken);
+  pthread_join(thread, NULL);
+  EXPECT_FALSE(taken);
+  ASSERT_TRUE(TakeLineForRetry("group_by_gid 1002", &line));
+  EXPECT_EQ("sudoers:1002:user1,user2", line);
+  // A kept line answers a single retry of its command only.
+  EXPECT_FALSE(TakeLineForRetry("group_by_gid 1002", &line));
+  KeepLineForRetry("group_by_gid 1002", "sudoers:1002:user1,user2");
+  EXPECT_FALSE(TakeLineForRetry("group_by_gid 1003", &line));
+  EXPECT_FALSE(TakeLineForRetry("group_by_gid 1002", &line));
+}
+
+TEST_F(LibnssGoogleTest, BufferManagerReserveVector) {
+  char buffer[32];
+  BufferManager buf(buffer, sizeof(buffer));
+  char** result = buf.ReserveVector(2);
+  EXPECT_EQ(NULL, result[2]);
+  EXPECT_EQ(buffer + 3 * sizeof(char*), buf.buffer());
+  ASSERT_THROW(buf.ReserveVector(static_cast<size_t>(-1) / sizeof(char*)),
+               std::length_error);
+}
+
 TEST_F(LibnssGoogleTest, AccountNameToShadowStructNormalCase) {
   std::string value = "jsmith";
   spwd result;
@@ -545,3 +1812,33 @@ TEST_F(LibnssGoogleTest, AccountNameToShadowStructInvalid) {
   ASSERT_THROW(AccountNameToShadowStruct(value, &result, &buf),
                std::runtime_error);
 }
+
+TEST_F(LibnssGoogleTest, AppendGroupGrowsArray) {
+  long int start = 1;  // NOLINT(runtime/int)
+  long int size = 1;  // NOLINT(runtime/int)
+  gid_t* groups = static_cast<gid_t*>(malloc(sizeof(gid_t)));
+  groups[0] = 1000;
+  ASSERT_TRUE(AppendGroup(1001, &start, &size, &groups, 0));
+  ASSERT_TRUE(AppendGroup(1000, &start, &size, &groups, 0));
+  ASSERT_TRUE(AppendGroup(1002, &start, &size, &groups, 0));
+  ASSERT_EQ(3, start);
+  EXPECT_LE(3, size);
+  EXPECT_EQ(1000, groups[0]);
+  EXPECT_EQ(1001, groups[1]);
+  EXPECT_EQ(1002, groups[2]);
+  free(groups);
+}
+
+TEST_F(LibnssGoogleTest, AppendGroupLimit) {
+  long int start = 0;  // NOLINT(runtime/int)
+  long int size = 1;  // NOLINT(runtime/int)
+  gid_t* groups = static_cast<gid_t*>(malloc(sizeof(gid_t)));
+  ASSERT_TRUE(AppendGroup(1000, &start, &size, &groups, 3));
+  ASSERT_TRUE(AppendGroup(1001, &start, &size, &groups, 3));
+  ASSERT_TRUE(AppendGroup(1002, &start, &size, &groups, 3));
+  ASSERT_FALSE(AppendGroup(1003, &start, &size, &groups, 3));
+  EXPECT_EQ(3, start);
+  EXPECT_EQ(3, size);
+  EXPECT_EQ(1002, groups[2]);
+  free(groups);
+}
@@ -28,6 +28,7 @@ Source1:	gcua-se-el6.pp
 
 %define relabel_files() \
 restorecon -R /usr/share/google/gcua; \
+restorecon -i /var/run/gcua.snapshot /var/run/gcua.generation /var/cache/gcua.cache; \
 
 %define _topdir %(pwd)
 %define WORKINGDIR %_topdir/selinux/el6
@@ -29,6 +29,7 @@ Source0:	gcua-se-el7.pp
 
 %define relabel_files() \
 restorecon -R /usr/share/google/gcua; \
+restorecon -i /var/run/gcua.snapshot /var/run/gcua.generation /var/cache/gcua.cache; \
 restorecon -R /etc/systemd/system/gcua.service; \
 
 %define selinux_policyver 3.13.1-23
@@ -108,6 +108,23 @@ func (c *Client) Groups() ([]*accounts.Group, error) {
 	return groups, nil
 }
 
+// GIDsForUser satisfies AccountProvider.
+func (c *Client) GIDsForUser(username string) ([]uint32, error) {
+	resp, err := send(fmt.Sprintf("gids_for_user %v", username), false)
+	if err != nil {
+		return nil, err
+	}
+	gids := make([]uint32, len(resp))
+	for i, l := range resp {
+		gid, err := strconv.ParseUint(l, 10, 32)
+		if err != nil {
+			return nil, err
+		}
+		gids[i] = uint32(gid)
+	}
+	return gids, nil
+}
+
 // Names satisfies AccountProvider.
 func (c *Client) Names() ([]string, error) {
 	return send("names", false)
@@ -0,0 +1,131 @@
+// Copyright 2015 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package server
+
+import (
+	"encoding/binary"
+	"os"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
+	"unsafe"
+
+	"github.com/GoogleCloudPlatform/compute-user-accounts/accounts"
+)
+
+// A generation page is a small file that the NSS plugin maps into memory to
+// check with a single load whether the lookups it cached are still current.
+// It is laid out as:
+//
+//	magic       "GCUAGENR"
+//	version     uint32, little-endian
+//	padding     uint32
+//	generation  uint64, in native byte order
+//
+// The generation is stored atomically in place, and only changes when users
+// or groups change. The page is never replaced once created, so that the
+// processes mapping it see every change, and its generation only increases,
+// including across restarts of the daemon.
+const (
+	generationMagic       = "GCUAGENR"
+	generationVersion     = 1
+	generationPageSize    = 24
+	generationValueOffset = 16
+)
+
+// generationTimeNow is mocked in tests.
+var generationTimeNow = time.Now
+
+// A GenerationWriter publishes the generation of accounts to a file.
+type GenerationWriter struct {
+	// Path is the file that the generation is written to. It should be on a
+	// memory backed file system.
+	Path string
+
+	mu sync.Mutex
+	// base is added to generations so that they increase across restarts.
+	base uint64
+	// writes numbers the generations of providers that are not versioned.
+	writes uint64
+	page   []byte
+}
+
+// Write publishes the generation of an AccountProvider. Providers that are
+// not an accounts.GenerationProvider get a new generation on every write.
+func (w *GenerationWriter) Write(provider accounts.AccountProvider) error {
+	w.mu.Lock()
+	defer w.mu.Unlock()
+	if w.page == nil {
+		if err := w.open(); err != nil {
+			return err
+		}
+	}
+	var generation uint64
+	if gp, ok := provider.(accounts.GenerationProvider); ok {
+		generation = gp.Generation()
+	} else {
+		w.writes++
+		generation = w.writes
+	}
+	value := (*uint64)(unsafe.Pointer(&w.page[generationValueOffset]))
+	next := w.base + generation
+	for {
+		current := atomic.LoadUint64(value)
+		if next <= current || atomic.CompareAndSwapUint64(value, current, next) {
+			return nil
+		}
+	}
+}
+
+// open maps the page, creating it if needed. The generation of an existing
+// page is left in place until it is replaced by a greater one, and base is
+// chosen above it so that a clock stepped back does not stall it.
+func (w *GenerationWriter) open() error {
+	f, err := os.OpenFile(w.Path, os.O_RDWR|os.O_CREATE, 0644)
+	if err != nil {
+		return err
+	}
+	defer f.Close()
+	// Make the page readable by all regardless of umask.
+	if err := f.Chmod(0644); err != nil {
+		return err
+	}
+	info, err := f.Stat()
+	if err != nil {
+		return err
+	}
+	if info.Size() != generationPageSize {
+		if err := f.Truncate(generationPageSize); err != nil {
+			return err
+		}
+	}
+	var header [generationValueOffset]byte
+	copy(header[:], generationMagic)
+	binary.LittleEndian.PutUint32(header[8:], generationVersion)
+	if _, err := f.WriteAt(header[:], 0); err != nil {
+		return err
+	}
+	page, err := syscall.Mmap(int(f.Fd()), 0, generationPageSize, syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	if err != nil {
+		return os.NewSyscallError("mmap", err)
+	}
+	w.page = page
+	w.base = uint64(generationTimeNow().UnixNano())
+	if current := atomic.LoadUint64((*uint64)(unsafe.Pointer(&page[generationValueOffset]))); w.base <= current {
+		w.base = current + 1
+	}
+	return nil
+}
@@ -0,0 +1,105 @@
+// Copyright 2015 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package server
+
+import (
+	"encoding/binary"
+	"io/ioutil"
+	"os"
+	"syscall"
+	"testing"
+	"time"
+
+	"github.com/GoogleCloudPlatform/compute-user-accounts/testbase"
+)
+
+// readGeneration reads the generation page at path.
+func readGeneration(t *testing.T, path string) uint64 {
+	data, err := ioutil.ReadFile(path)
+	if err != nil {
+		t.Fatalf("ReadFile(%v) = (_, %v); want (_, nil)", path, err)
+	}
+	if len(data) != generationPageSize || string(data[:8]) != generationMagic ||
+		binary.LittleEndian.Uint32(data[8:]) != generationVersion {
+		t.Fatalf("invalid generation page: %q", data)
+	}
+	// The test runs on a little-endian machine.
+	return binary.LittleEndian.Uint64(data[generationValueOffset:])
+}
+
+func TestGenerationWriter(t *testing.T) {
+	path := tempFile()
+	defer os.Remove(path)
+	defer func() { generationTimeNow = time.Now }()
+	generationTimeNow = func() time.Time { return time.Unix(0, 1000) }
+	w := &GenerationWriter{Path: path}
+	p := &versionedProvider{&testbase.MockProvider{}, 1}
+	if err := w.Write(p); err != nil {
+		t.Fatalf("Write() = %v; want nil", err)
+	}
+	if generation := readGeneration(t, path); generation != 1001 {
+		t.Errorf("generation = %v; want 1001", generation)
+	}
+	f, err := os.Open(path)
+	if err != nil {
+		t.Fatalf("Open() = (_, %v); want (_, nil)", err)
+	}
+	defer f.Close()
+	mapped, err := syscall.Mmap(int(f.Fd()), 0, generationPageSize, syscall.PROT_READ, syscall.MAP_SHARED)
+	if err != nil {
+		t.Fatalf("Mmap() = (_, %v); want (_, nil)", err)
+	}
+	defer syscall.Munmap(mapped)
+	// Changes are seen by processes that mapped the page.
+	p.generation = 3
+	if err := w.Write(p); err != nil {
+		t.Fatalf("Write() = %v; want nil", err)
+	}
+	if generation := binary.LittleEndian.Uint64(mapped[generationValueOffset:]); generation != 1003 {
+		t.Errorf("mapped generation = %v; want 1003", generation)
+	}
+	// A restarted daemon keeps the page and increases its generation.
+	generationTimeNow = func() time.Time { return time.Unix(0, 2000) }
+	restarted := &GenerationWriter{Path: path}
+	p.generation = 1
+	if err := restarted.Write(p); err != nil {
+		t.Fatalf("Write() = %v; want nil", err)
+	}
+	if generation := binary.LittleEndian.Uint64(mapped[generationValueOffset:]); generation != 2001 {
+		t.Errorf("mapped generation = %v; want 2001", generation)
+	}
+	// It also does if the clock was stepped back.
+	generationTimeNow = func() time.Time { return time.Unix(0, 500) }
+	stepped := &GenerationWriter{Path: path}
+	if err := stepped.Write(p); err != nil {
+		t.Fatalf("Write() = %v; want nil", err)
+	}
+	if generation := binary.LittleEndian.Uint64(mapped[generationValueOffset:]); generation != 2003 {
+		t.Errorf("mapped generation = %v; want 2003", generation)
+	}
+}
+
+func TestGenerationWriterUnversioned(t *testing.T) {
+	path := tempFile()
+	defer os.Remove(path)
+	w := &GenerationWriter{Path: path}
+	mock := &testbase.MockProvider{}
+	w.Write(mock)
+	first := readGeneration(t, path)
+	w.Write(mock)
+	if second := readGeneration(t, path); second != first+1 {
+		t.Errorf("generation = %v; want %v", second, first+1)
+	}
+}
@@ -0,0 +1,246 @@
+// Copyright 2015 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package server
+
+import (
+	"bytes"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+
+	"github.com/GoogleCloudPlatform/compute-user-accounts/accounts"
+)
+
+// A ResponseCache holds the responses to lookups and enumerations, serialized
+// once each time the accounts change, so that a Server can write them without
+// marshaling entities or querying its AccountProvider.
+type ResponseCache struct {
+	// updateMu is held while fetching data so that responses are replaced
+	// in the order their data was fetched.
+	updateMu sync.Mutex
+	// current holds the *cachedResponses that requests are answered from.
+	current atomic.Value
+}
+
+// cachedResponses are never modified once built.
+type cachedResponses struct {
+	// generation is that of the GenerationProvider the responses were
+	// built from, if versioned is set.
+	generation   uint64
+	versioned    bool
+	users        enumeration
+	groups       enumeration
+	names        enumeration
+	usersByName  map[string]lookup
+	usersByUID   map[uint32]lookup
+	groupsByName map[string]lookup
+	groupsByGID  map[uint32]lookup
+	// pages holds the lines of each enumeration command in order of name.
+	pages map[string][]pageEntry
+}
+
+// An enumeration holds the streamed response to an enumeration command. The
+// one-shot response is the same without the last two newline characters.
+type enumeration []byte
+
+func newEnumeration(lines []string) enumeration {
+	var buf bytes.Buffer
+	buf.WriteString("200")
+	for _, l := range lines {
+		buf.WriteString("\n")
+		buf.WriteString(l)
+	}
+	buf.WriteString("\n\n")
+	return buf.Bytes()
+}
+
+func (e enumeration) response() []byte {
+	return e[:len(e)-2]
+}
+
+// A lookup holds the response to a lookup in each encoding.
+type lookup struct {
+	text   []byte
+	binary []byte
+}
+
+func (l lookup) response(enc encoding) []byte {
+	if enc.binary {
+		return l.binary
+	}
+	return l.text
+}
+
+// Update replaces the cached responses with those for the users and groups of
+// an AccountProvider. Nothing is rebuilt if the provider is an
+// accounts.GenerationProvider whose generation did not change.
+func (c *ResponseCache) Update(provider accounts.AccountProvider) error {
+	c.updateMu.Lock()
+	defer c.updateMu.Unlock()
+	// The generation is read first so that it is never newer than the data.
+	gp, versioned := provider.(accounts.GenerationProvider)
+	var generation uint64
+	if versioned {
+		generation = gp.Generation()
+		if r := c.get(); r != nil && r.versioned && r.generation == generation {
+			return nil
+		}
+	}
+	users, err := provider.Users()
+	if err != nil {
+		return err
+	}
+	groups, err := provider.Groups()
+	if err != nil {
+		return err
+	}
+	names, err := provider.Names()
+	if err != nil {
+		return err
+	}
+	r := &cachedResponses{
+		generation:   generation,
+		versioned:    versioned,
+		usersByName:  make(map[string]lookup, len(users)),
+		usersByUID:   make(map[uint32]lookup, len(users)),
+		groupsByName: make(map[string]lookup, len(groups)),
+		groupsByGID:  make(map[uint32]lookup, len(groups)),
+		pages:        make(map[string][]pageEntry, 3),
+	}
+	lines := make([]string, len(users))
+	userPages := make([]pageEntry, len(users))
+	for i, u := range users {
+		lines[i] = marshalUser(u)
+		userPages[i] = pageEntry{u.Name, lines[i]}
+		l := lookup{[]byte("200\n" + lines[i]), []byte("200\n" + marshalBinaryUser(u))}
+		r.usersByName[u.Name] = l
+		r.usersByUID[u.UID] = l
+	}
+	r.users = newEnumeration(lines)
+	lines = make([]string, len(groups))
+	groupPages := make([]pageEntry, len(groups))
+	// Providers may share one membership list between groups with the same
+	// members, which is then joined once.
+	type memberList struct {
+		first *string
+		len   int
+	}
+	joined := make(map[memberList]string)
+	for i, g := range groups {
+		if len(g.Members) == 0 {
+			lines[i] = marshalGroup(g)
+		} else {
+			key := memberList{&g.Members[0], len(g.Members)}
+			members, ok := joined[key]
+			if !ok {
+				members = strings.Join(g.Members, ",")
+				joined[key] = members
+			}
+			lines[i] = marshalGroupWithMembers(g, members)
+		}
+		groupPages[i] = pageEntry{g.Name, lines[i]}
+		l := lookup{[]byte("200\n" + lines[i]), []byte("200\n" + marshalBinaryGroup(g))}
+		r.groupsByName[g.Name] = l
+		r.groupsByGID[g.GID] = l
+	}
+	r.groups = newEnumeration(lines)
+	r.names = newEnumeration(names)
+	namePages := make([]pageEntry, len(names))
+	for i, n := range names {
+		namePages[i] = pageEntry{n, n}
+	}
+	for cmd, entries := range map[string][]pageEntry{"users": userPages, "groups": groupPages, "names": namePages} {
+		sort.Sort(pageEntries(entries))
+		r.pages[cmd] = entries
+	}
+	c.current.Store(r)
+	return nil
+}
+
+func (c *ResponseCache) get() *cachedResponses {
+	if c == nil {
+		return nil
+	}
+	r, _ := c.current.Load().(*cachedResponses)
+	return r
+}
+
+// response returns the cached response to a request, or nil if there is none.
+// Requests for entities that are not cached are left to the AccountProvider,
+// which may refresh its accounts before answering them.
+func (c *ResponseCache) response(req string, enc encoding) []byte {
+	r := c.get()
+	if r == nil {
+		return nil
+	}
+	cmd, arg := req, ""
+	if i := strings.IndexByte(req, ' '); i >= 0 {
+		cmd, arg = req[:i], req[i+1:]
+	}
+	var l lookup
+	var ok bool
+	switch cmd {
+	case "users":
+		return r.users.response()
+	case "groups":
+		return r.groups.response()
+	case "names":
+		return r.names.response()
+	case "page":
+		cmd, count, after, err := parsePage(strings.Split(arg, " "))
+		entries, ok := r.pages[cmd]
+		if err != nil || !ok {
+			return nil
+		}
+		return []byte(marshalPage(entries, count, after))
+	case "user_by_name":
+		l, ok = r.usersByName[arg]
+	case "group_by_name":
+		l, ok = r.groupsByName[arg]
+	case "user_by_uid", "group_by_gid":
+		id, err := strconv.ParseUint(arg, 10, 32)
+		if err != nil {
+			return nil
+		} else if cmd == "user_by_uid" {
+			l, ok = r.usersByUID[uint32(id)]
+		} else {
+			l, ok = r.groupsByGID[uint32(id)]
+		}
+	}
+	if !ok {
+		return nil
+	}
+	return l.response(enc)
+}
+
+// stream returns the cached streamed response to an enumeration command, or
+// nil if there is none.
+func (c *ResponseCache) stream(cmd string) []byte {
+	r := c.get()
+	if r == nil {
+		return nil
+	}
+	switch cmd {
+	case "users":
+		return r.users
+	case "groups":
+		return r.groups
+	case "names":
+		return r.names
+	}
+	return nil
+}
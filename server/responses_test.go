@@ -0,0 +1,146 @@
+// Copyright 2015 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package server
+
+import (
+	"errors"
+	"io"
+	"io/ioutil"
+	"net"
+	"os"
+	"testing"
+	"time"
+
+	"github.com/GoogleCloudPlatform/compute-user-accounts/accounts"
+	"github.com/GoogleCloudPlatform/compute-user-accounts/testbase"
+)
+
+func TestResponseCacheMatchesProvider(t *testing.T) {
+	mock := &testbase.MockProvider{Usrs: testbase.ExpUsers, Grps: testbase.ExpGroups, Nams: testbase.ExpNames}
+	cache := &ResponseCache{}
+	if err := cache.Update(mock); err != nil {
+		t.Fatalf("Update() = %v; want nil", err)
+	}
+	server := &Server{Provider: mock}
+	requests := []string{
+		"users",
+		"groups",
+		"names",
+		"user_by_name user1",
+		"user_by_uid 1002",
+		"group_by_name group2",
+		"group_by_gid 1000",
+		"page users 1",
+		"page users 5 user1",
+		"page groups 1 group1",
+		"page names 2 group2",
+	}
+	for _, req := range requests {
+		for _, enc := range []encoding{textEncoding, binaryEncoding} {
+			want := server.respond(req, enc)
+			if resp := cache.response(req, enc); string(resp) != want {
+				t.Errorf("response(%q, binary=%v) = %q; want %q", req, enc.binary, resp, want)
+			}
+		}
+	}
+	// Misses are left to the provider.
+	for _, req := range []string{"user_by_name nil", "user_by_uid 1003", "user_by_uid 1001 1002", "group_by_gid x", "is_name user1", "keys user1", "page keys 1", "page users 0"} {
+		if resp := cache.response(req, textEncoding); resp != nil {
+			t.Errorf("response(%q) = %q; want nil", req, resp)
+		}
+	}
+	if resp := cache.stream("names"); string(resp) != "200\ngroup1\ngroup2\nuser1\nuser2\n\n" {
+		t.Errorf("stream(names) = %q; want %q", resp, "200\ngroup1\ngroup2\nuser1\nuser2\n\n")
+	}
+	if resp := cache.stream("keys"); resp != nil {
+		t.Errorf("stream(keys) = %q; want nil", resp)
+	}
+}
+
+func TestResponseCacheEmpty(t *testing.T) {
+	var nilCache *ResponseCache
+	for _, cache := range []*ResponseCache{nilCache, &ResponseCache{}} {
+		if resp := cache.response("users", textEncoding); resp != nil {
+			t.Errorf("response(users) = %q; want nil", resp)
+		}
+		if resp := cache.stream("users"); resp != nil {
+			t.Errorf("stream(users) = %q; want nil", resp)
+		}
+	}
+	cache := &ResponseCache{}
+	cache.Update(&testbase.MockProvider{})
+	if resp := cache.response("users", textEncoding); string(resp) != "200" {
+		t.Errorf("response(users) = %q; want %q", resp, "200")
+	}
+	if resp := cache.stream("users"); string(resp) != "200\n\n" {
+		t.Errorf("stream(users) = %q; want %q", resp, "200\n\n")
+	}
+	// A failed update keeps the previous responses.
+	if err := cache.Update(&testbase.MockProvider{Err: errors.New("error")}); err == nil {
+		t.Error("Update() = nil; want error")
+	}
+	if resp := cache.response("users", textEncoding); string(resp) != "200" {
+		t.Errorf("response(users) = %q; want %q", resp, "200")
+	}
+}
+
+func TestResponseCacheUnchangedGeneration(t *testing.T) {
+	provider := &versionedProvider{&testbase.MockProvider{Usrs: testbase.ExpUsers}, 1}
+	cache := &ResponseCache{}
+	cache.Update(provider)
+	provider.Usrs = nil
+	cache.Update(provider)
+	if resp := cache.response("user_by_uid 1001", textEncoding); resp == nil {
+		t.Errorf("response(user_by_uid 1001) = nil after unchanged generation; want cached user")
+	}
+	provider.generation++
+	cache.Update(provider)
+	if resp := cache.response("user_by_uid 1001", textEncoding); resp != nil {
+		t.Errorf("response(user_by_uid 1001) = %q after new generation; want nil", resp)
+	}
+}
+
+func TestServerUsesResponseCache(t *testing.T) {
+	socketPath = tempFile()
+	mock := &testbase.MockProvider{Usrs: testbase.ExpUsers}
+	cache := &ResponseCache{}
+	cache.Update(mock)
+	// Requests for cached responses no longer reach the provider.
+	mock.Usrs = []*accounts.User{}
+	serve(&Server{Provider: mock, Responses: cache})
+	defer os.Remove(socketPath)
+	testData := []struct {
+		request  string
+		response string
+	}{
+		{"user_by_uid 1002", "200\nuser2:1002:1000:Jane Doe:/home/user2:/bin/zsh"},
+		{"users", "200\nuser1:1001:1000:John Doe:/home/user1:/bin/bash\nuser2:1002:1000:Jane Doe:/home/user2:/bin/zsh"},
+		{"stream users\n", "200\nuser1:1001:1000:John Doe:/home/user1:/bin/bash\nuser2:1002:1000:Jane Doe:/home/user2:/bin/zsh\n\n"},
+		{"user_by_uid 1003", "404"},
+	}
+	for _, data := range testData {
+		conn, err := net.DialUnix("unix", nil, &net.UnixAddr{socketPath, "unix"})
+		if err != nil {
+			t.Fatalf("DialUnix() = (_, %v); want (_, nil)", err)
+		}
+		conn.SetDeadline(time.Now().Add(time.Second))
+		io.WriteString(conn, data.request)
+		resp, err := ioutil.ReadAll(conn)
+		conn.Close()
+		if string(resp) != data.response || err != nil {
+			t.Errorf("%q = (%q, %v); want (%q, nil)", data.request, resp, err, data.response)
+		}
+	}
+}
@@ -17,20 +17,81 @@
 package server
 
 import (
+	"bufio"
 	"bytes"
 	"errors"
-	"fmt"
+	"io"
 	"net"
 	"os"
+	"sort"
 	"strconv"
 	"strings"
+	"sync"
+	"syscall"
 	"time"
 
 	"github.com/GoogleCloudPlatform/compute-user-accounts/accounts"
 	"github.com/GoogleCloudPlatform/compute-user-accounts/logger"
+	"github.com/GoogleCloudPlatform/compute-user-accounts/metrics"
 )
 
-const maxRequestSize = 128
+const (
+	maxRequestSize = 128
+	// keepAliveRequest is sent by a client as the first request on a
+	// connection to switch it to keep-alive mode. In keep-alive mode each
+	// request is a single line terminated by a newline character and each
+	// response is framed as "<length>\n<response>".
+	keepAliveRequest = "keepalive"
+	// streamPrefix precedes an enumeration command to stream its response.
+	// A streamed response is "200\n" followed by one newline terminated line
+	// per entity and an empty line ending the stream, so that a client can
+	// parse entities as they arrive and detect truncated responses.
+	streamPrefix = "stream "
+	// batchPrefix precedes a lookup command followed by any number of
+	// space separated names or IDs. A batch request is terminated by a
+	// newline character and may be up to maxBatchRequestSize bytes long. Its
+	// response is "200" followed by one line per name or ID, in order, which
+	// is empty if the entity was not found.
+	batchPrefix         = "batch "
+	maxBatchRequestSize = 16 * 1024
+	// binaryRequest is sent by a client on a keep-alive connection to have
+	// the responses to user and group lookups on it encoded as binary
+	// records. A binary record is binaryRecordMarker followed by the fields
+	// of the entity, where integers are 32-bit little-endian and strings are
+	// their length followed by their bytes:
+	//
+	//	user:  uid gid name gecos home shell
+	//	group: gid name count member...
+	//
+	// Text lines never start with binaryRecordMarker.
+	binaryRequest      = "binary"
+	binaryRecordMarker = 0
+	// A paged request "page <command> <count> [<after>]" returns up to count
+	// lines of the response to the enumeration command, in order of entity
+	// name and starting after the entity named after. A page with fewer than
+	// count lines is the last one.
+	maxPageSize = 10000
+	// pipelineRequest is sent by a client on a keep-alive connection to
+	// pipeline the requests on it. Each following request is "<id> <request>",
+	// where id is any token chosen by the client, and is answered with the
+	// frame "<id> <length>\n<response>". Up to maxPipelinedRequests requests
+	// of a connection are answered concurrently, so responses are written as
+	// they are ready rather than in the order of their requests.
+	pipelineRequest      = "pipeline"
+	maxPipelinedRequests = 64
+)
+
+// An encoding marshals the entities of lookup responses.
+type encoding struct {
+	user   func(*accounts.User) string
+	group  func(*accounts.Group) string
+	binary bool
+}
+
+var (
+	textEncoding   = encoding{marshalUser, marshalGroup, false}
+	binaryEncoding = encoding{marshalBinaryUser, marshalBinaryGroup, true}
+)
 
 var (
 	// socketPath is set through the Makefile at compile time.
@@ -38,23 +99,214 @@ var (
 	// listeningCallback exposes a testing callback invoked when the server is
 	// listening.
 	listeningCallback = func() {}
-	serverTimeout     = time.Second
 )
 
+// commands are the commands that requests are counted and timed by.
+var commands = []string{
+	"user_by_name", "user_by_uid", "users", "group_by_name", "group_by_gid", "groups",
+	"gids_for_user", "names", "is_name", "keys", "batch", "page", "metrics", "stream", "invalid",
+}
+
+var (
+	requestsTotal        = metrics.NewCounterVec("gcua_requests_total", "Requests answered, by command.", "command")
+	requestDuration      = metrics.NewHistogramVec("gcua_request_duration_seconds", "Time taken to answer requests, by command.", "command")
+	responseCacheResults = metrics.NewCounterVec("gcua_response_cache_requests_total", "Requests looked up in the response cache, by result.", "result")
+	connectionsInFlight  = metrics.NewGauge("gcua_connections_in_flight", "Open client connections.")
+	timeoutsTotal        = metrics.NewCounter("gcua_timeouts_total", "Connections that timed out reading a request or writing a response.")
+)
+
+// commandStats holds the metrics of a command.
+type commandStats struct {
+	requests *metrics.Counter
+	duration *metrics.Histogram
+}
+
+var (
+	// statsByCommand is never modified after init, so it is read without
+	// locking.
+	statsByCommand = make(map[string]commandStats)
+	cacheHits      = responseCacheResults.With("hit")
+	cacheMisses    = responseCacheResults.With("miss")
+)
+
+func init() {
+	for _, cmd := range commands {
+		statsByCommand[cmd] = commandStats{requestsTotal.With(cmd), requestDuration.With(cmd)}
+	}
+}
+
+// statsFor returns the metrics of the command of a request.
+func statsFor(req string) commandStats {
+	cmd := req
+	if i := strings.IndexByte(req, ' '); i >= 0 {
+		cmd = req[:i]
+	}
+	stats, ok := statsByCommand[cmd]
+	if !ok {
+		stats = statsByCommand["invalid"]
+	}
+	return stats
+}
+
+// countError counts err if it is a timeout.
+func countError(err error) {
+	if ne, ok := err.(net.Error); ok && ne.Timeout() {
+		timeoutsTotal.Inc()
+	}
+}
+
 // A Server provides account information to a Client through a socket.
 type Server struct {
 	Provider accounts.AccountProvider
+	// Responses, if set, answers the requests it has cached responses for.
+	// It must be updated whenever the accounts of Provider change.
+	Responses *ResponseCache
+	// LogRequests sets whether connections and requests are logged at the
+	// info level. Errors are always logged.
+	LogRequests bool
+	// Backlog, if positive, sets how many connections may wait to be
+	// accepted. The kernel limits it to net.core.somaxconn.
+	Backlog int
+	// Workers sets how many connections are served at a time, or
+	// defaultWorkers if it is not positive. Keep-alive and streamed
+	// connections are not counted since they may live long.
+	Workers int
+	// Detached sets how many keep-alive and streamed connections are
+	// served at a time, or detachedPerWorker times the number of workers if
+	// it is not positive. Further keep-alive requests are refused, so that
+	// clients fall back to one-shot connections, and further streams are
+	// served by the worker that accepted them.
+	Detached int
+
+	// detached holds a token for each keep-alive and streamed connection.
+	detached chan struct{}
+	// These are set by tests. If positive, they override serverTimeout,
+	// defaultKeepAliveTimeout and defaultStreamTimeout.
+	timeout          time.Duration
+	keepAliveTimeout time.Duration
+	streamTimeout    time.Duration
+	// pages holds the sorted enumerations that pages are answered from
+	// when Responses does not have them.
+	pages pageCache
+}
+
+const (
+	// serverTimeout defines how long reading a request or writing a
+	// response may take.
+	serverTimeout = time.Second
+	// defaultKeepAliveTimeout defines how long an idle keep-alive
+	// connection is held open.
+	defaultKeepAliveTimeout = 30 * time.Second
+	// defaultStreamTimeout defines how long a streamed response waits for a
+	// client that stopped reading it.
+	defaultStreamTimeout = 30 * time.Second
+	// defaultWorkers is used if Server.Workers is not set.
+	defaultWorkers = 64
+	// detachedPerWorker sizes the default limit of detached connections.
+	detachedPerWorker = 16
+)
+
+// requestTimeout returns how long reading a request or writing a response may
+// take.
+func (s *Server) requestTimeout() time.Duration {
+	if s.timeout > 0 {
+		return s.timeout
+	}
+	return serverTimeout
+}
+
+// idleTimeout returns how long an idle keep-alive connection is held open.
+func (s *Server) idleTimeout() time.Duration {
+	if s.keepAliveTimeout > 0 {
+		return s.keepAliveTimeout
+	}
+	return defaultKeepAliveTimeout
+}
+
+// writeTimeout returns how long a streamed response waits for a client that
+// stopped reading it.
+func (s *Server) writeTimeout() time.Duration {
+	if s.streamTimeout > 0 {
+		return s.streamTimeout
+	}
+	return defaultStreamTimeout
+}
+
+// requestBuffers holds buffers of maxRequestSize bytes for reading requests.
+var requestBuffers = sync.Pool{New: func() interface{} { return make([]byte, maxRequestSize) }}
+
+// requestReaders holds readers for keep-alive connections and batch requests.
+var requestReaders = sync.Pool{New: func() interface{} { return bufio.NewReaderSize(nil, maxRequestSize) }}
+
+func getReader(r io.Reader) *bufio.Reader {
+	br := requestReaders.Get().(*bufio.Reader)
+	br.Reset(r)
+	return br
+}
+
+func putReader(br *bufio.Reader) {
+	br.Reset(nil)
+	requestReaders.Put(br)
+}
+
+func (s *Server) info(a ...interface{}) {
+	if s.LogRequests {
+		logger.Info(a...)
+	}
+}
+
+func (s *Server) infof(format string, a ...interface{}) {
+	if s.LogRequests {
+		logger.Infof(format, a...)
+	}
+}
+
+// answer returns the response to a request, from Responses if it is cached.
+func (s *Server) answer(req string, enc encoding) []byte {
+	start := time.Now()
+	stats := statsFor(req)
+	resp := s.Responses.response(req, enc)
+	if resp != nil {
+		cacheHits.Inc()
+	} else {
+		if s.Responses != nil {
+			cacheMisses.Inc()
+		}
+		resp = []byte(s.respond(req, enc))
+	}
+	stats.requests.Inc()
+	stats.duration.Since(start)
+	return resp
 }
 
 // Serve begins serving accounts information through a socket forever.
 func (s *Server) Serve() error {
 	os.Remove(socketPath)
-	sock, err := net.ListenUnix("unix", &net.UnixAddr{socketPath, "unix"})
+	sock, err := listen(socketPath, s.Backlog)
 	if err != nil {
 		return err
 	}
 	// Make the socket readable and writeable by all.
 	os.Chmod(socketPath, os.ModePerm)
+	workers := s.Workers
+	if workers <= 0 {
+		workers = defaultWorkers
+	}
+	detached := s.Detached
+	if detached <= 0 {
+		detached = workers * detachedPerWorker
+	}
+	s.detached = make(chan struct{}, detached)
+	// Accepted connections wait for a worker, so that a burst of them is
+	// held in the listen backlog rather than in goroutines.
+	conns := make(chan net.Conn)
+	for i := 0; i < workers; i++ {
+		go func() {
+			for conn := range conns {
+				s.handle(conn)
+			}
+		}()
+	}
 	listeningCallback()
 	logger.Infof("Listening for connections at %v.", socketPath)
 	for {
@@ -63,90 +315,416 @@ func (s *Server) Serve() error {
 			logger.Errorf("Failed to accept connection: %v.", err)
 			continue
 		}
-		logger.Info("Accepted connection.")
-		go s.handle(conn)
+		s.info("Accepted connection.")
+		connectionsInFlight.Add(1)
+		conns <- conn
 	}
 }
 
+// listen listens on a Unix socket at path. A positive backlog replaces the
+// default length of the queue of connections waiting to be accepted.
+func listen(path string, backlog int) (net.Listener, error) {
+	if backlog <= 0 {
+		return net.ListenUnix("unix", &net.UnixAddr{path, "unix"})
+	}
+	fd, err := syscall.Socket(syscall.AF_UNIX, syscall.SOCK_STREAM|syscall.SOCK_CLOEXEC, 0)
+	if err != nil {
+		return nil, os.NewSyscallError("socket", err)
+	}
+	f := os.NewFile(uintptr(fd), path)
+	defer f.Close()
+	if err := syscall.Bind(fd, &syscall.SockaddrUnix{Name: path}); err != nil {
+		return nil, os.NewSyscallError("bind", err)
+	}
+	if err := syscall.Listen(fd, backlog); err != nil {
+		return nil, os.NewSyscallError("listen", err)
+	}
+	// FileListener duplicates the socket.
+	return net.FileListener(f)
+}
+
+func closeConn(conn net.Conn) {
+	conn.Close()
+	connectionsInFlight.Add(-1)
+}
+
+// detach reserves a detached connection. It returns false if there are
+// already Detached of them.
+func (s *Server) detach() bool {
+	select {
+	case s.detached <- struct{}{}:
+		return true
+	default:
+		return false
+	}
+}
+
+// handle serves a connection. Keep-alive and streamed connections get their
+// own goroutines instead of holding the worker, up to Detached of them.
 func (s *Server) handle(conn net.Conn) {
-	defer conn.Close()
-	deadline := time.Now().Add(serverTimeout)
+	detached := false
+	defer func() {
+		if !detached {
+			closeConn(conn)
+		}
+	}()
+	deadline := time.Now().Add(s.requestTimeout())
 	conn.SetReadDeadline(deadline)
-	data := make([]byte, maxRequestSize)
+	data := requestBuffers.Get().([]byte)
+	defer requestBuffers.Put(data)
 	n, err := conn.Read(data)
 	if err != nil {
+		countError(err)
 		logger.Errorf("Failed to read request: %v.", err)
 		return
 	}
-	resp := s.respond(string(data[:n]))
-	deadline = time.Now().Add(serverTimeout)
+	req := string(data[:n])
+	if strings.HasPrefix(req, batchPrefix) {
+		br := getReader(io.MultiReader(bytes.NewReader(data[:n]), conn))
+		defer putReader(br)
+		line, err := readLine(br)
+		if err != nil && (err != io.EOF || len(line) == 0) {
+			countError(err)
+			logger.Errorf("Failed to read request: %v.", err)
+			return
+		}
+		req = strings.TrimSuffix(string(line), "\n")
+	} else if req == keepAliveRequest || strings.HasPrefix(req, keepAliveRequest+"\n") {
+		if !s.detach() {
+			logger.Notice("Refusing keep-alive connection: too many are open.")
+			conn.SetWriteDeadline(time.Now().Add(s.requestTimeout()))
+			io.WriteString(conn, "503")
+			return
+		}
+		rest := strings.TrimPrefix(strings.TrimPrefix(req, keepAliveRequest), "\n")
+		detached = true
+		go func() {
+			defer func() { <-s.detached }()
+			defer closeConn(conn)
+			br := getReader(io.MultiReader(strings.NewReader(rest), conn))
+			defer putReader(br)
+			s.handleKeepAlive(conn, br)
+		}()
+		return
+	} else if strings.HasPrefix(req, streamPrefix) {
+		cmd := strings.TrimSuffix(strings.TrimPrefix(req, streamPrefix), "\n")
+		if !s.detach() {
+			s.handleStream(conn, cmd)
+			return
+		}
+		detached = true
+		go func() {
+			defer func() { <-s.detached }()
+			defer closeConn(conn)
+			s.handleStream(conn, cmd)
+		}()
+		return
+	}
+	resp := s.answer(req, textEncoding)
+	deadline = time.Now().Add(s.requestTimeout())
 	conn.SetWriteDeadline(deadline)
-	_, err = conn.Write([]byte(resp))
+	_, err = conn.Write(resp)
 	if err != nil {
+		countError(err)
 		logger.Errorf("Failed to write response: %v.", err)
 	}
-	logger.Info("Request completed.")
+	s.info("Request completed.")
 }
 
-func (s *Server) respond(req string) string {
+// handleKeepAlive serves newline terminated requests from a keep-alive
+// connection until the client closes it or it is idle for idleTimeout.
+func (s *Server) handleKeepAlive(conn net.Conn, r *bufio.Reader) {
+	conn.SetWriteDeadline(time.Now().Add(s.requestTimeout()))
+	if _, err := io.WriteString(conn, "200\n"); err != nil {
+		logger.Errorf("Failed to accept keep-alive: %v.", err)
+		return
+	}
+	enc := textEncoding
+	for {
+		conn.SetReadDeadline(time.Now().Add(s.idleTimeout()))
+		line, err := readLine(r)
+		if ne, ok := err.(net.Error); len(line) == 0 && (err == io.EOF || ok && ne.Timeout()) {
+			// The client closed the connection or it was idle.
+			return
+		} else if err != nil {
+			countError(err)
+			logger.Errorf("Failed to read request: %v.", err)
+			return
+		}
+		req := string(line[:len(line)-1])
+		var resp []byte
+		pipeline := false
+		if req == binaryRequest {
+			s.info("Switching to binary records.")
+			enc = binaryEncoding
+			resp = []byte("200")
+		} else if req == pipelineRequest {
+			s.info("Switching to pipelined requests.")
+			pipeline = true
+			resp = []byte("200")
+		} else {
+			resp = s.answer(req, enc)
+		}
+		conn.SetWriteDeadline(time.Now().Add(s.requestTimeout()))
+		frame := net.Buffers{[]byte(strconv.Itoa(len(resp)) + "\n"), resp}
+		_, err = frame.WriteTo(conn)
+		if err != nil {
+			countError(err)
+			logger.Errorf("Failed to write response: %v.", err)
+			return
+		}
+		s.info("Request completed.")
+		if pipeline {
+			s.handlePipeline(conn, r, enc)
+			return
+		}
+	}
+}
+
+// handlePipeline serves pipelined requests from a keep-alive connection,
+// answering up to maxPipelinedRequests of them concurrently and writing each
+// response as soon as it is ready. It returns once every request read has
+// been answered.
+func (s *Server) handlePipeline(conn net.Conn, r *bufio.Reader, enc encoding) {
+	var (
+		wg sync.WaitGroup
+		// writeMu serializes frames and guards failed.
+		writeMu sync.Mutex
+		failed  bool
+	)
+	slots := make(chan struct{}, maxPipelinedRequests)
+	defer wg.Wait()
+	write := func(id string, resp []byte) {
+		writeMu.Lock()
+		defer writeMu.Unlock()
+		if failed {
+			return
+		}
+		conn.SetWriteDeadline(time.Now().Add(s.requestTimeout()))
+		frame := net.Buffers{[]byte(id + " " + strconv.Itoa(len(resp)) + "\n"), resp}
+		if _, err := frame.WriteTo(conn); err != nil {
+			countError(err)
+			logger.Errorf("Failed to write response: %v.", err)
+			// Wake up the reader so that no more requests are read.
+			failed = true
+			conn.SetReadDeadline(time.Now())
+			return
+		}
+		s.info("Request completed.")
+	}
+	for {
+		writeMu.Lock()
+		if failed {
+			writeMu.Unlock()
+			return
+		}
+		conn.SetReadDeadline(time.Now().Add(s.idleTimeout()))
+		writeMu.Unlock()
+		line, err := readLine(r)
+		if ne, ok := err.(net.Error); len(line) == 0 && (err == io.EOF || ok && ne.Timeout()) {
+			// The client closed the connection, it was idle or a response
+			// could not be written.
+			return
+		} else if err != nil {
+			countError(err)
+			logger.Errorf("Failed to read request: %v.", err)
+			return
+		}
+		req := string(line[:len(line)-1])
+		i := strings.IndexByte(req, ' ')
+		if i <= 0 {
+			logger.Errorf("Invalid pipelined request: %v.", req)
+			return
+		}
+		id := req[:i]
+		req = req[i+1:]
+		if req == binaryRequest {
+			// Requests read after this one are answered with binary records.
+			s.info("Switching to binary records.")
+			enc = binaryEncoding
+			write(id, []byte("200"))
+			continue
+		}
+		slots <- struct{}{}
+		wg.Add(1)
+		go func(enc encoding) {
+			defer wg.Done()
+			write(id, s.answer(req, enc))
+			<-slots
+		}(enc)
+	}
+}
+
+// readLine reads a newline terminated request from r. Requests longer than
+// the buffer of r are accepted up to maxBatchRequestSize bytes.
+func readLine(r *bufio.Reader) ([]byte, error) {
+	line, err := r.ReadSlice('\n')
+	if err != bufio.ErrBufferFull {
+		return line, err
+	}
+	long := append([]byte(nil), line...)
+	for err == bufio.ErrBufferFull && len(long) <= maxBatchRequestSize {
+		line, err = r.ReadSlice('\n')
+		long = append(long, line...)
+	}
+	if len(long) > maxBatchRequestSize {
+		return nil, errors.New("request too large")
+	}
+	return long, err
+}
+
+// A streamWriter writes to a connection, extending the write deadline before
+// each write so that the stream only fails if the client stops reading.
+type streamWriter struct {
+	conn    net.Conn
+	timeout time.Duration
+}
+
+func (w streamWriter) Write(p []byte) (int, error) {
+	w.conn.SetWriteDeadline(time.Now().Add(w.timeout))
+	return w.conn.Write(p)
+}
+
+// handleStream streams the response to an enumeration command, marshaling
+// entities as they are written instead of buffering the whole response.
+func (s *Server) handleStream(conn net.Conn, cmd string) {
+	stats := statsByCommand["stream"]
+	stats.requests.Inc()
+	defer stats.duration.Since(time.Now())
+	if data := s.Responses.stream(cmd); data != nil {
+		cacheHits.Inc()
+		s.infof("Streaming cached %v.", cmd)
+		if _, err := (streamWriter{conn, s.writeTimeout()}).Write(data); err != nil {
+			countError(err)
+			logger.Errorf("Failed to write response: %v.", err)
+			return
+		}
+		s.info("Request completed.")
+		return
+	}
+	if s.Responses != nil {
+		cacheMisses.Inc()
+	}
+	w := bufio.NewWriter(streamWriter{conn, s.writeTimeout()})
+	switch cmd {
+	case "users":
+		s.info("Streaming users.")
+		users, err := s.Provider.Users()
+		if err != nil {
+			w.WriteString(marshalError(err))
+			break
+		}
+		w.WriteString("200\n")
+		for _, u := range users {
+			w.WriteString(marshalUser(u))
+			w.WriteString("\n")
+		}
+		w.WriteString("\n")
+	case "groups":
+		s.info("Streaming groups.")
+		groups, err := s.Provider.Groups()
+		if err != nil {
+			w.WriteString(marshalError(err))
+			break
+		}
+		w.WriteString("200\n")
+		for _, g := range groups {
+			w.WriteString(marshalGroup(g))
+			w.WriteString("\n")
+		}
+		w.WriteString("\n")
+	case "names":
+		s.info("Streaming names.")
+		names, err := s.Provider.Names()
+		if err != nil {
+			w.WriteString(marshalError(err))
+			break
+		}
+		w.WriteString("200\n")
+		for _, n := range names {
+			w.WriteString(n)
+			w.WriteString("\n")
+		}
+		w.WriteString("\n")
+	default:
+		logger.Errorf("Invalid stream request: %v.", cmd)
+		w.WriteString("400")
+	}
+	if err := w.Flush(); err != nil {
+		countError(err)
+		logger.Errorf("Failed to write response: %v.", err)
+		return
+	}
+	s.info("Request completed.")
+}
+
+func (s *Server) respond(req string, enc encoding) string {
 	parts := strings.Split(req, " ")
 	cmd := parts[0]
 	args := parts[1:]
 	switch cmd {
 	case "user_by_name":
-		return s.userByName(args)
+		return s.userByName(args, enc)
 	case "user_by_uid":
-		return s.userByUID(args)
+		return s.userByUID(args, enc)
 	case "users":
 		return s.users()
 	case "group_by_name":
-		return s.groupByName(args)
+		return s.groupByName(args, enc)
 	case "group_by_gid":
-		return s.groupByGID(args)
+		return s.groupByGID(args, enc)
 	case "groups":
 		return s.groups()
+	case "gids_for_user":
+		return s.gidsForUser(args)
 	case "names":
 		return s.names()
 	case "is_name":
 		return s.isName(args)
 	case "keys":
 		return s.authorizedKeys(args)
+	case "batch":
+		return s.batch(args)
+	case "page":
+		return s.page(args)
+	case "metrics":
+		return s.metrics()
 	default:
 		logger.Errorf("Invalid request: %v.", req)
 		return "400"
 	}
 }
 
-func (s *Server) userByName(args []string) string {
+func (s *Server) userByName(args []string, enc encoding) string {
 	name, err := parseName(args)
 	if err != nil {
 		logger.Errorf("Invalid name for user: %v.", err)
 		return "400"
 	}
-	logger.Infof("Getting user by name: %v.", name)
+	s.infof("Getting user by name: %v.", name)
 	user, err := s.Provider.UserByName(name)
 	if err != nil {
 		return marshalError(err)
 	}
-	return fmt.Sprintf("200\n%v", marshalUser(user))
+	return "200\n" + enc.user(user)
 }
 
-func (s *Server) userByUID(args []string) string {
+func (s *Server) userByUID(args []string, enc encoding) string {
 	uid, err := parseID(args)
 	if err != nil {
 		logger.Errorf("Invalid UID for user: %v.", err)
 		return "400"
 	}
-	logger.Infof("Getting user by UID: %v.", uid)
+	s.infof("Getting user by UID: %v.", uid)
 	user, err := s.Provider.UserByUID(uid)
 	if err != nil {
 		return marshalError(err)
 	}
-	return fmt.Sprintf("200\n%v", marshalUser(user))
+	return "200\n" + enc.user(user)
 }
 
 func (s *Server) users() string {
-	logger.Info("Getting users.")
+	s.info("Getting users.")
 	users, err := s.Provider.Users()
 	if err != nil {
 		return marshalError(err)
@@ -160,36 +738,36 @@ func (s *Server) users() string {
 	return buf.String()
 }
 
-func (s *Server) groupByName(args []string) string {
+func (s *Server) groupByName(args []string, enc encoding) string {
 	name, err := parseName(args)
 	if err != nil {
 		logger.Errorf("Invalid name for group: %v.", err)
 		return "400"
 	}
-	logger.Infof("Getting group by name: %v.", name)
+	s.infof("Getting group by name: %v.", name)
 	group, err := s.Provider.GroupByName(name)
 	if err != nil {
 		return marshalError(err)
 	}
-	return fmt.Sprintf("200\n%v", marshalGroup(group))
+	return "200\n" + enc.group(group)
 }
 
-func (s *Server) groupByGID(args []string) string {
+func (s *Server) groupByGID(args []string, enc encoding) string {
 	gid, err := parseID(args)
 	if err != nil {
 		logger.Errorf("Invalid GID for group: %v.", err)
 		return "400"
 	}
-	logger.Infof("Getting group by GID: %v.", gid)
+	s.infof("Getting group by GID: %v.", gid)
 	group, err := s.Provider.GroupByGID(gid)
 	if err != nil {
 		return marshalError(err)
 	}
-	return fmt.Sprintf("200\n%v", marshalGroup(group))
+	return "200\n" + enc.group(group)
 }
 
 func (s *Server) groups() string {
-	logger.Info("Getting groups.")
+	s.info("Getting groups.")
 	groups, err := s.Provider.Groups()
 	if err != nil {
 		return marshalError(err)
@@ -203,8 +781,28 @@ func (s *Server) groups() string {
 	return buf.String()
 }
 
+func (s *Server) gidsForUser(args []string) string {
+	username, err := parseName(args)
+	if err != nil {
+		logger.Errorf("Invalid username for GIDs: %v.", err)
+		return "400"
+	}
+	s.infof("Getting GIDs for user: %v.", username)
+	gids, err := s.Provider.GIDsForUser(username)
+	if err != nil {
+		return marshalError(err)
+	}
+	var buf bytes.Buffer
+	buf.WriteString("200")
+	for _, gid := range gids {
+		buf.WriteString("\n")
+		buf.WriteString(strconv.FormatUint(uint64(gid), 10))
+	}
+	return buf.String()
+}
+
 func (s *Server) names() string {
-	logger.Info("Getting names.")
+	s.info("Getting names.")
 	names, err := s.Provider.Names()
 	if err != nil {
 		return marshalError(err)
@@ -224,15 +822,15 @@ func (s *Server) isName(args []string) string {
 		logger.Errorf("Invalid name: %v.", err)
 		return "400"
 	}
-	logger.Infof("Checking name: %v.", name)
+	s.infof("Checking name: %v.", name)
 	is, err := s.Provider.IsName(name)
 	if err != nil {
 		return marshalError(err)
 	} else if is {
-		logger.Info("Valid name.")
+		s.info("Valid name.")
 		return "200"
 	} else {
-		logger.Info("Invalid name.")
+		s.info("Invalid name.")
 		return "404"
 	}
 }
@@ -243,7 +841,7 @@ func (s *Server) authorizedKeys(args []string) string {
 		logger.Errorf("Invalid username for keys: %v.", err)
 		return "400"
 	}
-	logger.Infof("Getting keys for user: %v.", username)
+	s.infof("Getting keys for user: %v.", username)
 	keys, err := s.Provider.AuthorizedKeys(username)
 	if err != nil {
 		return marshalError(err)
@@ -257,6 +855,235 @@ func (s *Server) authorizedKeys(args []string) string {
 	return buf.String()
 }
 
+// errInvalidKey reports a name or ID of a batch request that cannot be parsed.
+var errInvalidKey = errors.New("invalid key")
+
+func (s *Server) batch(args []string) string {
+	if len(args) < 2 {
+		logger.Errorf("Invalid batch: %v.", args)
+		return "400"
+	}
+	var lookup func(key string) (string, error)
+	switch args[0] {
+	case "user_by_name":
+		userByName := s.Provider.UserByName
+		if bp, ok := s.Provider.(accounts.BatchProvider); ok {
+			// Missing users wait for a single refresh rather than one
+			// each.
+			users, err := bp.UsersByName(args[1:])
+			if err != nil {
+				return marshalError(err)
+			}
+			found := make(map[string]*accounts.User, len(users))
+			for i, user := range users {
+				if user != nil {
+					found[args[1+i]] = user
+				}
+			}
+			userByName = func(name string) (*accounts.User, error) {
+				if user, ok := found[name]; ok {
+					return user, nil
+				}
+				return nil, accounts.UsernameNotFound(name)
+			}
+		}
+		lookup = func(key string) (string, error) {
+			user, err := userByName(key)
+			if err != nil {
+				return "", err
+			}
+			return marshalUser(user), nil
+		}
+	case "user_by_uid":
+		lookup = func(key string) (string, error) {
+			uid, err := strconv.ParseUint(key, 10, 32)
+			if err != nil {
+				return "", errInvalidKey
+			}
+			user, err := s.Provider.UserByUID(uint32(uid))
+			if err != nil {
+				return "", err
+			}
+			return marshalUser(user), nil
+		}
+	case "group_by_name":
+		lookup = func(key string) (string, error) {
+			group, err := s.Provider.GroupByName(key)
+			if err != nil {
+				return "", err
+			}
+			return marshalGroup(group), nil
+		}
+	case "group_by_gid":
+		lookup = func(key string) (string, error) {
+			gid, err := strconv.ParseUint(key, 10, 32)
+			if err != nil {
+				return "", errInvalidKey
+			}
+			group, err := s.Provider.GroupByGID(uint32(gid))
+			if err != nil {
+				return "", err
+			}
+			return marshalGroup(group), nil
+		}
+	default:
+		logger.Errorf("Invalid batch command: %v.", args[0])
+		return "400"
+	}
+	keys := args[1:]
+	s.infof("Getting batch %v of %v keys.", args[0], len(keys))
+	var buf bytes.Buffer
+	buf.WriteString("200")
+	for _, key := range keys {
+		line, err := lookup(key)
+		if err == errInvalidKey {
+			logger.Errorf("Invalid key for batch %v: %q.", args[0], key)
+			return "400"
+		} else if _, ok := err.(*accounts.NotFoundError); err != nil && !ok {
+			return marshalError(err)
+		}
+		buf.WriteString("\n")
+		buf.WriteString(line)
+	}
+	return buf.String()
+}
+
+// A pageCache holds the sorted entries of each enumeration command for one
+// generation of a GenerationProvider, so that a Server without cached
+// responses sorts them once per generation rather than once per page.
+type pageCache struct {
+	mu         sync.Mutex
+	generation uint64
+	pages      map[string][]pageEntry
+}
+
+// get returns the entries of cmd if they were sorted for generation.
+func (c *pageCache) get(cmd string, generation uint64) ([]pageEntry, bool) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	if c.generation != generation {
+		return nil, false
+	}
+	entries, ok := c.pages[cmd]
+	return entries, ok
+}
+
+// put stores the entries of cmd sorted for generation, dropping those of
+// other generations.
+func (c *pageCache) put(cmd string, generation uint64, entries []pageEntry) {
+	c.mu.Lock()
+	defer c.mu.Unlock()
+	if c.pages != nil && generation < c.generation {
+		return
+	}
+	if c.pages == nil || c.generation != generation {
+		c.generation = generation
+		c.pages = make(map[string][]pageEntry, 3)
+	}
+	c.pages[cmd] = entries
+}
+
+// A pageEntry is a line of an enumeration and the name it is ordered by.
+type pageEntry struct {
+	name string
+	line string
+}
+
+type pageEntries []pageEntry
+
+func (e pageEntries) Len() int           { return len(e) }
+func (e pageEntries) Swap(i, j int)      { e[i], e[j] = e[j], e[i] }
+func (e pageEntries) Less(i, j int) bool { return e[i].name < e[j].name }
+
+// parsePage parses the arguments of a paged request.
+func parsePage(args []string) (cmd string, count int, after string, err error) {
+	if len(args) != 2 && len(args) != 3 {
+		return "", 0, "", errors.New("invalid page")
+	}
+	count, err = strconv.Atoi(args[1])
+	if err != nil || count <= 0 || count > maxPageSize {
+		return "", 0, "", errors.New("invalid page size")
+	}
+	if len(args) == 3 {
+		after = args[2]
+	}
+	return args[0], count, after, nil
+}
+
+// marshalPage returns the response with the page of sorted entries that
+// starts after the entry named after.
+func marshalPage(entries []pageEntry, count int, after string) string {
+	i := sort.Search(len(entries), func(i int) bool { return entries[i].name > after })
+	var buf bytes.Buffer
+	buf.WriteString("200")
+	for end := i + count; i < end && i < len(entries); i++ {
+		buf.WriteString("\n")
+		buf.WriteString(entries[i].line)
+	}
+	return buf.String()
+}
+
+func (s *Server) page(args []string) string {
+	cmd, count, after, err := parsePage(args)
+	if err != nil {
+		logger.Errorf("Invalid page %v: %v.", args, err)
+		return "400"
+	}
+	s.infof("Getting page of %v %v after %q.", count, cmd, after)
+	// The generation is read first so that it is never newer than the data.
+	gp, versioned := s.Provider.(accounts.GenerationProvider)
+	var generation uint64
+	if versioned {
+		generation = gp.Generation()
+		if entries, ok := s.pages.get(cmd, generation); ok {
+			return marshalPage(entries, count, after)
+		}
+	}
+	var entries []pageEntry
+	switch cmd {
+	case "users":
+		users, err := s.Provider.Users()
+		if err != nil {
+			return marshalError(err)
+		}
+		for _, u := range users {
+			entries = append(entries, pageEntry{u.Name, marshalUser(u)})
+		}
+	case "groups":
+		groups, err := s.Provider.Groups()
+		if err != nil {
+			return marshalError(err)
+		}
+		for _, g := range groups {
+			entries = append(entries, pageEntry{g.Name, marshalGroup(g)})
+		}
+	case "names":
+		names, err := s.Provider.Names()
+		if err != nil {
+			return marshalError(err)
+		}
+		for _, n := range names {
+			entries = append(entries, pageEntry{n, n})
+		}
+	default:
+		logger.Errorf("Invalid page command: %v.", cmd)
+		return "400"
+	}
+	sort.Sort(pageEntries(entries))
+	if versioned {
+		s.pages.put(cmd, generation, entries)
+	}
+	return marshalPage(entries, count, after)
+}
+
+func (s *Server) metrics() string {
+	s.info("Getting metrics.")
+	var buf bytes.Buffer
+	buf.WriteString("200\n")
+	metrics.Write(&buf)
+	return buf.String()
+}
+
 func parseName(args []string) (string, error) {
 	if len(args) == 0 {
 		return "", errors.New("no args")
@@ -290,7 +1117,47 @@ func marshalUser(user *accounts.User) string {
 }
 
 func marshalGroup(group *accounts.Group) string {
-	mem := strings.Join(group.Members, ",")
+	return marshalGroupWithMembers(group, strings.Join(group.Members, ","))
+}
+
+// marshalGroupWithMembers marshals a group whose members are already joined.
+func marshalGroupWithMembers(group *accounts.Group, members string) string {
 	gid := strconv.FormatUint(uint64(group.GID), 10)
-	return strings.Join([]string{group.Name, gid, mem}, ":")
+	return strings.Join([]string{group.Name, gid, members}, ":")
+}
+
+func marshalBinaryUser(user *accounts.User) string {
+	b := make([]byte, 1, 25+len(user.Name)+len(user.Gecos)+len(user.HomeDirectory)+len(user.Shell))
+	b[0] = binaryRecordMarker
+	b = appendUint32(b, user.UID)
+	b = appendUint32(b, user.GID)
+	b = appendString(b, user.Name)
+	b = appendString(b, user.Gecos)
+	b = appendString(b, user.HomeDirectory)
+	b = appendString(b, user.Shell)
+	return string(b)
+}
+
+func marshalBinaryGroup(group *accounts.Group) string {
+	size := 13 + len(group.Name)
+	for _, m := range group.Members {
+		size += 4 + len(m)
+	}
+	b := make([]byte, 1, size)
+	b[0] = binaryRecordMarker
+	b = appendUint32(b, group.GID)
+	b = appendString(b, group.Name)
+	b = appendUint32(b, uint32(len(group.Members)))
+	for _, m := range group.Members {
+		b = appendString(b, m)
+	}
+	return string(b)
+}
+
+func appendUint32(b []byte, v uint32) []byte {
+	return append(b, byte(v), byte(v>>8), byte(v>>16), byte(v>>24))
+}
+
+func appendString(b []byte, s string) []byte {
+	return append(appendUint32(b, uint32(len(s))), s...)
 }
@@ -15,10 +15,16 @@
 package server
 
 import (
+	"bufio"
 	"errors"
+	"io"
 	"io/ioutil"
+	"net"
 	"os"
 	"reflect"
+	"strconv"
+	"strings"
+	"sync/atomic"
 	"testing"
 	"time"
 
@@ -39,7 +45,10 @@ func tempFile() string {
 }
 
 func startServer(mock accounts.AccountProvider) {
-	server := &Server{mock}
+	serve(&Server{Provider: mock})
+}
+
+func serve(server *Server) {
 	ch := make(chan struct{})
 	listeningCallback = func() { close(ch) }
 	go func() { panic(server.Serve()) }()
@@ -84,6 +93,16 @@ func TestAll(t *testing.T) {
 			func() (interface{}, error) { return client.Groups() },
 			testbase.ExpGroups,
 		},
+		&testbase.SuccessCase{
+			`GIDsForUser("user1")`,
+			func() (interface{}, error) { return client.GIDsForUser("user1") },
+			[]uint32{1001},
+		},
+		&testbase.SuccessCase{
+			`GIDsForUser("nil")`,
+			func() (interface{}, error) { return client.GIDsForUser("nil") },
+			[]uint32{},
+		},
 		&testbase.SuccessCase{
 			"Names()",
 			func() (interface{}, error) { return client.Names() },
@@ -167,6 +186,11 @@ func TestAll(t *testing.T) {
 			func() (interface{}, error) { return client.Groups() },
 			"request failed",
 		},
+		&testbase.FailureCase{
+			`GIDsForUser("user1")`,
+			func() (interface{}, error) { return client.GIDsForUser("user1") },
+			"request failed",
+		},
 		&testbase.FailureCase{
 			"Names()",
 			func() (interface{}, error) { return client.Names() },
@@ -239,6 +263,7 @@ func TestIncompleteRequests(t *testing.T) {
 		{"groups_by_name ", "request failed"},
 		{"groups_by_gid", "request failed"},
 		{"is_name", "request failed"},
+		{"gids_for_user", "request failed"},
 		{"keys", "request failed"},
 	}
 	for _, data := range testData {
@@ -247,10 +272,13 @@ func TestIncompleteRequests(t *testing.T) {
 			t.Errorf(`send("%v", false) = (_, %v); want (_, %v)`, data.request, err, data.expError)
 		}
 	}
-	var defaultServerTimeout time.Duration
-	defaultServerTimeout, serverTimeout = serverTimeout, time.Nanosecond
+	// A server that times out reading a request must not crash.
+	path := socketPath
+	socketPath = tempFile()
+	serve(&Server{Provider: mock, timeout: time.Nanosecond})
 	send("", false)
-	serverTimeout = defaultServerTimeout
+	os.Remove(socketPath)
+	socketPath = path
 	// Ensure server did not crash.
 	resp, err := send("is_name user1", false)
 	if !reflect.DeepEqual(resp, []string{}) || err != nil {
@@ -275,3 +303,556 @@ func TestClientTimeout(t *testing.T) {
 	clientTimeout = defaultClientTimeout
 	extendedTimeout = defaultExtendedTimeout
 }
+
+func readFrame(r *bufio.Reader) (string, error) {
+	header, err := r.ReadString('\n')
+	if err != nil {
+		return "", err
+	}
+	length, err := strconv.Atoi(strings.TrimSuffix(header, "\n"))
+	if err != nil {
+		return "", err
+	}
+	body := make([]byte, length)
+	_, err = io.ReadFull(r, body)
+	return string(body), err
+}
+
+func TestKeepAlive(t *testing.T) {
+	socketPath = tempFile()
+	mock := &testbase.MockProvider{Usrs: testbase.ExpUsers, Grps: testbase.ExpGroups, Nams: testbase.ExpNames, Keys: testbase.ExpKeys}
+	startServer(mock)
+	defer os.Remove(socketPath)
+	conn, err := net.DialUnix("unix", nil, &net.UnixAddr{socketPath, "unix"})
+	if err != nil {
+		t.Fatalf("DialUnix() = (_, %v); want (_, nil)", err)
+	}
+	defer conn.Close()
+	conn.SetDeadline(time.Now().Add(time.Second))
+	r := bufio.NewReader(conn)
+	io.WriteString(conn, "keepalive\n")
+	if ack, err := r.ReadString('\n'); ack != "200\n" || err != nil {
+		t.Fatalf("keepalive = (%q, %v); want (%q, nil)", ack, err, "200\n")
+	}
+	testData := []struct {
+		request  string
+		response string
+	}{
+		{"user_by_uid 1002", "200\nuser2:1002:1000:Jane Doe:/home/user2:/bin/zsh"},
+		{"group_by_name group2", "200\ngroup2:1001:user2,user1"},
+		{"user_by_name nil", "404"},
+		{"is_name user1", "200"},
+		{"user", "400"},
+	}
+	// Send every request before reading any response to ensure the server
+	// does not lose buffered requests.
+	for _, data := range testData {
+		io.WriteString(conn, data.request+"\n")
+	}
+	for _, data := range testData {
+		resp, err := readFrame(r)
+		if resp != data.response || err != nil {
+			t.Errorf("%v = (%q, %v); want (%q, nil)", data.request, resp, err, data.response)
+		}
+	}
+}
+
+func TestKeepAliveIdleTimeout(t *testing.T) {
+	socketPath = tempFile()
+	mock := &testbase.MockProvider{Usrs: testbase.ExpUsers}
+	serve(&Server{Provider: mock, keepAliveTimeout: time.Nanosecond})
+	defer os.Remove(socketPath)
+	conn, err := net.DialUnix("unix", nil, &net.UnixAddr{socketPath, "unix"})
+	if err != nil {
+		t.Fatalf("DialUnix() = (_, %v); want (_, nil)", err)
+	}
+	defer conn.Close()
+	conn.SetDeadline(time.Now().Add(time.Second))
+	io.WriteString(conn, "keepalive")
+	data, err := ioutil.ReadAll(conn)
+	if string(data) != "200\n" || err != nil {
+		t.Errorf("ReadAll() = (%q, %v); want (%q, nil)", data, err, "200\n")
+	}
+}
+
+func TestKeepAliveBinary(t *testing.T) {
+	socketPath = tempFile()
+	mock := &testbase.MockProvider{Usrs: testbase.ExpUsers, Grps: testbase.ExpGroups}
+	startServer(mock)
+	defer os.Remove(socketPath)
+	conn, err := net.DialUnix("unix", nil, &net.UnixAddr{socketPath, "unix"})
+	if err != nil {
+		t.Fatalf("DialUnix() = (_, %v); want (_, nil)", err)
+	}
+	defer conn.Close()
+	conn.SetDeadline(time.Now().Add(time.Second))
+	r := bufio.NewReader(conn)
+	io.WriteString(conn, "keepalive\n")
+	if ack, err := r.ReadString('\n'); ack != "200\n" || err != nil {
+		t.Fatalf("keepalive = (%q, %v); want (%q, nil)", ack, err, "200\n")
+	}
+	user2 := "\x00\xea\x03\x00\x00\xe8\x03\x00\x00" +
+		"\x05\x00\x00\x00user2\x08\x00\x00\x00Jane Doe" +
+		"\x0b\x00\x00\x00/home/user2\x08\x00\x00\x00/bin/zsh"
+	group2 := "\x00\xe9\x03\x00\x00\x06\x00\x00\x00group2\x02\x00\x00\x00" +
+		"\x05\x00\x00\x00user2\x05\x00\x00\x00user1"
+	testData := []struct {
+		request  string
+		response string
+	}{
+		{"user_by_uid 1002", "200\nuser2:1002:1000:Jane Doe:/home/user2:/bin/zsh"},
+		{"binary", "200"},
+		{"user_by_uid 1002", "200\n" + user2},
+		{"user_by_name user2", "200\n" + user2},
+		{"group_by_gid 1001", "200\n" + group2},
+		{"group_by_name group2", "200\n" + group2},
+		{"user_by_name nil", "404"},
+		{"groups", "200\ngroup1:1000:\ngroup2:1001:user2,user1"},
+		{"batch user_by_uid 1002", "200\nuser2:1002:1000:Jane Doe:/home/user2:/bin/zsh"},
+	}
+	for _, data := range testData {
+		io.WriteString(conn, data.request+"\n")
+		resp, err := readFrame(r)
+		if resp != data.response || err != nil {
+			t.Errorf("%v = (%q, %v); want (%q, nil)", data.request, resp, err, data.response)
+		}
+	}
+}
+
+// A blockingProvider blocks lookups of users by name until release is
+// closed.
+type blockingProvider struct {
+	*testbase.MockProvider
+	release chan struct{}
+}
+
+func (p *blockingProvider) UserByName(name string) (*accounts.User, error) {
+	<-p.release
+	return p.MockProvider.UserByName(name)
+}
+
+func readPipelinedFrame(r *bufio.Reader) (string, string, error) {
+	header, err := r.ReadString('\n')
+	if err != nil {
+		return "", "", err
+	}
+	parts := strings.Split(strings.TrimSuffix(header, "\n"), " ")
+	if len(parts) != 2 {
+		return "", "", errors.New("invalid frame header")
+	}
+	length, err := strconv.Atoi(parts[1])
+	if err != nil {
+		return "", "", err
+	}
+	body := make([]byte, length)
+	_, err = io.ReadFull(r, body)
+	return parts[0], string(body), err
+}
+
+func TestPipeline(t *testing.T) {
+	socketPath = tempFile()
+	mock := &testbase.MockProvider{Usrs: testbase.ExpUsers, Grps: testbase.ExpGroups, Nams: testbase.ExpNames}
+	provider := &blockingProvider{mock, make(chan struct{})}
+	startServer(provider)
+	defer os.Remove(socketPath)
+	conn, err := net.DialUnix("unix", nil, &net.UnixAddr{socketPath, "unix"})
+	if err != nil {
+		t.Fatalf("DialUnix() = (_, %v); want (_, nil)", err)
+	}
+	defer conn.Close()
+	conn.SetDeadline(time.Now().Add(time.Second))
+	r := bufio.NewReader(conn)
+	io.WriteString(conn, "keepalive\npipeline\n")
+	if ack, err := r.ReadString('\n'); ack != "200\n" || err != nil {
+		t.Fatalf("keepalive = (%q, %v); want (%q, nil)", ack, err, "200\n")
+	}
+	if resp, err := readFrame(r); resp != "200" || err != nil {
+		t.Fatalf("pipeline = (%q, %v); want (%q, nil)", resp, err, "200")
+	}
+	// The first request blocks until the others are answered.
+	io.WriteString(conn, "1 user_by_name user1\n2 user_by_uid 1002\n3 group_by_name nil\n")
+	want := map[string]string{
+		"2": "200\nuser2:1002:1000:Jane Doe:/home/user2:/bin/zsh",
+		"3": "404",
+	}
+	for i := 0; i < 2; i++ {
+		id, resp, err := readPipelinedFrame(r)
+		if resp != want[id] || err != nil {
+			t.Errorf("response %v = (%q, %v); want (%q, nil)", id, resp, err, want[id])
+		}
+		delete(want, id)
+	}
+	close(provider.release)
+	if id, resp, err := readPipelinedFrame(r); id != "1" || resp != "200\nuser1:1001:1000:John Doe:/home/user1:/bin/bash" || err != nil {
+		t.Errorf("response = (%q, %q, %v); want (%q, %q, nil)", id, resp, err, "1", "200\nuser1:1001:1000:John Doe:/home/user1:/bin/bash")
+	}
+	// Requests without an ID end the connection.
+	io.WriteString(conn, "users\n")
+	if data, err := ioutil.ReadAll(r); len(data) != 0 || err != nil {
+		t.Errorf("ReadAll() = (%q, %v); want (\"\", nil)", data, err)
+	}
+}
+
+func TestStream(t *testing.T) {
+	socketPath = tempFile()
+	mock := &testbase.MockProvider{Usrs: testbase.ExpUsers, Grps: testbase.ExpGroups, Nams: testbase.ExpNames}
+	startServer(mock)
+	defer os.Remove(socketPath)
+	testData := []struct {
+		request  string
+		response string
+	}{
+		{"stream users", "200\nuser1:1001:1000:John Doe:/home/user1:/bin/bash\nuser2:1002:1000:Jane Doe:/home/user2:/bin/zsh\n\n"},
+		{"stream groups\n", "200\ngroup1:1000:\ngroup2:1001:user2,user1\n\n"},
+		{"stream names", "200\ngroup1\ngroup2\nuser1\nuser2\n\n"},
+		{"stream user_by_uid 1001", "400"},
+	}
+	for _, data := range testData {
+		conn, err := net.DialUnix("unix", nil, &net.UnixAddr{socketPath, "unix"})
+		if err != nil {
+			t.Fatalf("DialUnix() = (_, %v); want (_, nil)", err)
+		}
+		conn.SetDeadline(time.Now().Add(time.Second))
+		io.WriteString(conn, data.request)
+		resp, err := ioutil.ReadAll(conn)
+		conn.Close()
+		if string(resp) != data.response || err != nil {
+			t.Errorf("%q = (%q, %v); want (%q, nil)", data.request, resp, err, data.response)
+		}
+	}
+}
+
+func TestStreamError(t *testing.T) {
+	socketPath = tempFile()
+	mock := &testbase.MockProvider{Err: errors.New("failed")}
+	startServer(mock)
+	defer os.Remove(socketPath)
+	conn, err := net.DialUnix("unix", nil, &net.UnixAddr{socketPath, "unix"})
+	if err != nil {
+		t.Fatalf("DialUnix() = (_, %v); want (_, nil)", err)
+	}
+	defer conn.Close()
+	conn.SetDeadline(time.Now().Add(time.Second))
+	io.WriteString(conn, "stream users")
+	resp, err := ioutil.ReadAll(conn)
+	if string(resp) != "500" || err != nil {
+		t.Errorf("ReadAll() = (%q, %v); want (%q, nil)", resp, err, "500")
+	}
+}
+
+func TestStreamTimeoutCounted(t *testing.T) {
+	server := &Server{Provider: &testbase.MockProvider{Usrs: testbase.ExpUsers}, streamTimeout: time.Nanosecond}
+	client, conn := net.Pipe()
+	defer client.Close()
+	defer conn.Close()
+	timeouts := timeoutsTotal.Value()
+	// The client never reads, so the stream times out.
+	server.handleStream(conn, "users")
+	if timeoutsTotal.Value() == timeouts {
+		t.Errorf("gcua_timeouts_total did not count a stream that timed out")
+	}
+}
+
+func TestBatch(t *testing.T) {
+	socketPath = tempFile()
+	mock := &testbase.MockProvider{Usrs: testbase.ExpUsers, Grps: testbase.ExpGroups}
+	startServer(mock)
+	defer os.Remove(socketPath)
+	// Long enough to exceed maxRequestSize.
+	var manyUIDs, manyUsers []string
+	for i := 0; i < 100; i++ {
+		manyUIDs = append(manyUIDs, "1002")
+		manyUsers = append(manyUsers, "user2:1002:1000:Jane Doe:/home/user2:/bin/zsh")
+	}
+	testData := []struct {
+		request  string
+		response string
+	}{
+		{"batch user_by_uid 1002 1003 1001", "200\nuser2:1002:1000:Jane Doe:/home/user2:/bin/zsh\n\nuser1:1001:1000:John Doe:/home/user1:/bin/bash"},
+		{"batch user_by_name nil", "200\n"},
+		{"batch group_by_name group2 group1", "200\ngroup2:1001:user2,user1\ngroup1:1000:"},
+		{"batch group_by_gid 1000 1002", "200\ngroup1:1000:\n"},
+		{"batch user_by_uid " + strings.Join(manyUIDs, " "), "200\n" + strings.Join(manyUsers, "\n")},
+		{"batch user_by_uid 1001 user1", "400"},
+		{"batch user_by_uid", "400"},
+		{"batch keys user1", "400"},
+		{"batch user_by_uid " + strings.Repeat("1", maxBatchRequestSize), ""},
+	}
+	for _, data := range testData {
+		conn, err := net.DialUnix("unix", nil, &net.UnixAddr{socketPath, "unix"})
+		if err != nil {
+			t.Fatalf("DialUnix() = (_, %v); want (_, nil)", err)
+		}
+		conn.SetDeadline(time.Now().Add(time.Second))
+		io.WriteString(conn, data.request+"\n")
+		resp, err := ioutil.ReadAll(conn)
+		conn.Close()
+		if string(resp) != data.response || err != nil {
+			t.Errorf("%.40q = (%q, %v); want (%q, nil)", data.request, resp, err, data.response)
+		}
+	}
+
+	conn, err := net.DialUnix("unix", nil, &net.UnixAddr{socketPath, "unix"})
+	if err != nil {
+		t.Fatalf("DialUnix() = (_, %v); want (_, nil)", err)
+	}
+	defer conn.Close()
+	conn.SetDeadline(time.Now().Add(time.Second))
+	r := bufio.NewReader(conn)
+	io.WriteString(conn, "keepalive\n")
+	if ack, err := r.ReadString('\n'); ack != "200\n" || err != nil {
+		t.Fatalf("keepalive = (%q, %v); want (%q, nil)", ack, err, "200\n")
+	}
+	for _, data := range testData[:5] {
+		io.WriteString(conn, data.request+"\n")
+		resp, err := readFrame(r)
+		if resp != data.response || err != nil {
+			t.Errorf("keep-alive %.40q = (%q, %v); want (%q, nil)", data.request, resp, err, data.response)
+		}
+	}
+}
+
+// batchProvider is a MockProvider that only looks users up by name in
+// batches.
+type batchProvider struct {
+	*testbase.MockProvider
+	batches int32
+}
+
+func (p *batchProvider) UserByName(name string) (*accounts.User, error) {
+	return nil, errors.New("unexpected UserByName")
+}
+
+func (p *batchProvider) UsersByName(names []string) ([]*accounts.User, error) {
+	atomic.AddInt32(&p.batches, 1)
+	users := make([]*accounts.User, len(names))
+	for i, name := range names {
+		users[i], _ = p.MockProvider.UserByName(name)
+	}
+	return users, nil
+}
+
+func TestBatchByName(t *testing.T) {
+	socketPath = tempFile()
+	provider := &batchProvider{MockProvider: &testbase.MockProvider{Usrs: testbase.ExpUsers}}
+	startServer(provider)
+	defer os.Remove(socketPath)
+	conn, err := net.DialUnix("unix", nil, &net.UnixAddr{socketPath, "unix"})
+	if err != nil {
+		t.Fatalf("DialUnix() = (_, %v); want (_, nil)", err)
+	}
+	defer conn.Close()
+	conn.SetDeadline(time.Now().Add(time.Second))
+	io.WriteString(conn, "batch user_by_name nil user2 user3\n")
+	resp, err := ioutil.ReadAll(conn)
+	want := "200\n\nuser2:1002:1000:Jane Doe:/home/user2:/bin/zsh\n"
+	if string(resp) != want || err != nil {
+		t.Errorf("ReadAll() = (%q, %v); want (%q, nil)", resp, err, want)
+	}
+	if batches := atomic.LoadInt32(&provider.batches); batches != 1 {
+		t.Errorf("UsersByName() called %v times; want 1", batches)
+	}
+}
+
+func TestMetrics(t *testing.T) {
+	socketPath = tempFile()
+	mock := &testbase.MockProvider{Usrs: testbase.ExpUsers}
+	startServer(mock)
+	defer os.Remove(socketPath)
+	request := func(req string) string {
+		conn, err := net.DialUnix("unix", nil, &net.UnixAddr{socketPath, "unix"})
+		if err != nil {
+			t.Fatalf("DialUnix() = (_, %v); want (_, nil)", err)
+		}
+		defer conn.Close()
+		conn.SetDeadline(time.Now().Add(time.Second))
+		io.WriteString(conn, req)
+		resp, _ := ioutil.ReadAll(conn)
+		return string(resp)
+	}
+	lookups := statsByCommand["user_by_uid"].requests.Value()
+	invalid := statsByCommand["invalid"].requests.Value()
+	request("user_by_uid 1001")
+	request("user_by_uid 1001")
+	request("bogus request")
+	if n := statsByCommand["user_by_uid"].requests.Value() - lookups; n != 2 {
+		t.Errorf("user_by_uid requests counted %v times; want 2", n)
+	}
+	if n := statsByCommand["invalid"].requests.Value() - invalid; n != 1 {
+		t.Errorf("invalid requests counted %v times; want 1", n)
+	}
+	resp := request("metrics")
+	for _, want := range []string{
+		"200\n# HELP gcua_requests_total ",
+		"\n# TYPE gcua_request_duration_seconds histogram\n",
+		"\ngcua_request_duration_seconds_bucket{command=\"user_by_uid\",le=\"+Inf\"} ",
+		"\n# TYPE gcua_connections_in_flight gauge\n",
+	} {
+		if !strings.Contains(resp, want) {
+			t.Errorf("metrics = %q; want it to contain %q", resp, want)
+		}
+	}
+}
+
+func TestWorkerPool(t *testing.T) {
+	socketPath = tempFile()
+	mock := &testbase.MockProvider{Usrs: testbase.ExpUsers}
+	serve(&Server{Provider: mock, Backlog: 32, Workers: 1})
+	defer os.Remove(socketPath)
+	// An open keep-alive connection does not hold the only worker.
+	keepAlive, err := net.DialUnix("unix", nil, &net.UnixAddr{socketPath, "unix"})
+	if err != nil {
+		t.Fatalf("DialUnix() = (_, %v); want (_, nil)", err)
+	}
+	defer keepAlive.Close()
+	io.WriteString(keepAlive, "keepalive\n")
+	r := bufio.NewReader(keepAlive)
+	if ack, err := r.ReadString('\n'); ack != "200\n" || err != nil {
+		t.Fatalf("keep-alive ack = (%q, %v); want (%q, nil)", ack, err, "200\n")
+	}
+	// Concurrent connections wait in the backlog for the worker.
+	want := "200\nuser1:1001:1000:John Doe:/home/user1:/bin/bash"
+	errs := make(chan error)
+	for i := 0; i < 20; i++ {
+		go func() {
+			conn, err := net.DialUnix("unix", nil, &net.UnixAddr{socketPath, "unix"})
+			if err != nil {
+				errs <- err
+				return
+			}
+			defer conn.Close()
+			conn.SetDeadline(time.Now().Add(5 * time.Second))
+			io.WriteString(conn, "user_by_uid 1001")
+			resp, err := ioutil.ReadAll(conn)
+			if err == nil && string(resp) != want {
+				err = errors.New("unexpected response " + strconv.Quote(string(resp)))
+			}
+			errs <- err
+		}()
+	}
+	for i := 0; i < 20; i++ {
+		if err := <-errs; err != nil {
+			t.Errorf("user_by_uid 1001 = %v; want %q", err, want)
+		}
+	}
+}
+
+func TestPage(t *testing.T) {
+	socketPath = tempFile()
+	mock := &testbase.MockProvider{Usrs: testbase.ExpUsers, Grps: testbase.ExpGroups, Nams: testbase.ExpNames}
+	startServer(mock)
+	defer os.Remove(socketPath)
+	testData := []struct {
+		request  string
+		response string
+	}{
+		{"page users 1", "200\nuser1:1001:1000:John Doe:/home/user1:/bin/bash"},
+		{"page users 1 user1", "200\nuser2:1002:1000:Jane Doe:/home/user2:/bin/zsh"},
+		{"page users 1 user2", "200"},
+		{"page groups 5", "200\ngroup1:1000:\ngroup2:1001:user2,user1"},
+		{"page names 2 group1", "200\ngroup2\nuser1"},
+		{"page names 2 a", "200\ngroup1\ngroup2"},
+		{"page names 0", "400"},
+		{"page keys 1", "400"},
+		{"page users", "400"},
+	}
+	for _, data := range testData {
+		conn, err := net.DialUnix("unix", nil, &net.UnixAddr{socketPath, "unix"})
+		if err != nil {
+			t.Fatalf("DialUnix() = (_, %v); want (_, nil)", err)
+		}
+		conn.SetDeadline(time.Now().Add(time.Second))
+		io.WriteString(conn, data.request)
+		resp, err := ioutil.ReadAll(conn)
+		conn.Close()
+		if string(resp) != data.response || err != nil {
+			t.Errorf("%q = (%q, %v); want (%q, nil)", data.request, resp, err, data.response)
+		}
+	}
+}
+
+// usersCountingProvider counts the calls to Users.
+type usersCountingProvider struct {
+	*versionedProvider
+	calls int
+}
+
+func (p *usersCountingProvider) Users() ([]*accounts.User, error) {
+	p.calls++
+	return p.versionedProvider.Users()
+}
+
+func TestPageSortedOncePerGeneration(t *testing.T) {
+	mock := &usersCountingProvider{versionedProvider: &versionedProvider{MockProvider: &testbase.MockProvider{Usrs: testbase.ExpUsers}, generation: 1}}
+	server := &Server{Provider: mock}
+	want := "200\nuser2:1002:1000:Jane Doe:/home/user2:/bin/zsh"
+	for i := 0; i < 3; i++ {
+		if resp := server.page([]string{"users", "1", "user1"}); resp != want {
+			t.Errorf("page users 1 user1 = %q; want %q", resp, want)
+		}
+	}
+	if mock.calls != 1 {
+		t.Errorf("Users() called %v times for one generation; want 1", mock.calls)
+	}
+	mock.generation++
+	mock.Usrs = testbase.ExpUsers[:1]
+	if resp := server.page([]string{"users", "1", "user1"}); resp != "200" {
+		t.Errorf("page users 1 user1 = %q; want %q", resp, "200")
+	}
+	if mock.calls != 2 {
+		t.Errorf("Users() called %v times for two generations; want 2", mock.calls)
+	}
+}
+
+func TestDetachedLimit(t *testing.T) {
+	socketPath = tempFile()
+	mock := &testbase.MockProvider{Usrs: testbase.ExpUsers}
+	serve(&Server{Provider: mock, Workers: 1, Detached: 1})
+	defer os.Remove(socketPath)
+	keepAlive := func() (net.Conn, string) {
+		conn, err := net.DialUnix("unix", nil, &net.UnixAddr{socketPath, "unix"})
+		if err != nil {
+			t.Fatalf("DialUnix() = (_, %v); want (_, nil)", err)
+		}
+		conn.SetDeadline(time.Now().Add(time.Second))
+		io.WriteString(conn, "keepalive\n")
+		ack := make([]byte, 4)
+		n, _ := io.ReadAtLeast(conn, ack, 3)
+		return conn, string(ack[:n])
+	}
+	first, ack := keepAlive()
+	if ack != "200\n" {
+		t.Fatalf("keepalive = %q; want %q", ack, "200\n")
+	}
+	// Over the limit, keep-alive is refused so that clients fall back to
+	// one-shot requests.
+	second, ack := keepAlive()
+	second.Close()
+	if ack != "503" {
+		t.Errorf("keepalive over the limit = %q; want %q", ack, "503")
+	}
+	conn, err := net.DialUnix("unix", nil, &net.UnixAddr{socketPath, "unix"})
+	if err != nil {
+		t.Fatalf("DialUnix() = (_, %v); want (_, nil)", err)
+	}
+	conn.SetDeadline(time.Now().Add(time.Second))
+	io.WriteString(conn, "stream users")
+	resp, err := ioutil.ReadAll(conn)
+	conn.Close()
+	// Streams over the limit are served by the worker.
+	if !strings.HasPrefix(string(resp), "200\nuser1:") || err != nil {
+		t.Errorf("stream users over the limit = (%q, %v); want users", resp, err)
+	}
+	first.Close()
+	// The slot is released once the connection is closed.
+	for i := 0; ; i++ {
+		conn, ack := keepAlive()
+		conn.Close()
+		if ack == "200\n" {
+			break
+		} else if i == 100 {
+			t.Fatalf("keepalive after close = %q; want %q", ack, "200\n")
+		}
+		time.Sleep(10 * time.Millisecond)
+	}
+}
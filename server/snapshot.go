@@ -0,0 +1,226 @@
+// Copyright 2015 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package server
+
+import (
+	"encoding/binary"
+	"hash/fnv"
+	"io/ioutil"
+	"os"
+	"sort"
+	"sync"
+	"time"
+
+	"github.com/GoogleCloudPlatform/compute-user-accounts/accounts"
+)
+
+// A snapshot file is an immutable, little-endian encoding of all users and
+// groups that the NSS plugin maps into memory to answer lookups without
+// contacting the daemon. It is laid out as:
+//
+//	header            snapshotHeaderSize bytes, see the offsets below
+//	users by name     index entries sorted by FNV-1a hash of the name
+//	users by UID      index entries sorted by UID
+//	groups by name    index entries sorted by FNV-1a hash of the name
+//	groups by GID     index entries sorted by GID
+//	lines             users and groups in the socket response format
+//
+// Each index entry is three uint32s: the key, and the offset and length of
+// the entity's line within the lines section.
+//
+// The header is the only part of a snapshot that is modified after it is
+// written: once a newer snapshot replaces it, its superseded field is set so
+// that processes mapping it know to map the new one, and when a refresh finds
+// that nothing changed only its refresh time is updated.
+const (
+	snapshotMagic      = "GCUASNAP"
+	snapshotVersion    = 1
+	snapshotHeaderSize = 64
+	snapshotEntrySize  = 12
+
+	versionOffset      = 8
+	supersededOffset   = 12
+	generationOffset   = 16
+	refreshTimeOffset  = 24
+	userCountOffset    = 32
+	groupCountOffset   = 36
+	usersByNameOffset  = 40
+	usersByUIDOffset   = 44
+	groupsByNameOffset = 48
+	groupsByGIDOffset  = 52
+	linesOffset        = 56
+	linesSizeOffset    = 60
+)
+
+// snapshotTimeNow is mocked in tests.
+var snapshotTimeNow = time.Now
+
+// A SnapshotWriter publishes account snapshots to a file.
+type SnapshotWriter struct {
+	// Path is the file that snapshots are written to. It should be on a
+	// memory backed file system.
+	Path string
+
+	mu         sync.Mutex
+	generation uint64
+	// provided is the generation of the GenerationProvider the current
+	// snapshot was written from, if versioned is set.
+	provided  uint64
+	versioned bool
+}
+
+type snapshotEntry struct {
+	key    uint32
+	name   string
+	offset uint32
+	length uint32
+}
+
+type entrySlice []snapshotEntry
+
+func (s entrySlice) Len() int      { return len(s) }
+func (s entrySlice) Swap(i, j int) { s[i], s[j] = s[j], s[i] }
+func (s entrySlice) Less(i, j int) bool {
+	if s[i].key != s[j].key {
+		return s[i].key < s[j].key
+	}
+	return s[i].name < s[j].name
+}
+
+// Write atomically replaces the snapshot with the users and groups of an
+// AccountProvider. If the provider is an accounts.GenerationProvider whose
+// generation did not change, only the refresh time of the snapshot is updated.
+func (w *SnapshotWriter) Write(provider accounts.AccountProvider) error {
+	// Holding the lock while fetching data ensures that snapshots are
+	// written in the order their data was fetched.
+	w.mu.Lock()
+	defer w.mu.Unlock()
+	// The generation is read first so that it is never newer than the data.
+	gp, versioned := provider.(accounts.GenerationProvider)
+	var provided uint64
+	if versioned {
+		provided = gp.Generation()
+		if w.versioned && w.provided == provided && w.touch() == nil {
+			return nil
+		}
+	}
+	w.versioned = false
+	users, err := provider.Users()
+	if err != nil {
+		return err
+	}
+	groups, err := provider.Groups()
+	if err != nil {
+		return err
+	}
+	w.generation++
+	data := encodeSnapshot(users, groups, w.generation, snapshotTimeNow())
+	tmp := w.Path + ".tmp"
+	if err := ioutil.WriteFile(tmp, data, 0644); err != nil {
+		return err
+	}
+	// Make the snapshot readable by all regardless of umask.
+	if err := os.Chmod(tmp, 0644); err != nil {
+		return err
+	}
+	old, oldErr := os.OpenFile(w.Path, os.O_WRONLY, 0)
+	if err := os.Rename(tmp, w.Path); err != nil {
+		if oldErr == nil {
+			old.Close()
+		}
+		return err
+	}
+	w.provided, w.versioned = provided, versioned
+	if oldErr == nil {
+		defer old.Close()
+		_, err = old.WriteAt([]byte{1, 0, 0, 0}, supersededOffset)
+	}
+	return err
+}
+
+// touch updates the refresh time of the current snapshot.
+func (w *SnapshotWriter) touch() error {
+	f, err := os.OpenFile(w.Path, os.O_WRONLY, 0)
+	if err != nil {
+		return err
+	}
+	defer f.Close()
+	var refreshTime [8]byte
+	binary.LittleEndian.PutUint64(refreshTime[:], uint64(snapshotTimeNow().Unix()))
+	_, err = f.WriteAt(refreshTime[:], refreshTimeOffset)
+	return err
+}
+
+func nameHash(name string) uint32 {
+	h := fnv.New32a()
+	h.Write([]byte(name))
+	return h.Sum32()
+}
+
+func encodeSnapshot(users []*accounts.User, groups []*accounts.Group, generation uint64, refreshTime time.Time) []byte {
+	var lines []byte
+	appendLine := func(line string) (uint32, uint32) {
+		offset := uint32(len(lines))
+		lines = append(lines, line...)
+		return offset, uint32(len(line))
+	}
+	usersByName := make(entrySlice, len(users))
+	usersByUID := make(entrySlice, len(users))
+	for i, u := range users {
+		offset, length := appendLine(marshalUser(u))
+		usersByName[i] = snapshotEntry{nameHash(u.Name), u.Name, offset, length}
+		usersByUID[i] = snapshotEntry{u.UID, "", offset, length}
+	}
+	groupsByName := make(entrySlice, len(groups))
+	groupsByGID := make(entrySlice, len(groups))
+	for i, g := range groups {
+		offset, length := appendLine(marshalGroup(g))
+		groupsByName[i] = snapshotEntry{nameHash(g.Name), g.Name, offset, length}
+		groupsByGID[i] = snapshotEntry{g.GID, "", offset, length}
+	}
+
+	indexSize := snapshotEntrySize * 2 * (len(users) + len(groups))
+	data := make([]byte, snapshotHeaderSize, snapshotHeaderSize+indexSize+len(lines))
+	copy(data, snapshotMagic)
+	le := binary.LittleEndian
+	le.PutUint32(data[versionOffset:], snapshotVersion)
+	le.PutUint64(data[generationOffset:], generation)
+	le.PutUint64(data[refreshTimeOffset:], uint64(refreshTime.Unix()))
+	le.PutUint32(data[userCountOffset:], uint32(len(users)))
+	le.PutUint32(data[groupCountOffset:], uint32(len(groups)))
+	indexes := []struct {
+		offset  int
+		entries entrySlice
+	}{
+		{usersByNameOffset, usersByName},
+		{usersByUIDOffset, usersByUID},
+		{groupsByNameOffset, groupsByName},
+		{groupsByGIDOffset, groupsByGID},
+	}
+	var entry [snapshotEntrySize]byte
+	for _, index := range indexes {
+		le.PutUint32(data[index.offset:], uint32(len(data)))
+		sort.Sort(index.entries)
+		for _, e := range index.entries {
+			le.PutUint32(entry[0:], e.key)
+			le.PutUint32(entry[4:], e.offset)
+			le.PutUint32(entry[8:], e.length)
+			data = append(data, entry[:]...)
+		}
+	}
+	le.PutUint32(data[linesOffset:], uint32(len(data)))
+	le.PutUint32(data[linesSizeOffset:], uint32(len(lines)))
+	return append(data, lines...)
+}
@@ -0,0 +1,222 @@
+// Copyright 2015 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package server
+
+import (
+	"encoding/binary"
+	"errors"
+	"io/ioutil"
+	"os"
+	"reflect"
+	"testing"
+	"time"
+
+	"github.com/GoogleCloudPlatform/compute-user-accounts/testbase"
+)
+
+type decodedSnapshot struct {
+	superseded   uint32
+	generation   uint64
+	refreshTime  int64
+	usersByName  []string
+	usersByUID   []uint32
+	groupsByName []string
+	groupsByGID  []uint32
+}
+
+func decodeSnapshot(t *testing.T, data []byte) *decodedSnapshot {
+	le := binary.LittleEndian
+	if string(data[:8]) != snapshotMagic || le.Uint32(data[versionOffset:]) != snapshotVersion {
+		t.Fatalf("invalid snapshot header: %q", data[:snapshotHeaderSize])
+	}
+	users := int(le.Uint32(data[userCountOffset:]))
+	groups := int(le.Uint32(data[groupCountOffset:]))
+	lines := data[le.Uint32(data[linesOffset:]):]
+	if len(lines) != int(le.Uint32(data[linesSizeOffset:])) {
+		t.Fatalf("len(lines) = %v; want %v", len(lines), le.Uint32(data[linesSizeOffset:]))
+	}
+	index := func(offset, count int, keys func(key uint32, line string)) {
+		entries := data[le.Uint32(data[offset:]):]
+		var lastKey uint32
+		for i := 0; i < count; i++ {
+			entry := entries[i*snapshotEntrySize:]
+			key := le.Uint32(entry)
+			if key < lastKey {
+				t.Errorf("index at %v is not sorted", offset)
+			}
+			lastKey = key
+			start := le.Uint32(entry[4:])
+			keys(key, string(lines[start:start+le.Uint32(entry[8:])]))
+		}
+	}
+	s := &decodedSnapshot{
+		superseded:  le.Uint32(data[supersededOffset:]),
+		generation:  le.Uint64(data[generationOffset:]),
+		refreshTime: int64(le.Uint64(data[refreshTimeOffset:])),
+	}
+	index(usersByNameOffset, users, func(key uint32, line string) {
+		if u, err := unmarshalUser(line); err != nil || nameHash(u.Name) != key {
+			t.Errorf("invalid users by name entry %v: %q", key, line)
+		}
+		s.usersByName = append(s.usersByName, line)
+	})
+	index(usersByUIDOffset, users, func(key uint32, line string) {
+		if u, err := unmarshalUser(line); err != nil || u.UID != key {
+			t.Errorf("invalid users by UID entry %v: %q", key, line)
+		}
+		s.usersByUID = append(s.usersByUID, key)
+	})
+	index(groupsByNameOffset, groups, func(key uint32, line string) {
+		if g, err := unmarshalGroup(line); err != nil || nameHash(g.Name) != key {
+			t.Errorf("invalid groups by name entry %v: %q", key, line)
+		}
+		s.groupsByName = append(s.groupsByName, line)
+	})
+	index(groupsByGIDOffset, groups, func(key uint32, line string) {
+		if g, err := unmarshalGroup(line); err != nil || g.GID != key {
+			t.Errorf("invalid groups by GID entry %v: %q", key, line)
+		}
+		s.groupsByGID = append(s.groupsByGID, key)
+	})
+	return s
+}
+
+// versionedProvider is a MockProvider numbered by generation.
+type versionedProvider struct {
+	*testbase.MockProvider
+	generation uint64
+}
+
+func (p *versionedProvider) Generation() uint64 { return p.generation }
+
+func TestSnapshotWriterUnchangedGeneration(t *testing.T) {
+	mTime := time.Unix(1440000000, 0)
+	snapshotTimeNow = func() time.Time { return mTime }
+	defer func() { snapshotTimeNow = time.Now }()
+	path := tempFile()
+	os.Remove(path)
+	defer os.Remove(path)
+	writer := &SnapshotWriter{Path: path}
+	provider := &versionedProvider{&testbase.MockProvider{Usrs: testbase.ExpUsers, Grps: testbase.ExpGroups}, 7}
+	if err := writer.Write(provider); err != nil {
+		t.Fatalf("Write() = %v; want nil", err)
+	}
+	old, err := os.Open(path)
+	if err != nil {
+		t.Fatalf("Open() = (_, %v); want (_, nil)", err)
+	}
+	defer old.Close()
+
+	// The same generation only advances the refresh time of the snapshot.
+	mTime = mTime.Add(time.Minute)
+	provider.Usrs = nil
+	if err := writer.Write(provider); err != nil {
+		t.Fatalf("Write() = %v; want nil", err)
+	}
+	data, _ := ioutil.ReadAll(old)
+	s := decodeSnapshot(t, data)
+	if s.superseded != 0 || s.generation != 1 || s.refreshTime != mTime.Unix() || len(s.usersByUID) != 2 {
+		t.Errorf("touched snapshot = %+v; want generation 1 with refresh time %v and two users", s, mTime.Unix())
+	}
+
+	// A new generation replaces it.
+	provider.generation++
+	if err := writer.Write(provider); err != nil {
+		t.Fatalf("Write() = %v; want nil", err)
+	}
+	data, _ = ioutil.ReadFile(path)
+	s = decodeSnapshot(t, data)
+	if s.generation != 2 || len(s.usersByUID) != 0 {
+		t.Errorf("new snapshot = %+v; want generation 2 and no users", s)
+	}
+
+	// A missing snapshot is written again even if nothing changed.
+	os.Remove(path)
+	if err := writer.Write(provider); err != nil {
+		t.Fatalf("Write() = %v; want nil", err)
+	}
+	if data, err := ioutil.ReadFile(path); err != nil || decodeSnapshot(t, data).generation != 3 {
+		t.Errorf("ReadFile() = (_, %v); want snapshot with generation 3", err)
+	}
+}
+
+func TestSnapshotWriter(t *testing.T) {
+	mTime := time.Unix(1440000000, 0)
+	snapshotTimeNow = func() time.Time { return mTime }
+	defer func() { snapshotTimeNow = time.Now }()
+	path := tempFile()
+	os.Remove(path)
+	defer os.Remove(path)
+	writer := &SnapshotWriter{Path: path}
+	mock := &testbase.MockProvider{Usrs: testbase.ExpUsers, Grps: testbase.ExpGroups}
+	if err := writer.Write(mock); err != nil {
+		t.Fatalf("Write() = %v; want nil", err)
+	}
+	old, err := os.Open(path)
+	if err != nil {
+		t.Fatalf("Open() = (_, %v); want (_, nil)", err)
+	}
+	defer old.Close()
+	data, _ := ioutil.ReadAll(old)
+	s := decodeSnapshot(t, data)
+	exp := &decodedSnapshot{
+		superseded:  0,
+		generation:  1,
+		refreshTime: 1440000000,
+		// FNV-1a hashes are 0xa07d2cf9 for user1, 0x9d7d2840 for user2,
+		// 0x6d6b6387 for group1 and 0x6e6b651a for group2.
+		usersByName: []string{
+			"user2:1002:1000:Jane Doe:/home/user2:/bin/zsh",
+			"user1:1001:1000:John Doe:/home/user1:/bin/bash",
+		},
+		usersByUID: []uint32{1001, 1002},
+		groupsByName: []string{
+			"group1:1000:",
+			"group2:1001:user2,user1",
+		},
+		groupsByGID: []uint32{1000, 1001},
+	}
+	if !reflect.DeepEqual(s, exp) {
+		t.Errorf("snapshot = %+v; want %+v", s, exp)
+	}
+
+	// Writing a new snapshot supersedes the old one.
+	mock.Usrs = mock.Usrs[:1]
+	if err := writer.Write(mock); err != nil {
+		t.Fatalf("Write() = %v; want nil", err)
+	}
+	var superseded [4]byte
+	old.ReadAt(superseded[:], supersededOffset)
+	if superseded != [4]byte{1, 0, 0, 0} {
+		t.Errorf("old superseded = %v; want [1 0 0 0]", superseded)
+	}
+	data, _ = ioutil.ReadFile(path)
+	s = decodeSnapshot(t, data)
+	if s.superseded != 0 || s.generation != 2 || len(s.usersByUID) != 1 {
+		t.Errorf("new snapshot = %+v; want not superseded with generation 2 and one user", s)
+	}
+	if info, err := os.Stat(path); err != nil || info.Mode().Perm() != 0644 {
+		t.Errorf("Stat() = (%v, %v); want mode 0644", info, err)
+	}
+
+	// A failed provider leaves the current snapshot in place.
+	mock.Err = errors.New("")
+	if err := writer.Write(mock); err == nil {
+		t.Errorf("Write() = nil; want !nil")
+	}
+	if after, _ := ioutil.ReadFile(path); !reflect.DeepEqual(after, data) {
+		t.Errorf("snapshot changed after failed Write()")
+	}
+}
@@ -0,0 +1,143 @@
+// Copyright 2015 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package store
+
+import (
+	"bytes"
+	"encoding/gob"
+	"io/ioutil"
+	"os"
+	"time"
+
+	"github.com/GoogleCloudPlatform/compute-user-accounts/accounts"
+	"github.com/GoogleCloudPlatform/compute-user-accounts/logger"
+
+	cua "google.golang.org/api/clouduseraccounts/vm_beta"
+)
+
+// A cache file is the gob encoding of a cacheFile holding the last users,
+// groups and authorized keys of a store, so that a restarted daemon answers
+// lookups before its first refresh from the API. Files of other versions are
+// ignored.
+const cacheVersion = 1
+
+type cacheFile struct {
+	Version int
+	Users   []cacheUser
+	Groups  []*accounts.Group
+}
+
+type cacheUser struct {
+	User        *accounts.User
+	Keys        []string
+	Sudoer      bool
+	RefreshTime time.Time
+}
+
+// saveCache atomically replaces the cache file with the current snapshot and
+// key states. Errors are logged, since the cache is only an optimization.
+func (s *cachingStore) saveCache() {
+	path := s.config.CachePath
+	if path == "" {
+		return
+	}
+	s.cacheMu.Lock()
+	defer s.cacheMu.Unlock()
+	snap := s.accounts()
+	f := &cacheFile{
+		Version: cacheVersion,
+		Users:   make([]cacheUser, 0, len(snap.usersByName)),
+		Groups:  make([]*accounts.Group, 0, len(snap.groupsByName)),
+	}
+	for _, cu := range snap.usersByName {
+		state := cu.keyState()
+		f.Users = append(f.Users, cacheUser{cu.user, state.keys, state.sudoer, state.refreshTime})
+	}
+	for _, g := range snap.groupsByName {
+		f.Groups = append(f.Groups, g)
+	}
+	var buf bytes.Buffer
+	if err := gob.NewEncoder(&buf).Encode(f); err != nil {
+		logger.Errorf("Failed to encode cache: %v.", err)
+		return
+	}
+	tmp := path + ".tmp"
+	if err := ioutil.WriteFile(tmp, buf.Bytes(), 0600); err != nil {
+		logger.Errorf("Failed to write cache: %v.", err)
+		return
+	}
+	if err := os.Rename(tmp, path); err != nil {
+		logger.Errorf("Failed to write cache: %v.", err)
+	}
+}
+
+// loadCache publishes the snapshot saved in the cache file. It returns false
+// if there is no usable cache file.
+func (s *cachingStore) loadCache() bool {
+	path := s.config.CachePath
+	if path == "" {
+		return false
+	}
+	data, err := ioutil.ReadFile(path)
+	if err != nil {
+		if !os.IsNotExist(err) {
+			logger.Errorf("Failed to read cache: %v.", err)
+		}
+		return false
+	}
+	var f cacheFile
+	if err := gob.NewDecoder(bytes.NewReader(data)).Decode(&f); err != nil {
+		logger.Errorf("Failed to decode cache: %v.", err)
+		return false
+	}
+	if f.Version != cacheVersion {
+		logger.Infof("Ignoring cache of version %v.", f.Version)
+		return false
+	}
+	// The cached entities are indexed like the views of a refresh.
+	users := make([]*cua.LinuxUserView, len(f.Users))
+	for i, cu := range f.Users {
+		u := cu.User
+		users[i] = &cua.LinuxUserView{
+			Username:      u.Name,
+			Uid:           int64(u.UID),
+			Gid:           int64(u.GID),
+			Gecos:         u.Gecos,
+			HomeDirectory: u.HomeDirectory,
+			Shell:         u.Shell,
+		}
+	}
+	groups := make([]*cua.LinuxGroupView, len(f.Groups))
+	for i, g := range f.Groups {
+		groups[i] = &cua.LinuxGroupView{
+			GroupName: g.Name,
+			Gid:       int64(g.GID),
+			Members:   g.Members,
+		}
+	}
+	snap := &accountsSnapshot{generation: 1}
+	applyUsers(snap, &accountsSnapshot{}, users)
+	applyGroups(snap, &accountsSnapshot{}, groups)
+	for _, cu := range f.Users {
+		snap.usersByName[cu.User.Name].state.Store(&keyState{cu.Keys, cu.Sudoer, cu.RefreshTime})
+	}
+	s.writeMu.Lock()
+	s.snapshot.Store(snap)
+	s.writeMu.Unlock()
+	userCount.Set(float64(len(snap.usersByName)))
+	groupCount.Set(float64(len(snap.groupsByName)))
+	logger.Infof("Loaded %v users and %v groups from cache.", len(snap.usersByName), len(snap.groupsByName))
+	return true
+}
@@ -0,0 +1,98 @@
+// Copyright 2015 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+package store
+
+import (
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"reflect"
+	"testing"
+	"time"
+
+	"github.com/GoogleCloudPlatform/compute-user-accounts/testbase"
+
+	cua "google.golang.org/api/clouduseraccounts/vm_beta"
+)
+
+// blockingAPIClient holds users and groups requests until release is closed.
+type blockingAPIClient struct {
+	*mockAPIClient
+	release chan struct{}
+}
+
+// UsersAndGroups satisfies APIClient.
+func (c *blockingAPIClient) UsersAndGroups() ([]*cua.LinuxUserView, []*cua.LinuxGroupView, error) {
+	<-c.release
+	return c.mockAPIClient.UsersAndGroups()
+}
+
+func TestWarmCache(t *testing.T) {
+	dir, err := ioutil.TempDir("", "gcua")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+	newConfig := func() *Config {
+		return &Config{
+			AccountRefreshFrequency: time.Hour,
+			AccountRefreshCooldown:  0,
+			KeyRefreshFrequency:     time.Hour,
+			KeyRefreshCooldown:      time.Hour,
+			CachePath:               filepath.Join(dir, "cache"),
+		}
+	}
+	testStore(newMock(), newConfig())
+
+	// A restarted store answers from the cache before its first refresh.
+	blocking := &blockingAPIClient{newMock(), make(chan struct{})}
+	defer close(blocking.release)
+	store := New(blocking, newConfig())
+	if u, err := store.UserByName("user1"); err != nil || !reflect.DeepEqual(u, testbase.ExpUsers[0]) {
+		t.Errorf(`UserByName("user1") = (%+v, %v); want (%+v, nil)`, u, err, testbase.ExpUsers[0])
+	}
+	if g, err := store.GroupByGID(1001); err != nil || !reflect.DeepEqual(g.Members, []string{"user2", "user1"}) {
+		t.Errorf("GroupByGID(1001) = (%+v, %v); want members [user2 user1]", g, err)
+	}
+	if keys, _ := store.AuthorizedKeys("user1"); !reflect.DeepEqual(keys, testbase.ExpKeys["user1"]) {
+		t.Errorf(`AuthorizedKeys("user1") = %v; want %v`, keys, testbase.ExpKeys["user1"])
+	}
+	if gids, _ := store.GIDsForUser("user1"); !reflect.DeepEqual(gids, []uint32{1001, 4001}) {
+		t.Errorf(`GIDsForUser("user1") = %v; want [1001 4001]`, gids)
+	}
+}
+
+func TestInvalidWarmCache(t *testing.T) {
+	dir, err := ioutil.TempDir("", "gcua")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+	config := &Config{
+		AccountRefreshFrequency: time.Hour,
+		AccountRefreshCooldown:  0,
+		KeyRefreshFrequency:     time.Hour,
+		KeyRefreshCooldown:      0,
+		CachePath:               filepath.Join(dir, "cache"),
+	}
+	if err := ioutil.WriteFile(config.CachePath, []byte("garbage"), 0600); err != nil {
+		t.Fatal(err)
+	}
+	// The store waits for a refresh as if there were no cache.
+	store := testStore(newMock(), config)
+	if u, err := store.UserByName("user2"); err != nil || !reflect.DeepEqual(u, testbase.ExpUsers[1]) {
+		t.Errorf(`UserByName("user2") = (%+v, %v); want (%+v, nil)`, u, err, testbase.ExpUsers[1])
+	}
+}
@@ -16,12 +16,15 @@
 package store
 
 import (
+	"strings"
 	"sync"
+	"sync/atomic"
 	"time"
 
 	"github.com/GoogleCloudPlatform/compute-user-accounts/accounts"
 	"github.com/GoogleCloudPlatform/compute-user-accounts/apiclient"
 	"github.com/GoogleCloudPlatform/compute-user-accounts/logger"
+	"github.com/GoogleCloudPlatform/compute-user-accounts/metrics"
 
 	cua "google.golang.org/api/clouduseraccounts/vm_beta"
 )
@@ -33,13 +36,16 @@ const (
 	sudoersGroupGID  = 4001
 )
 
-// These are mocked in tests.
+// defaultKeyRefreshConcurrency is used if Config.KeyRefreshConcurrency is not
+// set.
+const defaultKeyRefreshConcurrency = 16
+
 var (
-	timeNow   = time.Now
-	timeAfter = time.After
-	// refreshCallback exposes a testing callback invoked when the
-	// store has refreshed user, group, and key data.
-	refreshCallback = func(*Config) {}
+	refreshDuration = metrics.NewHistogramVec("gcua_refresh_duration_seconds", "Time taken by refreshes from the API, by kind.", "kind")
+	refreshFailures = metrics.NewCounterVec("gcua_refresh_failures_total", "Failed refreshes from the API, by kind.", "kind")
+	userCount       = metrics.NewGauge("gcua_users", "Users in the store.")
+	groupCount      = metrics.NewGauge("gcua_groups", "Groups in the store, not including the sudoers group.")
+	oldestKeys      = metrics.NewGauge("gcua_keys_oldest_refresh_timestamp_seconds", "Unix time at which the least recently refreshed authorized keys were fetched.")
 )
 
 // A Config provides configuration options for a store AccountProvider.
@@ -50,31 +56,256 @@ type Config struct {
 	// AccountRefreshCooldown defines how long to block on-demand refreshes
 	// of user and group information after a refresh.
 	AccountRefreshCooldown time.Duration
+	// AccountRefreshWindow defines how long an on-demand refresh of user
+	// and group information waits for further lookup misses to share it.
+	AccountRefreshWindow time.Duration
 	// KeyRefreshFrequency defines how often to perform scheduled refreshes
 	// of authorized keys information.
 	KeyRefreshFrequency time.Duration
 	// KeyRefreshCooldown defines how long to block on-demand refreshes of
 	// authorized keys information after a refresh.
 	KeyRefreshCooldown time.Duration
+	// KeyRefreshConcurrency bounds the number of authorized keys requests
+	// that scheduled refreshes have in flight.
+	KeyRefreshConcurrency int
+	// KeyRefreshRate, if positive, bounds the number of authorized keys
+	// requests per second that scheduled refreshes start. On-demand
+	// refreshes are not limited.
+	KeyRefreshRate float64
+	// CachePath, if set, is a file that the users, groups and authorized
+	// keys of the store are saved to after each refresh. New loads it to
+	// answer lookups right away, and refreshes from the API in the
+	// background, instead of waiting for the first refresh.
+	CachePath string
+	// UpdateCallback, if set, is invoked with the store after each refresh
+	// of user and group information and after the members of the sudoers
+	// group change. The store is an accounts.GenerationProvider, so the
+	// callback can skip work when its generation did not change.
+	UpdateCallback func(accounts.AccountProvider)
+
+	// These are mocked in tests, so that each test configures its own
+	// store. If unset, time.Now and time.After are used.
+	timeNow   func() time.Time
+	timeAfter func(time.Duration) <-chan time.Time
+	// refreshCallback, if set, exposes a testing callback invoked when
+	// the store has refreshed user, group, and key data.
+	refreshCallback func()
+}
+
+// keyState is the authorized keys information of a user. It is replaced
+// rather than modified once published.
+type keyState struct {
+	keys        []string
+	sudoer      bool
+	refreshTime time.Time
 }
 
 type cachedUser struct {
-	user           *accounts.User
-	keys           []string
-	sudoer         bool
-	keyRefreshTime time.Time
+	user *accounts.User
+	// state holds the current *keyState of the user.
+	state atomic.Value
+}
+
+func newCachedUser(user *accounts.User, state *keyState) *cachedUser {
+	cu := &cachedUser{user: user}
+	cu.state.Store(state)
+	return cu
+}
+
+func (cu *cachedUser) keyState() *keyState {
+	return cu.state.Load().(*keyState)
+}
+
+// updateKeyState publishes state unless the current key state of the user was
+// refreshed after it, and reports whether the sudoer bit of the user changed.
+// It must be called under writeMu.
+func (cu *cachedUser) updateKeyState(state *keyState) (sudoerChanged bool) {
+	old := cu.keyState()
+	if !state.refreshTime.After(old.refreshTime) {
+		return false
+	}
+	cu.state.Store(state)
+	return old.sudoer != state.sudoer
+}
+
+// accountsSnapshot indexes users and groups. It is never modified once
+// published.
+type accountsSnapshot struct {
+	// generation is increased whenever a user or group changes.
+	generation   uint64
+	usersByName  map[string]*cachedUser
+	usersByUID   map[uint32]*cachedUser
+	groupsByName map[string]*accounts.Group
+	groupsByGID  map[uint32]*accounts.Group
+	members      *memberIndex
+}
+
+// memberIndex interns the members of the groups of a snapshot. Each name is
+// stored once, shared with its user if there is one, and groups with the same
+// members share a single list, so that large memberships repeated across many
+// groups cost one copy.
+type memberIndex struct {
+	// ids maps the names of members to their position in names.
+	ids   map[string]uint32
+	names []string
+	// gids holds the GIDs of the groups of each member by ID, excluding the
+	// sudoers group.
+	gids [][]uint32
+}
+
+// memberLists dedupes membership lists while a memberIndex is built.
+type memberLists struct {
+	index *memberIndex
+	old   *memberIndex
+	users map[string]*cachedUser
+	// lists maps the NUL-joined names of a membership list to its interned
+	// form.
+	lists map[string][]string
+}
+
+// intern returns the ID of a member, reusing the string of the same name in
+// the old index or of the user with that name.
+func (l *memberLists) intern(name string) uint32 {
+	if id, ok := l.index.ids[name]; ok {
+		return id
+	}
+	if id, ok := l.old.ids[name]; ok {
+		name = l.old.names[id]
+	} else if cu, ok := l.users[name]; ok {
+		name = cu.user.Name
+	}
+	id := uint32(len(l.index.names))
+	l.index.ids[name] = id
+	l.index.names = append(l.index.names, name)
+	l.index.gids = append(l.index.gids, nil)
+	return id
+}
+
+// add indexes the members of a group and returns its interned membership
+// list. If keep is set, members becomes the interned list unless there
+// already is one.
+func (l *memberLists) add(gid uint32, members []string, keep bool) []string {
+	if len(members) == 0 {
+		return members
+	}
+	key := strings.Join(members, "\x00")
+	list, ok := l.lists[key]
+	// Names with NUL characters could give different lists the same key,
+	// so the list of a key is only shared by lists with the same names.
+	collision := ok && !sameMembers(list, members)
+	if collision {
+		ok = false
+	} else if !ok && keep {
+		list, ok = members, true
+		l.lists[key] = list
+	}
+	if !ok {
+		list = make([]string, len(members))
+	}
+	for i, m := range members {
+		id := l.intern(m)
+		l.index.gids[id] = append(l.index.gids[id], gid)
+		if !ok {
+			list[i] = l.index.names[id]
+		}
+	}
+	if !ok && !collision {
+		l.lists[key] = list
+	}
+	return list
+}
+
+// sameMembers returns whether two membership lists have the same names in
+// the same order.
+func sameMembers(a, b []string) bool {
+	if len(a) != len(b) {
+		return false
+	}
+	for i := range a {
+		if a[i] != b[i] {
+			return false
+		}
+	}
+	return true
+}
+
+// gidsFor returns the GIDs of the groups of a member.
+func (idx *memberIndex) gidsFor(name string) []uint32 {
+	if idx == nil {
+		return nil
+	}
+	if id, ok := idx.ids[name]; ok {
+		return idx.gids[id]
+	}
+	return nil
 }
 
 // cachingStore implements AccountProvider as an in-memory store.
+//
+// Readers load the current accountsSnapshot and key states without locking.
+// Refreshes publish a new snapshot, and key updates a new keyState for each
+// user, so that lookups never wait for them.
 type cachingStore struct {
-	sync.RWMutex
+	// writeMu serializes the publication of snapshots and key states.
+	writeMu       sync.Mutex
+	snapshot      atomic.Value
 	apiClient     apiclient.APIClient
 	config        *Config
 	updateWaiters chan chan struct{}
-	usersByName   map[string]*cachedUser
-	usersByUID    map[uint32]*cachedUser
-	groupsByName  map[string]*accounts.Group
-	groupsByGID   map[uint32]*accounts.Group
+	// refreshMu guards pendingRefresh, the channel closed by the on-demand
+	// refresh of users and groups that has been requested but not started.
+	refreshMu      sync.Mutex
+	pendingRefresh chan struct{}
+	// keyRefreshRunning is 1 while a scheduled key refresh runs, so that
+	// no other one starts meanwhile.
+	keyRefreshRunning int32
+	keyThrottle       *throttle
+	// fetchMu guards keyFetches, the authorized keys requests in flight by
+	// username.
+	fetchMu    sync.Mutex
+	keyFetches map[string]*keyFetch
+	// cacheMu serializes writes of the cache file.
+	cacheMu sync.Mutex
+}
+
+// A keyFetch is an authorized keys request in flight. Everyone who needs the
+// keys of its user meanwhile waits for it instead of making another request.
+type keyFetch struct {
+	done chan struct{}
+	view *cua.AuthorizedKeysView
+	err  error
+	time time.Time
+}
+
+// A throttle spaces out events to at most a rate per second.
+type throttle struct {
+	mu       sync.Mutex
+	interval time.Duration
+	next     time.Time
+}
+
+func newThrottle(rate float64) *throttle {
+	t := &throttle{}
+	if rate > 0 {
+		t.interval = time.Duration(float64(time.Second) / rate)
+	}
+	return t
+}
+
+// wait blocks until the next event may happen.
+func (t *throttle) wait() {
+	if t.interval == 0 {
+		return
+	}
+	t.mu.Lock()
+	now := time.Now()
+	if t.next.Before(now) {
+		t.next = now
+	}
+	delay := t.next.Sub(now)
+	t.next = t.next.Add(t.interval)
+	t.mu.Unlock()
+	time.Sleep(delay)
 }
 
 // New returns an AccountProvider implemented as an in-memory store.
@@ -83,16 +314,40 @@ func New(apiClient apiclient.APIClient, config *Config) accounts.AccountProvider
 		apiClient:     apiClient,
 		config:        config,
 		updateWaiters: make(chan chan struct{}),
+		keyThrottle:   newThrottle(config.KeyRefreshRate),
+		keyFetches:    make(map[string]*keyFetch),
 	}
-	ch := make(chan struct{})
+	store.snapshot.Store(&accountsSnapshot{})
 	go updateTask(store)
+	if store.loadCache() {
+		// The cached accounts are served until the first refresh replaces
+		// them.
+		store.requestRefresh()
+		store.notifyUpdate()
+		return store
+	}
+	ch := make(chan struct{})
 	store.updateWaiters <- ch
 	<-ch
 	return store
 }
 
-func nowOutsideTimespan(start time.Time, duration time.Duration) bool {
-	now := timeNow()
+func (s *cachingStore) now() time.Time {
+	if s.config.timeNow != nil {
+		return s.config.timeNow()
+	}
+	return time.Now()
+}
+
+func (s *cachingStore) after(d time.Duration) <-chan time.Time {
+	if s.config.timeAfter != nil {
+		return s.config.timeAfter(d)
+	}
+	return time.After(d)
+}
+
+func (s *cachingStore) nowOutsideTimespan(start time.Time, duration time.Duration) bool {
+	now := s.now()
 	end := start.Add(duration)
 	return now.Before(start) || now.After(end)
 }
@@ -103,118 +358,317 @@ func updateTask(s *cachingStore) {
 		var ch chan struct{}
 		select {
 		case ch = <-s.updateWaiters:
-		case <-timeAfter(s.config.AccountRefreshFrequency):
+			if ch != nil {
+				s.startRefresh(ch)
+			}
+		case <-s.after(s.config.AccountRefreshFrequency):
 		}
-		if nowOutsideTimespan(lastRefresh, s.config.AccountRefreshCooldown) {
+		if s.nowOutsideTimespan(lastRefresh, s.config.AccountRefreshCooldown) {
 			logger.Info("Refreshing users and groups.")
 			updateAccounts(s)
-			lastRefresh = timeNow()
+			lastRefresh = s.now()
+		}
+		// Passes that would overlap a running one are skipped rather than
+		// queued.
+		if atomic.CompareAndSwapInt32(&s.keyRefreshRunning, 0, 1) {
+			go updateKeys(s)
 		}
-		go updateKeys(s)
 		if ch != nil {
 			close(ch)
 		}
 	}
 }
 
+// requestRefresh requests an on-demand refresh of users and groups and
+// returns a channel that is closed once it is done. Requests made before the
+// refresh starts share it.
+func (s *cachingStore) requestRefresh() chan struct{} {
+	s.refreshMu.Lock()
+	defer s.refreshMu.Unlock()
+	if s.pendingRefresh == nil {
+		ch := make(chan struct{})
+		s.pendingRefresh = ch
+		go func() { s.updateWaiters <- ch }()
+	}
+	return s.pendingRefresh
+}
+
+// startRefresh waits out AccountRefreshWindow for more requests to share the
+// refresh closing ch, then stops it from taking any more.
+func (s *cachingStore) startRefresh(ch chan struct{}) {
+	if s.config.AccountRefreshWindow > 0 {
+		time.Sleep(s.config.AccountRefreshWindow)
+	}
+	s.refreshMu.Lock()
+	if s.pendingRefresh == ch {
+		s.pendingRefresh = nil
+	}
+	s.refreshMu.Unlock()
+}
+
+// updateAccounts applies the users and groups fetched from the API to the
+// store. Unchanged users and groups are kept, and a new snapshot is only
+// published if any of them changed.
 func updateAccounts(s *cachingStore) {
+	defer refreshDuration.With("accounts").Since(time.Now())
 	users, groups, err := s.apiClient.UsersAndGroups()
 	if err != nil {
+		refreshFailures.With("accounts").Inc()
 		logger.Errorf("Failed refresh: %v.", err)
 		return
 	}
-	s.Lock()
-	defer s.Unlock()
-	oldUsers := s.usersByName
-	s.usersByName = make(map[string]*cachedUser)
-	s.usersByUID = make(map[uint32]*cachedUser)
-	s.groupsByName = make(map[string]*accounts.Group)
-	s.groupsByGID = make(map[uint32]*accounts.Group)
+	// Key updates are held off while the new snapshot carries over the key
+	// states of the old one.
+	s.writeMu.Lock()
+	old := s.accounts()
+	usersChanged := len(users) != len(old.usersByName)
 	for _, u := range users {
-		user := &accounts.User{
-			Name:          u.Username,
-			UID:           uint32(u.Uid),
-			GID:           uint32(u.Gid),
-			Gecos:         u.Gecos,
-			HomeDirectory: u.HomeDirectory,
-			Shell:         u.Shell,
-		}
-		cu := &cachedUser{user: user}
-		if old, ok := oldUsers[user.Name]; ok {
-			cu.keyRefreshTime = old.keyRefreshTime
-			cu.keys = old.keys
-			cu.sudoer = old.sudoer
+		cu, ok := old.usersByName[u.Username]
+		if !ok || !sameUser(cu.user, u) {
+			usersChanged = true
+			break
 		}
-		s.usersByName[user.Name] = cu
-		s.usersByUID[user.UID] = cu
 	}
+	groupsChanged := len(groups) != len(old.groupsByName)
 	for _, g := range groups {
-		group := &accounts.Group{
-			Name:    g.GroupName,
-			GID:     uint32(g.Gid),
-			Members: g.Members,
+		group, ok := old.groupsByName[g.GroupName]
+		if !ok || !sameGroup(group, g) {
+			groupsChanged = true
+			break
 		}
-		s.groupsByName[group.Name] = group
-		s.groupsByGID[group.GID] = group
+	}
+	if usersChanged || groupsChanged {
+		snap := *old
+		snap.generation++
+		if usersChanged {
+			applyUsers(&snap, old, users)
+		}
+		if groupsChanged {
+			applyGroups(&snap, old, groups)
+		}
+		s.snapshot.Store(&snap)
+		userCount.Set(float64(len(snap.usersByName)))
+		groupCount.Set(float64(len(snap.groupsByName)))
+		logger.Infof("Users and groups changed, generation %v.", snap.generation)
+	}
+	s.writeMu.Unlock()
+	if usersChanged || groupsChanged {
+		s.saveCache()
 	}
 	logger.Info("Refreshing users and groups succeeded.")
+	s.notifyUpdate()
+}
+
+func sameUser(user *accounts.User, u *cua.LinuxUserView) bool {
+	return user.Name == u.Username && user.UID == uint32(u.Uid) && user.GID == uint32(u.Gid) &&
+		user.Gecos == u.Gecos && user.HomeDirectory == u.HomeDirectory && user.Shell == u.Shell
+}
+
+func sameGroup(group *accounts.Group, g *cua.LinuxGroupView) bool {
+	if group.Name != g.GroupName || group.GID != uint32(g.Gid) || len(group.Members) != len(g.Members) {
+		return false
+	}
+	for i, m := range group.Members {
+		if m != g.Members[i] {
+			return false
+		}
+	}
+	return true
+}
+
+// applyUsers indexes users in snap, reusing the unchanged users of old along
+// with their key states.
+func applyUsers(snap, old *accountsSnapshot, users []*cua.LinuxUserView) {
+	snap.usersByName = make(map[string]*cachedUser, len(users))
+	snap.usersByUID = make(map[uint32]*cachedUser, len(users))
+	for _, u := range users {
+		cu, ok := old.usersByName[u.Username]
+		if !ok || !sameUser(cu.user, u) {
+			state := &keyState{}
+			if ok {
+				state = cu.keyState()
+			}
+			cu = newCachedUser(&accounts.User{
+				Name:          u.Username,
+				UID:           uint32(u.Uid),
+				GID:           uint32(u.Gid),
+				Gecos:         u.Gecos,
+				HomeDirectory: u.HomeDirectory,
+				Shell:         u.Shell,
+			}, state)
+		}
+		snap.usersByName[cu.user.Name] = cu
+		snap.usersByUID[cu.user.UID] = cu
+	}
+}
+
+// applyGroups indexes groups in snap, reusing the unchanged groups of old.
+func applyGroups(snap, old *accountsSnapshot, groups []*cua.LinuxGroupView) {
+	snap.groupsByName = make(map[string]*accounts.Group, len(groups))
+	snap.groupsByGID = make(map[uint32]*accounts.Group, len(groups))
+	snap.members = &memberIndex{ids: make(map[string]uint32)}
+	lists := &memberLists{
+		index: snap.members,
+		old:   old.members,
+		users: snap.usersByName,
+		lists: make(map[string][]string),
+	}
+	if lists.old == nil {
+		lists.old = &memberIndex{}
+	}
+	for _, g := range groups {
+		group, ok := old.groupsByName[g.GroupName]
+		if !ok || !sameGroup(group, g) {
+			group = &accounts.Group{
+				Name:    g.GroupName,
+				GID:     uint32(g.Gid),
+				Members: lists.add(uint32(g.Gid), g.Members, false),
+			}
+		} else {
+			// Unchanged groups are shared with old unless another group
+			// with the same members interned its list first.
+			members := lists.add(group.GID, group.Members, true)
+			if len(members) != 0 && &members[0] != &group.Members[0] {
+				group = &accounts.Group{Name: group.Name, GID: group.GID, Members: members}
+			}
+		}
+		snap.groupsByName[group.Name] = group
+		snap.groupsByGID[group.GID] = group
+	}
 }
 
+// updateKeys refreshes the authorized keys of users whose keys are older than
+// KeyRefreshFrequency, using at most KeyRefreshConcurrency requests at a time.
+// It is started by updateTask, which sets keyRefreshRunning, and clears it once
+// done.
 func updateKeys(s *cachingStore) {
 	type update struct {
 		name string
 		view *cua.AuthorizedKeysView
-		err  error
 		time time.Time
 	}
+	names := keysRequiringRefresh(s)
+	if len(names) != 0 {
+		defer refreshDuration.With("keys").Since(time.Now())
+	}
+	workers := s.config.KeyRefreshConcurrency
+	if workers <= 0 {
+		workers = defaultKeyRefreshConcurrency
+	}
+	if workers > len(names) {
+		workers = len(names)
+	}
+	work := make(chan string)
 	ch := make(chan update)
-	workers := 0
-	for _, name := range keysRequiringRefresh(s) {
-		go func(n string) {
-			view, err := s.apiClient.AuthorizedKeys(n)
-			ch <- update{n, view, err, timeNow()}
-		}(name)
-		workers += 1
-	}
-	refreshedKeys := make([]update, workers)
-	for workers != 0 {
-		up := <-ch
-		workers -= 1
-		if up.err != nil {
-			logger.Errorf("Failed key refresh for %v: %v.", up.name, up.err)
-			continue
+	var wg sync.WaitGroup
+	wg.Add(workers)
+	for i := 0; i < workers; i++ {
+		go func() {
+			defer wg.Done()
+			for name := range work {
+				s.keyThrottle.wait()
+				view, refreshTime, err := s.fetchKeys(name)
+				if err != nil {
+					refreshFailures.With("keys").Inc()
+					logger.Errorf("Failed key refresh for %v: %v.", name, err)
+					continue
+				}
+				logger.Infof("Refreshed keys for %v.", name)
+				ch <- update{name, view, refreshTime}
+			}
+		}()
+	}
+	go func() {
+		for _, name := range names {
+			work <- name
 		}
-		logger.Infof("Refreshed keys for %v.", up.name)
+		close(work)
+		wg.Wait()
+		close(ch)
+	}()
+	var refreshedKeys []update
+	for up := range ch {
 		refreshedKeys = append(refreshedKeys, up)
 	}
-	s.Lock()
-	defer s.Unlock()
+	s.writeMu.Lock()
+	sudoersChanged := false
+	usersByName := s.accounts().usersByName
 	for _, rk := range refreshedKeys {
-		if cu, ok := s.usersByName[rk.name]; ok {
-			cu.keys = rk.view.Keys
-			cu.sudoer = rk.view.Sudoer
-			cu.keyRefreshTime = rk.time
+		// Keys refreshed on demand while the pass ran are newer and kept.
+		if cu, ok := usersByName[rk.name]; ok && cu.updateKeyState(&keyState{rk.view.Keys, rk.view.Sudoer, rk.time}) {
+			sudoersChanged = true
 		}
 	}
-	refreshCallback(s.config)
+	var oldest time.Time
+	for _, cu := range usersByName {
+		t := cu.keyState().refreshTime
+		if !t.IsZero() && (oldest.IsZero() || t.Before(oldest)) {
+			oldest = t
+		}
+	}
+	if !oldest.IsZero() {
+		oldestKeys.Set(float64(oldest.UnixNano()) / float64(time.Second))
+	}
+	if sudoersChanged {
+		s.bumpGeneration()
+	}
+	s.writeMu.Unlock()
+	if sudoersChanged {
+		// The members of the sudoers group changed.
+		s.notifyUpdate()
+	}
+	if len(refreshedKeys) != 0 {
+		s.saveCache()
+	}
+	atomic.StoreInt32(&s.keyRefreshRunning, 0)
+	if s.config.refreshCallback != nil {
+		s.config.refreshCallback()
+	}
+}
+
+// fetchKeys fetches the authorized keys of a user from the API, sharing a
+// request already in flight for the user. A user that the API does not know
+// has no keys.
+func (s *cachingStore) fetchKeys(username string) (*cua.AuthorizedKeysView, time.Time, error) {
+	s.fetchMu.Lock()
+	f, ok := s.keyFetches[username]
+	if ok {
+		s.fetchMu.Unlock()
+		<-f.done
+		return f.view, f.time, f.err
+	}
+	f = &keyFetch{done: make(chan struct{})}
+	s.keyFetches[username] = f
+	s.fetchMu.Unlock()
+	f.view, f.err = s.apiClient.AuthorizedKeys(username)
+	if f.err == nil && f.view == nil {
+		f.view = &cua.AuthorizedKeysView{}
+	}
+	f.time = s.now()
+	s.fetchMu.Lock()
+	delete(s.keyFetches, username)
+	s.fetchMu.Unlock()
+	close(f.done)
+	return f.view, f.time, f.err
 }
 
 func keysRequiringRefresh(s *cachingStore) []string {
 	var result []string
-	s.RLock()
-	defer s.RUnlock()
-	for name, cu := range s.usersByName {
-		if nowOutsideTimespan(cu.keyRefreshTime, s.config.KeyRefreshFrequency) {
+	for name, cu := range s.accounts().usersByName {
+		if s.nowOutsideTimespan(cu.keyState().refreshTime, s.config.KeyRefreshFrequency) {
 			result = append(result, name)
 		}
 	}
 	return result
 }
 
+// accounts returns the current snapshot.
+func (s *cachingStore) accounts() *accountsSnapshot {
+	return s.snapshot.Load().(*accountsSnapshot)
+}
+
 func (s *cachingStore) userByNameImpl(name string) (*cachedUser, bool) {
-	s.RLock()
-	defer s.RUnlock()
-	cu, ok := s.usersByName[name]
+	cu, ok := s.accounts().usersByName[name]
 	return cu, ok
 }
 
@@ -224,11 +678,9 @@ func (s *cachingStore) UserByName(name string) (*accounts.User, error) {
 	if ok {
 		return cu.user, nil
 	}
-	ch := make(chan struct{})
 	logger.Infof("Triggering refresh due to missing user %v.", name)
-	s.updateWaiters <- ch
 	// Block on update.
-	<-ch
+	<-s.requestRefresh()
 	cu, ok = s.userByNameImpl(name)
 	if ok {
 		return cu.user, nil
@@ -236,11 +688,34 @@ func (s *cachingStore) UserByName(name string) (*accounts.User, error) {
 	return nil, accounts.UsernameNotFound(name)
 }
 
+// UsersByName satisfies BatchProvider.
+func (s *cachingStore) UsersByName(names []string) ([]*accounts.User, error) {
+	users := make([]*accounts.User, len(names))
+	missing := 0
+	for i, name := range names {
+		if cu, ok := s.userByNameImpl(name); ok {
+			users[i] = cu.user
+		} else {
+			missing++
+		}
+	}
+	if missing == 0 {
+		return users, nil
+	}
+	logger.Infof("Triggering refresh due to %v missing users.", missing)
+	// Block on a single update for all of them.
+	<-s.requestRefresh()
+	for i, name := range names {
+		if cu, ok := s.userByNameImpl(name); ok && users[i] == nil {
+			users[i] = cu.user
+		}
+	}
+	return users, nil
+}
+
 // UserByName satisfies AccountProvider.
 func (s *cachingStore) UserByUID(uid uint32) (*accounts.User, error) {
-	s.RLock()
-	defer s.RUnlock()
-	cu, ok := s.usersByUID[uid]
+	cu, ok := s.accounts().usersByUID[uid]
 	if ok {
 		return cu.user, nil
 	}
@@ -249,11 +724,10 @@ func (s *cachingStore) UserByUID(uid uint32) (*accounts.User, error) {
 
 // Users satisfies AccountProvider.
 func (s *cachingStore) Users() ([]*accounts.User, error) {
-	s.RLock()
-	defer s.RUnlock()
-	ret := make([]*accounts.User, len(s.usersByName))
+	usersByName := s.accounts().usersByName
+	ret := make([]*accounts.User, len(usersByName))
 	i := 0
-	for _, cu := range s.usersByName {
+	for _, cu := range usersByName {
 		ret[i] = cu.user
 		i++
 	}
@@ -262,29 +736,27 @@ func (s *cachingStore) Users() ([]*accounts.User, error) {
 
 // GroupByName satisfies AccountProvider.
 func (s *cachingStore) GroupByName(name string) (*accounts.Group, error) {
-	s.RLock()
-	defer s.RUnlock()
+	snap := s.accounts()
 	if name == sudoersGroupName {
-		return s.sudoersGroup(), nil
+		return snap.sudoersGroup(), nil
 	}
-	g, ok := s.groupsByName[name]
+	g, ok := snap.groupsByName[name]
 	if ok {
 		return g, nil
 	}
 	logger.Info("Triggering refresh due to missing group.")
 	// Do not block on update.
-	go func() { s.updateWaiters <- nil }()
+	s.requestRefresh()
 	return nil, accounts.GroupNameNotFound(name)
 }
 
 // GroupByGID satisfies AccountProvider.
 func (s *cachingStore) GroupByGID(gid uint32) (*accounts.Group, error) {
-	s.RLock()
-	defer s.RUnlock()
+	snap := s.accounts()
 	if gid == sudoersGroupGID {
-		return s.sudoersGroup(), nil
+		return snap.sudoersGroup(), nil
 	}
-	g, ok := s.groupsByGID[gid]
+	g, ok := snap.groupsByGID[gid]
 	if ok {
 		return g, nil
 	}
@@ -293,29 +765,39 @@ func (s *cachingStore) GroupByGID(gid uint32) (*accounts.Group, error) {
 
 // Groups satisfies AccountProvider.
 func (s *cachingStore) Groups() ([]*accounts.Group, error) {
-	s.RLock()
-	defer s.RUnlock()
-	ret := make([]*accounts.Group, len(s.groupsByName)+1)
+	snap := s.accounts()
+	ret := make([]*accounts.Group, len(snap.groupsByName)+1)
 	i := 0
-	for _, g := range s.groupsByName {
+	for _, g := range snap.groupsByName {
 		ret[i] = g
 		i++
 	}
-	ret[i] = s.sudoersGroup()
+	ret[i] = snap.sudoersGroup()
+	return ret, nil
+}
+
+// GIDsForUser satisfies AccountProvider.
+func (s *cachingStore) GIDsForUser(username string) ([]uint32, error) {
+	snap := s.accounts()
+	gids := snap.members.gidsFor(username)
+	ret := make([]uint32, len(gids), len(gids)+1)
+	copy(ret, gids)
+	if cu, ok := snap.usersByName[username]; ok && cu.keyState().sudoer {
+		ret = append(ret, sudoersGroupGID)
+	}
 	return ret, nil
 }
 
 // Names satisfies AccountProvider.
 func (s *cachingStore) Names() ([]string, error) {
-	s.RLock()
-	defer s.RUnlock()
-	ret := make([]string, len(s.usersByName)+len(s.groupsByName)+1)
+	snap := s.accounts()
+	ret := make([]string, len(snap.usersByName)+len(snap.groupsByName)+1)
 	i := 0
-	for u := range s.usersByName {
+	for u := range snap.usersByName {
 		ret[i] = u
 		i++
 	}
-	for g := range s.groupsByName {
+	for g := range snap.groupsByName {
 		ret[i] = g
 		i++
 	}
@@ -328,10 +810,9 @@ func (s *cachingStore) IsName(name string) (bool, error) {
 	if name == sudoersGroupName {
 		return true, nil
 	}
-	s.RLock()
-	defer s.RUnlock()
-	_, ok1 := s.usersByName[name]
-	_, ok2 := s.groupsByName[name]
+	snap := s.accounts()
+	_, ok1 := snap.usersByName[name]
+	_, ok2 := snap.groupsByName[name]
 	return ok1 || ok2, nil
 }
 
@@ -342,33 +823,60 @@ func (s *cachingStore) AuthorizedKeys(username string) ([]string, error) {
 	cu, ok := s.userByNameImpl(username)
 	if !ok {
 		return nil, accounts.UsernameNotFound(username)
-	} else if !nowOutsideTimespan(cu.keyRefreshTime, s.config.KeyRefreshCooldown) {
+	}
+	state := cu.keyState()
+	if !s.nowOutsideTimespan(state.refreshTime, s.config.KeyRefreshCooldown) {
 		logger.Infof("Returning cached keys for %v due to cooldown.", username)
-		return cu.keys, nil
+		return state.keys, nil
 	}
-	view, err := s.apiClient.AuthorizedKeys(username)
+	view, refreshTime, err := s.fetchKeys(username)
 	if err != nil {
-		return cu.keys, nil
+		return state.keys, nil
 	}
-	go s.updateCachedKeys(username, view.Keys, view.Sudoer, timeNow())
+	go s.updateCachedKeys(username, view.Keys, view.Sudoer, refreshTime)
 	return view.Keys, nil
 }
 
 func (s *cachingStore) updateCachedKeys(username string, keys []string, sudoer bool, refreshTime time.Time) {
-	s.Lock()
-	defer s.Unlock()
-	if cu, ok := s.usersByName[username]; ok {
-		cu.keys = keys
-		cu.sudoer = sudoer
-		cu.keyRefreshTime = refreshTime
+	s.writeMu.Lock()
+	sudoersChanged := false
+	if cu, ok := s.userByNameImpl(username); ok {
+		sudoersChanged = cu.updateKeyState(&keyState{keys, sudoer, refreshTime})
+	}
+	if sudoersChanged {
+		s.bumpGeneration()
+	}
+	s.writeMu.Unlock()
+	if sudoersChanged {
+		s.notifyUpdate()
+	}
+}
+
+// bumpGeneration publishes the current snapshot with a new generation after
+// the members of the sudoers group changed. It must be called under writeMu.
+func (s *cachingStore) bumpGeneration() {
+	snap := *s.accounts()
+	snap.generation++
+	s.snapshot.Store(&snap)
+}
+
+// Generation satisfies GenerationProvider.
+func (s *cachingStore) Generation() uint64 {
+	return s.accounts().generation
+}
+
+// notifyUpdate invokes the update callback. It must not be called under
+// writeMu.
+func (s *cachingStore) notifyUpdate() {
+	if s.config.UpdateCallback != nil {
+		s.config.UpdateCallback(s)
 	}
 }
 
-func (s *cachingStore) sudoersGroup() *accounts.Group {
-	// This must only be called under RLock().
+func (snap *accountsSnapshot) sudoersGroup() *accounts.Group {
 	members := make([]string, 0)
-	for name, cu := range s.usersByName {
-		if cu.sudoer {
+	for name, cu := range snap.usersByName {
+		if cu.keyState().sudoer {
 			members = append(members, name)
 		}
 	}
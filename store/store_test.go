@@ -16,7 +16,10 @@ package store
 
 import (
 	"errors"
+	"fmt"
+	"reflect"
 	"sort"
+	"sync"
 	"testing"
 	"time"
 
@@ -111,26 +114,42 @@ func newMock() *mockAPIClient {
 	}
 }
 
-func registerCallback(config *Config) chan struct{} {
-	ch := make(chan struct{})
-	refreshCallback = func(c *Config) {
-		if c == config {
+// refreshWaiters holds the channel closed by the next refresh of the store
+// of each config, once registered.
+var (
+	refreshMu      sync.Mutex
+	refreshWaiters = make(map[*Config]chan struct{})
+)
+
+// watchRefreshes sets the refresh callback of config before a store is
+// created with it, so that its refreshes can be waited for.
+func watchRefreshes(config *Config) {
+	config.refreshCallback = func() {
+		refreshMu.Lock()
+		defer refreshMu.Unlock()
+		if ch, ok := refreshWaiters[config]; ok {
 			close(ch)
+			delete(refreshWaiters, config)
 		}
 	}
-	return ch
 }
 
-func removeCallback() {
-	refreshCallback = func(*Config) {}
+// registerCallback returns a channel closed by the next refresh of the store
+// of config, which must be watched.
+func registerCallback(config *Config) chan struct{} {
+	ch := make(chan struct{})
+	refreshMu.Lock()
+	refreshWaiters[config] = ch
+	refreshMu.Unlock()
+	return ch
 }
 
 func testStore(mock *mockAPIClient, config *Config) accounts.AccountProvider {
 	// Ensure keys are warmed.
+	watchRefreshes(config)
 	ch := registerCallback(config)
 	store := New(mock, config)
 	<-ch
-	removeCallback()
 	return store
 }
 
@@ -189,6 +208,21 @@ func TestUsersGroups(t *testing.T) {
 			func() (interface{}, error) { r, e := store.Names(); sort.Sort(sort.StringSlice(r)); return r, e },
 			append([]string{"gce-sudoers"}, testbase.ExpNames...),
 		},
+		&testbase.SuccessCase{
+			`GIDsForUser("user1")`,
+			func() (interface{}, error) { return store.GIDsForUser("user1") },
+			[]uint32{1001, 4001},
+		},
+		&testbase.SuccessCase{
+			`GIDsForUser("user2")`,
+			func() (interface{}, error) { return store.GIDsForUser("user2") },
+			[]uint32{1001},
+		},
+		&testbase.SuccessCase{
+			`GIDsForUser("nil")`,
+			func() (interface{}, error) { return store.GIDsForUser("nil") },
+			[]uint32{},
+		},
 		&testbase.SuccessCase{
 			`IsName("user1")`,
 			func() (interface{}, error) { return store.IsName("user1") },
@@ -286,17 +320,22 @@ func TestKeyPrewarmingAndCaching(t *testing.T) {
 }
 
 func TestKeyCooldownAndRefresh(t *testing.T) {
+	var mu sync.Mutex
 	mTime := time.Now().UTC()
-	// Mock time.
-	timeNow = func() time.Time { return mTime }
 	pulse := make(chan time.Time)
-	timeAfter = func(time.Duration) <-chan time.Time { return pulse }
 	mock := newMock()
 	config := &Config{
 		AccountRefreshFrequency: time.Hour,
 		AccountRefreshCooldown:  0,
 		KeyRefreshFrequency:     time.Second,
 		KeyRefreshCooldown:      0,
+		// Mock time.
+		timeNow: func() time.Time {
+			mu.Lock()
+			defer mu.Unlock()
+			return mTime
+		},
+		timeAfter: func(time.Duration) <-chan time.Time { return pulse },
 	}
 	store := testStore(mock, config)
 	testbase.RunCases(t, []testbase.TestCase{
@@ -308,12 +347,13 @@ func TestKeyCooldownAndRefresh(t *testing.T) {
 	})
 	mock.keys["user1"] = []string{"key1"}
 
+	mu.Lock()
 	mTime = mTime.Add(time.Second + time.Nanosecond)
+	mu.Unlock()
 	ch := registerCallback(config)
 	// Trigger refresh.
-	pulse <- mTime
+	pulse <- config.timeNow()
 	<-ch
-	removeCallback()
 	mock.keys["user1"] = []string{"key2"}
 	testbase.RunCases(t, []testbase.TestCase{
 		&testbase.SuccessCase{
@@ -322,8 +362,6 @@ func TestKeyCooldownAndRefresh(t *testing.T) {
 			[]string{"key1"},
 		},
 	})
-	timeAfter = time.After
-	timeNow = time.Now
 }
 
 func TestUserOnDemandRefresh(t *testing.T) {
@@ -353,7 +391,6 @@ func TestUserOnDemandRefresh(t *testing.T) {
 		},
 	})
 	<-ch
-	removeCallback()
 }
 
 func TestGroupOnDemandRefresh(t *testing.T) {
@@ -377,7 +414,6 @@ func TestGroupOnDemandRefresh(t *testing.T) {
 		},
 	})
 	<-ch
-	removeCallback()
 	testbase.RunCases(t, []testbase.TestCase{
 		&testbase.SuccessCase{
 			`GroupByName("group1")`,
@@ -389,7 +425,12 @@ func TestGroupOnDemandRefresh(t *testing.T) {
 
 func TestEmptyUsersGroups(t *testing.T) {
 	emptyMock := &mockAPIClient{}
-	config := &Config{time.Hour, time.Hour, time.Hour, 0}
+	config := &Config{
+		AccountRefreshFrequency: time.Hour,
+		AccountRefreshCooldown:  time.Hour,
+		KeyRefreshFrequency:     time.Hour,
+		KeyRefreshCooldown:      0,
+	}
 	store := testStore(emptyMock, config)
 	testbase.RunCases(t, []testbase.TestCase{
 		&testbase.SuccessCase{
@@ -403,7 +444,12 @@ func TestEmptyUsersGroups(t *testing.T) {
 func TestEmptyKeys(t *testing.T) {
 	mock := newMock()
 	emptyMock := &mockAPIClient{users: mock.users}
-	config := &Config{time.Hour, time.Hour, time.Hour, 0}
+	config := &Config{
+		AccountRefreshFrequency: time.Hour,
+		AccountRefreshCooldown:  time.Hour,
+		KeyRefreshFrequency:     time.Hour,
+		KeyRefreshCooldown:      0,
+	}
 	store := testStore(emptyMock, config)
 	testbase.RunCases(t, []testbase.TestCase{
 		&testbase.SuccessCase{
@@ -413,3 +459,327 @@ func TestEmptyKeys(t *testing.T) {
 		},
 	})
 }
+
+func TestDeltaRefresh(t *testing.T) {
+	mock := newMock()
+	config := &Config{
+		AccountRefreshFrequency: time.Hour,
+		AccountRefreshCooldown:  0,
+		KeyRefreshFrequency:     time.Hour,
+		KeyRefreshCooldown:      0,
+	}
+	store := testStore(mock, config).(accounts.GenerationProvider)
+	// The first refresh and the first sudoer change both bump the generation.
+	if gen := store.Generation(); gen != 2 {
+		t.Errorf("Generation() = %v; want 2", gen)
+	}
+	user1, _ := store.UserByName("user1")
+	user2, _ := store.UserByName("user2")
+	group2, _ := store.GroupByName("group2")
+	refresh := func() {
+		if _, err := store.UserByName("nil"); err == nil {
+			t.Errorf(`UserByName("nil") = (_, nil); want (_, !nil)`)
+		}
+	}
+
+	// Refreshing unchanged users and groups keeps the current snapshot.
+	refresh()
+	if gen := store.Generation(); gen != 2 {
+		t.Errorf("unchanged Generation() = %v; want 2", gen)
+	}
+	if u, _ := store.UserByName("user2"); u != user2 {
+		t.Errorf("unchanged user2 was replaced")
+	}
+
+	// Only changed users are replaced.
+	changed := *mock.users[1]
+	changed.Shell = "/bin/sh"
+	mock.users = []*cua.LinuxUserView{mock.users[0], &changed}
+	refresh()
+	if gen := store.Generation(); gen != 3 {
+		t.Errorf("changed Generation() = %v; want 3", gen)
+	}
+	if u, _ := store.UserByName("user1"); u != user1 {
+		t.Errorf("unchanged user1 was replaced")
+	}
+	if u, _ := store.UserByUID(1002); u == user2 || u.Shell != "/bin/sh" {
+		t.Errorf("UserByUID(1002) = %+v; want new user with shell /bin/sh", u)
+	}
+	if g, _ := store.GroupByName("group2"); g != group2 {
+		t.Errorf("unchanged group2 was replaced")
+	}
+	if gids, _ := store.GIDsForUser("user1"); !reflect.DeepEqual(gids, []uint32{1001, 4001}) {
+		t.Errorf(`GIDsForUser("user1") = %v; want [1001 4001]`, gids)
+	}
+
+	// Removed groups are dropped.
+	mock.groups = mock.groups[:1]
+	refresh()
+	if gen := store.Generation(); gen != 4 {
+		t.Errorf("removed Generation() = %v; want 4", gen)
+	}
+	if _, err := store.GroupByGID(1001); err == nil {
+		t.Errorf("GroupByGID(1001) = (_, nil); want (_, !nil)")
+	}
+	if gids, _ := store.GIDsForUser("user1"); !reflect.DeepEqual(gids, []uint32{4001}) {
+		t.Errorf(`GIDsForUser("user1") = %v; want [4001]`, gids)
+	}
+}
+
+func TestMemberInterning(t *testing.T) {
+	mock := newMock()
+	config := &Config{
+		AccountRefreshFrequency: time.Hour,
+		AccountRefreshCooldown:  0,
+		KeyRefreshFrequency:     time.Hour,
+		KeyRefreshCooldown:      0,
+	}
+	store := testStore(mock, config)
+	same := func(a, b []string) bool { return len(a) == len(b) && len(a) > 0 && &a[0] == &b[0] }
+	group2, _ := store.GroupByName("group2")
+
+	// A new group with the same members shares the list of an unchanged one.
+	mock.groups = append(mock.groups, &cua.LinuxGroupView{
+		GroupName: "group3",
+		Gid:       1003,
+		Members:   []string{"user2", "user1"},
+	})
+	if _, err := store.UserByName("nil"); err == nil {
+		t.Errorf(`UserByName("nil") = (_, nil); want (_, !nil)`)
+	}
+	group3, err := store.GroupByName("group3")
+	if err != nil {
+		t.Fatalf(`GroupByName("group3") = (_, %v); want (_, nil)`, err)
+	}
+	if !same(group3.Members, group2.Members) {
+		t.Errorf("group3 members %v are not shared with group2 members %v", group3.Members, group2.Members)
+	}
+	if gids, _ := store.GIDsForUser("user2"); !reflect.DeepEqual(gids, []uint32{1001, 1003}) {
+		t.Errorf(`GIDsForUser("user2") = %v; want [1001 1003]`, gids)
+	}
+}
+
+func TestUnchangedGroupInterning(t *testing.T) {
+	mock := newMock()
+	config := &Config{
+		AccountRefreshFrequency: time.Hour,
+		AccountRefreshCooldown:  0,
+		KeyRefreshFrequency:     time.Hour,
+		KeyRefreshCooldown:      0,
+	}
+	store := testStore(mock, config)
+	// group1 now has the members of group2, which is unchanged and indexed
+	// after it.
+	mock.groups[0] = &cua.LinuxGroupView{
+		GroupName: "group1",
+		Gid:       1000,
+		Members:   []string{"user2", "user1"},
+	}
+	if _, err := store.UserByName("nil"); err == nil {
+		t.Errorf(`UserByName("nil") = (_, nil); want (_, !nil)`)
+	}
+	group1, _ := store.GroupByName("group1")
+	group2, _ := store.GroupByName("group2")
+	if len(group1.Members) != 2 || &group1.Members[0] != &group2.Members[0] {
+		t.Errorf("group2 members %v are not shared with group1 members %v", group2.Members, group1.Members)
+	}
+}
+
+func TestMemberListsWithSeparators(t *testing.T) {
+	l := &memberLists{
+		index: &memberIndex{ids: make(map[string]uint32)},
+		old:   &memberIndex{},
+		lists: make(map[string][]string),
+	}
+	for i, members := range [][]string{{"a,b"}, {"a", "b"}, {"a\x00b"}, {"a", "b"}} {
+		if list := l.add(uint32(1000+i), members, false); !reflect.DeepEqual(list, members) {
+			t.Errorf("add(%v, %q, false) = %q; want %q", 1000+i, members, list, members)
+		}
+	}
+	if gids := l.index.gidsFor("a"); !reflect.DeepEqual(gids, []uint32{1001, 1003}) {
+		t.Errorf(`gidsFor("a") = %v; want [1001 1003]`, gids)
+	}
+}
+
+func TestUpdateKeyStateKeepsNewerKeys(t *testing.T) {
+	now := time.Now()
+	cu := newCachedUser(&accounts.User{Name: "user1"}, &keyState{[]string{"new"}, false, now})
+	// A scheduled refresh that fetched keys before an on-demand one.
+	if cu.updateKeyState(&keyState{[]string{"old"}, true, now.Add(-time.Second)}) {
+		t.Errorf("updateKeyState(older) = true; want false")
+	}
+	if state := cu.keyState(); state.sudoer || !reflect.DeepEqual(state.keys, []string{"new"}) {
+		t.Errorf("key state = %+v; want the newer keys", state)
+	}
+	if !cu.updateKeyState(&keyState{[]string{"newer"}, true, now.Add(time.Second)}) {
+		t.Errorf("updateKeyState(newer) = false; want true")
+	}
+	if state := cu.keyState(); !state.sudoer || !reflect.DeepEqual(state.keys, []string{"newer"}) {
+		t.Errorf("key state = %+v; want the newer keys", state)
+	}
+}
+
+// countingAPIClient records the most AuthorizedKeys calls it had in flight.
+type countingAPIClient struct {
+	*mockAPIClient
+	mu          sync.Mutex
+	inFlight    int
+	maxInFlight int
+	calls       int
+	// accountCalls counts UsersAndGroups calls.
+	accountCalls int
+}
+
+// UsersAndGroups satisfies APIClient.
+func (c *countingAPIClient) UsersAndGroups() ([]*cua.LinuxUserView, []*cua.LinuxGroupView, error) {
+	c.mu.Lock()
+	c.accountCalls++
+	c.mu.Unlock()
+	return c.mockAPIClient.UsersAndGroups()
+}
+
+// AuthorizedKeys satisfies APIClient.
+func (c *countingAPIClient) AuthorizedKeys(username string) (*cua.AuthorizedKeysView, error) {
+	c.mu.Lock()
+	c.calls++
+	c.inFlight++
+	if c.inFlight > c.maxInFlight {
+		c.maxInFlight = c.inFlight
+	}
+	c.mu.Unlock()
+	time.Sleep(5 * time.Millisecond)
+	c.mu.Lock()
+	c.inFlight--
+	c.mu.Unlock()
+	// Users without keys are reported as not found, as the API client does
+	// for a 404.
+	if _, ok := c.keys[username]; !ok {
+		return nil, nil
+	}
+	return c.mockAPIClient.AuthorizedKeys(username)
+}
+
+func TestKeyRefreshConcurrency(t *testing.T) {
+	mock := &countingAPIClient{mockAPIClient: newMock()}
+	for i := 0; i < 20; i++ {
+		mock.users = append(mock.users, &cua.LinuxUserView{
+			Username: fmt.Sprintf("extra%v", i),
+			Uid:      int64(2000 + i),
+			Gid:      1000,
+		})
+	}
+	config := &Config{
+		AccountRefreshFrequency: time.Hour,
+		AccountRefreshCooldown:  time.Hour,
+		KeyRefreshFrequency:     time.Hour,
+		KeyRefreshCooldown:      time.Hour,
+		KeyRefreshConcurrency:   3,
+	}
+	watchRefreshes(config)
+	ch := registerCallback(config)
+	store := New(mock, config)
+	<-ch
+	mock.mu.Lock()
+	if mock.calls != 22 || mock.maxInFlight > 3 {
+		t.Errorf("key refresh made %v calls with up to %v in flight; want 22 with up to 3", mock.calls, mock.maxInFlight)
+	}
+	mock.mu.Unlock()
+	if n := userCount.Value(); n != 22 {
+		t.Errorf("gcua_users = %v; want 22", n)
+	}
+	if oldest := oldestKeys.Value(); oldest <= 0 || oldest > float64(time.Now().Unix()+1) {
+		t.Errorf("gcua_keys_oldest_refresh_timestamp_seconds = %v; want a recent time", oldest)
+	}
+	testbase.RunCases(t, []testbase.TestCase{
+		&testbase.SuccessCase{
+			`AuthorizedKeys("user1")`,
+			func() (interface{}, error) { return store.AuthorizedKeys("user1") },
+			testbase.ExpKeys["user1"],
+		},
+		&testbase.SuccessCase{
+			`AuthorizedKeys("extra0")`,
+			func() (interface{}, error) { return store.AuthorizedKeys("extra0") },
+			[]string(nil),
+		},
+	})
+}
+
+func TestKeyFetchCoalescing(t *testing.T) {
+	mock := &countingAPIClient{mockAPIClient: newMock()}
+	s := &cachingStore{apiClient: mock, config: &Config{}, keyFetches: make(map[string]*keyFetch)}
+	var wg sync.WaitGroup
+	for i := 0; i < 10; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			view, _, err := s.fetchKeys("user1")
+			if err != nil || !reflect.DeepEqual(view.Keys, testbase.ExpKeys["user1"]) {
+				t.Errorf(`fetchKeys("user1") = (%+v, _, %v); want keys of user1`, view, err)
+			}
+		}()
+	}
+	wg.Wait()
+	if mock.calls >= 10 {
+		t.Errorf("fetchKeys made %v calls for 10 concurrent requests; want fewer", mock.calls)
+	}
+}
+
+func TestMissRefreshCoalescing(t *testing.T) {
+	mock := &countingAPIClient{mockAPIClient: newMock()}
+	config := &Config{
+		AccountRefreshFrequency: time.Hour,
+		AccountRefreshCooldown:  0,
+		AccountRefreshWindow:    50 * time.Millisecond,
+		KeyRefreshFrequency:     time.Hour,
+		KeyRefreshCooldown:      time.Hour,
+	}
+	store := New(mock, config)
+	var wg sync.WaitGroup
+	for i := 0; i < 50; i++ {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			name := fmt.Sprintf("new%v", i%5)
+			if _, err := store.UserByName(name); err == nil {
+				t.Errorf("UserByName(%q) = (_, nil); want (_, !nil)", name)
+			}
+		}(i)
+	}
+	wg.Wait()
+	mock.mu.Lock()
+	defer mock.mu.Unlock()
+	// One refresh at startup and one shared by every miss.
+	if mock.accountCalls != 2 {
+		t.Errorf("UsersAndGroups() called %v times; want 2", mock.accountCalls)
+	}
+}
+
+func TestBatchMissRefresh(t *testing.T) {
+	mock := &countingAPIClient{mockAPIClient: newMock()}
+	config := &Config{
+		AccountRefreshFrequency: time.Hour,
+		AccountRefreshCooldown:  0,
+		AccountRefreshWindow:    50 * time.Millisecond,
+		KeyRefreshFrequency:     time.Hour,
+		KeyRefreshCooldown:      time.Hour,
+	}
+	store := New(mock, config).(accounts.BatchProvider)
+	names := []string{"user1"}
+	for i := 0; i < 100; i++ {
+		names = append(names, fmt.Sprintf("new%v", i))
+	}
+	start := time.Now()
+	users, err := store.UsersByName(names)
+	if err != nil || len(users) != len(names) || users[0] == nil || users[0].Name != "user1" || users[1] != nil {
+		t.Fatalf("UsersByName() = (%v, %v); want user1 followed by missing users", users, err)
+	}
+	// The misses share one refresh window instead of waiting for one each.
+	if elapsed := time.Since(start); elapsed > time.Second {
+		t.Errorf("UsersByName() took %v; want less than 1s", elapsed)
+	}
+	mock.mu.Lock()
+	defer mock.mu.Unlock()
+	if mock.accountCalls != 2 {
+		t.Errorf("UsersAndGroups() called %v times; want 2", mock.accountCalls)
+	}
+}
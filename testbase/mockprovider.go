@@ -75,6 +75,20 @@ func (m *MockProvider) Groups() ([]*accounts.Group, error) {
 	return m.Grps, m.Err
 }
 
+// GIDsForUser satisfies AccountProvider.
+func (m *MockProvider) GIDsForUser(username string) ([]uint32, error) {
+	gids := []uint32{}
+	for _, g := range m.Grps {
+		for _, member := range g.Members {
+			if member == username {
+				gids = append(gids, g.GID)
+				break
+			}
+		}
+	}
+	return gids, m.Err
+}
+
 // Names satisfies AccountProvider.
 func (m *MockProvider) Names() ([]string, error) {
 	return m.Nams, m.Err